@@ -0,0 +1,314 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "acl.h"
+
+namespace {
+
+const int kAddressBits = 128;
+const int kMappedBits = 96;   // ahead of an IPv4 address mapped to IPv6
+const int kMaxLineLen = 256;
+
+// Bits of the address that index the start tables
+const int kStartBits = 16;
+const int kStarts = 1 << kStartBits;
+
+}
+
+Acl::Acl()
+      : rules_(0) {
+   // The root covers everything, and allows it unless a rule says otherwise
+   Key everything;
+   memset(&everything, 0, sizeof(everything));
+   NewNode(everything, 0, kAllow);
+}
+
+// static
+Acl* Acl::Load(const char* path) {
+   FILE* file = fopen(path, "r");
+   if (!file) {
+      perror(path);
+      return NULL;
+   }
+
+   Acl* acl = new Acl();
+   MALLOCCHECK(acl);
+
+   char line[kMaxLineLen];
+   int line_number = 0;
+   while (fgets(line, sizeof(line), file)) {
+      line_number++;
+      char* comment = strchr(line, '#');
+      if (comment)
+         *comment = '\0';
+
+      char action_name[16];
+      char prefix_text[64];
+      char extra[2];
+      int fields = sscanf(line, "%15s %63s %1s", action_name, prefix_text,
+            extra);
+      if (fields <= 0)
+         continue;
+
+      Action action = kActions;
+      for (int i = 0; i < kActions; ++i) {
+         if (!strcmp(action_name, ActionName((Action) i)))
+            action = (Action) i;
+      }
+
+      struct in6_addr prefix;
+      int len;
+      if (fields != 2 || action == kActions ||
+          !ParsePrefix(prefix_text, &prefix, &len)) {
+         fprintf(stderr, "%s:%d: expected \"allow|refuse|norecurse "
+               "PREFIX\"\n", path, line_number);
+         fclose(file);
+         delete acl;
+         return NULL;
+      }
+      acl->Add(prefix, len, action);
+   }
+
+   fclose(file);
+   acl->Finish();
+   return acl;
+}
+
+// static
+bool Acl::ParsePrefix(const char* text, struct in6_addr* prefix, int* len) {
+   char address[INET6_ADDRSTRLEN];
+   const char* slash = strchr(text, '/');
+   size_t address_len = slash ? (size_t) (slash - text) : strlen(text);
+   if (address_len >= sizeof(address))
+      return false;
+
+   memcpy(address, text, address_len);
+   address[address_len] = '\0';
+
+   int max_len;
+   struct in_addr v4;
+   if (inet_pton(AF_INET, address, &v4) == 1) {
+      memset(prefix, 0, sizeof(*prefix));
+      prefix->s6_addr[10] = 0xff;
+      prefix->s6_addr[11] = 0xff;
+      memcpy(&prefix->s6_addr[12], &v4, sizeof(v4));
+      max_len = kAddressBits - kMappedBits;
+   } else if (inet_pton(AF_INET6, address, prefix) == 1) {
+      max_len = kAddressBits;
+   } else {
+      return false;
+   }
+
+   *len = max_len;
+   if (slash) {
+      char* end;
+      long parsed = strtol(slash + 1, &end, 10);
+      if (end == slash + 1 || *end || parsed < 0 || parsed > max_len)
+         return false;
+      *len = parsed;
+   }
+
+   if (max_len != kAddressBits)
+      *len += kMappedBits;
+   return true;
+}
+
+void Acl::Add(const struct in6_addr& prefix, int len, Action action) {
+   Key key = ToKey(prefix, len);
+   rules_++;
+
+   // Walk down the nodes covering the new prefix. References into nodes_
+   // do not survive NewNode(), so nodes are named by index.
+   uint32_t parent = 0;
+   for (;;) {
+      if (nodes_[parent].len_ == len) {
+         nodes_[parent].action_ = action;
+         return;
+      }
+
+      int bit = Bit(key, nodes_[parent].len_);
+      uint32_t child = nodes_[parent].child_[bit];
+      if (!child) {
+         uint32_t leaf = NewNode(key, len, action);
+         nodes_[parent].child_[bit] = leaf;
+         return;
+      }
+
+      int child_len = nodes_[child].len_;
+      int common = CommonLength(key, nodes_[child].key_,
+            len < child_len ? len : child_len);
+      if (common == child_len) {
+         parent = child;
+         continue;
+      }
+
+      // The new prefix parts from the child's (or ends) partway along the
+      // edge to it: put a node there
+      uint32_t split;
+      if (common == len) {
+         split = NewNode(key, len, action);
+      } else {
+         split = NewNode(ToKey(prefix, common), common, kNoAction);
+         uint32_t leaf = NewNode(key, len, action);
+         nodes_[split].child_[Bit(key, common)] = leaf;
+      }
+      nodes_[split].child_[Bit(nodes_[child].key_, common)] = child;
+      nodes_[parent].child_[bit] = split;
+      return;
+   }
+}
+
+void Acl::Finish() {
+   v4_starts_.resize(kStarts);
+   v6_starts_.resize(kStarts);
+
+   struct in6_addr v4;
+   memset(&v4, 0, sizeof(v4));
+   v4.s6_addr[10] = 0xff;
+   v4.s6_addr[11] = 0xff;
+   struct in6_addr v6;
+   memset(&v6, 0, sizeof(v6));
+
+   for (int i = 0; i < kStarts; ++i) {
+      v4.s6_addr[12] = i >> 8;
+      v4.s6_addr[13] = i;
+      v4_starts_[i] = Walk(ToKey(v4, kMappedBits + kStartBits),
+            kMappedBits + kStartBits);
+
+      v6.s6_addr[0] = i >> 8;
+      v6.s6_addr[1] = i;
+      v6_starts_[i] = Walk(ToKey(v6, kStartBits), kStartBits);
+   }
+}
+
+Acl::Action Acl::Lookup(const struct in6_addr& addr) const {
+   const uint8_t* bytes = addr.s6_addr;
+   const Start& start = IN6_IS_ADDR_V4MAPPED(&addr) ?
+         v4_starts_[bytes[12] << 8 | bytes[13]] :
+         v6_starts_[bytes[0] << 8 | bytes[1]];
+
+   Key key = ToKey(addr, kAddressBits);
+   const Node* nodes = nodes_.data();
+   const Node* node = &nodes[start.node_];
+   uint8_t action = start.action_;
+   while (node->len_ < kAddressBits) {
+      uint32_t child = node->child_[Bit(key, node->len_)];
+      if (!child)
+         break;
+
+      node = &nodes[child];
+      if (!Covers(*node, key))
+         break;
+      if (node->action_ != kNoAction)
+         action = node->action_;
+   }
+   return (Action) action;
+}
+
+size_t Acl::bytes() const {
+   return nodes_.size() * sizeof(Node) +
+         (v4_starts_.size() + v6_starts_.size()) * sizeof(Start);
+}
+
+// static
+const char* Acl::ActionName(Action action) {
+   switch (action) {
+      case kAllow:
+         return "allow";
+      case kRefuse:
+         return "refuse";
+      case kNoRecursion:
+         return "norecurse";
+      default:
+         return "?";
+   }
+}
+
+// static
+Acl::Key Acl::ToKey(const struct in6_addr& addr, int len) {
+   Key key;
+   for (int word = 0; word < 2; ++word) {
+      uint64_t value = 0;
+      for (int i = 0; i < 8; ++i)
+         value = value << 8 | addr.s6_addr[word * 8 + i];
+
+      // Keep the first |len| bits
+      int keep = len - word * 64;
+      if (keep <= 0)
+         value = 0;
+      else if (keep < 64)
+         value &= ~0ULL << (64 - keep);
+      key.words_[word] = value;
+   }
+   return key;
+}
+
+// static
+int Acl::Bit(const Key& key, int i) {
+   return key.words_[i / 64] >> (63 - i % 64) & 1;
+}
+
+// static
+int Acl::CommonLength(const Key& a, const Key& b, int max) {
+   int common;
+   uint64_t differ = a.words_[0] ^ b.words_[0];
+   if (differ)
+      common = __builtin_clzll(differ);
+   else if ((differ = a.words_[1] ^ b.words_[1]))
+      common = 64 + __builtin_clzll(differ);
+   else
+      common = kAddressBits;
+   return common < max ? common : max;
+}
+
+// static
+bool Acl::Covers(const Node& node, const Key& key) {
+   // Keys are zero past their length, so mask |key| to |node|'s
+   if (node.len_ <= 64) {
+      uint64_t mask = node.len_ ? ~0ULL << (64 - node.len_) : 0;
+      return (key.words_[0] & mask) == node.key_.words_[0];
+   }
+
+   uint64_t mask = ~0ULL << (kAddressBits - node.len_);
+   return key.words_[0] == node.key_.words_[0] &&
+         (key.words_[1] & mask) == node.key_.words_[1];
+}
+
+Acl::Start Acl::Walk(const Key& key, int len) const {
+   // The root covers everything, and has an action
+   Start start;
+   start.node_ = 0;
+   start.action_ = nodes_[0].action_;
+   for (;;) {
+      const Node& node = nodes_[start.node_];
+      if (node.len_ >= len)
+         return start;
+
+      uint32_t child = node.child_[Bit(key, node.len_)];
+      if (!child || nodes_[child].len_ > len || !Covers(nodes_[child], key))
+         return start;
+
+      start.node_ = child;
+      if (nodes_[child].action_ != kNoAction)
+         start.action_ = nodes_[child].action_;
+   }
+}
+
+uint32_t Acl::NewNode(const Key& key, int len, uint8_t action) {
+   Node node;
+   node.key_ = key;
+   node.child_[0] = 0;
+   node.child_[1] = 0;
+   node.len_ = len;
+   node.action_ = action;
+   nodes_.push_back(node);
+   return nodes_.size() - 1;
+}
@@ -0,0 +1,112 @@
+#ifndef _ACL_H_
+#define _ACL_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "smartalloc.h"
+
+// Who may query the server, by client prefix. Each rule gives an IPv4 or
+// IPv6 prefix an action; a client gets the action of the longest prefix
+// that covers it, or kAllow if none does. IPv4 prefixes are kept as their
+// IPv4-mapped IPv6 equivalents (::ffff:a.b.c.d/96+len), which is how IPv4
+// clients arrive on the server's socket.
+//
+// The prefixes are held in a path-compressed binary radix tree: a node
+// only exists where a rule is, or where two rules' prefixes part. Nodes sit
+// in one array and refer to each other by index. A lookup does not start
+// at the root: a table indexed by the first 16 bits of the address (of the
+// IPv4 address, if mapped) says where the walk would be after them, and
+// what it would have matched, so it visits a few nodes near the leaves.
+//
+// An Acl is built, then only read: lookups take no locks, and a new rule
+// set replaces an old one by swapping a pointer (see DnsServer).
+class Acl {
+  public:
+   enum Action {
+      kAllow = 0,
+      kRefuse,        // answer REFUSED to everything
+      kNoRecursion,   // answer from cache only; REFUSED otherwise
+      kActions
+   };
+
+   Acl();
+
+   // Reads rules from |path|, one a line: an action ("allow", "refuse" or
+   // "norecurse"), then a prefix ("192.0.2.0/24", "2001:db8::/32", or an
+   // address alone). '#' starts a comment. Returns NULL, having said why on
+   // stderr, if the file cannot be read or a line is malformed.
+   static Acl* Load(const char* path);
+
+   // Parses "address[/length]". IPv4 is mapped, its length raised by 96.
+   static bool ParsePrefix(const char* text, struct in6_addr* prefix,
+         int* len);
+
+   // Gives |prefix|/|len| (bits past |len| ignored) |action|, replacing any
+   // action it had.
+   void Add(const struct in6_addr& prefix, int len, Action action);
+
+   // Builds the tables lookups start from. Call after the last Add(), and
+   // before the first Lookup().
+   void Finish();
+
+   Action Lookup(const struct in6_addr& addr) const;
+
+   size_t rules() const { return rules_; }   // added, counting repeats
+   size_t nodes() const { return nodes_.size(); }
+   size_t bytes() const;
+
+   static const char* ActionName(Action action);
+
+  private:
+   // A prefix in two big-endian words, so bits compare with shifts
+   struct Key {
+      uint64_t words_[2];
+   };
+
+   struct Node {
+      Key key_;             // zero past |len_|
+      uint32_t child_[2];   // by the bit after the prefix; 0 for none
+      uint8_t len_;
+      uint8_t action_;      // kActions if no rule ends here
+   };
+
+   // Where a lookup's walk is after the bits that index it
+   struct Start {
+      uint32_t node_;    // deepest node covering those bits
+      uint8_t action_;   // of the longest rule covering them
+   };
+
+   static const uint8_t kNoAction = kActions;
+
+   static Key ToKey(const struct in6_addr& addr, int len);
+
+   // Bit |i| of |key|, counting from the most significant
+   static int Bit(const Key& key, int i);
+
+   // Length of the prefix |a| and |b| share, up to |max|
+   static int CommonLength(const Key& a, const Key& b, int max);
+
+   // True if |key| starts with |node|'s prefix
+   static bool Covers(const Node& node, const Key& key);
+
+   uint32_t NewNode(const Key& key, int len, uint8_t action);
+
+   // Walks from the root as far as |key|'s first |len| bits lead
+   Start Walk(const Key& key, int len) const;
+
+   std::vector<Node, STLsmartalloc<Node> > nodes_;
+   size_t rules_;
+
+   // By bits 96-111 for IPv4-mapped addresses, bits 0-15 for the rest
+   std::vector<Start, STLsmartalloc<Start> > v4_starts_;
+   std::vector<Start, STLsmartalloc<Start> > v6_starts_;
+
+   Acl(const Acl&);
+   void operator=(const Acl&);
+};
+
+#endif   // _ACL_H_
@@ -0,0 +1,186 @@
+// Builds an Acl from many random IPv4 and IPv6 prefixes, with lengths
+// spread roughly as in a routing table, and times lookups: of random
+// addresses, which mostly fall outside every rule, and of addresses inside
+// the rules, which walk the tree to its leaves.
+
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "acl.h"
+
+namespace {
+
+struct Options {
+   int prefixes_;
+   int lookups_;
+   double v6_share_;
+};
+
+struct Prefix {
+   struct in6_addr addr_;
+   int len_;
+};
+
+uint64_t WallUs() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint64_t NextRandom(uint64_t* state) {
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+void RandomAddress(uint64_t* state, bool v6, struct in6_addr* addr) {
+   uint64_t high = NextRandom(state);
+   uint64_t low = NextRandom(state);
+   memcpy(&addr->s6_addr[0], &high, 8);
+   memcpy(&addr->s6_addr[8], &low, 8);
+
+   if (v6) {
+      // Global unicast, 2000::/3
+      addr->s6_addr[0] = 0x20 | (addr->s6_addr[0] & 0x1f);
+   } else {
+      memset(addr->s6_addr, 0, 10);
+      addr->s6_addr[10] = 0xff;
+      addr->s6_addr[11] = 0xff;
+   }
+}
+
+// Mostly /24s for IPv4, and /32s and /48s for IPv6, as routing tables are
+int PrefixLength(uint64_t* state, bool v6) {
+   int r = NextRandom(state) % 100;
+   if (v6)
+      return r < 60 ? 48 : r < 80 ? 32 : 29 + r % 19;
+   return 96 + (r < 60 ? 24 : r < 90 ? 16 + r % 8 : 8 + r % 8);
+}
+
+// Times |lookups_| lookups of |addrs|, round robin. Returns ns per lookup.
+double TimeLookups(const Acl& acl, const std::vector<struct in6_addr>& addrs,
+                   int lookups, int counts[Acl::kActions]) {
+   memset(counts, 0, sizeof(int) * Acl::kActions);
+   uint64_t start_us = WallUs();
+   for (int i = 0; i < lookups; ++i)
+      counts[acl.Lookup(addrs[i % addrs.size()])]++;
+   return (WallUs() - start_us) * 1000.0 / lookups;
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --prefixes=N          rules in the ACL (100000)\n"
+         "  --lookups=N           lookups timed per workload (10000000)\n"
+         "  --v6-share=F          share of rules and lookups that are IPv6\n"
+         "                        (0.3)\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   Options options;
+   options.prefixes_ = 100000;
+   options.lookups_ = 10000000;
+   options.v6_share_ = 0.3;
+
+   static struct option long_options[] = {
+      { "prefixes", required_argument, NULL, 'p' },
+      { "lookups",  required_argument, NULL, 'l' },
+      { "v6-share", required_argument, NULL, 'v' },
+      { NULL,       0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 'p':
+            options.prefixes_ = atoi(optarg);
+            break;
+         case 'l':
+            options.lookups_ = atoi(optarg);
+            break;
+         case 'v':
+            options.v6_share_ = atof(optarg);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
+   if (options.prefixes_ < 1 || options.lookups_ < 1 ||
+       options.v6_share_ < 0 || options.v6_share_ > 1)
+      usage(argv[0]);
+
+   uint64_t state = 0x9e3779b97f4a7c15ULL;
+   uint64_t v6_threshold = (uint64_t) (options.v6_share_ * 1e6);
+
+   std::vector<Prefix> prefixes(options.prefixes_);
+   for (size_t i = 0; i < prefixes.size(); ++i) {
+      bool v6 = NextRandom(&state) % 1000000 < v6_threshold;
+      RandomAddress(&state, v6, &prefixes[i].addr_);
+      prefixes[i].len_ = PrefixLength(&state, v6);
+   }
+
+   uint64_t start_us = WallUs();
+   Acl acl;
+   for (size_t i = 0; i < prefixes.size(); ++i) {
+      acl.Add(prefixes[i].addr_, prefixes[i].len_,
+            (Acl::Action) (i % Acl::kActions));
+   }
+   acl.Finish();
+   uint64_t build_us = WallUs() - start_us;
+
+   printf("%d prefixes (%.0f%% IPv6): built in %.1f ms, %zu nodes, "
+         "%zu KiB\n", options.prefixes_, 100 * options.v6_share_,
+         build_us / 1000.0, acl.nodes(), acl.bytes() / 1024);
+
+   // A table's worth of addresses per workload, so the tree is not all in
+   // cache the way one address's path would be
+   std::vector<struct in6_addr> random_addrs(1 << 16);
+   std::vector<struct in6_addr> covered_addrs(1 << 16);
+   for (size_t i = 0; i < random_addrs.size(); ++i) {
+      bool v6 = NextRandom(&state) % 1000000 < v6_threshold;
+      RandomAddress(&state, v6, &random_addrs[i]);
+
+      // The rule's prefix, then random bits
+      const Prefix& prefix = prefixes[NextRandom(&state) % prefixes.size()];
+      struct in6_addr* addr = &covered_addrs[i];
+      RandomAddress(&state, true, addr);
+      for (int bit = 0; bit < prefix.len_; ++bit) {
+         uint8_t mask = 0x80 >> bit % 8;
+         addr->s6_addr[bit / 8] = (addr->s6_addr[bit / 8] & ~mask) |
+               (prefix.addr_.s6_addr[bit / 8] & mask);
+      }
+   }
+
+   printf("workload            ns/lookup   lookups/s   allow  refuse  "
+         "norecurse\n");
+   const char* names[] = { "random addresses", "inside rules" };
+   std::vector<struct in6_addr>* workloads[] = { &random_addrs,
+         &covered_addrs };
+   for (int i = 0; i < 2; ++i) {
+      int counts[Acl::kActions];
+      double ns = TimeLookups(acl, *workloads[i], options.lookups_, counts);
+      printf("%-18s %10.1f %11.0f %6.1f%% %6.1f%% %9.1f%%\n", names[i], ns,
+            1e9 / ns,
+            100.0 * counts[Acl::kAllow] / options.lookups_,
+            100.0 * counts[Acl::kRefuse] / options.lookups_,
+            100.0 * counts[Acl::kNoRecursion] / options.lookups_);
+   }
+   return 0;
+}
@@ -0,0 +1,108 @@
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "admission.h"
+
+AdmissionControl::Options::Options()
+      : max_recursions_(2000),
+        max_per_prefix_(200),
+        max_queue_delay_us_(200000),
+        max_frame_bytes_(64 * 1024 * 1024),
+        refuse_(true) {
+}
+
+AdmissionControl::AdmissionControl(const Options& options)
+      : options_(options),
+        outstanding_(0),
+        peak_outstanding_(0) {
+   memset(verdicts_, 0, sizeof(verdicts_));
+}
+
+AdmissionControl::Verdict AdmissionControl::Admit(
+      const struct sockaddr_in6& client, uint64_t queued_us,
+      uint64_t frame_bytes) {
+   Verdict verdict = kAdmit;
+   uint64_t prefix = PrefixOf(client);
+
+   PrefixMap::iterator it = per_prefix_.find(prefix);
+   if (outstanding_ >= options_.max_recursions_)
+      verdict = kShedGlobal;
+   else if (it != per_prefix_.end() && it->second >= options_.max_per_prefix_)
+      verdict = kShedPrefix;
+   else if (queued_us > options_.max_queue_delay_us_)
+      verdict = kShedDelay;
+   else if (frame_bytes > options_.max_frame_bytes_)
+      verdict = kShedMemory;
+
+   verdicts_[verdict]++;
+   if (verdict != kAdmit)
+      return verdict;
+
+   if (it == per_prefix_.end())
+      per_prefix_[prefix] = 1;
+   else
+      it->second++;
+
+   if (++outstanding_ > peak_outstanding_)
+      peak_outstanding_ = outstanding_;
+   return kAdmit;
+}
+
+void AdmissionControl::Finished(const struct sockaddr_in6& client) {
+   PrefixMap::iterator it = per_prefix_.find(PrefixOf(client));
+   if (it == per_prefix_.end())
+      return;
+
+   if (!--it->second)
+      per_prefix_.erase(it);
+   outstanding_--;
+}
+
+AdmissionControl::Stats AdmissionControl::stats() const {
+   Stats stats;
+   memcpy(stats.verdicts, verdicts_, sizeof(verdicts_));
+   stats.outstanding = outstanding_;
+   stats.peak_outstanding = peak_outstanding_;
+   stats.prefixes = per_prefix_.size();
+   return stats;
+}
+
+// static
+const char* AdmissionControl::VerdictName(Verdict verdict) {
+   switch (verdict) {
+      case kAdmit:
+         return "admitted";
+      case kShedGlobal:
+         return "over global limit";
+      case kShedPrefix:
+         return "over prefix limit";
+      case kShedDelay:
+         return "queued too long";
+      case kShedMemory:
+         return "over memory limit";
+      default:
+         return "?";
+   }
+}
+
+// static
+uint64_t AdmissionControl::PrefixOf(const struct sockaddr_in6& client) {
+   const uint8_t* addr = client.sin6_addr.s6_addr;
+
+   // IPv4 clients arrive mapped (::ffff:a.b.c.d); their /24 goes under
+   // ff00::/8, which no unicast client comes from
+   if (IN6_IS_ADDR_V4MAPPED(&client.sin6_addr))
+      return 0xffULL << 56 | addr[12] << 16 | addr[13] << 8 | addr[14];
+
+   uint64_t prefix = 0;
+   for (int i = 0; i < 7; ++i)
+      prefix = prefix << 8 | addr[i];
+   return prefix << 8;
+}
@@ -0,0 +1,90 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+
+#include "smartalloc.h"
+
+// Decides whether a cache miss may start a recursion, so a flood of
+// queries for names nobody has cached (a random-subdomain attack) cannot
+// run the server out of memory or pile onto the authorities. A recursion is
+// shed if any of these is over its limit:
+//
+//   - recursions in flight, over all clients
+//   - recursions in flight for the client's prefix (/24 for IPv4, /56 for
+//     IPv6), so one network cannot take all of them
+//   - how long the query waited in the event loop's queue; one that waited
+//     this long is likely to be retransmitted or given up on anyway
+//   - bytes held by the coroutine frames of recursions in flight
+//
+// Cache hits never come here, so they are answered at full speed whatever
+// the load. Single threaded, like the resolver.
+class AdmissionControl {
+  public:
+   enum Verdict {
+      kAdmit = 0,
+      kShedGlobal,
+      kShedPrefix,
+      kShedDelay,
+      kShedMemory,
+      kVerdicts
+   };
+
+   struct Options {
+      Options();
+
+      int max_recursions_;
+      int max_per_prefix_;
+      uint64_t max_queue_delay_us_;
+      uint64_t max_frame_bytes_;
+      bool refuse_;   // answer REFUSED to shed queries, rather than drop
+   };
+
+   struct Stats {
+      uint64_t verdicts[kVerdicts];
+      uint64_t outstanding;
+      uint64_t peak_outstanding;
+      uint64_t prefixes;   // with recursions in flight
+   };
+
+   explicit AdmissionControl(const Options& options);
+
+   // Checks whether |client| may start a recursion, given how long its
+   // query has been queued and the frame bytes now in use. Counts it as in
+   // flight if so.
+   Verdict Admit(const struct sockaddr_in6& client, uint64_t queued_us,
+         uint64_t frame_bytes);
+
+   // Ends a recursion Admit() let through.
+   void Finished(const struct sockaddr_in6& client);
+
+   bool refuse() const { return options_.refuse_; }
+
+   Stats stats() const;
+
+   static const char* VerdictName(Verdict verdict);
+
+  private:
+   typedef std::map<uint64_t, int, std::less<uint64_t>,
+         STLsmartalloc<std::pair<const uint64_t, int> > > PrefixMap;
+
+   static uint64_t PrefixOf(const struct sockaddr_in6& client);
+
+   const Options options_;
+   uint64_t verdicts_[kVerdicts];
+   int outstanding_;
+   int peak_outstanding_;
+
+   // Prefix -> its recursions in flight; none is kept at 0
+   PrefixMap per_prefix_;
+
+   AdmissionControl(const AdmissionControl&);
+   void operator=(const AdmissionControl&);
+};
+
+#endif   // _ADMISSION_H_
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "arena.h"
+
+Arena::Arena(size_t block_size)
+      : first_(NULL),
+        first_size_(0),
+        owns_first_(true),
+        extra_(NULL),
+        cur_(NULL),
+        end_(NULL),
+        block_size_(block_size) {
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+Arena::Arena(char* buf, size_t len)
+      : first_(buf),
+        first_size_(len),
+        owns_first_(false),
+        extra_(NULL),
+        cur_(buf),
+        end_(buf + len),
+        block_size_(kDefaultBlockSize) {
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+Arena::~Arena() {
+   Reset();
+   if (owns_first_)
+      free(first_);
+}
+
+void* Arena::Allocate(size_t size, size_t align) {
+   stats_.allocations++;
+   stats_.bytes_allocated += size;
+
+   char* p = (char*) (((uintptr_t) cur_ + align - 1) & ~(uintptr_t) (align - 1));
+   if (!cur_ || p + size > end_) {
+      NewBlock(size + align);
+      p = (char*) (((uintptr_t) cur_ + align - 1) & ~(uintptr_t) (align - 1));
+   }
+
+   cur_ = p + size;
+   return p;
+}
+
+void Arena::Reset() {
+   while (extra_) {
+      Block* block = extra_;
+      extra_ = block->next_;
+      free(block);
+   }
+
+   cur_ = first_;
+   end_ = first_ + first_size_;
+}
+
+void Arena::NewBlock(size_t min_size) {
+   stats_.blocks++;
+
+   // The first block we malloc becomes the one kept across resets
+   if (!first_) {
+      first_size_ = std::max(block_size_, min_size);
+      first_ = (char*) malloc(first_size_);
+      MALLOCCHECK(first_);
+
+      cur_ = first_;
+      end_ = first_ + first_size_;
+      return;
+   }
+
+   size_t size = std::max(block_size_, min_size + sizeof(Block));
+   Block* block = (Block*) malloc(size);
+   MALLOCCHECK(block);
+
+   block->next_ = extra_;
+   extra_ = block;
+
+   cur_ = (char*) (block + 1);
+   end_ = (char*) block + size;
+}
@@ -0,0 +1,129 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <type_traits>
+
+#include "smartalloc.h"
+
+// Monotonic (bump pointer) allocator for the temporaries of one request:
+// record vectors, name compression maps and the like. Allocating is a
+// pointer increment; nothing is freed until Reset(), which drops everything
+// at once. The first block is kept across resets, so a reused arena stops
+// calling malloc once it has grown to fit a typical request.
+//
+// The first block may be supplied by the caller (a buffer on the stack, or in
+// a coroutine frame); more blocks are malloc'd as needed.
+class Arena {
+  public:
+   struct Stats {
+      uint64_t allocations;
+      uint64_t blocks;   // malloc'd, over the arena's life
+      uint64_t bytes_allocated;
+   };
+
+   explicit Arena(size_t block_size = kDefaultBlockSize);
+   Arena(char* buf, size_t len);
+   ~Arena();
+
+   void* Allocate(size_t size, size_t align = alignof(max_align_t));
+
+   // Frees everything allocated so far.
+   void Reset();
+
+   const Stats& stats() const { return stats_; }
+
+  private:
+   static const size_t kDefaultBlockSize = 4096;
+
+   // Blocks after the first are chained through a header at their start
+   struct Block {
+      Block* next_;
+   };
+
+   void NewBlock(size_t min_size);
+
+   char* first_;         // first block, kept across Reset()
+   size_t first_size_;
+   bool owns_first_;
+
+   Block* extra_;        // later blocks, newest first
+   char* cur_;
+   char* end_;
+   const size_t block_size_;
+
+   Stats stats_;
+
+   Arena(const Arena&);
+   void operator=(const Arena&);
+};
+
+// STL allocator drawing from an Arena. deallocate() is a no-op; memory comes
+// back when the arena is reset.
+//
+// Without an arena (the default) it allocates from the heap, through
+// STLsmartalloc, so containers using it work unchanged where no arena is
+// at hand. Copying a container puts the copy on the heap, so a copy can
+// safely outlive the request; moves and swaps carry the arena along.
+template <class T>
+class ArenaAllocator {
+  public:
+   typedef T                 value_type;
+   typedef value_type*       pointer;
+   typedef const value_type* const_pointer;
+   typedef value_type&       reference;
+   typedef const value_type& const_reference;
+   typedef std::size_t       size_type;
+   typedef std::ptrdiff_t    difference_type;
+
+   typedef std::false_type propagate_on_container_copy_assignment;
+   typedef std::true_type  propagate_on_container_move_assignment;
+   typedef std::true_type  propagate_on_container_swap;
+   typedef std::false_type is_always_equal;
+
+   ArenaAllocator() : arena_(NULL) { }
+   ArenaAllocator(Arena* arena) : arena_(arena) { }
+   ArenaAllocator(const ArenaAllocator& alloc) : arena_(alloc.arena_) { }
+   template <class U> ArenaAllocator(const ArenaAllocator<U>& alloc)
+         : arena_(alloc.arena()) { }
+
+   pointer allocate(size_type n) {
+      if (!arena_)
+         return STLsmartalloc<T>().allocate(n);
+      return static_cast<pointer>(arena_->Allocate(n * sizeof(T), alignof(T)));
+   }
+
+   void deallocate(pointer p, size_type n) {
+      if (!arena_)
+         STLsmartalloc<T>().deallocate(p, n);
+   }
+
+   ArenaAllocator select_on_container_copy_construction() const {
+      return ArenaAllocator();
+   }
+
+   size_type max_size() const {
+      return static_cast<size_type>(-1) / sizeof(value_type);
+   }
+
+   Arena* arena() const { return arena_; }
+
+   template <class U> struct rebind { typedef ArenaAllocator<U> other; };
+
+  private:
+   Arena* arena_;
+};
+
+template <class T, class U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+   return a.arena() == b.arena();
+}
+
+template <class T, class U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+   return a.arena() != b.arena();
+}
+
+#endif   // _ARENA_H_
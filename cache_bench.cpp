@@ -0,0 +1,324 @@
+// Hammers one DnsCache from many threads at once, mostly with lookups and
+// with a configurable share of inserts, and reports how throughput scales
+// with the number of threads. Given a shared memory segment, the cache puts
+// its sets there, and several copies run at once share them.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "clock.h"
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "shared_cache.h"
+#include "slab_arena.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+const int kMaxThreads = 64;
+
+// Addresses a name can take: an insert adds one of them, so sets grow to
+// this size and further inserts are duplicates
+const int kAddressesPerName = 4;
+
+struct Options {
+   int keys_;
+   double write_ratio_;
+   double seconds_;
+   bool global_lock_;
+   const char* shared_;
+   uint32_t shared_slots_;
+};
+
+struct Counts {
+   uint64_t reads;
+   uint64_t hits;
+   uint64_t writes;
+};
+
+uint64_t WallUs() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// h<host>.zone<zone>.com, in wire format
+std::string WireName(int host, int zone) {
+   char host_label[16];
+   char zone_label[16];
+   snprintf(host_label, sizeof(host_label), "h%d", host);
+   snprintf(zone_label, sizeof(zone_label), "zone%d", zone);
+
+   std::string name;
+   name += (char) strlen(host_label);
+   name += host_label;
+   name += (char) strlen(zone_label);
+   name += zone_label;
+   name += "\x03" "com";
+   return name;
+}
+
+DnsResourceRecord AddressRecord(const DnsQuery& query, int address) {
+   char ip[4] = { 10, 3, (char) (address >> 8), (char) address };
+   return DnsResourceRecord(query.name(), query.type(), query.clz(),
+         htonl(3600), htons(4), ip);
+}
+
+// Cheap per-thread randomness; random() takes a lock
+uint64_t NextRandom(uint64_t* state) {
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+void Worker(DnsCache* cache, std::vector<DnsQuery>* keys,
+            const Options* options, int id, std::mutex* global_lock,
+            std::atomic<bool>* stop, Counts* counts) {
+   Arena arena;
+   uint64_t state = 0x9e3779b97f4a7c15ULL * (id + 1);
+   // Records live an hour; one reading of the clock does for a run
+   uint64_t now_ms = Clock::System()->NowMs();
+   uint64_t write_threshold = (uint64_t) (options->write_ratio_ * 1e6);
+   memset(counts, 0, sizeof(Counts));
+
+   while (!stop->load(std::memory_order_relaxed)) {
+      uint64_t r = NextRandom(&state);
+      DnsQuery& query = (*keys)[r % keys->size()];
+
+      if ((r >> 32) % 1000000 < write_threshold) {
+         DnsResourceRecord record = AddressRecord(query,
+               (r >> 16) % kAddressesPerName);
+         if (global_lock) {
+            std::lock_guard<std::mutex> lock(*global_lock);
+            cache->Insert(query, record, now_ms);
+         } else {
+            cache->Insert(query, record, now_ms);
+         }
+         counts->writes++;
+         continue;
+      }
+
+      arena.Reset();
+      RRVec rrs(&arena);
+      bool hit;
+      if (global_lock) {
+         std::lock_guard<std::mutex> lock(*global_lock);
+         hit = cache->GetIterative(query, &rrs, dns_cache::kCache, now_ms);
+      } else {
+         hit = cache->GetIterative(query, &rrs, dns_cache::kCache, now_ms);
+      }
+      counts->reads++;
+      if (hit)
+         counts->hits++;
+   }
+}
+
+// Runs |threads| workers for the configured time. Returns operations per
+// second, and adds up what they did in |total|.
+double Run(DnsCache* cache, std::vector<DnsQuery>& keys,
+           const Options& options, int threads, Counts* total) {
+   std::mutex global_lock;
+   std::atomic<bool> stop(false);
+   Counts counts[kMaxThreads];
+   std::vector<std::thread> workers;
+
+   uint64_t start_us = WallUs();
+   for (int i = 0; i < threads; ++i) {
+      workers.push_back(std::thread(Worker, cache, &keys, &options, i,
+            options.global_lock_ ? &global_lock : NULL, &stop, &counts[i]));
+   }
+
+   while (WallUs() - start_us < options.seconds_ * 1e6)
+      usleep(10000);
+   stop.store(true);
+
+   for (size_t i = 0; i < workers.size(); ++i)
+      workers[i].join();
+   uint64_t elapsed_us = WallUs() - start_us;
+
+   memset(total, 0, sizeof(Counts));
+   for (int i = 0; i < threads; ++i) {
+      total->reads += counts[i].reads;
+      total->hits += counts[i].hits;
+      total->writes += counts[i].writes;
+   }
+
+   return (total->reads + total->writes) * 1e6 / elapsed_us;
+}
+
+// Parses "1,2,4" into |threads|.
+bool ParseThreads(const char* list, std::vector<int>* threads) {
+   threads->clear();
+   while (*list) {
+      char* end;
+      long n = strtol(list, &end, 10);
+      if (end == list || n < 1 || n > kMaxThreads)
+         return false;
+      threads->push_back(n);
+
+      list = end;
+      if (*list == ',')
+         list++;
+      else if (*list)
+         return false;
+   }
+   return !threads->empty();
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --threads=N,N,...     thread counts to run (1,2,4,8,16,32)\n"
+         "  --write-ratio=F       share of operations that insert (0.01)\n"
+         "  --keys=N              names in the cache (100000)\n"
+         "  --seconds=F           length of each run (1)\n"
+         "  --global-lock         serialize all access behind one mutex, for\n"
+         "                        comparison\n"
+         "  --shared=NAME         cache in shared memory segment NAME\n"
+         "  --shared-slots=N      RRsets the segment holds, if created (262144)\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   Options options;
+   options.keys_ = 100000;
+   options.write_ratio_ = 0.01;
+   options.seconds_ = 1;
+   options.global_lock_ = false;
+   options.shared_ = NULL;
+   options.shared_slots_ = 262144;
+
+   std::vector<int> threads;
+   ParseThreads("1,2,4,8,16,32", &threads);
+
+   static struct option long_options[] = {
+      { "threads",     required_argument, NULL, 't' },
+      { "write-ratio", required_argument, NULL, 'w' },
+      { "keys",        required_argument, NULL, 'k' },
+      { "seconds",     required_argument, NULL, 's' },
+      { "global-lock", no_argument,       NULL, 'g' },
+      { "shared",      required_argument, NULL, 'S' },
+      { "shared-slots", required_argument, NULL, 'n' },
+      { NULL,          0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 't':
+            if (!ParseThreads(optarg, &threads))
+               usage(argv[0]);
+            break;
+         case 'w':
+            options.write_ratio_ = atof(optarg);
+            break;
+         case 'k':
+            options.keys_ = atoi(optarg);
+            break;
+         case 's':
+            options.seconds_ = atof(optarg);
+            break;
+         case 'g':
+            options.global_lock_ = true;
+            break;
+         case 'S':
+            options.shared_ = optarg;
+            break;
+         case 'n':
+            options.shared_slots_ = atoi(optarg);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
+   if (options.keys_ < 1 || options.write_ratio_ < 0 ||
+       options.write_ratio_ > 1 || options.seconds_ <= 0 ||
+       options.shared_slots_ < 1)
+      usage(argv[0]);
+
+   SharedCache* shared = NULL;
+   if (options.shared_) {
+      shared = SharedCache::Attach(options.shared_, options.shared_slots_);
+      if (!shared)
+         exit(EXIT_FAILURE);
+   }
+
+   // A thousand names per zone, each cached with one address to start with
+   std::vector<DnsQuery> keys;
+   DnsCache cache(SlabArena::kNoHugePages, shared);
+   for (int i = 0; i < options.keys_; ++i) {
+      keys.push_back(DnsQuery(WireName(i % 1000, i / 1000),
+            htons(constants::type::A), htons(constants::clz::IN)));
+      cache.Insert(keys.back(), AddressRecord(keys.back(), 0),
+            Clock::System()->NowMs());
+   }
+
+   printf("%d keys, %.1f%% writes, %s%s\n", options.keys_,
+         100 * options.write_ratio_,
+         options.global_lock_ ? "one global lock" : "sharded, lock-free reads",
+         shared ? ", shared memory" : "");
+   printf("threads        ops/s    reads/s   writes/s   hit rate   scaling\n");
+
+   double base = 0;
+   for (size_t i = 0; i < threads.size(); ++i) {
+      Counts total;
+      double ops = Run(&cache, keys, options, threads[i], &total);
+      if (!base)
+         base = ops / threads[i];
+
+      printf("%7d %12.0f %10.0f %10.0f %9.1f%% %8.2fx\n", threads[i], ops,
+            ops * total.reads / (total.reads + total.writes),
+            ops * total.writes / (total.reads + total.writes),
+            total.reads ? 100.0 * total.hits / total.reads : 0,
+            ops / base);
+   }
+
+   SlabArena::Stats stats = cache.arena_stats();
+   printf("cache: %llu entries, %llu slabs, %llu of %llu bytes in use\n",
+         (unsigned long long) cache.size(),
+         (unsigned long long) stats.slabs_used,
+         (unsigned long long) stats.bytes_in_use,
+         (unsigned long long) stats.bytes_mapped);
+
+   if (shared) {
+      SharedCache::Stats shared_stats = shared->stats();
+      printf("shared: %u slots, %llu lookups (%llu hits, %llu torn), "
+            "%llu inserts (%llu busy, %llu too large), %llu evictions, "
+            "%llu recovered\n",
+            shared->slots(),
+            (unsigned long long) shared_stats.lookups,
+            (unsigned long long) shared_stats.hits,
+            (unsigned long long) shared_stats.torn_reads,
+            (unsigned long long) shared_stats.inserts,
+            (unsigned long long) shared_stats.busy,
+            (unsigned long long) shared_stats.too_large,
+            (unsigned long long) shared_stats.evictions,
+            (unsigned long long) shared_stats.recovered);
+   }
+
+   // The cache never touches it again
+   delete shared;
+   return 0;
+}
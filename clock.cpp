@@ -0,0 +1,46 @@
+#include <time.h>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "clock.h"
+
+namespace {
+class SystemClock : public Clock {
+  public:
+   virtual uint64_t NowMs() const {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+   }
+
+   virtual uint64_t NowUs() const {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+   }
+
+   virtual uint32_t NowSecs() const {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+      return ts.tv_sec;
+   }
+};
+}
+
+// static
+const Clock* Clock::System() {
+   static SystemClock system;
+   return &system;
+}
+
+FakeClock::FakeClock(uint64_t start_ms)
+      : now_ms_(start_ms) {
+}
+
+void FakeClock::Set(uint64_t ms) {
+   uint64_t now = now_ms_.load(std::memory_order_relaxed);
+   while (ms > now &&
+          !now_ms_.compare_exchange_weak(now, ms, std::memory_order_relaxed))
+      ;
+}
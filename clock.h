@@ -0,0 +1,58 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// Time for timers, round trips, rate limits and TTLs. The system clock is
+// the monotonic clock, which a step of the wall clock (NTP, an admin, a VM
+// resuming) cannot move: cached records do not all expire at once, or
+// outlive their TTL, and timers do not all fire, or stall, when the date
+// changes. All three readings count from the same point (boot), so they
+// may be compared after scaling.
+//
+// Whatever keeps time takes a Clock, so a FakeClock can stand in for the
+// system's, and cache expiry or retransmission can be run through hours in
+// a moment, the same way every time.
+class Clock {
+  public:
+   virtual ~Clock() { }
+
+   // To the millisecond: timers and round trips
+   virtual uint64_t NowMs() const = 0;
+
+   // To the microsecond: queueing delays
+   virtual uint64_t NowUs() const = 0;
+
+   // Seconds: TTLs. The cheapest, as it may lag the others by a tick of
+   // the kernel's (a few ms), which does not matter at this scale.
+   virtual uint32_t NowSecs() const = 0;
+
+   // CLOCK_MONOTONIC, and CLOCK_MONOTONIC_COARSE for NowSecs(). Shared and
+   // thread-safe.
+   static const Clock* System();
+};
+
+// A clock that only moves when told to. Thread-safe.
+class FakeClock : public Clock {
+  public:
+   explicit FakeClock(uint64_t start_ms);
+
+   virtual uint64_t NowMs() const {
+      return now_ms_.load(std::memory_order_relaxed);
+   }
+   virtual uint64_t NowUs() const { return NowMs() * 1000; }
+   virtual uint32_t NowSecs() const { return NowMs() / 1000; }
+
+   // Never back in time: an earlier |ms| leaves the clock where it is
+   void Set(uint64_t ms);
+   void Advance(uint64_t ms) { Set(NowMs() + ms); }
+
+  private:
+   std::atomic<uint64_t> now_ms_;
+};
+
+#endif   // _CLOCK_H_
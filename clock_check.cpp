@@ -0,0 +1,220 @@
+// Checks of what runs on the clock, on a FakeClock so they come out the same
+// every run: a record served until its TTL is up and gone a second later, a
+// negative answer expiring the same way, and the resolver giving up on an
+// authority that does not answer when its retransmit timeout is up, and
+// asking the next -- at once, if the one asked refuses. Prints a line per
+// check; exits non-zero if one fails.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "clock.h"
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "infra_cache.h"
+#include "resolver.h"
+#include "sim_network.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+
+// Whole seconds, as TTLs count them
+const uint64_t kStartMs = 1000000;
+const uint32_t kTtl = 60;
+
+// Two root servers: the one tried first never answers
+const char* kDeadRoot = "10.9.0.1";
+const char* kLiveRoot = "10.9.0.2";
+const uint32_t kDeadRootRttMs = 10;
+const uint32_t kLiveRootRttMs = 40;
+
+// Or it answers REFUSED, at once
+const char* kLameRoot = "10.9.0.3";
+const uint32_t kLameRootRttMs = 10;
+
+int failures = 0;
+
+void Check(bool ok, const char* what) {
+   printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+   if (!ok)
+      failures++;
+}
+
+DnsQuery AQuery(const char* name) {
+   return DnsQuery(SimZone::DnsName(name), htons(constants::type::A),
+         htons(constants::clz::IN));
+}
+
+DnsResourceRecord AddressRecord(const char* name, uint32_t ttl) {
+   char ip[4] = { 10, 3, 0, 1 };
+   return DnsResourceRecord(SimZone::DnsName(name), htons(constants::type::A),
+         htons(constants::clz::IN), htonl(ttl), htons(sizeof(ip)), ip);
+}
+
+// MNAME and RNAME the root, and the five counters zeroed
+DnsResourceRecord SoaRecord(const char* name, uint32_t ttl) {
+   char rdata[22];
+   memset(rdata, 0, sizeof(rdata));
+   return DnsResourceRecord(SimZone::DnsName(name),
+         htons(constants::type::SOA), htons(constants::clz::IN), htonl(ttl),
+         htons(sizeof(rdata)), rdata);
+}
+
+// The TTL a lookup of |query| in |cache| serves now, or -1 if it misses
+int64_t CachedTtl(DnsCache* cache, DnsQuery& query, int which,
+                  const Clock& clock, Arena* arena) {
+   arena->Reset();
+   RRVec rrs(arena);
+   if (!cache->GetIterative(query, &rrs, which, clock.NowMs()))
+      return -1;
+   return ntohl(rrs.front().ttl());
+}
+
+void CheckRecordExpiry() {
+   FakeClock clock(kStartMs);
+   DnsCache cache;
+   Arena arena;
+   DnsQuery query = AQuery("host.test");
+   cache.Insert(query, AddressRecord("host.test", kTtl), clock.NowMs());
+
+   clock.Advance((kTtl - 1) * 1000);
+   Check(CachedTtl(&cache, query, dns_cache::kCache, clock, &arena) == 1,
+         "record has 1 s left a second before its TTL");
+   clock.Advance(1000);
+   Check(CachedTtl(&cache, query, dns_cache::kCache, clock, &arena) == 0,
+         "record is served with TTL 0 at its TTL");
+   clock.Advance(1000);
+   Check(CachedTtl(&cache, query, dns_cache::kCache, clock, &arena) < 0,
+         "record is gone a second after its TTL");
+}
+
+void CheckNegativeExpiry() {
+   FakeClock clock(kStartMs);
+   DnsCache cache;
+   Arena arena;
+   DnsQuery query = AQuery("missing.test");
+   cache.Insert(query, SoaRecord("test", kTtl), clock.NowMs());
+
+   Check(CachedTtl(&cache, query, dns_cache::kCache, clock, &arena) < 0,
+         "negative answer is not a positive one");
+   clock.Advance(kTtl * 1000);
+   Check(CachedTtl(&cache, query, dns_cache::kNegativeCache, clock,
+               &arena) == 0,
+         "negative answer is served at its TTL");
+   clock.Advance(1000);
+   Check(CachedTtl(&cache, query, dns_cache::kNegativeCache, clock,
+               &arena) < 0,
+         "negative answer is gone a second after its TTL");
+}
+
+struct Result {
+   bool resolved_;
+   uint64_t done_ms_;
+};
+
+DetachedTask Client(Resolver* resolver, SimNetwork* network,
+                    Result* result) {
+   Arena arena;
+   DnsQuery query = AQuery("host.test");
+   Resolver::Answer answer = co_await resolver->Resolve(query, &arena);
+   result->resolved_ = answer.resolved_;
+   result->done_ms_ = network->now_ms();
+}
+
+// The v4-mapped address the resolver and the infra cache key servers by
+struct in6_addr MappedAddr(const char* ip) {
+   struct in6_addr addr;
+   inet_pton(AF_INET6, (std::string("::ffff:") + ip).c_str(), &addr);
+   return addr;
+}
+
+void CheckTimeoutFailover() {
+   SimZone root("");
+   root.AddA("host.test", "10.3.0.1");
+
+   SimNetwork network;
+   network.AddServer(kLiveRoot, &root, kLiveRootRttMs, 0, false);
+
+   DnsCache::RootHints hints(2);
+   hints[0].name_ = SimZone::DnsName("a.root.test");
+   inet_pton(AF_INET, kDeadRoot, &hints[0].addr_);
+   hints[1].name_ = SimZone::DnsName("b.root.test");
+   inet_pton(AF_INET, kLiveRoot, &hints[1].addr_);
+   DnsCache cache(SlabArena::kNoHugePages, NULL, &hints);
+
+   // Measured before, so the dead root is the one asked first
+   InfraCache infra(0);
+   struct in6_addr dead = MappedAddr(kDeadRoot);
+   infra.RecordRtt(dead, kDeadRootRttMs, network.now_ms());
+   infra.RecordRtt(MappedAddr(kLiveRoot), kLiveRootRttMs, network.now_ms());
+   uint64_t timeout_ms = infra.RetransmitTimeoutMs(dead, network.now_ms());
+
+   Resolver::Options options;
+   Resolver resolver(options, &cache, &infra, &network);
+
+   Result result = { false, 0 };
+   uint64_t start_ms = network.now_ms();
+   resolver.Start(Client(&resolver, &network, &result), start_ms);
+   network.Run(&resolver);
+
+   Check(result.resolved_,
+         "resolves past an authority that does not answer");
+   Check(resolver.stats().timeouts == 1, "times out once");
+   Check(result.done_ms_ == start_ms + timeout_ms + kLiveRootRttMs,
+         "asks the next authority when the timeout is up");
+}
+
+void CheckRefusedFailover() {
+   SimZone root("");
+   root.AddA("host.test", "10.3.0.1");
+
+   SimNetwork network;
+   network.AddServer(kLameRoot, NULL, kLameRootRttMs, 0, false);
+   network.AddServer(kLiveRoot, &root, kLiveRootRttMs, 0, false);
+
+   DnsCache::RootHints hints(2);
+   hints[0].name_ = SimZone::DnsName("a.root.test");
+   inet_pton(AF_INET, kLameRoot, &hints[0].addr_);
+   hints[1].name_ = SimZone::DnsName("b.root.test");
+   inet_pton(AF_INET, kLiveRoot, &hints[1].addr_);
+   DnsCache cache(SlabArena::kNoHugePages, NULL, &hints);
+
+   // Measured before, so the lame root is the one asked first
+   InfraCache infra(0);
+   infra.RecordRtt(MappedAddr(kLameRoot), kLameRootRttMs, network.now_ms());
+   infra.RecordRtt(MappedAddr(kLiveRoot), kLiveRootRttMs, network.now_ms());
+
+   Resolver::Options options;
+   Resolver resolver(options, &cache, &infra, &network);
+
+   Result result = { false, 0 };
+   uint64_t start_ms = network.now_ms();
+   resolver.Start(Client(&resolver, &network, &result), start_ms);
+   network.Run(&resolver);
+
+   Check(result.resolved_, "resolves past an authority that refuses");
+   Check(resolver.stats().errors == 1 && resolver.stats().timeouts == 0,
+         "counts the refusal, not a timeout");
+   Check(result.done_ms_ == start_ms + kLameRootRttMs + kLiveRootRttMs,
+         "asks the next authority as soon as it is refused");
+}
+
+}
+
+int main() {
+   CheckRecordExpiry();
+   CheckNegativeExpiry();
+   CheckTimeoutFailover();
+   CheckRefusedFailover();
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#ifndef _CONCURRENCY_H_
+#define _CONCURRENCY_H_
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <utility>
+
+#include "smartalloc.h"
+
+// Helpers for the threads that run beside the event loop: the pipeline's,
+// the socket monitor's, the metrics server's and the query log's.
+
+// Raises |value| to |to|, if it is lower: a peak any thread may push up.
+inline void RaiseTo(std::atomic<uint64_t>* value, uint64_t to) {
+   uint64_t current = value->load(std::memory_order_relaxed);
+   while (current < to && !value->compare_exchange_weak(current, to,
+         std::memory_order_relaxed)) {
+   }
+}
+
+// Starts a thread running |f|(|args|...) with every signal blocked in it,
+// so signals go to the owner's thread, whose handlers expect to run there.
+template <typename F, typename... Args>
+std::thread StartThread(F&& f, Args&&... args) {
+   sigset_t all;
+   sigset_t old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &old);
+   std::thread thread(std::forward<F>(f), std::forward<Args>(args)...);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   return thread;
+}
+
+#endif   // _CONCURRENCY_H_
@@ -1,5 +1,8 @@
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +13,13 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -22,129 +30,197 @@
 
 #include "dns_cache.h"
 #include "dns_packet.h"
+#include "epoch.h"
+#include "shared_cache.h"
+#include "slab_arena.h"
 
 namespace constants = dns_packet_constants;
 
-namespace dns_cache {
-const int kCache = 0;
-const int kNegativeCache = 1;
+namespace {
+// Shards' arenas map less at a time than a whole cache's would
+const size_t kShardRegionSize = 8 * 1024 * 1024;
+
+// Buckets a shard starts with; it doubles them past two entries per bucket
+const size_t kInitialBuckets = 64;
+
+// Retired objects a shard collects before trying to free them
+const size_t kReclaimBatch = 64;
+
+// Tries at a shared slot another writer holds before keeping the set here.
+// Writers hold slots for a copy's time, so this rarely runs out.
+const int kSharedInsertAttempts = 3;
+
+// Root hints, as IANA publishes them
+struct RootServer {
+   const char* name_;
+   const char* ip_;
+};
+
+const RootServer kRootServers[] = {
+   { "a.root-servers.net", "198.41.0.4" },
+   { "b.root-servers.net", "192.228.79.201" },
+   { "c.root-servers.net", "192.33.4.12" },
+   { "d.root-servers.net", "128.8.10.90" },
+   { "e.root-servers.net", "192.203.230.10" },
+   { "f.root-servers.net", "192.5.5.241" },
+   { "g.root-servers.net", "192.112.36.4" },
+   { "h.root-servers.net", "128.63.2.53" },
+   { "i.root-servers.net", "192.36.148.17" },
+   { "j.root-servers.net", "129.58.128.30" },
+   { "k.root-servers.net", "193.0.14.129" },
+   { "l.root-servers.net", "199.7.83.42" },
+   { "m.root-servers.net", "202.12.27.33" }
+};
+
+// "a.root-servers.net" -> DNS name format. Empty if a label is empty or
+// too long.
+std::string WireName(const char* name) {
+   std::string ret;
+   while (*name) {
+      const char* dot = strchr(name, '.');
+      size_t len = dot ? dot - name : strlen(name);
+      if (len == 0 || len > 63)
+         return std::string();
+
+      ret.push_back((char) len);
+      ret.append(name, len);
+      name += len;
+      if (*name == '.')
+         name++;
+   }
+   return ret;
+}
+
+bool Expired(const TimestampedRR& rr, time_t now) {
+   // TTL == 0 never expires
+   uint32_t ttl = ntohl(rr.second.ttl());
+   return ttl && now - rr.first > (time_t) ttl;
+}
+}
+
+DnsCache::Entry::Entry(const DnsQuery& query, int cache, uint64_t hash,
+                       SlabArena* arena)
+      : next_(NULL),
+        hash_(hash),
+        cache_(cache),
+        query_(query),
+        rrs_(arena) {
+}
+
+DnsCache::Shard::Shard(SlabArena::HugePages huge_pages)
+      : arena_(huge_pages, kShardRegionSize),
+        table_(NULL),
+        size_(0),
+        compact_bucket_(-1) {
 }
 
-DnsCache::DnsCache() {
-   char a[] = "\x01\x61\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char b[] = "\x01\x62\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char c[] = "\x01\x63\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char d[] = "\x01\x64\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char e[] = "\x01\x65\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char f[] = "\x01\x66\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char g[] = "\x01\x67\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char h[] = "\x01\x68\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char i[] = "\x01\x69\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char j[] = "\x01\x6a\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char k[] = "\x01\x6b\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char l[] = "\x01\x6c\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-   char m[] = "\x01\x6d\x0c\x72\x6f\x6f\x74\x2d\x73\x65\x72\x76\x65\x72\x73\x03\x6e\x65\x74";
-
-   char a_ip[] = "\xc6\x29\x00\x04";
-   char b_ip[] = "\xc0\xe4\x4f\xc9";
-   char c_ip[] = "\xc0\x21\x04\x0c";
-   char d_ip[] = "\x80\x08\x0a\x5a";
-   char e_ip[] = "\xc0\xcb\xe6\x0a";
-   char f_ip[] = "\xc0\x05\x05\xf1";
-   char g_ip[] = "\xc0\x70\x24\x04";
-   char h_ip[] = "\x80\x3f\x02\x35";
-   char i_ip[] = "\xc0\x24\x94\x11";
-   char j_ip[] = "\x81\x3a\x80\x1e";
-   char k_ip[] = "\xc1\x00\x0e\x81";
-   char l_ip[] = "\xc7\x07\x53\x2a";
-   char m_ip[] = "\xca\x0c\x1b\x21";
-
-   // Initialize with root servers -- match with queries for ""
+DnsCache::DnsCache(SlabArena::HugePages huge_pages, SharedCache* shared,
+                   const RootHints* root_hints)
+      : shared_(shared) {
+   for (int i = 0; i < kShards; ++i) {
+      shards_[i] = new Shard(huge_pages);
+      shards_[i]->table_.store(NewTable(shards_[i], kInitialBuckets));
+   }
+
+   RootHints defaults;
+   if (!root_hints) {
+      for (size_t i = 0; i < sizeof(kRootServers) / sizeof(kRootServers[0]);
+           ++i) {
+         RootHint hint;
+         hint.name_ = WireName(kRootServers[i].name_);
+         inet_pton(AF_INET, kRootServers[i].ip_, &hint.addr_);
+         defaults.push_back(hint);
+      }
+      root_hints = &defaults;
+   }
+
+   // Initialize with root servers -- match with queries for "". TTL 0
+   // pins them.
    DnsQuery query = DnsQuery("",
                              htons(constants::type::NS),
                              htons(constants::clz::IN));
 
-   DnsResourceRecord rr_a("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(a)+1), a);
-   DnsResourceRecord rr_b("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(b)+1), b);
-   DnsResourceRecord rr_c("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(c)+1), c);
-   DnsResourceRecord rr_d("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(d)+1), d);
-   DnsResourceRecord rr_e("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(e)+1), e);
-   DnsResourceRecord rr_f("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(f)+1), f);
-   DnsResourceRecord rr_g("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(g)+1), g);
-   DnsResourceRecord rr_h("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(h)+1), h);
-   DnsResourceRecord rr_i("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(i)+1), i);
-   DnsResourceRecord rr_j("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(j)+1), j);
-   DnsResourceRecord rr_k("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(k)+1), k);
-   DnsResourceRecord rr_l("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(l)+1), l);
-   DnsResourceRecord rr_m("", htons(constants::type::NS),
-         htons(constants::clz::IN), 0, htons(strlen(m)+1), m);
-
-   DnsResourceRecord rr_a_ip(a, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), a_ip);
-   DnsResourceRecord rr_b_ip(b, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), b_ip);
-   DnsResourceRecord rr_c_ip(c, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), c_ip);
-   DnsResourceRecord rr_d_ip(d, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), d_ip);
-   DnsResourceRecord rr_e_ip(e, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), e_ip);
-   DnsResourceRecord rr_f_ip(f, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), f_ip);
-   DnsResourceRecord rr_g_ip(g, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), g_ip);
-   DnsResourceRecord rr_h_ip(h, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), h_ip);
-   DnsResourceRecord rr_i_ip(i, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), i_ip);
-   DnsResourceRecord rr_j_ip(j, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), j_ip);
-   DnsResourceRecord rr_k_ip(k, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), k_ip);
-   DnsResourceRecord rr_l_ip(l, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), l_ip);
-   DnsResourceRecord rr_m_ip(m, htons(constants::type::A),
-         htons(constants::clz::IN), 0, htons(4), m_ip);
-
-   Insert(query, rr_a);
-   Insert(query, rr_b);
-   Insert(query, rr_c);
-   Insert(query, rr_d);
-   Insert(query, rr_e);
-   Insert(query, rr_f);
-   Insert(query, rr_g);
-   Insert(query, rr_h);
-   Insert(query, rr_i);
-   Insert(query, rr_j);
-   Insert(query, rr_k);
-   Insert(query, rr_l);
-   Insert(query, rr_m);
-
-   Insert(rr_a_ip);
-   Insert(rr_b_ip);
-   Insert(rr_c_ip);
-   Insert(rr_d_ip);
-   Insert(rr_e_ip);
-   Insert(rr_f_ip);
-   Insert(rr_g_ip);
-   Insert(rr_h_ip);
-   Insert(rr_i_ip);
-   Insert(rr_j_ip);
-   Insert(rr_k_ip);
-   Insert(rr_l_ip);
-   Insert(rr_m_ip);
+   RootHints::const_iterator it;
+   for (it = root_hints->begin(); it != root_hints->end(); ++it) {
+      char* name = (char*) it->name_.c_str();
+      DnsResourceRecord ns_rr("", htons(constants::type::NS),
+            htons(constants::clz::IN), 0, htons(it->name_.size() + 1), name);
+      DnsResourceRecord a_rr(it->name_, htons(constants::type::A),
+            htons(constants::clz::IN), 0, htons(4), (char*) &it->addr_);
+      Insert(query, ns_rr, 0);
+      Insert(a_rr, 0);
+   }
+}
+
+// static
+bool DnsCache::LoadRootHints(const char* path, RootHints* hints) {
+   FILE* file = fopen(path, "r");
+   if (!file) {
+      perror(path);
+      return false;
+   }
+
+   hints->clear();
+   char line[512];
+   int line_number = 0;
+   bool ok = true;
+   while (ok && fgets(line, sizeof(line), file)) {
+      line_number++;
+      char* hash = strchr(line, '#');
+      if (hash)
+         *hash = '\0';
+
+      char name[256];
+      char ip[64];
+      char extra[2];
+      int fields = sscanf(line, "%255s %63s %1s", name, ip, extra);
+      if (fields <= 0)
+         continue;
+
+      RootHint hint;
+      size_t len = strlen(name);
+      if (len > 1 && name[len - 1] == '.')
+         name[len - 1] = '\0';
+      hint.name_ = WireName(name);
+      if (fields != 2 || hint.name_.empty() ||
+          inet_pton(AF_INET, ip, &hint.addr_) != 1) {
+         fprintf(stderr, "%s:%d: expected a name and an IPv4 address\n", path,
+               line_number);
+         ok = false;
+      } else {
+         hints->push_back(hint);
+      }
+   }
+   fclose(file);
+
+   if (ok && hints->empty()) {
+      fprintf(stderr, "%s: no root servers\n", path);
+      ok = false;
+   }
+   return ok;
+}
+
+DnsCache::~DnsCache() {
+   // No readers are left, so everything goes now
+   for (int i = 0; i < kShards; ++i) {
+      Shard* shard = shards_[i];
+      Table* table = shard->table_.load();
+      for (size_t j = 0; j <= table->mask_; ++j) {
+         Entry* entry = table->buckets_[j].load();
+         while (entry) {
+            Entry* next = entry->next_.load();
+            Retire(shard, entry, NULL);
+            entry = next;
+         }
+      }
+      Retire(shard, NULL, table);
+
+      RetiredVec::iterator it;
+      for (it = shard->retired_.begin(); it != shard->retired_.end(); ++it)
+         Free(shard, *it);
+
+      delete shard;
+   }
 }
 
 bool DnsCache::Get(std::string name,
@@ -152,39 +228,41 @@ bool DnsCache::Get(std::string name,
                    uint16_t clz,
                    RRVec* answer_rrs,
                    RRVec* authority_rrs,
-                   RRVec* additional_rrs) {
+                   RRVec* additional_rrs,
+                   uint64_t now_ms) {
    DnsQuery query(name, type, clz);
-   return Get(query, answer_rrs, authority_rrs, additional_rrs);
+   return Get(query, answer_rrs, authority_rrs, additional_rrs, now_ms);
 }
 
 bool DnsCache::Get(DnsQuery& query,
                    RRVec* answer_rrs,
                    RRVec* authority_rrs,
-                   RRVec* additional_rrs) {
-   bool ret = Get2(query, answer_rrs, authority_rrs, additional_rrs);
-
-   // Randomize authorities
-   std::random_shuffle(authority_rrs->begin(), authority_rrs->end());
-
-   return ret;
+                   RRVec* additional_rrs,
+                   uint64_t now_ms) {
+   // Authorities are returned in cache order; the server picks among them
+   // by measured round trip time.
+   return Get2(query, answer_rrs, authority_rrs, additional_rrs, now_ms);
 }
 
 bool DnsCache::Get2(DnsQuery& query,
                     RRVec* answer_rrs,
                     RRVec* authority_rrs,
-                    RRVec* additional_rrs) {
+                    RRVec* additional_rrs,
+                    uint64_t now_ms) {
    // First and foremost, search the negative cache
-   if (GetIterative(query, authority_rrs, ncache_))
+   if (GetIterative(query, authority_rrs, dns_cache::kNegativeCache,
+         now_ms))
       return true;
 
    // Look for exact match
-   if (GetIterative(query, answer_rrs, cache_)) {
+   if (GetIterative(query, answer_rrs, dns_cache::kCache, now_ms)) {
       // Fill authority section
       GetRecursive(query.name(),
                    ntohs(constants::type::NS),
                    query.clz(),
                    authority_rrs,
-                   cache_);
+                   dns_cache::kCache,
+                   now_ms);
 
       // If NS or MX, try to fill additional with A/AAAA
       uint16_t type = ntohs(query.type());
@@ -195,13 +273,15 @@ bool DnsCache::Get2(DnsQuery& query,
                          ntohs(constants::type::A),
                          query.clz(),
                          additional_rrs,
-                         cache_);
+                         dns_cache::kCache,
+                         now_ms);
 
             GetIterative(it->data(),
                          ntohs(constants::type::AAAA),
                          query.clz(),
                          additional_rrs,
-                         cache_);
+                         dns_cache::kCache,
+                         now_ms);
          }
       } else if (type == constants::type::MX) {
          for (it = answer_rrs->begin(); it != answer_rrs->end(); ++it) {
@@ -209,13 +289,15 @@ bool DnsCache::Get2(DnsQuery& query,
                          ntohs(constants::type::A),
                          query.clz(),
                          additional_rrs,
-                         cache_);
+                         dns_cache::kCache,
+                         now_ms);
 
             GetIterative(it->data() + 2,
                          ntohs(constants::type::AAAA),
                          query.clz(),
                          additional_rrs,
-                         cache_);
+                         dns_cache::kCache,
+                         now_ms);
          }
       }
 
@@ -229,7 +311,8 @@ bool DnsCache::Get2(DnsQuery& query,
                     ntohs(constants::type::CNAME),
                     query.clz(),
                     answer_rrs,
-                    cache_)) {
+                    dns_cache::kCache,
+                    now_ms)) {
       bool found = false;
 
       // Follow CNAME chains, break on query.type() found, or no more CNAMEs
@@ -238,7 +321,8 @@ bool DnsCache::Get2(DnsQuery& query,
                           query.type(),
                           query.clz(),
                           answer_rrs,
-                          cache_)) {
+                          dns_cache::kCache,
+                          now_ms)) {
             found = true;
             break;
          }
@@ -247,7 +331,8 @@ bool DnsCache::Get2(DnsQuery& query,
                            ntohs(constants::type::CNAME),
                            query.clz(),
                            answer_rrs,
-                           cache_)) {
+                           dns_cache::kCache,
+                           now_ms)) {
             break;
          }
       }
@@ -262,14 +347,16 @@ bool DnsCache::Get2(DnsQuery& query,
                       ntohs(constants::type::NS),
                       query.clz(),
                       authority_rrs,
-                      cache_);
+                      dns_cache::kCache,
+                      now_ms);
       } else {
          // Try to fill out authority with NS of the answer
          GetRecursive(answer_rrs->back().name(),
                       ntohs(constants::type::NS),
                       query.clz(),
                       authority_rrs,
-                      cache_);
+                      dns_cache::kCache,
+                      now_ms);
       }
 
       // Try to fill out additional with A/AAAA records of NS
@@ -278,13 +365,15 @@ bool DnsCache::Get2(DnsQuery& query,
                       ntohs(constants::type::A),
                       query.clz(),
                       additional_rrs,
-                      cache_);
+                      dns_cache::kCache,
+                      now_ms);
 
          GetIterative(it->data(),
                       ntohs(constants::type::AAAA),
                       query.clz(),
                       additional_rrs,
-                      cache_);
+                      dns_cache::kCache,
+                      now_ms);
       }
 
       // If we hit any A/AAAA records for any CNAMEs, cache hit. Otherwise,
@@ -297,7 +386,8 @@ bool DnsCache::Get2(DnsQuery& query,
                 ntohs(constants::type::NS),
                 query.clz(),
                 authority_rrs,
-                cache_);
+                dns_cache::kCache,
+                now_ms);
 
    // Try to fill out additional information with A/AAAA records of NS
    for (it = authority_rrs->begin(); it != authority_rrs->end(); ++it) {
@@ -305,13 +395,15 @@ bool DnsCache::Get2(DnsQuery& query,
                    ntohs(constants::type::A),
                    query.clz(),
                    additional_rrs,
-                   cache_);
+                   dns_cache::kCache,
+                   now_ms);
 
       GetIterative(it->data(),
                    ntohs(constants::type::AAAA),
                    query.clz(),
                    additional_rrs,
-                   cache_);
+                   dns_cache::kCache,
+                   now_ms);
    }
 
    return false;
@@ -321,126 +413,400 @@ bool DnsCache::GetIterative(std::string name,
                             uint16_t type,
                             uint16_t clz,
                             RRVec* rrs,
-                            Cache& cache) {
+                            int cache,
+                            uint64_t now_ms) {
    DnsQuery query(name, type, clz);
-   return GetIterative(query, rrs, cache);
+   return GetIterative(query, rrs, cache, now_ms);
 }
 
 bool DnsCache::GetIterative(DnsQuery& query,
                             RRVec* rrs,
-                            Cache& cache) {
+                            int cache,
+                            uint64_t now_ms) {
    LOG << "Looking for " << query.ToString();
-   if (&cache == &ncache_)
+   if (cache == dns_cache::kNegativeCache)
       LOG << " in negative cache";
 
-   Cache::iterator it = cache.find(query);
-   if (it != cache.end()) {
-      time_t now = time(NULL);
-
-      TimestampedRRVec::iterator it2;
-      for (it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-         // ignore TTL == 0
-         if (ntohl(it2->second.ttl())) {
-            // Remove expired RRs
-            if (now - it2->first > (time_t) ntohl(it2->second.ttl())) {
-               LOG << "Erasing expired record" << std::endl;
-               it2 = it->second.erase(it2);
-               it2--;
-            }
-
-            // Not expired -- update TTL
-            else {
-               //LOG << "Updating TTL: Subtracting " << now - it2->first <<
-               //      std::endl;
-               it2->second.SubtractFromTtl(now - it2->first);
-               it2->first = now;
-            }
-         }
-      }
+   EpochGuard guard;
 
-      // If we removed them all due to expired TTLs, return false (cache miss)
-      if (!it->second.size()) {
-         LOG << " -- NOT FOUND" << std::endl;
-         return false;
+   time_t now = now_ms / 1000;
+   const Entry* entry = Find(query, cache, Hash(query, cache));
+   if (!entry) {
+      if (shared_ && shared_->Get(query, cache, now, rrs)) {
+         LOG << "-- FOUND (shared)" << std::endl;
+         return true;
       }
 
-      // Push all RRs to the supplied vector
-      LOG << "-- FOUND" << std::endl;
-      for (it2 = it->second.begin(); it2 != it->second.end(); ++it2)
-         rrs->push_back(it2->second);
+      LOG << "-- NOT FOUND" << std::endl;
+      return false;
+   }
 
-      return true;
+   // Push all unexpired RRs to the supplied vector, their TTLs counted down
+   // to now
+   size_t found = 0;
+   TimestampedRRVec::const_iterator it;
+   for (it = entry->rrs_.begin(); it != entry->rrs_.end(); ++it) {
+      if (Expired(*it, now))
+         continue;
+
+      rrs->push_back(it->second);
+      if (ntohl(it->second.ttl()))
+         rrs->back().SubtractFromTtl(now - it->first);
+      found++;
    }
 
-   // No hits
-   LOG << "-- NOT FOUND" << std::endl;
-   return false;
+   // If they have all expired, cache miss
+   if (!found) {
+      LOG << " -- NOT FOUND" << std::endl;
+      return false;
+   }
+
+   LOG << "-- FOUND" << std::endl;
+   return true;
 }
 
 void DnsCache::GetRecursive(std::string name,
                             uint16_t type,
                             uint16_t clz,
                             RRVec* rrs,
-                            Cache& cache) {
+                            int cache,
+                            uint64_t now_ms) {
    DnsQuery query(name, type, clz);
-   GetRecursive(query, rrs, cache);
+   GetRecursive(query, rrs, cache, now_ms);
 }
 
 
 void DnsCache::GetRecursive(DnsQuery& query,
                             RRVec* rrs,
-                            Cache& cache) {
-   if (GetIterative(query, rrs, cache))
+                            int cache,
+                            uint64_t now_ms) {
+   if (GetIterative(query, rrs, cache, now_ms))
       return;
 
    GetRecursive(DnsPacket::ShortenName(query.name()),
                 query.type(),
                 query.clz(),
                 rrs,
-                cache);
+                cache,
+                now_ms);
 }
 
 void DnsCache::Insert(DnsQuery& query,
-                      const DnsResourceRecord& resource_record) {
-   Cache* cache;
+                      const DnsResourceRecord& resource_record,
+                      uint64_t now_ms) {
+   int cache;
    if (ntohs(resource_record.type()) == constants::type::SOA)
-      cache = &ncache_;
+      cache = dns_cache::kNegativeCache;
    else
-      cache = &cache_;
+      cache = dns_cache::kCache;
+
+   uint64_t hash = Hash(query, cache);
+   time_t now = now_ms / 1000;
+
+   // Sets already kept here stay here
+   bool local = false;
+   if (shared_) {
+      EpochGuard guard;
+      local = Find(query, cache, hash) != NULL;
+   }
+
+   for (int i = 0; shared_ && !local && i < kSharedInsertAttempts; ++i) {
+      RRVec spilled;
+      if (shared_->Insert(query, cache, resource_record, now, &spilled))
+         return;
+
+      // Outgrew its slot: the set is ours now
+      if (!spilled.empty()) {
+         RRVec::iterator it;
+         for (it = spilled.begin(); it != spilled.end(); ++it)
+            InsertLocal(query, cache, hash, *it, now);
+         return;
+      }
 
-   Cache::iterator it = cache->find(query);
-   if (it == cache->end()) {
+      sched_yield();
+   }
+
+   InsertLocal(query, cache, hash, resource_record, now);
+}
+
+void DnsCache::InsertLocal(const DnsQuery& query, int cache, uint64_t hash,
+                           const DnsResourceRecord& resource_record,
+                           time_t now) {
+   Shard* shard = ShardOf(hash);
+   std::lock_guard<std::mutex> lock(shard->lock_);
+
+   // Writers hold the lock, so nothing moves under us
+   Table* table = shard->table_.load(std::memory_order_relaxed);
+   std::atomic<Entry*>* link = &table->buckets_[hash / kShards & table->mask_];
+   Entry* entry = link->load(std::memory_order_relaxed);
+   while (entry && (entry->hash_ != hash || entry->cache_ != cache ||
+                    !(entry->query_ == query))) {
+      link = &entry->next_;
+      entry = link->load(std::memory_order_relaxed);
+   }
+
+   if (!entry) {
       LOG << "Query " << query.ToString() << " not found in cache -- inserting "
             << resource_record.ToString() << std::endl;
-      TimestampedRRVec timestamped_resource_records;
-      timestamped_resource_records.push_back(
-            TimestampedRR(time(NULL), resource_record));
-      cache->insert(
-            std::pair<DnsQuery, TimestampedRRVec >
-                  (query, timestamped_resource_records));
-   } else {
-      LOG << "Query " << query.ToString() <<
-            " found in cache -- adding " << resource_record.ToString() <<
-            " to vector" << std::endl;
-      TimestampedRRVec::iterator it2;
-      for (it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-         if (resource_record == it2->second) {
-            LOG << " -- actually not adding (duplicate)" << std::endl;
-            break;
-         }
-      }
+      Entry* fresh = NewEntry(shard, query, cache, hash);
+      fresh->rrs_.push_back(TimestampedRR(now, resource_record));
+
+      // Readers see the entry whole, or not at all
+      std::atomic<Entry*>* head = &table->buckets_[hash / kShards & table->mask_];
+      fresh->next_.store(head->load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+      head->store(fresh, std::memory_order_release);
 
-      // Only insert if we didn't find the resource record already in the vec
-      if (it2 == it->second.end())
-         it->second.push_back(TimestampedRR(
-               time(NULL), resource_record));
+      if (++shard->size_ > 2 * (table->mask_ + 1))
+         Grow(shard);
+      return;
    }
+
+   LOG << "Query " << query.ToString() <<
+         " found in cache -- adding " << resource_record.ToString() <<
+         " to vector" << std::endl;
+   TimestampedRRVec::const_iterator it;
+   for (it = entry->rrs_.begin(); it != entry->rrs_.end(); ++it) {
+      if (resource_record == it->second) {
+         LOG << " -- actually not adding (duplicate)" << std::endl;
+         break;
+      }
+   }
+
+   // Only insert if we didn't find the resource record already in the vec
+   if (it != entry->rrs_.end())
+      return;
+
+   // A copy with the record added (and expired ones dropped) replaces it
+   Entry* fresh = NewEntry(shard, query, cache, hash);
+   CopyLiveRecords(entry, fresh, now);
+   fresh->rrs_.push_back(TimestampedRR(now, resource_record));
+   fresh->next_.store(entry->next_.load(std::memory_order_relaxed),
+         std::memory_order_relaxed);
+   link->store(fresh, std::memory_order_release);
+
+   Retire(shard, entry, NULL);
+   Reclaim(shard, false);
 }
 
-void DnsCache::Insert(const DnsResourceRecord& resource_record) {
+void DnsCache::Insert(const DnsResourceRecord& resource_record,
+                      uint64_t now_ms) {
    if (ntohs(resource_record.type()) == constants::type::SOA)
       LOG << "WARNING: Inserting an SOA with no Query. Generating a Query from "
             " the Resource Record." << std::endl;
    DnsQuery query = resource_record.ConstructQuery();
-   Insert(query, resource_record);
+   Insert(query, resource_record, now_ms);
+}
+
+void DnsCache::Compact(int budget, uint64_t now_ms) {
+   time_t now = now_ms / 1000;
+
+   int per_shard = std::max(1, budget / kShards);
+   for (int i = 0; i < kShards; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i]->lock_);
+      CompactShard(shards_[i], per_shard, now);
+   }
+}
+
+SlabArena::Stats DnsCache::arena_stats() const {
+   SlabArena::Stats total;
+   memset(&total, 0, sizeof(SlabArena::Stats));
+
+   for (int i = 0; i < kShards; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i]->lock_);
+      const SlabArena::Stats& stats = shards_[i]->arena_.stats();
+      total.allocations += stats.allocations;
+      total.frees += stats.frees;
+      total.large += stats.large;
+      total.regions += stats.regions;
+      total.huge_page_regions += stats.huge_page_regions;
+      total.huge_page_fallbacks += stats.huge_page_fallbacks;
+      total.slabs_used += stats.slabs_used;
+      total.slabs_free += stats.slabs_free;
+      total.bytes_mapped += stats.bytes_mapped;
+      total.bytes_in_use += stats.bytes_in_use;
+      total.compactions += stats.compactions;
+      total.slabs_drained += stats.slabs_drained;
+   }
+
+   return total;
+}
+
+uint64_t DnsCache::size() const {
+   uint64_t size = 0;
+   for (int i = 0; i < kShards; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i]->lock_);
+      size += shards_[i]->size_;
+   }
+   return size;
+}
+
+// static
+uint64_t DnsCache::Hash(const DnsQuery& query, int cache) {
+   uint64_t key = (uint64_t) cache << 32 | (uint32_t) query.type() << 16 |
+         query.clz();
+   return std::hash<std::string>()(query.name()) ^
+         (key + 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+const DnsCache::Entry* DnsCache::Find(const DnsQuery& query, int cache,
+                                      uint64_t hash) {
+   Table* table = ShardOf(hash)->table_.load(std::memory_order_acquire);
+   const Entry* entry = table->buckets_[hash / kShards & table->mask_].load(
+         std::memory_order_acquire);
+   for (; entry; entry = entry->next_.load(std::memory_order_acquire)) {
+      if (entry->hash_ == hash && entry->cache_ == cache &&
+          entry->query_ == query)
+         return entry;
+   }
+
+   return NULL;
+}
+
+DnsCache::Entry* DnsCache::NewEntry(Shard* shard, const DnsQuery& query,
+                                    int cache, uint64_t hash) {
+   // Not placement new, which smartalloc would track as an allocation of its
+   // own
+   Entry* entry = (Entry*) shard->arena_.Allocate(sizeof(Entry));
+   return std::construct_at(entry, query, cache, hash, &shard->arena_);
+}
+
+DnsCache::Table* DnsCache::NewTable(Shard* shard, size_t buckets) {
+   Table* table = (Table*) shard->arena_.Allocate(
+         offsetof(Table, buckets_) + buckets * sizeof(std::atomic<Entry*>));
+   table->mask_ = buckets - 1;
+   for (size_t i = 0; i < buckets; ++i)
+      table->buckets_[i].store(NULL, std::memory_order_relaxed);
+   return table;
+}
+
+void DnsCache::CopyLiveRecords(const Entry* from, Entry* to, time_t now) {
+   to->rrs_.reserve(from->rrs_.size() + 1);
+
+   TimestampedRRVec::const_iterator it;
+   for (it = from->rrs_.begin(); it != from->rrs_.end(); ++it) {
+      if (Expired(*it, now)) {
+         LOG << "Erasing expired record" << std::endl;
+      } else {
+         to->rrs_.push_back(*it);
+      }
+   }
+}
+
+void DnsCache::Grow(Shard* shard) {
+   Table* old_table = shard->table_.load(std::memory_order_relaxed);
+   Table* table = NewTable(shard, 2 * (old_table->mask_ + 1));
+
+   for (size_t i = 0; i <= old_table->mask_; ++i) {
+      Entry* entry = old_table->buckets_[i].load(std::memory_order_relaxed);
+      while (entry) {
+         Entry* copy = NewEntry(shard, entry->query_, entry->cache_,
+               entry->hash_);
+         copy->rrs_ = entry->rrs_;
+
+         std::atomic<Entry*>* head =
+               &table->buckets_[entry->hash_ / kShards & table->mask_];
+         copy->next_.store(head->load(std::memory_order_relaxed),
+               std::memory_order_relaxed);
+         head->store(copy, std::memory_order_relaxed);
+
+         Entry* next = entry->next_.load(std::memory_order_relaxed);
+         Retire(shard, entry, NULL);
+         entry = next;
+      }
+   }
+
+   shard->table_.store(table, std::memory_order_release);
+   Retire(shard, NULL, old_table);
+   Reclaim(shard, false);
+}
+
+void DnsCache::Retire(Shard* shard, Entry* entry, Table* table) {
+   Retired retired;
+   retired.epoch_ = EpochManager::Instance()->epoch();
+   retired.entry_ = entry;
+   retired.table_ = table;
+   shard->retired_.push_back(retired);
+}
+
+void DnsCache::Reclaim(Shard* shard, bool force) {
+   if (!force && shard->retired_.size() < kReclaimBatch)
+      return;
+
+   // Retired in epoch order, so stop at the first that may still be held
+   EpochManager* epoch = EpochManager::Instance();
+   RetiredVec::iterator it = shard->retired_.begin();
+   while (it != shard->retired_.end() && epoch->Reclaimable(it->epoch_)) {
+      Free(shard, *it);
+      ++it;
+   }
+
+   shard->retired_.erase(shard->retired_.begin(), it);
+}
+
+void DnsCache::Free(Shard* shard, const Retired& retired) {
+   if (retired.entry_) {
+      std::destroy_at(retired.entry_);
+      shard->arena_.Free(retired.entry_, sizeof(Entry));
+   } else {
+      shard->arena_.Free(retired.table_, offsetof(Table, buckets_) +
+            (retired.table_->mask_ + 1) * sizeof(std::atomic<Entry*>));
+   }
+}
+
+void DnsCache::CompactShard(Shard* shard, int budget, time_t now) {
+   SlabArena* arena = &shard->arena_;
+
+   // Between passes: start one, draining whatever slabs the last pass left
+   // sparse. With none to drain, it just sweeps out expired records.
+   if (shard->compact_bucket_ < 0) {
+      arena->StartCompaction();
+      shard->compact_bucket_ = 0;
+   }
+
+   Table* table = shard->table_.load(std::memory_order_relaxed);
+   while (budget > 0 && (size_t) shard->compact_bucket_ <= table->mask_) {
+      std::atomic<Entry*>* link = &table->buckets_[shard->compact_bucket_++];
+      Entry* entry = link->load(std::memory_order_relaxed);
+      for (; entry; entry = link->load(std::memory_order_relaxed), --budget) {
+         bool expired = false;
+         TimestampedRRVec::const_iterator it;
+         for (it = entry->rrs_.begin(); it != entry->rrs_.end(); ++it)
+            expired = expired || Expired(*it, now);
+
+         if (!expired && !arena->IsDraining(entry) &&
+             !arena->IsDraining(entry->rrs_.data())) {
+            link = &entry->next_;
+            continue;
+         }
+
+         // Replace it with a fresh copy of its live records, or drop it
+         Entry* next = entry->next_.load(std::memory_order_relaxed);
+         Entry* fresh = NewEntry(shard, entry->query_, entry->cache_,
+               entry->hash_);
+         CopyLiveRecords(entry, fresh, now);
+         if (fresh->rrs_.empty()) {
+            std::destroy_at(fresh);
+            arena->Free(fresh, sizeof(Entry));
+            link->store(next, std::memory_order_release);
+            shard->size_--;
+         } else {
+            fresh->next_.store(next, std::memory_order_relaxed);
+            link->store(fresh, std::memory_order_release);
+            link = &fresh->next_;
+         }
+
+         Retire(shard, entry, NULL);
+      }
+   }
+
+   if ((size_t) shard->compact_bucket_ > table->mask_) {
+      // Whatever is still in the drained slabs was allocated before the
+      // pass reached it; those slabs go back to taking allocations
+      Reclaim(shard, true);
+      arena->FinishCompaction();
+      shard->compact_bucket_ = -1;
+   } else {
+      Reclaim(shard, false);
+   }
 }
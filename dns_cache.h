@@ -13,24 +13,71 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <list>
 #include <map>
+#include <mutex>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "smartalloc.h"
 
 #include "dns_packet.h"
+#include "epoch.h"
+#include "shared_cache.h"
+#include "slab_arena.h"
 
+// A record and when it was cached, in seconds of the caller's clock
 typedef std::pair<time_t, DnsResourceRecord> TimestampedRR;
 
-typedef std::vector<TimestampedRR, STLsmartalloc<TimestampedRR> > TimestampedRRVec;
-
-typedef std::map<DnsQuery, TimestampedRRVec, std::less<DnsQuery>, STLsmartalloc<std::pair<DnsQuery, TimestampedRRVec> > > Cache;
-
+// Record vectors live in the cache's own SlabArenas, apart from the
+// short-lived allocations of request handling
+typedef std::vector<TimestampedRR, SlabArenaAllocator<TimestampedRR> > TimestampedRRVec;
+
+namespace dns_cache {
+// Which of the two caches a lookup goes to
+const int kCache = 0;
+const int kNegativeCache = 1;   // SOAs of negative answers
+}
+
+// Thread-safe, and built for many readers. Entries are spread over kShards
+// shards by a hash of their key; each shard is a chained hash table with its
+// own lock and SlabArena. Readers take no lock: entries are never changed
+// once published, so a writer replaces an entry with an updated copy and
+// retires the old one, and EpochManager tells it when no reader can still
+// be looking at it. Lookups do not write either: record TTLs count down
+// from the time of insertion, and expired records are skipped until an
+// insert or Compact() drops them.
+//
+// Given a SharedCache, RRsets go there, and only those that outgrow its
+// slots (or find theirs busy) are kept here; lookups try here first, then
+// there.
 class DnsCache {
   public:
-   DnsCache();
+   // A root server, as root hints give it
+   struct RootHint {
+      std::string name_;        // DNS name format
+      struct in_addr addr_;
+   };
+
+   typedef std::vector<RootHint> RootHints;
+
+   // The cache starts out knowing the root servers, pinned: those of
+   // |root_hints|, or IANA's if it is NULL.
+   //
+   // Callers pass the time, |now_ms| on a Clock's NowMs(), as they do to the
+   // infra cache; TTLs count down on it. A lookup, insert or compaction
+   // step reads no clock of its own.
+   DnsCache(SlabArena::HugePages huge_pages = SlabArena::kNoHugePages,
+            SharedCache* shared = NULL, const RootHints* root_hints = NULL);
+   ~DnsCache();
+
+   // Reads root hints from |path|, a server a line: its name, then its IPv4
+   // address ("a.root-servers.net 198.41.0.4"). '#' starts a comment.
+   // Returns false, having said why on stderr, if the file cannot be read,
+   // a line is malformed or there are no servers.
+   static bool LoadRootHints(const char* path, RootHints* hints);
 
    // Gets the best match the cache contains. Has 3 out-parameters.
    // Constructs a DnsQuery with the given three fields. Requires network
@@ -40,30 +87,36 @@ class DnsCache {
             uint16_t clz,
             RRVec* answer_rrs,
             RRVec* authority_rrs,
-            RRVec* additional_rrs);
+            RRVec* additional_rrs,
+            uint64_t now_ms);
 
    bool Get(DnsQuery& query,
             RRVec* answer_rrs,
             RRVec* authority_rrs,
-            RRVec* additional_rrs);
+            RRVec* additional_rrs,
+            uint64_t now_ms);
 
    bool Get2(DnsQuery& query,
             RRVec* answer_rrs,
             RRVec* authority_rrs,
-            RRVec* additional_rrs);
+            RRVec* additional_rrs,
+            uint64_t now_ms);
 
    // Queries the cache for an exact match. Returns true if such a match is
    // found, false otherwise. Constructs a DnsQuery with the given fields. Has
-   // one out-parameter. Requires network byte order.
+   // one out-parameter. Requires network byte order. |cache| is kCache or
+   // kNegativeCache.
    bool GetIterative(std::string name,
                      uint16_t type,
                      uint16_t clz,
                      RRVec* rrs,
-                     Cache& cache);
+                     int cache,
+                     uint64_t now_ms);
 
    bool GetIterative(DnsQuery& query,
                      RRVec* rrs,
-                     Cache& cache);
+                     int cache,
+                     uint64_t now_ms);
 
    // Recursively queries the cache for NS records. NS record isn't hard-coded
    // into the function, but it's the only RR that makes any sense to perform
@@ -73,22 +126,118 @@ class DnsCache {
                      uint16_t type,
                      uint16_t clz,
                      RRVec* rrs,
-                     Cache& cache);
+                     int cache,
+                     uint64_t now_ms);
 
    void GetRecursive(DnsQuery& query,
                      RRVec* rrs,
-                     Cache& cache);
+                     int cache,
+                     uint64_t now_ms);
 
-   // Timestamps and insertsthe resource records into the cache with key
+   // Timestamps and inserts the resource records into the cache with key
    // |query|.
    void Insert(DnsQuery& query,
-               RRVec* resource_records);
-   void Insert(DnsQuery& query, const DnsResourceRecord& resource_record);
-   void Insert(const DnsResourceRecord& resource_record);
+               RRVec* resource_records,
+               uint64_t now_ms);
+   void Insert(DnsQuery& query, const DnsResourceRecord& resource_record,
+               uint64_t now_ms);
+   void Insert(const DnsResourceRecord& resource_record, uint64_t now_ms);
+
+   // Does up to |budget| entries' worth of compaction: drops expired records
+   // and emptied entries, and moves entries out of the arenas' sparsest
+   // slabs so they can be released. A pass over the whole cache is spread
+   // over as many calls as it takes; the next pass starts once it is done.
+   void Compact(int budget, uint64_t now_ms);
+
+   // The shards' arenas, added up
+   SlabArena::Stats arena_stats() const;
+
+   // Entries, over all shards
+   uint64_t size() const;
 
   private:
-   Cache cache_;
-   Cache ncache_; // Negative cache for SOAs
+   static const int kShards = 16;
+
+   // An RRset under one key. Never changed once readers can reach it.
+   struct Entry {
+      Entry(const DnsQuery& query, int cache, uint64_t hash,
+            SlabArena* arena);
+
+      std::atomic<Entry*> next_;   // in its bucket's chain
+      uint64_t hash_;
+      int cache_;
+      DnsQuery query_;
+      TimestampedRRVec rrs_;
+   };
+
+   // A shard's buckets. Replaced by a bigger one as the shard fills up.
+   struct Table {
+      size_t mask_;
+      std::atomic<Entry*> buckets_[1];
+   };
+
+   // Something unlinked, waiting for the readers that may hold it
+   struct Retired {
+      uint64_t epoch_;
+      Entry* entry_;   // or, if NULL, table_
+      Table* table_;
+   };
+
+   typedef std::vector<Retired, STLsmartalloc<Retired> > RetiredVec;
+
+   struct alignas(64) Shard {
+      Shard(SlabArena::HugePages huge_pages);
+
+      std::mutex lock_;   // held by writers
+      SlabArena arena_;
+      std::atomic<Table*> table_;
+      uint64_t size_;
+      RetiredVec retired_;
+
+      // Compaction pass under way: the next bucket to visit, or -1 between
+      // passes
+      long compact_bucket_;
+   };
+
+   static uint64_t Hash(const DnsQuery& query, int cache);
+
+   // Adds |resource_record| to this process's own copy of the set.
+   void InsertLocal(const DnsQuery& query, int cache, uint64_t hash,
+         const DnsResourceRecord& resource_record, time_t now);
+
+   Shard* ShardOf(uint64_t hash) { return shards_[hash % kShards]; }
+
+   // The entry for |query|, or NULL. Requires an EpochGuard.
+   const Entry* Find(const DnsQuery& query, int cache, uint64_t hash);
+
+   // The rest require the shard's lock.
+   Entry* NewEntry(Shard* shard, const DnsQuery& query, int cache,
+         uint64_t hash);
+   Table* NewTable(Shard* shard, size_t buckets);
+
+   // Copies the unexpired records of |from| to |to|.
+   void CopyLiveRecords(const Entry* from, Entry* to, time_t now);
+
+   // Doubles the shard's buckets. The entries are copied into the new
+   // table, as readers may still be walking the old chains.
+   void Grow(Shard* shard);
+
+   void Retire(Shard* shard, Entry* entry, Table* table);
+
+   // Frees what no reader can hold any more. Unless |force|, only does so
+   // once enough has piled up to be worth the scan of the readers.
+   void Reclaim(Shard* shard, bool force);
+
+   void Free(Shard* shard, const Retired& retired);
+
+   // Compacts up to |budget| entries of the shard.
+   void CompactShard(Shard* shard, int budget, time_t now);
+
+   Shard* shards_[kShards];
+   SharedCache* shared_;
+
+   DnsCache(const DnsCache&);
+   void operator=(const DnsCache&);
 };
 
 #endif   // _DNS_CACHE_H_
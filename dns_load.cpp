@@ -0,0 +1,711 @@
+// Drives a DNS server on this machine with queries and measures what it
+// achieves: queries answered a second, queries lost, and the latency of
+// the answers, as a histogram. Queries come from a file, replayed in order,
+// or are drawn from a synthetic set of names whose popularity follows a
+// Zipf distribution, as real query streams' does.
+//
+// In open-loop mode (--rate) queries go out on a fixed schedule whether or
+// not answers keep up, and latency is measured from when each query was
+// due, not from when it was sent, so a stalled server is charged for the
+// queries it held up. In closed-loop mode (--concurrency) a fixed number
+// are kept in flight, which finds the most the server can answer.
+//
+// Queries are spread over many sockets, each with a source port of its
+// own, and sent and received in batches with sendmmsg() and recvmmsg().
+// Only loopback targets are accepted: this is for measuring a server
+// started for the purpose, not for pointing at someone else's.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+#include "histogram.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+const int kMaxQueryLen = 512;
+const int kMaxResponseLen = 4096;
+const int kIds = 65536;
+const int kMaxBatch = 1024;
+
+// Queries one socket may have in flight; the rest of its IDs are left for
+// queries that timed out, so a late answer to one is still recognised
+const int kMaxInFlightPerSocket = kIds / 2;
+
+const char* const kRcodeNames[] = { "NOERROR", "FORMERR", "SERVFAIL",
+      "NXDOMAIN", "NOTIMP", "REFUSED" };
+
+struct Options {
+   const char* server_;
+   int port_;
+   const char* queries_;
+   bool once_;
+   int names_;
+   double zipf_;
+   const char* suffix_;
+   uint16_t type_;
+   double rate_;
+   int concurrency_;
+   double duration_;
+   int timeout_ms_;
+   int sockets_;
+   int batch_;
+   bool histogram_;
+};
+
+struct Slot {
+   enum State { kFree = 0, kInFlight, kTimedOut };
+
+   uint64_t due_ns_;
+   uint8_t state_;
+};
+
+struct Socket {
+   int fd_;
+   uint16_t next_id_;
+   int in_flight_;
+   std::vector<Slot> slots_;
+};
+
+// A query sent, in the order sent, for finding the ones that time out
+struct Sent {
+   uint32_t socket_;
+   uint16_t id_;
+   uint64_t due_ns_;
+};
+
+struct Counts {
+   uint64_t sent;
+   uint64_t answered;
+   uint64_t timed_out;
+   uint64_t late;         // answered after timing out
+   uint64_t unexpected;   // answers to no query we know of
+   uint64_t truncated;
+   uint64_t send_errors;
+   uint64_t rcodes[16];
+};
+
+uint64_t NowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t NextRandom(uint64_t* state) {
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+// "www.example.com" to its wire format, without the root label's zero
+// (ConstructQuery writes it). Returns false if a label or the whole name
+// is too long, or a label is empty.
+bool ToWireName(const std::string& dotted, std::string* wire) {
+   wire->clear();
+   size_t start = 0;
+   while (start < dotted.size()) {
+      size_t dot = dotted.find('.', start);
+      if (dot == std::string::npos)
+         dot = dotted.size();
+
+      size_t len = dot - start;
+      if (len == 0 || len > 63)
+         return false;
+      *wire += (char) len;
+      wire->append(dotted, start, len);
+      start = dot + 1;
+   }
+   return wire->size() + 1 <= 255;
+}
+
+// "A", "AAAA", ..., or a number. Returns 0 if it is neither.
+uint16_t ParseType(const char* text) {
+   char* end;
+   long number = strtol(text, &end, 10);
+   if (*text && !*end)
+      return number > 0 && number < 65536 ? number : 0;
+
+   for (int type = 1; type < 256; ++type) {
+      if (DnsPacket::TypeToString(type) == text)
+         return type;
+   }
+   return 0;
+}
+
+// A query for |dotted|, with ID 0, for sends to copy and set the ID of
+bool MakeQuery(const std::string& dotted, uint16_t type, std::string* query) {
+   std::string wire;
+   if (!ToWireName(dotted, &wire))
+      return false;
+
+   char buf[kMaxQueryLen];
+   char* end = DnsPacket::ConstructQuery(buf, 0, constants::opcode::Query,
+         true, wire.c_str(), htons(type), htons(constants::clz::IN));
+   query->assign(buf, end - buf);
+   return true;
+}
+
+// One query a line: a name, then optionally a type (A if not)
+bool LoadQueries(const char* path, std::vector<std::string>* queries) {
+   FILE* file = fopen(path, "r");
+   if (!file) {
+      perror(path);
+      return false;
+   }
+
+   char line[1024];
+   int line_number = 0;
+   while (fgets(line, sizeof(line), file)) {
+      line_number++;
+      char* hash = strchr(line, '#');
+      if (hash)
+         *hash = '\0';
+
+      char name[300];
+      char type_text[32];
+      int fields = sscanf(line, "%299s %31s", name, type_text);
+      if (fields < 1)
+         continue;
+
+      uint16_t type = fields == 2 ? ParseType(type_text) :
+            constants::type::A;
+      std::string dotted = name;
+      if (dotted.size() > 1 && dotted[dotted.size() - 1] == '.')
+         dotted.resize(dotted.size() - 1);
+      else if (dotted == ".")
+         dotted.clear();
+
+      std::string query;
+      if (!type || !MakeQuery(dotted, type, &query)) {
+         fprintf(stderr, "%s:%d: bad query\n", path, line_number);
+         fclose(file);
+         return false;
+      }
+      queries->push_back(query);
+   }
+   fclose(file);
+
+   if (queries->empty()) {
+      fprintf(stderr, "%s: no queries\n", path);
+      return false;
+   }
+   return true;
+}
+
+// n<rank>.<suffix> for ranks 1 to |names|, most popular first, and the
+// cumulative weights to draw them by
+bool MakeZipfQueries(const Options& options,
+                     std::vector<std::string>* queries,
+                     std::vector<double>* cdf) {
+   double total = 0;
+   for (int rank = 1; rank <= options.names_; ++rank) {
+      char name[300];
+      snprintf(name, sizeof(name), "n%d.%s", rank, options.suffix_);
+
+      std::string query;
+      if (!MakeQuery(name, options.type_, &query)) {
+         fprintf(stderr, "bad suffix %s\n", options.suffix_);
+         return false;
+      }
+      queries->push_back(query);
+
+      total += 1 / pow(rank, options.zipf_);
+      cdf->push_back(total);
+   }
+   for (size_t i = 0; i < cdf->size(); ++i)
+      (*cdf)[i] /= total;
+   return true;
+}
+
+// Accepts 127.0.0.0/8 and ::1, and nothing else
+bool ParseLoopback(const char* text, int port, struct sockaddr_storage* addr,
+                   socklen_t* len) {
+   memset(addr, 0, sizeof(*addr));
+
+   struct sockaddr_in* sin = (struct sockaddr_in*) addr;
+   if (inet_pton(AF_INET, text, &sin->sin_addr) == 1) {
+      if ((ntohl(sin->sin_addr.s_addr) >> 24) != 127)
+         return false;
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(port);
+      *len = sizeof(*sin);
+      return true;
+   }
+
+   struct sockaddr_in6* sin6 = (struct sockaddr_in6*) addr;
+   if (inet_pton(AF_INET6, text, &sin6->sin6_addr) == 1) {
+      if (!IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr))
+         return false;
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(port);
+      *len = sizeof(*sin6);
+      return true;
+   }
+   return false;
+}
+
+// Sends up to |count| queries on |socket|, due at |due_ns[i]|. Returns how
+// many went; the rest are for another socket, or the next round.
+int SendBatch(Socket* socket, uint32_t socket_index, int count,
+              const uint64_t* due_ns,
+              const std::vector<std::string>& queries,
+              const std::vector<double>& cdf, uint64_t* next_query,
+              uint64_t* random, std::deque<Sent>* sent, Counts* counts,
+              char* bufs, struct mmsghdr* msgs, struct iovec* iovs) {
+   count = std::min(count, kMaxInFlightPerSocket - socket->in_flight_);
+   uint16_t ids[kMaxBatch];
+   int prepared = 0;
+   uint16_t id = socket->next_id_;
+   for (int tried = 0; prepared < count && tried < kIds; ++tried, ++id) {
+      if (socket->slots_[id].state_ == Slot::kInFlight)
+         continue;
+
+      // The next query in the file, or a name drawn by popularity
+      const std::string* query;
+      if (cdf.empty()) {
+         query = &queries[(*next_query)++ % queries.size()];
+      } else {
+         double u = (NextRandom(random) >> 11) * (1.0 / (1ULL << 53));
+         size_t rank = std::upper_bound(cdf.begin(), cdf.end(), u) -
+               cdf.begin();
+         query = &queries[std::min(rank, queries.size() - 1)];
+      }
+
+      char* buf = bufs + prepared * kMaxQueryLen;
+      memcpy(buf, query->data(), query->size());
+      uint16_t net_id = htons(id);
+      memcpy(buf, &net_id, sizeof(net_id));
+
+      iovs[prepared].iov_base = buf;
+      iovs[prepared].iov_len = query->size();
+      memset(&msgs[prepared], 0, sizeof(msgs[prepared]));
+      msgs[prepared].msg_hdr.msg_iov = &iovs[prepared];
+      msgs[prepared].msg_hdr.msg_iovlen = 1;
+      ids[prepared++] = id;
+   }
+   if (!prepared)
+      return 0;
+
+   int done = sendmmsg(socket->fd_, msgs, prepared, 0);
+   if (done < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS &&
+          errno != ECONNREFUSED)
+         counts->send_errors++;
+      return 0;
+   }
+
+   for (int i = 0; i < done; ++i) {
+      Slot* slot = &socket->slots_[ids[i]];
+      slot->state_ = Slot::kInFlight;
+      slot->due_ns_ = due_ns[i];
+      sent->push_back((Sent) { socket_index, ids[i], due_ns[i] });
+   }
+   socket->next_id_ = ids[done - 1] + 1;
+   socket->in_flight_ += done;
+   counts->sent += done;
+   return done;
+}
+
+// Reads every answer waiting on |socket|. Returns how many answered
+// queries still in flight.
+int ReceiveAll(Socket* socket, Histogram* latency, Counts* counts,
+               char* bufs, struct mmsghdr* msgs, struct iovec* iovs,
+               int batch) {
+   int answered = 0;
+   while (true) {
+      for (int i = 0; i < batch; ++i) {
+         iovs[i].iov_base = bufs + i * kMaxResponseLen;
+         iovs[i].iov_len = kMaxResponseLen;
+         memset(&msgs[i], 0, sizeof(msgs[i]));
+         msgs[i].msg_hdr.msg_iov = &iovs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      int received = recvmmsg(socket->fd_, msgs, batch, MSG_DONTWAIT, NULL);
+      if (received <= 0)
+         return answered;
+
+      uint64_t now_ns = NowNs();
+      for (int i = 0; i < received; ++i) {
+         if (msgs[i].msg_len < sizeof(DnsPacket::Header)) {
+            counts->unexpected++;
+            continue;
+         }
+
+         DnsPacket::Header header;
+         memcpy(&header, bufs + i * kMaxResponseLen, sizeof(header));
+         uint16_t flags = ntohs(header.flags);
+         Slot* slot = &socket->slots_[ntohs(header.id)];
+         if (!(flags & 0x8000) || slot->state_ == Slot::kFree) {
+            counts->unexpected++;
+            continue;
+         }
+
+         if (slot->state_ == Slot::kTimedOut) {
+            counts->late++;
+            slot->state_ = Slot::kFree;
+            continue;
+         }
+
+         slot->state_ = Slot::kFree;
+         socket->in_flight_--;
+         answered++;
+         counts->answered++;
+         counts->rcodes[flags & 0x000F]++;
+         if (flags & 0x0200)
+            counts->truncated++;
+         latency->Record(now_ns > slot->due_ns_ ? now_ns - slot->due_ns_ : 0);
+      }
+   }
+}
+
+// Times out queries sent before |cutoff_ns|. Returns how many.
+int Expire(std::vector<Socket>* sockets, std::deque<Sent>* sent,
+           uint64_t cutoff_ns, Counts* counts) {
+   int expired = 0;
+   while (!sent->empty() && sent->front().due_ns_ < cutoff_ns) {
+      const Sent& query = sent->front();
+      Socket* socket = &(*sockets)[query.socket_];
+      Slot* slot = &socket->slots_[query.id_];
+
+      // Unless it was answered, and perhaps the ID reused since
+      if (slot->state_ == Slot::kInFlight && slot->due_ns_ == query.due_ns_) {
+         slot->state_ = Slot::kTimedOut;
+         socket->in_flight_--;
+         counts->timed_out++;
+         expired++;
+      }
+      sent->pop_front();
+   }
+   return expired;
+}
+
+void PrintReport(const Options& options, const Counts& counts,
+                 const Histogram& latency, double seconds) {
+   printf("sent        %10llu  %10.0f q/s\n",
+         (unsigned long long) counts.sent, counts.sent / seconds);
+   printf("answered    %10llu  %10.0f q/s\n",
+         (unsigned long long) counts.answered, counts.answered / seconds);
+   printf("lost        %10llu  %10.3f%%  (%llu of them answered late)\n",
+         (unsigned long long) counts.timed_out,
+         counts.sent ? 100.0 * counts.timed_out / counts.sent : 0.0,
+         (unsigned long long) counts.late);
+   if (counts.unexpected || counts.send_errors) {
+      printf("unexpected  %10llu  send errors %llu\n",
+            (unsigned long long) counts.unexpected,
+            (unsigned long long) counts.send_errors);
+   }
+
+   if (!counts.answered)
+      return;
+
+   printf("rcodes     ");
+   for (int rcode = 0; rcode < 16; ++rcode) {
+      if (!counts.rcodes[rcode])
+         continue;
+      if (rcode < (int) (sizeof(kRcodeNames) / sizeof(kRcodeNames[0])))
+         printf(" %s", kRcodeNames[rcode]);
+      else
+         printf(" RCODE%d", rcode);
+      printf(" %llu", (unsigned long long) counts.rcodes[rcode]);
+   }
+   printf("\n");
+   if (counts.truncated) {
+      printf("truncated   %10llu\n", (unsigned long long) counts.truncated);
+   }
+
+   printf("latency us   min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+         "p99.9 %.1f  max %.1f\n", latency.min() / 1e3, latency.mean() / 1e3,
+         latency.Percentile(0.5) / 1e3, latency.Percentile(0.9) / 1e3,
+         latency.Percentile(0.99) / 1e3, latency.Percentile(0.999) / 1e3,
+         latency.max() / 1e3);
+
+   if (options.histogram_) {
+      printf("\n      us(<=)      count  fraction\n");
+      latency.Print(stdout, 1e3);
+   }
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --server=ADDR         loopback address of the server (127.0.0.1)\n"
+         "  --port=N              its port (53)\n"
+         "  --queries=FILE        replay \"name [type]\" lines from FILE, in\n"
+         "                        order, instead of synthetic names\n"
+         "  --once                send each of them once, then stop: with a\n"
+         "                        fresh server and distinct names, all\n"
+         "                        cache misses\n"
+         "  --names=N             synthetic names, n<rank>.<suffix> (10000)\n"
+         "  --zipf=S              their popularity's Zipf exponent (1.0)\n"
+         "  --suffix=NAME         their parent (example.com)\n"
+         "  --type=TYPE           their type (A)\n"
+         "  --rate=N              queries a second, open loop (off)\n"
+         "  --concurrency=N       queries kept in flight, closed loop, if\n"
+         "                        no --rate (100)\n"
+         "  --duration=S          seconds to send for (10)\n"
+         "  --timeout-ms=N        count a query lost after this long (1000)\n"
+         "  --sockets=N           sockets, and source ports, to send from\n"
+         "                        (16)\n"
+         "  --batch=N             queries a sendmmsg() or recvmmsg() (32)\n"
+         "  --histogram           print the whole latency histogram\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   Options options;
+   options.server_ = "127.0.0.1";
+   options.port_ = 53;
+   options.queries_ = NULL;
+   options.once_ = false;
+   options.names_ = 10000;
+   options.zipf_ = 1.0;
+   options.suffix_ = "example.com";
+   options.type_ = constants::type::A;
+   options.rate_ = 0;
+   options.concurrency_ = 100;
+   options.duration_ = 10;
+   options.timeout_ms_ = 1000;
+   options.sockets_ = 16;
+   options.batch_ = 32;
+   options.histogram_ = false;
+
+   static struct option long_options[] = {
+      { "server",      required_argument, NULL, 's' },
+      { "port",        required_argument, NULL, 'P' },
+      { "queries",     required_argument, NULL, 'q' },
+      { "once",        no_argument,       NULL, 'o' },
+      { "names",       required_argument, NULL, 'n' },
+      { "zipf",        required_argument, NULL, 'z' },
+      { "suffix",      required_argument, NULL, 'x' },
+      { "type",        required_argument, NULL, 'T' },
+      { "rate",        required_argument, NULL, 'r' },
+      { "concurrency", required_argument, NULL, 'c' },
+      { "duration",    required_argument, NULL, 'd' },
+      { "timeout-ms",  required_argument, NULL, 't' },
+      { "sockets",     required_argument, NULL, 'S' },
+      { "batch",       required_argument, NULL, 'b' },
+      { "histogram",   no_argument,       NULL, 'H' },
+      { NULL,          0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 's':
+            options.server_ = optarg;
+            break;
+         case 'P':
+            options.port_ = atoi(optarg);
+            break;
+         case 'q':
+            options.queries_ = optarg;
+            break;
+         case 'o':
+            options.once_ = true;
+            break;
+         case 'n':
+            options.names_ = atoi(optarg);
+            break;
+         case 'z':
+            options.zipf_ = atof(optarg);
+            break;
+         case 'x':
+            options.suffix_ = optarg;
+            break;
+         case 'T':
+            options.type_ = ParseType(optarg);
+            break;
+         case 'r':
+            options.rate_ = atof(optarg);
+            break;
+         case 'c':
+            options.concurrency_ = atoi(optarg);
+            break;
+         case 'd':
+            options.duration_ = atof(optarg);
+            break;
+         case 't':
+            options.timeout_ms_ = atoi(optarg);
+            break;
+         case 'S':
+            options.sockets_ = atoi(optarg);
+            break;
+         case 'b':
+            options.batch_ = atoi(optarg);
+            break;
+         case 'H':
+            options.histogram_ = true;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
+   if (options.port_ < 1 || options.port_ > 65535 || options.names_ < 1 ||
+       options.zipf_ < 0 || !options.type_ || options.rate_ < 0 ||
+       options.concurrency_ < 1 || options.duration_ <= 0 ||
+       options.timeout_ms_ < 1 || options.sockets_ < 1 ||
+       options.batch_ < 1 || options.batch_ > kMaxBatch ||
+       (options.once_ && !options.queries_))
+      usage(argv[0]);
+
+   struct sockaddr_storage server;
+   socklen_t server_len;
+   if (!ParseLoopback(options.server_, options.port_, &server, &server_len)) {
+      fprintf(stderr, "%s: only loopback servers (127.0.0.0/8, ::1)\n",
+            options.server_);
+      exit(EXIT_FAILURE);
+   }
+
+   std::vector<std::string> queries;
+   std::vector<double> cdf;
+   if (options.queries_ ? !LoadQueries(options.queries_, &queries) :
+       !MakeZipfQueries(options, &queries, &cdf))
+      exit(EXIT_FAILURE);
+
+   uint64_t random = 0x9e3779b97f4a7c15ULL;
+   std::vector<Socket> sockets(options.sockets_);
+   std::vector<struct pollfd> pollfds(options.sockets_);
+   for (int i = 0; i < options.sockets_; ++i) {
+      int fd;
+      SYSCALL((fd = socket(server.ss_family, SOCK_DGRAM, 0)), "socket");
+      SYSCALL(connect(fd, (struct sockaddr*) &server, server_len),
+            "connect");
+      SYSCALL(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK), "fcntl");
+
+      sockets[i].fd_ = fd;
+      sockets[i].next_id_ = NextRandom(&random) & 0xffff;
+      sockets[i].in_flight_ = 0;
+      sockets[i].slots_.resize(kIds);
+      pollfds[i].fd = fd;
+      pollfds[i].events = POLLIN;
+   }
+
+   printf("%zu %s queries to %s port %d from %d sockets, %s\n",
+         queries.size(), options.queries_ ? "replayed" : "synthetic",
+         options.server_, options.port_, options.sockets_,
+         options.rate_ ? "open loop" : "closed loop");
+
+   std::vector<char> send_bufs(options.batch_ * kMaxQueryLen);
+   std::vector<char> receive_bufs(options.batch_ * kMaxResponseLen);
+   std::vector<struct mmsghdr> msgs(options.batch_);
+   std::vector<struct iovec> iovs(options.batch_);
+   std::vector<uint64_t> due_ns(options.batch_);
+
+   Counts counts;
+   memset(&counts, 0, sizeof(counts));
+   Histogram latency;
+   std::deque<Sent> sent;
+   uint64_t next_query = 0;
+   int in_flight = 0;
+   uint32_t next_socket = 0;
+
+   uint64_t timeout_ns = (uint64_t) options.timeout_ms_ * 1000000;
+   uint64_t interval_ns = options.rate_ ? 1e9 / options.rate_ : 0;
+   uint64_t start_ns = NowNs();
+   uint64_t end_ns = start_ns + (uint64_t) (options.duration_ * 1e9);
+   uint64_t next_due_ns = start_ns;
+   uint64_t now_ns = start_ns;
+
+   // Send until the end, then wait out the stragglers
+   while (now_ns < end_ns + timeout_ns && (now_ns < end_ns || in_flight)) {
+      // Send what is due, a socket's batch at a time, around the sockets.
+      // A socket that takes none (its buffer full) ends the round.
+      while (now_ns < end_ns) {
+         int64_t wanted;
+         if (interval_ns) {
+            wanted = next_due_ns <= now_ns ?
+                  (now_ns - next_due_ns) / interval_ns + 1 : 0;
+         } else {
+            wanted = options.concurrency_ - in_flight;
+         }
+         wanted = std::min(wanted, (int64_t) options.batch_);
+         if (options.once_)
+            wanted = std::min(wanted, (int64_t) (queries.size() - next_query));
+         if (wanted <= 0)
+            break;
+
+         for (int i = 0; i < wanted; ++i) {
+            due_ns[i] = interval_ns ? next_due_ns + i * interval_ns : now_ns;
+         }
+         int done = SendBatch(&sockets[next_socket], next_socket, wanted,
+               due_ns.data(), queries, cdf, &next_query, &random, &sent,
+               &counts, send_bufs.data(), msgs.data(), iovs.data());
+         next_socket = (next_socket + 1) % sockets.size();
+         if (!done)
+            break;
+
+         in_flight += done;
+         next_due_ns += done * interval_ns;
+
+         // Sent them all: stop the clock
+         if (options.once_ && next_query == queries.size())
+            end_ns = now_ns;
+      }
+
+      // Wait for answers until the next query is due, or one times out
+      uint64_t wake_ns = sent.empty() ? end_ns + timeout_ns :
+            sent.front().due_ns_ + timeout_ns;
+      if (interval_ns && now_ns < end_ns)
+         wake_ns = std::min(wake_ns, next_due_ns);
+      struct timespec wait = { 0, 0 };
+      if (wake_ns > now_ns) {
+         uint64_t wait_ns = std::min(wake_ns - now_ns, (uint64_t) 100000000);
+         wait.tv_nsec = wait_ns;
+      }
+      if (ppoll(pollfds.data(), pollfds.size(), &wait, NULL) < 0 &&
+          errno != EINTR) {
+         perror("ppoll");
+         exit(EXIT_FAILURE);
+      }
+
+      for (size_t i = 0; i < sockets.size(); ++i) {
+         if (pollfds[i].revents & POLLIN) {
+            in_flight -= ReceiveAll(&sockets[i], &latency, &counts,
+                  receive_bufs.data(), msgs.data(), iovs.data(),
+                  options.batch_);
+         }
+      }
+
+      now_ns = NowNs();
+      in_flight -= Expire(&sockets, &sent,
+            now_ns > timeout_ns ? now_ns - timeout_ns : 0, &counts);
+   }
+
+   // Whatever is left has had its full timeout
+   in_flight -= Expire(&sockets, &sent, UINT64_MAX, &counts);
+
+   double seconds = (std::min(now_ns, end_ns) - start_ns) / 1e9;
+   PrintReport(options, counts, latency, seconds);
+
+   for (size_t i = 0; i < sockets.size(); ++i)
+      close(sockets[i].fd_);
+   return 0;
+}
@@ -12,6 +12,7 @@
 #include "checksum.h"
 #include "smartalloc.h"
 
+#include "arena.h"
 #include "dns_packet.h"
 
 namespace dns_packet_constants {
@@ -60,6 +61,8 @@ const int MINFO = 14;
 const int MX = 15;
 const int TXT = 16;
 const int AAAA = 28;
+const int SRV = 33;
+const int OPT = 41;
 }
 
 namespace clz {
@@ -78,6 +81,10 @@ const int kAnswerRrsOffset = 6;
 const int kAuthorityRrsOffset = 8;
 const int kAdditionalRrsOffset = 10;
 const int kFirstQueryOffset = 12;
+
+// Stack space for name compression while writing a packet. Enough for the
+// names in a 512 byte packet; the arena mallocs more if it has to.
+const int kEncodeScratchLen = 4096;
 }
 
 namespace constants = dns_packet_constants;
@@ -172,8 +179,11 @@ int DnsPacket::ConstructPacket(char* buf, uint16_t id, bool qr_flag,
    char* old_p = p;
    bool stop_writing = false;
 
-   // Create offset map
-   OffsetMap offset_map;
+   // Create offset map, in scratch space that covers a 512 byte packet's
+   // worth of names
+   char scratch[kEncodeScratchLen];
+   Arena arena(scratch, sizeof(scratch));
+   OffsetMap offset_map(&arena);
 
    // Write the query
    p = query.Construct(&offset_map, p, buf);
@@ -272,13 +282,13 @@ char* DnsPacket::ConstructHeader(char* buf, uint16_t id, bool qr_flag,
 
 // static
 char* DnsPacket::ConstructDnsName(OffsetMap* offset_map, char* p, char* packet,
-      char* name) {
-   return ConstructDnsName(offset_map, p, packet, std::string(name));
+      const char* name) {
+   return ConstructDnsName(offset_map, p, packet, std::string_view(name));
 }
 
 // static
 char* DnsPacket::ConstructDnsName(OffsetMap* offset_map, char* p, char* packet,
-      std::string name) {
+      std::string_view name) {
    OffsetMap::iterator it;
    bool ptr_used = false;
 
@@ -296,15 +306,16 @@ char* DnsPacket::ConstructDnsName(OffsetMap* offset_map, char* p, char* packet,
 
       // no match found --
       // 1. write the first octet of the current name to the packet
-      const char* c_name = name.c_str();
-      memcpy(p, c_name, *c_name+1);
+      int label_len = name[0] + 1;
+      memcpy(p, name.data(), label_len);
 
       // 2. add the current name to the offset map, then advance p
-      offset_map->insert(std::pair<std::string, uint16_t>(name, p - packet));
-      p += *c_name+1;
+      offset_map->insert(std::pair<std::string_view, uint16_t>(name,
+            p - packet));
+      p += label_len;
 
       // 3. shorten the current name
-      name = DnsPacket::ShortenName(name);
+      name.remove_prefix(label_len);
    }
 
    // Write null terminating byte of string
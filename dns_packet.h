@@ -5,16 +5,18 @@
 
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "smartalloc.h"
 
-typedef std::map<std::string, uint16_t, std::less<std::string>,
-      STLsmartalloc<std::pair<std::string, uint16_t> > > OffsetMap;
+#include "arena.h"
 
-
-typedef std::map<std::string, uint16_t, std::less<std::string>,
-      STLsmartalloc<std::pair<std::string, uint16_t> > > OffsetMap;
+// Name compression: names (and their suffixes) already written to a packet
+// -> their offsets. The names are viewed in place, in the records being
+// written, and the map lives in the packet's scratch arena.
+typedef std::map<std::string_view, uint16_t, std::less<std::string_view>,
+      ArenaAllocator<std::pair<const std::string_view, uint16_t> > > OffsetMap;
 
 namespace dns_packet_constants {
 namespace qr_flag {
@@ -62,6 +64,8 @@ extern const int MINFO;
 extern const int MX;
 extern const int TXT;
 extern const int AAAA;
+extern const int SRV;
+extern const int OPT;
 }
 
 namespace clz {
@@ -82,6 +86,7 @@ class DnsQuery {
    DnsQuery(std::string name, int type, int clz);
 
    bool operator<(const DnsQuery& query) const;
+   bool operator==(const DnsQuery& query) const;
 
    // "Construct" a query at |p|.
    char* Construct(OffsetMap* offset_map, char* p,
@@ -91,7 +96,7 @@ class DnsQuery {
    std::string ToString() const;
 
    // Getters
-   std::string name() const { return name_; }
+   const std::string& name() const { return name_; }
    uint16_t type() const { return type_; }
    uint16_t clz() const { return clz_; }
 
@@ -127,7 +132,7 @@ class DnsResourceRecord {
    std::string ToString() const;
 
    // Getters
-   std::string name() const { return name_; }
+   const std::string& name() const { return name_; }
    uint16_t type() const { return type_; }
    uint16_t clz() const { return clz_; }
    uint32_t ttl() const { return ttl_; }
@@ -135,15 +140,26 @@ class DnsResourceRecord {
    char* data() const { return data_; }
 
   private:
+   // Short rdata (A and AAAA records, mostly) is kept in the record itself
+   static const int kInlineDataLen = 16;
+
+   // Points data_ at room for |len| bytes of rdata; FreeData() gives it back.
+   void AllocateData(size_t len);
+   void FreeData();
+
    std::string name_;
    uint16_t type_;
    uint16_t clz_;
    uint32_t ttl_;
    uint16_t data_len_;
    char* data_;
+   char inline_data_[kInlineDataLen];
 };
 
-typedef std::vector<DnsResourceRecord, STLsmartalloc<DnsResourceRecord> > RRVec;
+// Record vectors built while handling a request can live in its arena:
+// RRVec rrs(&arena). Default-constructed ones are on the heap.
+typedef std::vector<DnsResourceRecord, ArenaAllocator<DnsResourceRecord> >
+      RRVec;
 
 // A single DNS packet. A DnsPacket consists of a header and one or more
 // Records. A Record is either a Query or a ResourceRecord
@@ -190,10 +206,12 @@ class DnsPacket {
          bool ra_flag, uint16_t rcode);
 
    // "Construct" a <dns name> onto a buffer, possibly compressing the name.
+   // |name| must stay put until the packet is written; |offset_map| keeps
+   // views of it.
    static char* ConstructDnsName(OffsetMap* offset_map, char* p, char* packet,
-         char* name);
+         const char* name);
    static char* ConstructDnsName(OffsetMap* offset_map, char* p, char* packet,
-         std::string name);
+         std::string_view name);
 
    // "Constructs" a query onto a buffer
    char* Construct(char* p);
@@ -37,6 +37,10 @@ bool DnsQuery::operator<(const DnsQuery& query) const {
    return clz_ < query.clz_;
 }
 
+bool DnsQuery::operator==(const DnsQuery& query) const {
+   return name_ == query.name_ && type_ == query.type_ && clz_ == query.clz_;
+}
+
 char* DnsQuery::Construct(OffsetMap* offset_map, char* p, char* packet) const {
   p = DnsPacket::ConstructDnsName(offset_map, p, packet, name_);
 
@@ -13,6 +13,7 @@
 #include "smartalloc.h"
 
 #include "dns_packet.h"
+#include "slab_pool.h"
 
 namespace constants = dns_packet_constants;
 
@@ -35,7 +36,7 @@ DnsResourceRecord::DnsResourceRecord(DnsPacket& packet) {
       const char* temp_c_str = temp_str.c_str();
 
       data_len_ = htons(strlen(temp_c_str)+1);
-      MALLOCCHECK((data_ = (char*) malloc(ntohs(data_len_))));
+      AllocateData(ntohs(data_len_));
 
       memcpy(data_, temp_c_str, ntohs(data_len_));
    } else if (type == constants::type::MX) {
@@ -47,7 +48,7 @@ DnsResourceRecord::DnsResourceRecord(DnsPacket& packet) {
       const char* temp_c_str = temp_str.c_str();
 
       data_len_ = htons(2 + strlen(temp_c_str)+1);
-      MALLOCCHECK((data_ = (char*) malloc(ntohs(data_len_))));
+      AllocateData(ntohs(data_len_));
 
       memcpy(data_, p, 2);
       memcpy(data_ + 2, temp_c_str, strlen(temp_c_str)+1);
@@ -59,7 +60,7 @@ DnsResourceRecord::DnsResourceRecord(DnsPacket& packet) {
       const char* temp_c_str2 = temp_str2.c_str();
 
       data_len_ = htons(strlen(temp_c_str1)+1 + strlen(temp_c_str2)+1 + 20);
-      MALLOCCHECK((data_ = (char*) malloc(ntohs(data_len_))));
+      AllocateData(ntohs(data_len_));
 
       memcpy(data_,
              temp_c_str1,
@@ -95,7 +96,7 @@ DnsResourceRecord::DnsResourceRecord(DnsPacket& packet) {
    } else {
       data_len_ = *((uint16_t*) (packet.cur_ - 2));
 
-      MALLOCCHECK((data_ = (char*) malloc((size_t) ntohs(data_len_))));
+      AllocateData((size_t) ntohs(data_len_));
       memcpy(data_, packet.cur_, ntohs(data_len_));
 
       packet.cur_ += ntohs(data_len_);
@@ -105,7 +106,7 @@ DnsResourceRecord::DnsResourceRecord(DnsPacket& packet) {
 DnsResourceRecord::DnsResourceRecord(std::string name, uint16_t type,
       uint16_t clz, uint32_t ttl, uint16_t data_len, char* data)
       : name_(name), type_(type), clz_(clz), ttl_(ttl), data_len_(data_len) {
-   MALLOCCHECK((data_ = (char*) malloc((size_t) ntohs(data_len))));
+   AllocateData((size_t) ntohs(data_len));
    memcpy(data_, data, ntohs(data_len));
 }
 
@@ -115,25 +116,39 @@ DnsResourceRecord::DnsResourceRecord(const DnsResourceRecord& rr)
 }
 
 DnsResourceRecord::~DnsResourceRecord() {
-   free(data_);
+   FreeData();
 }
 
 DnsResourceRecord& DnsResourceRecord::operator=(const DnsResourceRecord& rr) {
    if (this == &rr)
       return *this;
 
+   FreeData();
+
    name_ = rr.name_;
    type_ = rr.type_;
    clz_ = rr.clz_;
    ttl_ = rr.ttl_;
    data_len_ = rr.data_len_;
 
-   if (data_) delete data_;
-   MALLOCCHECK((data_ = (char*) malloc((size_t) ntohs(data_len_))));
+   AllocateData((size_t) ntohs(data_len_));
    memcpy(data_, rr.data_, ntohs(data_len_));
    return *this;
 }
 
+void DnsResourceRecord::AllocateData(size_t len) {
+   if (len <= (size_t) kInlineDataLen)
+      data_ = inline_data_;
+   else
+      data_ = (char*) SlabPool::Local()->Allocate(len);
+}
+
+void DnsResourceRecord::FreeData() {
+   if (data_ && data_ != inline_data_)
+      SlabPool::Local()->Free(data_, ntohs(data_len_));
+   data_ = NULL;
+}
+
 bool DnsResourceRecord::operator<(const DnsResourceRecord& record) const {
    if (name_ != record.name_)
       return name_ < record.name_;
@@ -145,7 +160,7 @@ bool DnsResourceRecord::operator<(const DnsResourceRecord& record) const {
       return clz_ < record.clz_;
 
    if (data_len_ != record.data_len_)
-      return data_len_ < data_len_;
+      return data_len_ < record.data_len_;
 
    for (int i = 0; i < ntohs(data_len_); ++i) {
       if (data_[i] != record.data_[i])
@@ -156,14 +171,15 @@ bool DnsResourceRecord::operator<(const DnsResourceRecord& record) const {
 }
 
 bool DnsResourceRecord::operator==(const DnsResourceRecord& record) const {
-   if (name_ == record.name_ &&
-       type_ == record.type_ &&
-       clz_ == record.clz_ &&
-       data_len_ == record.data_len_) {
-      for (int i = 0; i < ntohs(data_len_); ++i) {
-         if (data_[i] != record.data_[i])
-            return false;
-      }
+   if (name_ != record.name_ ||
+       type_ != record.type_ ||
+       clz_ != record.clz_ ||
+       data_len_ != record.data_len_)
+      return false;
+
+   for (int i = 0; i < ntohs(data_len_); ++i) {
+      if (data_[i] != record.data_[i])
+         return false;
    }
 
    return true;
@@ -1,30 +1,147 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/if_ether.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <iostream>
-#include <list>
+#include <string>
 
 #include "debug.h"
 #include "checksum.h"
 #include "smartalloc.h"
 
+#include "arena.h"
 #include "dns_server.h"
 #include "dns_packet.h"
+#include "epoch.h"
+#include "frame_pool.h"
+#include "infra_cache.h"
+#include "latency_stats.h"
+#include "metrics.h"
+#include "query_log.h"
+#include "resolver.h"
+#include "slab_pool.h"
+#include "tcp_connection_pool.h"
 
 namespace constants = dns_packet_constants;
 
-DnsServer::DnsServer() : port_(53), port_str_("53") {
+namespace {
+// Upstream TCP connection pool limits
+const int kTcpMaxIdlePerServer = 2;
+const int kTcpMaxConnections = 64;
+const int kTcpIdleTimeoutMs = 30000;
+const int kTcpMaxPipelined = 16;
+
+// Chance of querying a random authority instead of the fastest known one
+const double kExploreProbability = 0.05;
+
+// Longest the event loop sleeps in select()
+const uint64_t kMaxWaitMs = 100;
+
+// Arena space in each client task's frame
+const size_t kServeScratchLen = 2048;
+
+// Cache compaction: how often a slice of it runs, and how many entries each
+// slice visits
+const uint64_t kCompactIntervalMs = 1000;
+const int kCompactBudget = 512;
+
+// How often the event loop publishes its numbers for metrics scrapes
+const uint64_t kMetricsIntervalMs = 1000;
+
+// Datagrams read per wakeup, and items served before looking for more
+const int kReadBatch = 64;
+const int kRoundLen = 32;
+
+// RRsets a shared cache holds by default: 32 MiB of 512-byte slots
+const uint32_t kSharedCacheSlots = 65536;
+
+// "192.0.2.1#53", for logging
+std::string AddrToString(const struct sockaddr_in6& addr) {
+   char buf[INET6_ADDRSTRLEN];
+   if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr))
+      inet_ntop(AF_INET, &addr.sin6_addr.s6_addr[12], buf, sizeof(buf));
+   else
+      inet_ntop(AF_INET6, &addr.sin6_addr, buf, sizeof(buf));
+   return std::string(buf) + "#" + std::to_string(ntohs(addr.sin6_port));
+}
+
+void PrintStageStats(FILE* out, const char* name,
+                     const Pipeline::StageStats& stage) {
+   fprintf(out, "  %s: %llu queued (%llu dropped), depth %llu (peak %llu), "
+         "wait %.1f us avg, %.1f us max\n", name,
+         (unsigned long long) stage.items,
+         (unsigned long long) stage.dropped,
+         (unsigned long long) stage.depth,
+         (unsigned long long) stage.peak_depth,
+         stage.items ? stage.total_wait_ns / 1000.0 / stage.items : 0,
+         stage.max_wait_ns / 1000.0);
+}
+
+// Turns the query in |packet| into a REFUSED response without parsing
+// it: the header alone, keeping the ID, opcode and RD. Returns its length.
+int MakeRefused(char* packet) {
+   DnsPacket::Header* header = (DnsPacket::Header*) packet;
+   uint16_t flags = ntohs(header->flags);
+   flags = 0x8000 | (flags & 0x7900) | 0x0080 |
+         constants::response_code::Refused;
+   header->flags = htons(flags);
+   header->queries = 0;
+   header->answer_rrs = 0;
+   header->authority_rrs = 0;
+   header->additional_rrs = 0;
+   return sizeof(DnsPacket::Header);
+}
+
+}
+
+DnsServer::Options::Options()
+      : port_(53),
+        rcvbuf_(0),
+        sndbuf_(0),
+        cache_huge_pages_(SlabArena::kNoHugePages),
+        shared_cache_slots_(kSharedCacheSlots),
+        use_pipeline_(false),
+        latency_stats_(false),
+        metrics_port_(0),
+        trace_format_(Tracer::kJson),
+        trace_sample_(0),
+        trace_slow_ms_(0),
+        clock_(NULL) {
+}
+
+DnsServer::DnsServer(const Options& options)
+      : clock_(options.clock_ ? options.clock_ : Clock::System()),
+        now_us_(clock_->NowUs()),
+        now_ms_(now_us_ / 1000),
+        pipeline_(NULL),
+        scheduler_(options.scheduler_),
+        admission_(options.admission_),
+        rrl_(options.rrl_),
+        latency_(options.latency_stats_),
+        dump_latency_(false),
+        metrics_(options.metrics_port_ > 0),
+        acl_path_(options.acl_path_),
+        acl_(NULL),
+        reload_acl_(false),
+        acl_refused_(0),
+        acl_kept_from_recursion_(0),
+        shared_cache_(NULL),
+        port_(options.port_),
+        port_str_(std::to_string(options.port_)) {
    // set up server hints struct
    struct addrinfo hints;
 
@@ -34,449 +151,874 @@ DnsServer::DnsServer() : port_(53), port_str_("53") {
    hints.ai_socktype = SOCK_DGRAM;
    hints.ai_flags = AI_PASSIVE;
 
+   // load client access rules
+   if (!acl_path_.empty()) {
+      acl_ = Acl::Load(acl_path_.c_str());
+      if (!acl_)
+         exit(EXIT_FAILURE);
+   }
+
+   // attach shared cache
+   if (!options.shared_cache_name_.empty()) {
+      shared_cache_ = SharedCache::Attach(options.shared_cache_name_.c_str(),
+            options.shared_cache_slots_);
+      if (!shared_cache_)
+         exit(EXIT_FAILURE);
+   }
+
+   // read root hints
+   DnsCache::RootHints root_hints;
+   if (!options.root_hints_path_.empty() &&
+       !DnsCache::LoadRootHints(options.root_hints_path_.c_str(), &root_hints))
+      exit(EXIT_FAILURE);
+
    // alloc cache
-   cache_ = new DnsCache();
+   cache_ = new DnsCache(options.cache_huge_pages_, shared_cache_,
+         options.root_hints_path_.empty() ? NULL : &root_hints);
+
+   // alloc upstream server statistics
+   infra_ = new InfraCache(kExploreProbability);
+
+   // alloc upstream TCP connection pool
+   tcp_pool_ = new TcpConnectionPool(kTcpMaxIdlePerServer, kTcpMaxConnections,
+         kTcpIdleTimeoutMs, kTcpMaxPipelined);
+
+   // alloc resolution engine, which reaches upstream through us
+   resolver_ = new Resolver(options, cache_, infra_, this);
+   if (latency_.enabled())
+      resolver_->set_latency_stats(&latency_);
+   if (metrics_.enabled())
+      resolver_->set_metrics(&metrics_);
 
    // init server
    LOG << "Initializing server" << std::endl;
    Server::Init(port_str_, &hints);
    LOG << "Server initialized" << std::endl;
+
+   if (!socket_monitor_.Attach(sock_, options.rcvbuf_, options.sndbuf_))
+      exit(EXIT_FAILURE);
+
+   // A full send buffer must not stall the event loop; what does not fit
+   // is dropped, as the network may drop it anyway
+   SYSCALL(fcntl(sock_, F_SETFL, fcntl(sock_, F_GETFL) | O_NONBLOCK),
+         "fcntl");
+
+   if (metrics_.enabled() && !metrics_.Serve(options.metrics_port_, sock_))
+      exit(EXIT_FAILURE);
+
+   // start the query log's writer
+   if (!options.query_log_path_.empty() &&
+       !query_log_.Open(options.query_log_path_))
+      exit(EXIT_FAILURE);
+
+   if (!options.trace_path_.empty() &&
+       !tracer_.Open(options.trace_path_, options.trace_format_,
+             options.trace_sample_, options.trace_slow_ms_))
+      exit(EXIT_FAILURE);
+
+   // Its threads start with Run()
+   if (options.use_pipeline_)
+      pipeline_ = new Pipeline(sock_, options.pipeline_, this,
+            &socket_monitor_, clock_);
 }
 
 DnsServer::~DnsServer() {
+   // Its workers use the cache
+   delete pipeline_;
+   delete resolver_;
+   delete tcp_pool_;
+   delete infra_;
    delete cache_;
+   delete shared_cache_;
+   delete acl_.load();
 }
 
-DnsServer::QueryInfo::QueryInfo(DnsQuery& query,
-                                RRVec& authority_rrs,
-                                RRVec& additional_rrs)
-      : query_(query),
-        authority_rrs_(authority_rrs),
-        additional_rrs_(additional_rrs) {
-}
-
-DnsServer::ClientInfo::ClientInfo(struct sockaddr_in6 client_addr,
-                                  uint16_t id,
-                                  DnsQuery& query,
-                                  RRVec& authority_rrs,
-                                  RRVec& additional_rrs)
+DnsServer::ClientKey::ClientKey(const struct sockaddr_in6& client_addr,
+                                uint16_t id)
       : client_addr_(client_addr),
         id_(id) {
-   query_info_list_.push_back(QueryInfo(query, authority_rrs, additional_rrs));
-}
-
-bool DnsServer::ClientInfo::operator==(const uint16_t id) const {
-   return id_ == id;
-}
-
-bool DnsServer::ClientInfo::operator<(const ClientInfo& client_info) const {
-   return timeout_ > client_info.timeout_;
 }
 
-bool DnsServer::UpdateTimeout(uint16_t id) {
-   ClientInfoVec::iterator it =
-         std::find(client_info_vec_.begin(), client_info_vec_.end(), id);
+bool DnsServer::ClientKey::operator<(const ClientKey& key) const {
+   if (id_ != key.id_)
+      return id_ < key.id_;
 
-   // Replace old timeout, if it exists
-   if (it != client_info_vec_.end()) {
-      it->timeout_ = time(NULL) + 2;
+   if (client_addr_.sin6_port != key.client_addr_.sin6_port)
+      return client_addr_.sin6_port < key.client_addr_.sin6_port;
 
-      // Sort into heap
-      std::make_heap(client_info_vec_.begin(), client_info_vec_.end());
+   return memcmp(&client_addr_.sin6_addr, &key.client_addr_.sin6_addr,
+         sizeof(struct in6_addr)) < 0;
+}
 
-      return true;
+void DnsServer::Run() {
+   std::string tcp_response;
+   struct sockaddr_in6 tcp_failed_addr;
+   uint16_t tcp_failed_id;
+   ReadClock();
+   uint64_t compact_ms = now_ms_;
+   uint64_t metrics_ms = 0;
+   Datagram datagram;
+   Scheduler::Lane lane;
+
+   // With a pipeline, what the loop reads comes from it
+   int listen_fd = sock_;
+   if (pipeline_) {
+      pipeline_->Start();
+      listen_fd = pipeline_->event_fd();
    }
 
-   return false;
-}
+   // Main event loop
+   while (1) {
+      if (reload_acl_.exchange(false, std::memory_order_relaxed))
+         SwapAcl();
 
-DnsServer::ClientInfoVec::iterator DnsServer::GetClient(uint16_t id) {
-   return std::find(client_info_vec_.begin(),
-                    client_info_vec_.end(),
-                    id);
-}
+      if (dump_latency_.exchange(false, std::memory_order_relaxed)) {
+         latency_.Print(stdout);
+         fflush(stdout);
+      }
 
-bool DnsServer::RemoveClient(uint16_t id) {
-   return RemoveClient(GetClient(id));
-}
+      ReadClock();
 
-bool DnsServer::RemoveClient(ClientInfoVec::iterator it) {
-   if (it != client_info_vec_.end()) {
-      client_info_vec_.erase(it);
-      return true;
-   }
+      // Give the cache's memory back a slice at a time, so no query waits
+      // long behind it
+      if (now_ms_ - compact_ms >= kCompactIntervalMs) {
+         cache_->Compact(kCompactBudget, now_ms_);
+         compact_ms = now_ms_;
+      }
 
-   return false;
-}
+      if (metrics_.enabled() && now_ms_ - metrics_ms >= kMetricsIntervalMs) {
+         PublishMetrics();
+         metrics_ms = now_ms_;
+      }
 
-void DnsServer::Run() {
-   struct sockaddr_in6 client_addr;
-   socklen_t client_addr_len = sizeof(struct sockaddr_in6);
+      // Move on from the upstream servers ICMP errors said cannot be
+      // reached, without waiting for them to time out
+      SocketMonitor::SentError sent_error;
+      while (socket_monitor_.PopError(&sent_error))
+         resolver_->HandleUnreachable(sent_error.to_, sent_error.id_, now_ms_);
+
+      // Wake up the tasks whose upstream server is due to time out (or be
+      // hedged)
+      resolver_->HandleTimers(now_ms_);
+
+      // Wait up to 100 ms (less if a timer is due sooner, not at all if
+      // work is queued) for data to come in, on the listening socket or
+      // any upstream TCP connection
+      uint64_t wait_ms = kMaxWaitMs;
+      uint64_t timer_ms;
+      if (!scheduler_.empty() || socket_monitor_.has_errors()) {
+         wait_ms = 0;
+      } else if (resolver_->NextTimer(&timer_ms)) {
+         if (timer_ms <= now_ms_)
+            wait_ms = 0;
+         else if (timer_ms - now_ms_ < wait_ms)
+            wait_ms = timer_ms - now_ms_;
+      }
 
-   // Main event loop
-   while (1) {
-      // If timeout, query another authority server
-      if (client_info_vec_.size() &&
-          time(NULL) > client_info_vec_.front().timeout_) {
-         LOG << "Timeout. Deleting top authority record and querying another "
-               "server." << std::endl;
-         ClientInfo* client_info = &client_info_vec_.front();
-         RRVec& auth_rrs = client_info->query_info_list_.back().authority_rrs_;
-
-         auth_rrs.erase(auth_rrs.begin());
-
-         // If there are no more authority servers to query, delete this client
-         if (auth_rrs.empty()) {
-            LOG << "Just erased last authority RR. Delete this ClientInfo and "
-                  "simply don't respond." << std::endl;
-            std::pop_heap(client_info_vec_.begin(), client_info_vec_.end());
-            client_info_vec_.pop_back();
-         } else {
-            if (!UpdateTimeout(client_info->id_)) {
-               LOG << "ERROR: id " << client_info->id_ <<
-                     " not found in client info list" << std::endl;
-               exit(EXIT_FAILURE);
-            }
-
-            SendQueryUpstream(client_info);
+      fd_set readfds;
+      fd_set writefds;
+      FD_ZERO(&readfds);
+      FD_ZERO(&writefds);
+      FD_SET(listen_fd, &readfds);
+
+      int max_fd = std::max(listen_fd,
+            tcp_pool_->AddToFdSets(&readfds, &writefds));
+
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = wait_ms * 1000;
+      // A signal (such as the one asking to reload the ACL) cuts the wait
+      // short, with nothing ready
+      if (select(max_fd + 1, &readfds, &writefds, NULL, &tv) < 0) {
+         if (errno != EINTR) {
+            perror("select");
+            exit(EXIT_FAILURE);
          }
+         FD_ZERO(&readfds);
+         FD_ZERO(&writefds);
       }
 
-      // 100 ms wait for data to come in
-      if (Server::HasDataToRead(sock_, 0, 100)) {
-         int rlen = ReadIntoBuffer((struct sockaddr*) &client_addr, 
-                                   &client_addr_len);
-         DnsPacket packet(buf_);
-
-         DnsQuery query = packet.GetQuery();
-
-         if (packet.qr_flag()) {
-            // If the packet contained an SOA, just forward it to the
-            // client and delete it. Shitty, I know.
-            if (CacheAllResourceRecords(packet, query)) {
-               ClientInfoVec::iterator it = GetClient(packet.id());   
-               if (it != client_info_vec_.end()) {
-                  SendBufferToAddr(
-                        (struct sockaddr*) &it->client_addr_,
-                        sizeof(struct sockaddr_in6),
-                        rlen);
-
-                 RemoveClient(it);
-               }
-            }
-         }
+      ReadClock();
 
-         if (packet.rcode() == constants::response_code::Refused) {
-            // TODO respond to client
-            RemoveClient(packet.id());
+      // Queue whatever came in: complete responses over TCP, then
+      // datagrams
+      tcp_pool_->Process(&readfds, &writefds, now_ms_);
+      while (tcp_pool_->PopResponse(&tcp_response, &datagram.addr_)) {
+         if (tcp_response.size() > sizeof(buf_))
             continue;
-         }
 
-         // Assume that the top QueryInfo of the current ClientInfo is
-         // out-of-date and be refreshed. (This is not the case when this is
-         // there is no ClientInfo for this client yet (first query)).
-
-         RRVec answer_rrs;
-
-         ClientInfo* cur_client_info;
-         ClientInfoVec::iterator it = GetClient(packet.id());
-
-         // "Special" case -- no ClientInfo for this client yet (first query)
-         if (it == client_info_vec_.end()) {
-            LOG << "First time query - attempting to respond with cache" <<
-                  std::endl;
-            RRVec authority_rrs;
-            RRVec additional_rrs;
-
-            // If cache hit or iterative-request, respond
-            if (cache_->Get(query, &answer_rrs, &authority_rrs,
-                  &additional_rrs) || !packet.rd_flag()) {
-               int packet_len = DnsPacket::ConstructPacket(buf_, packet.id(),
-                     true, packet.opcode(), false, false, packet.rd_flag(),
-                     true, packet.rcode(), query, answer_rrs,
-                     authority_rrs, additional_rrs);
-
-               SendBufferToAddr((struct sockaddr*) &client_addr,
-                                sizeof(struct sockaddr_in6),
-                                packet_len);
-
-               // Go back to listening for packets
-               continue;
-            }
-
-            // Cache miss and recursive-request. Initialize ClientInfo.
-            LOG << "First time query after cache miss -- creating ClientInfo"
-                  << std::endl;
-
-            // Push client info to list
-            client_info_vec_.push_back(
-                  ClientInfo(client_addr,
-                             packet.id(),
-                             query,
-                             authority_rrs,
-                             additional_rrs));
-
-            // Save a pointer to the client just added
-            cur_client_info = &client_info_vec_.back();
-
-            // Update timeout, which sorts the list
-            if (!UpdateTimeout(packet.id())) {
-               LOG << "ERROR: id " << packet.id() <<
-                     " not found in client info list" << std::endl;
-               exit(EXIT_FAILURE);
-            }
-         } else {
-            // Grab a pointer to the client
-            cur_client_info = &(*it);
-
-            // Grab a pointer to the query list
-            QueryInfoList& cur_query_info_list =
-               cur_client_info->query_info_list_;
-
-            // If this was a response, and there are answers to a query that
-            // wasn't the original, pop its query
-            if (packet.qr_flag() && cur_query_info_list.size() > 1) {
-               QueryInfo& cur_query_info = cur_query_info_list.back();
-               RRVec temp_answer_rrs;
-
-               if (cache_->Get(cur_query_info.query_,
-                               &temp_answer_rrs,                    // junk
-                               &cur_query_info.authority_rrs_,      // junk
-                               &cur_query_info.additional_rrs_)) {  // junk
-                  LOG << "Intermediate query '" <<
-                        cur_query_info_list.back().query_.ToString() <<
-                        "' resolved. Popping from current QueryInfoList" <<
-                        std::endl;
-                  cur_query_info_list.pop_back();
-               }
-            }
-
-            QueryInfo& cur_query_info = cur_query_info_list.back();
-
-            RRVec& authority_rrs = cur_query_info.authority_rrs_;
-            RRVec& additional_rrs = cur_query_info.additional_rrs_;
-
-            cur_query_info.authority_rrs_.clear();
-            cur_query_info.additional_rrs_.clear();
-
-            // Cache hit -- this will be the original query, (or and SOA)
-            // because if there were answers to another query (such as an A
-            // record of a NS we needed), they would have been cached and then
-            // the QueryInfo struct popped. The only QueryInfo struct *not*
-            // popped is the original query.
-            if (cache_->Get(cur_query_info.query_, &answer_rrs, &authority_rrs,
-                  &additional_rrs)) {
-               int packet_len = DnsPacket::ConstructPacket(buf_, packet.id(),
-                     true, packet.opcode(), false, false, packet.rd_flag(),
-                     true, packet.rcode(), cur_query_info_list.front().query_,
-                     answer_rrs, authority_rrs, additional_rrs);
-
-               SendBufferToAddr(
-                     (struct sockaddr*) &cur_client_info->client_addr_,
-                     sizeof(struct sockaddr_in6),
-                     packet_len);
-
-               // Delete the current client info
-               RemoveClient(it);
-
-               // Go back to listening for packets
-               continue;
-            }
+         // Too large for a queue slot: handle it now
+         if (tcp_response.size() > sizeof(datagram.data_)) {
+            memcpy(buf_, tcp_response.data(), tcp_response.size());
+            resolver_->HandleResponse(buf_, tcp_response.size(),
+                  datagram.addr_, now_ms_);
+            continue;
          }
 
-         QueryInfo& cur_query_info = cur_client_info->query_info_list_.back();
-
-         // If we got a CNAME from cache, put it on the query info list
-         if (answer_rrs.size()) {
-            DnsQuery temp_query(answer_rrs.begin()->data(),
-                                query.type(),
-                                query.clz());
+         datagram.len_ = tcp_response.size();
+         memcpy(datagram.data_, tcp_response.data(), datagram.len_);
+         datagram.received_ns_ = 0;
+         datagram.received_ms_ = now_ms_;
+         datagram.kernel_wait_ns_ = 0;
+         datagram.cache_missed_ = false;
+         datagram.queued_us_ = now_us_;
+         if (!scheduler_.Push(Scheduler::kSlow, datagram, now_us_))
+            Serve(&datagram, Scheduler::kSlow);
+      }
 
-            LOG << "Pushing " << temp_query.ToString() <<
-                  " onto current QueryInfoList" << std::endl;
+      // Queries whose connection closed unanswered: their tasks move on
+      // now, rather than at their timeouts
+      while (tcp_pool_->PopFailure(&tcp_failed_addr, &tcp_failed_id))
+         resolver_->HandleUnreachable(tcp_failed_addr, tcp_failed_id, now_ms_);
 
-            cur_client_info->query_info_list_.push_back(
-                  QueryInfo(temp_query,
-                            cur_query_info.authority_rrs_,
-                            cur_query_info.additional_rrs_));
+      if (FD_ISSET(listen_fd, &readfds))
+         ReadDatagrams();
 
+      // Serve a round, then look for new arrivals
+      for (int i = 0; i < kRoundLen; ++i) {
+         if (!scheduler_.Next(&datagram, &lane, now_us_))
+            break;
+         Serve(&datagram, lane);
+      }
+   }
+}
 
-            // Update timeout, which sorts the list
-            if (!UpdateTimeout(packet.id())) {
-               LOG << "ERROR: id " << packet.id() <<
-                     " not found in client info list" << std::endl;
-               exit(EXIT_FAILURE);
-            }
+void DnsServer::ReadDatagrams() {
+   Datagram datagram;
+   for (int i = 0; i < kReadBatch; ++i) {
+      if (pipeline_) {
+         // Cache misses and upstream responses the workers passed on
+         if (!pipeline_->PopForOwner(&datagram))
+            return;
+      } else {
+         struct iovec iov;
+         iov.iov_base = datagram.data_;
+         iov.iov_len = sizeof(datagram.data_);
+         char control[SocketMonitor::kControlLen];
+         struct msghdr msg;
+         memset(&msg, 0, sizeof(msg));
+         msg.msg_name = &datagram.addr_;
+         msg.msg_namelen = sizeof(struct sockaddr_in6);
+         msg.msg_iov = &iov;
+         msg.msg_iovlen = 1;
+         msg.msg_control = control;
+         msg.msg_controllen = sizeof(control);
+
+         datagram.len_ = recvmsg(sock_, &msg, MSG_DONTWAIT);
+         if (datagram.len_ < 0) {
+            SocketMonitor::Error error = SocketMonitor::Classify(errno);
+
+            // An ICMP error for a datagram sent earlier; if the socket was
+            // readable with nothing to read, there may be several
+            if (error == SocketMonitor::kUnreachable ||
+                (error == SocketMonitor::kWouldBlock && !i))
+               socket_monitor_.ReadErrors();
+
+            if (error == SocketMonitor::kDrop ||
+                error == SocketMonitor::kFatal)
+               socket_monitor_.CountError(error);
+            if (error == SocketMonitor::kWouldBlock ||
+                error == SocketMonitor::kFatal)
+               return;
+            continue;
          }
+         LOG << "Read " << datagram.len_ << " bytes." << std::endl;
+         datagram.received_ns_ = latency_.enabled() ||
+               query_log_.enabled() ? LatencyStats::NowNs() : 0;
+         datagram.received_ms_ = now_ms_;
+         datagram.kernel_wait_ns_ = socket_monitor_.KernelWait(msg,
+               SocketMonitor::RealtimeNs());
+         datagram.cache_missed_ = false;
+         socket_monitor_.Count(1, datagram.kernel_wait_ns_,
+               datagram.kernel_wait_ns_);
+      }
 
-         if (!SendQueryUpstream(cur_client_info))
-            RemoveClient(cur_client_info->id_);
+      if (datagram.len_ < (int) sizeof(DnsPacket::Header))
+         continue;
+
+      // Client queries may be cache hits; responses are for the resolver
+      DnsPacket packet(datagram.data_);
+      if (!pipeline_ && !packet.qr_flag() && latency_.enabled() &&
+          datagram.kernel_wait_ns_)
+         latency_.Record(LatencyStats::kKernelQueue, datagram.kernel_wait_ns_);
+      if (!packet.qr_flag() &&
+          ClientAction(datagram.addr_) == Acl::kRefuse) {
+         acl_refused_.fetch_add(1, std::memory_order_relaxed);
+         int packet_len = MakeRefused(datagram.data_);
+         memcpy(buf_, datagram.data_, packet_len);
+         SendBufferToAddr((struct sockaddr*) &datagram.addr_,
+               sizeof(struct sockaddr_in6), packet_len, datagram.received_ns_,
+               QueryLog::kRefused);
+         continue;
       }
+
+      // A query a worker missed in cache needs resolving; only that is
+      // left
+      Scheduler::Lane lane = packet.qr_flag() || datagram.cache_missed_ ?
+            Scheduler::kSlow : Scheduler::kFast;
+      datagram.queued_us_ = now_us_;
+      scheduler_.Push(lane, datagram, now_us_);
    }
 }
 
-RRVec::iterator DnsServer::FindNameserverIp(DnsResourceRecord& auth_rr,
-                                             RRVec& addl_rrs,
-                                             bool v4) {
-   RRVec::iterator it;
-   uint16_t type;
-
-   if (v4)
-      type = htons(constants::type::A);
-   else
-      type = htons(constants::type::AAAA);
-
-   for (it = addl_rrs.begin(); it != addl_rrs.end(); ++it) {
-      if (!it->name().compare(auth_rr.data()) &&
-          it->type() == type) {
-         break;
-      }
+void DnsServer::Serve(Datagram* datagram, Scheduler::Lane lane) {
+   DnsPacket packet(datagram->data_);
+   if (packet.qr_flag()) {
+      resolver_->HandleResponse(datagram->data_, datagram->len_,
+            datagram->addr_, now_ms_);
+      return;
    }
 
-   // Fall back to v4, if v6 miss
-   if (it == addl_rrs.end() && !v4) {
-      for (it = addl_rrs.begin(); it != addl_rrs.end(); ++it) {
-         if (!it->name().compare(auth_rr.data()) &&
-             it->type() == htons(constants::type::A)) {
-            break;
-         }
+   if (lane == Scheduler::kFast) {
+      // Whatever the last query left in the arena goes now
+      request_arena_.Reset();
+      DnsQuery query = packet.GetQuery();
+      uint64_t now_ns = 0;
+      if (latency_.enabled()) {
+         now_ns = LatencyStats::NowNs();
+         latency_.Record(LatencyStats::kReceiveToParse,
+               now_ns - datagram->received_ns_);
+      }
+      int packet_len = AnswerFromCache(packet, query, now_ms_,
+            &request_arena_, buf_, &now_ns);
+      if (packet_len) {
+         if (now_ns)
+            latency_.Record(LatencyStats::kCacheAnswer,
+                  now_ns - datagram->received_ns_);
+         SendBufferToAddr((struct sockaddr*) &datagram->addr_,
+               sizeof(struct sockaddr_in6), packet_len,
+               datagram->received_ns_, QueryLog::kCached);
+         return;
       }
+
+      // Needs resolving, which is slow work. It has had its lookup.
+      datagram->cache_missed_ = true;
+      if (scheduler_.Push(Scheduler::kSlow, *datagram, now_us_))
+         return;
    }
 
-   return it;
+   // All the time it has been queued, in the fast lane as well as the slow
+   uint64_t queued_us = datagram->queued_us_;
+   memcpy(buf_, datagram->data_, datagram->len_);
+   DnsPacket query_packet(buf_);
+   HandleClientQuery(query_packet, datagram->addr_,
+         now_us_ > queued_us ? now_us_ - queued_us : 0,
+         datagram->received_ns_, datagram->cache_missed_);
 }
 
-bool DnsServer::SendQueryUpstream(ClientInfo* client_info) {
-   // Grab the top authority from the top QueryInfo and check to see if
-   // its A/AAAA record is in the additionals
-   QueryInfoList& query_info_list = client_info->query_info_list_;
-   if (!query_info_list.size()) {
-      LOG << "Client ran out of authority RRs." << std::endl;
-      return false;   
-   }
-
-   QueryInfo& query_info = query_info_list.back();
-   DnsResourceRecord& auth_rr = query_info.authority_rrs_.front();
-   RRVec& addl_rrs = query_info.additional_rrs_;
-
-   RRVec::iterator it = FindNameserverIp(auth_rr, addl_rrs, 
-         IN6_IS_ADDR_V4MAPPED(&client_info->client_addr_.sin6_addr));
-
-   // If we didn't find such an A/AAAA rec, do a cache query to get the
-   // right authority and A records. (kind of cheating here... :/)
-   // This query may end up with missing additional information as well, in
-   // which case we recurse. (This will terminate at root servers, worst case).
-   if (it == addl_rrs.end()) {
-      DnsQuery query2(auth_rr.data(), 
-                      htons(constants::type::A), 
-                      htons(constants::clz::IN));
-
-      RRVec temp_answer_rrs;
-      RRVec temp_authority_rrs;
-      RRVec temp_additional_rrs;
-
-      if (cache_->Get(query2, &temp_answer_rrs, &temp_authority_rrs,
-            &temp_additional_rrs)) {
-         LOG << "Probably I got an SOA for an A record of a NS. If this is the "
-               "case, delete this auth and re-call this function." << std::endl;
-
-         query_info_list.pop_back();
-         return SendQueryUpstream(client_info);
-      }
+void DnsServer::HandleClientQuery(DnsPacket& packet,
+                                  struct sockaddr_in6& client_addr,
+                                  uint64_t queued_us, uint64_t received_ns,
+                                  bool cache_missed) {
+   DnsQuery query = packet.GetQuery();
+
+   // Whatever the last query left in the arena goes now
+   request_arena_.Reset();
+
+   // If cache hit or iterative-request, respond
+   int packet_len = 0;
+   if (!cache_missed) {
+      uint64_t now_ns = latency_.enabled() ? LatencyStats::NowNs() : 0;
+      packet_len = AnswerFromCache(packet, query, now_ms_, &request_arena_,
+            buf_, &now_ns);
+      if (packet_len && now_ns)
+         latency_.Record(LatencyStats::kCacheAnswer, now_ns - received_ns);
+   }
+   if (packet_len) {
+      SendBufferToAddr((struct sockaddr*) &client_addr,
+                       sizeof(struct sockaddr_in6),
+                       packet_len, received_ns, QueryLog::kCached);
 
-      LOG << "Pushing " << query2.ToString() << " onto current QueryInfoList"
-            << std::endl;
-      query_info_list.push_back(QueryInfo(query2,
-                                          temp_authority_rrs,
-                                          temp_additional_rrs));
+      // Go back to listening for packets
+      return;
+   }
+   metrics_.CacheMiss(query.type());
 
-      // Update timeout, which sorts the list
-      if (!UpdateTimeout(client_info->id_)) {
-         LOG << "ERROR: id " << client_info->id_ <<
-               " not found in client info list" << std::endl;
-         exit(EXIT_FAILURE);
+   // A retransmission of a query we are already resolving
+   ClientKey key(client_addr, packet.id());
+   if (clients_.find(key) != clients_.end()) {
+      LOG << "Ignoring retransmitted query" << std::endl;
+      return;
+   }
+
+   // Clients the ACL keeps to the cache get no further; nor, under
+   // overload, do those whose recursions are shed
+   bool refuse = false;
+   if (ClientAction(client_addr) == Acl::kNoRecursion) {
+      LOG << "Refusing recursion to client" << std::endl;
+      acl_kept_from_recursion_++;
+      refuse = true;
+   } else {
+      AdmissionControl::Verdict verdict = admission_.Admit(client_addr,
+            queued_us, FramePool::Instance()->stats().bytes_outstanding);
+      if (verdict != AdmissionControl::kAdmit) {
+         LOG << "Shedding query: " << AdmissionControl::VerdictName(verdict)
+               << std::endl;
+         if (!admission_.refuse())
+            return;
+         refuse = true;
       }
+   }
 
-      return SendQueryUpstream(client_info);
+   if (refuse) {
+      RRVec none(&request_arena_);
+      packet_len = DnsPacket::ConstructPacket(buf_, packet.id(), true,
+            packet.opcode(), false, false, packet.rd_flag(), true,
+            constants::response_code::Refused, query, none, none, none);
+      SendBufferToAddr((struct sockaddr*) &client_addr,
+                       sizeof(struct sockaddr_in6),
+                       packet_len, received_ns, QueryLog::kRefused);
+      return;
    }
 
-   // TODO i6
-   struct sockaddr_in6 addr;
-   addr.sin6_family = AF_INET6;
-   addr.sin6_port = htons(port_);
-   addr.sin6_flowinfo = 0; // what?
-   addr.sin6_scope_id = 0; // what?
+   // Cache miss and recursive-request
+   LOG << "First time query after cache miss -- starting resolution"
+         << std::endl;
+
+   clients_[key] = now_ms_;
+   resolver_->Start(ServeClient(client_addr, packet.id(), packet.opcode(),
+         query, received_ns), now_ms_);
+}
 
-   if (it->type() == htons(constants::type::A)) {
-      memcpy(&addr.sin6_addr,
-             "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xFF\xFF",
-             12);
-      memcpy(((char*) &addr.sin6_addr) + 12,
-             it->data(),
-             sizeof(struct in_addr));
+int DnsServer::AnswerFromCache(DnsPacket& packet, DnsQuery& query,
+                               uint64_t now_ms, Arena* arena, char* out,
+                               uint64_t* now_ns) {
+   LOG << "First time query - attempting to respond with cache" <<
+         std::endl;
+   RRVec answer_rrs(arena);
+   RRVec authority_rrs(arena);
+   RRVec additional_rrs(arena);
+
+   bool found = cache_->Get(query, &answer_rrs, &authority_rrs,
+         &additional_rrs, now_ms);
+   if (*now_ns) {
+      uint64_t start_ns = *now_ns;
+      *now_ns = LatencyStats::NowNs();
+      latency_.Record(LatencyStats::kCacheLookup, *now_ns - start_ns);
+   }
+   if (!found) {
+      // Misses that need resolving are counted once they reach the event
+      // loop, which starts resolving them
+      if (packet.rd_flag())
+         return 0;
+      metrics_.CacheMiss(query.type());
    } else {
-      memcpy(&addr.sin6_addr, it->data(), sizeof(struct in6_addr));
+      metrics_.CacheHit(query.type(), answer_rrs.empty() &&
+            authority_rrs.size() && ntohs(authority_rrs[0].type()) ==
+            constants::type::SOA);
+   }
+
+   int len = DnsPacket::ConstructPacket(out, packet.id(), true,
+         packet.opcode(), false, false, packet.rd_flag(), true,
+         packet.rcode(), query, answer_rrs, authority_rrs, additional_rrs);
+   if (*now_ns) {
+      uint64_t start_ns = *now_ns;
+      *now_ns = LatencyStats::NowNs();
+      latency_.Record(LatencyStats::kEncode, *now_ns - start_ns);
    }
+   return len;
+}
 
-   SendQueryUpstream((struct sockaddr*) &addr, sizeof(struct sockaddr_in6),
-         query_info.query_, client_info->id_);
+bool DnsServer::AnswerQuery(Datagram* query, Datagram* reply, Arena* arena) {
+   // Upstream responses are the resolver's
+   if (query->len_ < (int) sizeof(DnsPacket::Header))
+      return false;
+
+   DnsPacket packet(query->data_);
+   if (packet.qr_flag())
+      return false;
+
+   if (ClientAction(query->addr_) == Acl::kRefuse) {
+      acl_refused_.fetch_add(1, std::memory_order_relaxed);
+      memcpy(reply->data_, query->data_, sizeof(DnsPacket::Header));
+      reply->len_ = MakeRefused(reply->data_);
+      metrics_.Response(reply->data_);
+      query_log_.Log(query->addr_, reply->data_, reply->len_,
+            query->received_ns_, QueryLog::kRefused);
+      return true;
+   }
 
+   DnsQuery question = packet.GetQuery();
+   uint64_t now_ns = 0;
+   if (latency_.enabled()) {
+      if (query->kernel_wait_ns_)
+         latency_.Record(LatencyStats::kKernelQueue, query->kernel_wait_ns_);
+      now_ns = LatencyStats::NowNs();
+      latency_.Record(LatencyStats::kReceiveToParse,
+            now_ns - query->received_ns_);
+   }
+   reply->len_ = AnswerFromCache(packet, question, query->received_ms_,
+         arena, reply->data_, &now_ns);
+   if (!reply->len_) {
+      query->cache_missed_ = true;
+      return false;
+   }
+   if (now_ns)
+      latency_.Record(LatencyStats::kCacheAnswer,
+            now_ns - query->received_ns_);
+
+   QueryLog::Outcome outcome = QueryLog::kCached;
+   if (rrl_.enabled() && rrl_.Check(query->addr_, reply->data_, &reply->len_,
+         query->received_ms_) == RateLimiter::kDrop)
+      outcome = QueryLog::kRateLimited;
+   else
+      metrics_.Response(reply->data_);
+   query_log_.Log(query->addr_, reply->data_, reply->len_,
+         query->received_ns_, outcome);
+   if (outcome == QueryLog::kRateLimited)
+      reply->len_ = 0;
    return true;
 }
 
-bool DnsServer::CacheAllResourceRecords(DnsPacket& packet) {
-   DnsQuery query = packet.GetQuery(); // Save query in case of SOAs
-   return CacheAllResourceRecords(packet, query);
+DetachedTask DnsServer::ServeClient(struct sockaddr_in6 client_addr,
+                                    uint16_t id, uint16_t opcode,
+                                    DnsQuery query, uint64_t received_ns) {
+   // Room for a typical resolution's temporaries, in the (pooled) frame
+   char scratch[kServeScratchLen];
+   Arena arena(scratch, sizeof(scratch));
+
+   QueryTrace* trace = tracer_.Start(query, client_addr);
+   Resolver::Answer answer = co_await resolver_->Resolve(query, &arena, 0,
+         TraceLane(trace, 0));
+   tracer_.Finish(trace);
+
+   clients_.erase(ClientKey(client_addr, id));
+   admission_.Finished(client_addr);
+
+   // Negative answer: forward the authority's response as is
+   if (answer.response_.size() && answer.response_.size() <= sizeof(buf_)) {
+      memcpy(buf_, answer.response_.data(), answer.response_.size());
+      ((DnsPacket::Header*) buf_)->id = id;
+      SendBufferToAddr((struct sockaddr*) &client_addr,
+            sizeof(struct sockaddr_in6), answer.response_.size(), received_ns,
+            QueryLog::kResolved);
+      if (latency_.enabled())
+         latency_.RecordSince(LatencyStats::kResolvedAnswer, received_ns);
+      co_return;
+   }
+
+   // No answer to be had: tell the client so, rather than leave it to time
+   // out and retry
+   if (!answer.resolved_) {
+      RRVec none(&arena);
+      int packet_len = DnsPacket::ConstructPacket(buf_, id, true, opcode,
+            false, false, true, true, constants::response_code::ServerFailure,
+            query, none, none, none);
+      SendBufferToAddr((struct sockaddr*) &client_addr,
+            sizeof(struct sockaddr_in6), packet_len, received_ns,
+            QueryLog::kFailed);
+      co_return;
+   }
+
+   uint64_t start_ns = latency_.enabled() ? LatencyStats::NowNs() : 0;
+   int packet_len = DnsPacket::ConstructPacket(buf_, id, true, opcode, false,
+         false, true, true, constants::response_code::NoError, query,
+         answer.answer_rrs_, answer.authority_rrs_, answer.additional_rrs_);
+   if (start_ns)
+      latency_.RecordSince(LatencyStats::kEncode, start_ns);
+
+   SendBufferToAddr((struct sockaddr*) &client_addr,
+         sizeof(struct sockaddr_in6), packet_len, received_ns,
+         QueryLog::kResolved);
+   if (latency_.enabled())
+      latency_.RecordSince(LatencyStats::kResolvedAnswer, received_ns);
 }
 
-bool DnsServer::CacheAllResourceRecords(DnsPacket& packet, DnsQuery& query) {
-   int num_rrs = packet.answer_rrs() + packet.authority_rrs() +
-         packet.additional_rrs();
+Acl::Action DnsServer::ClientAction(const struct sockaddr_in6& client_addr) {
+   EpochGuard guard;
+   Acl* acl = acl_.load(std::memory_order_acquire);
+   if (!acl)
+      return Acl::kAllow;
 
-   bool contains_soa = false;
+   return acl->Lookup(client_addr.sin6_addr);
+}
 
-   for (int i = 0; i < num_rrs; ++i) {
-      DnsResourceRecord record = packet.GetResourceRecord();
+void DnsServer::SwapAcl() {
+   if (acl_path_.empty())
+      return;
 
-      if (ntohs(record.type()) == constants::type::SOA) {
-         cache_->Insert(query, record);
-         contains_soa = true;
-      }
-      else {
-         cache_->Insert(record);
-      }
+   // A file that does not parse leaves the rules as they were
+   Acl* acl = Acl::Load(acl_path_.c_str());
+   if (!acl) {
+      fprintf(stderr, "Keeping the ACL in use\n");
+      return;
    }
 
-   return contains_soa;
+   // Readers hold the old rules for one lookup at most, so waiting them
+   // out takes no time to speak of
+   Acl* old = acl_.exchange(acl, std::memory_order_acq_rel);
+   EpochManager* epoch = EpochManager::Instance();
+   uint64_t retired = epoch->epoch();
+   while (!epoch->Reclaimable(retired))
+      sched_yield();
+   delete old;
+
+   fprintf(stderr, "Loaded %zu ACL rules from %s\n", acl->rules(),
+         acl_path_.c_str());
+}
+
+void DnsServer::SendUdp(const struct sockaddr_in6& addr, const char* packet,
+                        int len) {
+   metrics_.UpstreamQuery(addr.sin6_addr);
+   SendDatagram(addr, packet, len);
 }
 
-void DnsServer::SendQueryUpstream(struct sockaddr* addr, socklen_t addrlen,
-      DnsQuery& query, uint16_t id) {
+bool DnsServer::SendTcp(const struct sockaddr_in6& addr, const char* packet,
+                        int len, uint16_t id, uint64_t now_ms) {
+   if (!tcp_pool_->Send(addr, packet, len, id, now_ms))
+      return false;
 
-   char* p = DnsPacket::ConstructQuery(buf_, id,
-         constants::opcode::Query, false, query);
+   metrics_.UpstreamQuery(addr.sin6_addr);
+   return true;
+}
+
+void DnsServer::PrintStats(FILE* out) const {
+   const Resolver::Stats& resolver = resolver_->stats();
+   const TcpConnectionPool::Stats& tcp = tcp_pool_->stats();
+   const FramePool::Stats& frames = FramePool::Instance()->stats();
+   const SlabPool::Stats& slabs = SlabPool::Local()->stats();
+   SlabArena::Stats cache_slabs = cache_->arena_stats();
+
+   fprintf(out, "Infra cache: %d servers\n", infra_->size());
+   fprintf(out, "Slab pool: %llu allocations (%llu large), %llu slabs, "
+         "%llu bytes reserved; %lld in use over all threads\n",
+         (unsigned long long) slabs.allocations,
+         (unsigned long long) slabs.large,
+         (unsigned long long) slabs.slabs,
+         (unsigned long long) slabs.bytes_reserved,
+         (long long) SlabPool::BytesInUse());
+   fprintf(out, "Cache arena: %llu regions (%llu huge), %llu slabs used, "
+         "%llu free, %llu of %llu bytes in use, %.1f%% fragmented, "
+         "%llu slabs drained\n",
+         (unsigned long long) cache_slabs.regions,
+         (unsigned long long) cache_slabs.huge_page_regions,
+         (unsigned long long) cache_slabs.slabs_used,
+         (unsigned long long) cache_slabs.slabs_free,
+         (unsigned long long) cache_slabs.bytes_in_use,
+         (unsigned long long) cache_slabs.bytes_mapped,
+         100 * SlabArena::Fragmentation(cache_slabs),
+         (unsigned long long) cache_slabs.slabs_drained);
+   if (shared_cache_) {
+      SharedCache::Stats shared = shared_cache_->stats();
+      fprintf(out, "Shared cache: %u slots, %llu lookups (%llu hits, "
+            "%llu torn), %llu inserts (%llu busy, %llu too large), %llu evictions, "
+            "%llu recovered\n",
+            shared_cache_->slots(),
+            (unsigned long long) shared.lookups,
+            (unsigned long long) shared.hits,
+            (unsigned long long) shared.torn_reads,
+            (unsigned long long) shared.inserts,
+            (unsigned long long) shared.busy,
+            (unsigned long long) shared.too_large,
+            (unsigned long long) shared.evictions,
+            (unsigned long long) shared.recovered);
+   }
+   SocketMonitor::Stats socket = socket_monitor_.stats();
+   fprintf(out, "Socket: %llu datagrams read, %llu dropped by the kernel, "
+         "kernel wait %.1f us avg, %.1f us max; %d byte receive buffer, "
+         "%d byte send buffer\n",
+         (unsigned long long) socket.datagrams,
+         (unsigned long long) socket.kernel_drops,
+         socket.datagrams ? socket.total_wait_ns / 1000.0 / socket.datagrams :
+         0, socket.max_wait_ns / 1000.0, socket.rcvbuf, socket.sndbuf);
+   fprintf(out, "Socket errors: %llu would block, %llu unreachable, "
+         "%llu dropped, %llu fatal; %llu ICMP errors read\n",
+         (unsigned long long) socket.errors[SocketMonitor::kWouldBlock],
+         (unsigned long long) socket.errors[SocketMonitor::kUnreachable],
+         (unsigned long long) socket.errors[SocketMonitor::kDrop],
+         (unsigned long long) socket.errors[SocketMonitor::kFatal],
+         (unsigned long long) socket.icmp_errors);
+   if (pipeline_) {
+      Pipeline::Stats pipeline = pipeline_->stats();
+      fprintf(out, "Pipeline: %llu answered by workers, %llu receive "
+            "batches, %llu send batches\n",
+            (unsigned long long) pipeline.answered,
+            (unsigned long long) pipeline.receive_batches,
+            (unsigned long long) pipeline.send_batches);
+      PrintStageStats(out, "to workers", pipeline.to_workers);
+      PrintStageStats(out, "to resolver", pipeline.to_owner);
+      PrintStageStats(out, "to senders", pipeline.to_senders);
+   }
+   if (rrl_.enabled()) {
+      RateLimiter::Stats rrl = rrl_.stats();
+      fprintf(out, "Rate limiting%s: %llu answers, %llu no data, "
+            "%llu nxdomain, %llu errors; %llu sent, %llu dropped, "
+            "%llu slipped, %llu evictions\n",
+            rrl_.log_only() ? " (log only)" : "",
+            (unsigned long long) rrl.checked[RateLimiter::kAnswer],
+            (unsigned long long) rrl.checked[RateLimiter::kNoData],
+            (unsigned long long) rrl.checked[RateLimiter::kNxDomain],
+            (unsigned long long) rrl.checked[RateLimiter::kError],
+            (unsigned long long) rrl.verdicts[RateLimiter::kSend],
+            (unsigned long long) rrl.verdicts[RateLimiter::kDrop],
+            (unsigned long long) rrl.verdicts[RateLimiter::kSlip],
+            (unsigned long long) rrl.evictions);
+   }
+   for (int i = 0; i < Scheduler::kLanes; ++i) {
+      const Scheduler::LaneStats& lane =
+            scheduler_.stats((Scheduler::Lane) i);
+      fprintf(out, "%s lane: %llu queued (%llu dropped), %llu served, "
+            "wait %.1f us avg, %llu us max, %llu over budget\n",
+            i == Scheduler::kFast ? "Fast" : "Slow",
+            (unsigned long long) lane.queued,
+            (unsigned long long) lane.dropped,
+            (unsigned long long) lane.served,
+            lane.served ? (double) lane.total_wait_us / lane.served : 0,
+            (unsigned long long) lane.max_wait_us,
+            (unsigned long long) lane.over_budget);
+   }
+   Acl* acl = acl_.load(std::memory_order_acquire);
+   if (acl) {
+      fprintf(out, "ACL: %zu rules in %zu nodes; %llu queries refused, "
+            "%llu kept from recursion\n",
+            acl->rules(), acl->nodes(),
+            (unsigned long long) acl_refused_.load(),
+            (unsigned long long) acl_kept_from_recursion_);
+   }
+   AdmissionControl::Stats admission = admission_.stats();
+   fprintf(out, "Admission: %llu recursions in flight (peak %llu) from %llu "
+         "prefixes, shed queries %s\n",
+         (unsigned long long) admission.outstanding,
+         (unsigned long long) admission.peak_outstanding,
+         (unsigned long long) admission.prefixes,
+         admission_.refuse() ? "refused" : "dropped");
+   for (int i = 0; i < AdmissionControl::kVerdicts; ++i) {
+      fprintf(out, "  %s: %llu\n",
+            AdmissionControl::VerdictName((AdmissionControl::Verdict) i),
+            (unsigned long long) admission.verdicts[i]);
+   }
+   fprintf(out, "Resolver: %llu tasks, %llu frames allocated (%llu reused, "
+         "peak %llu live, %llu bytes pooled)\n",
+         (unsigned long long) resolver.tasks_started,
+         (unsigned long long) frames.allocations,
+         (unsigned long long) frames.reused,
+         (unsigned long long) frames.peak_outstanding,
+         (unsigned long long) frames.bytes_reserved);
+   fprintf(out, "Upstream UDP: %llu queries, %llu timeouts, %llu "
+         "unreachable, %llu errors, %llu hedges (%llu won, %llu over "
+         "budget)\n",
+         (unsigned long long) resolver.upstream_queries,
+         (unsigned long long) resolver.timeouts,
+         (unsigned long long) resolver.unreachable,
+         (unsigned long long) resolver.errors,
+         (unsigned long long) resolver.hedges_sent,
+         (unsigned long long) resolver.hedges_won,
+         (unsigned long long) resolver.hedges_denied);
+   fprintf(out, "Nameserver lookups: %llu started, %llu joined, %llu resolved, "
+         "%llu failed\n",
+         (unsigned long long) resolver.ns_lookups_started,
+         (unsigned long long) resolver.ns_lookups_joined,
+         (unsigned long long) resolver.ns_lookups_resolved,
+         (unsigned long long) resolver.ns_lookups_failed);
+   fprintf(out, "Upstream TCP: %d open, %llu queries, %llu responses\n",
+         tcp_pool_->size(),
+         (unsigned long long) tcp.queries_sent,
+         (unsigned long long) tcp.responses_received);
+   fprintf(out, "  connections: %llu opened, %llu reused, %llu evicted, "
+         "%llu failed\n",
+         (unsigned long long) tcp.connections_opened,
+         (unsigned long long) tcp.connections_reused,
+         (unsigned long long) tcp.connections_evicted,
+         (unsigned long long) tcp.connections_failed);
+   fprintf(out, "  handshake: %llu us spent, ~%llu us saved by reuse\n",
+         (unsigned long long) tcp.handshake_us_total,
+         (unsigned long long) tcp.handshake_us_saved);
+   if (tracer_.enabled()) {
+      fprintf(out, "Traces: %llu started, %llu written\n",
+            (unsigned long long) tracer_.stats().started,
+            (unsigned long long) tracer_.stats().written);
+   }
+   if (query_log_.enabled()) {
+      QueryLog::Stats log = query_log_.stats();
+      fprintf(out, "Query log: %llu logged, %llu dropped, %llu write errors\n",
+            (unsigned long long) log.logged,
+            (unsigned long long) log.dropped,
+            (unsigned long long) log.write_errors);
+   }
+   latency_.Print(out);
+}
 
-   LOG << "Sending query " << query.ToString() << " with id " << id <<
-         " upstream." << std::endl;
-   SendBufferToAddr(addr, addrlen, p - buf_);
+void DnsServer::PublishMetrics() {
+   const Resolver::Stats& resolver = resolver_->stats();
+   metrics_.Set(Metrics::kRecursionsInFlight, clients_.size());
+   metrics_.Set(Metrics::kUpstreamPending, resolver_->pending());
+   metrics_.Set(Metrics::kCacheEntries, cache_->size());
+   metrics_.Set(Metrics::kCacheBytes, cache_->arena_stats().bytes_in_use);
+   metrics_.Set(Metrics::kUpstreamServers, infra_->size());
+   metrics_.Set(Metrics::kResolutionsStarted, resolver.tasks_started);
+   metrics_.Set(Metrics::kHedgesSent, resolver.hedges_sent);
+   metrics_.Set(Metrics::kTcpQueries, resolver.tcp_retries);
+   metrics_.Set(Metrics::kAclRefused,
+         acl_refused_.load(std::memory_order_relaxed));
+
+   AdmissionControl::Stats admission = admission_.stats();
+   uint64_t shed = 0;
+   for (int i = AdmissionControl::kAdmit + 1; i < AdmissionControl::kVerdicts;
+        ++i)
+      shed += admission.verdicts[i];
+   metrics_.Set(Metrics::kRecursionsShed, shed);
+
+   if (rrl_.enabled() && !rrl_.log_only())
+      metrics_.Set(Metrics::kRateLimited,
+            rrl_.stats().verdicts[RateLimiter::kDrop]);
+
+   uint64_t dropped = 0;
+   for (int i = 0; i < Scheduler::kLanes; ++i)
+      dropped += scheduler_.stats((Scheduler::Lane) i).dropped;
+   if (pipeline_) {
+      Pipeline::Stats pipeline = pipeline_->stats();
+      dropped += pipeline.to_workers.dropped + pipeline.to_owner.dropped +
+            pipeline.to_senders.dropped;
+   }
+   metrics_.Set(Metrics::kQueueDropped, dropped);
 }
 
 void DnsServer::SendBufferToAddr(struct sockaddr* addr, socklen_t addrlen,
-      int datalen) {
-   // intentionally not error-checked
-   sendto(sock_, buf_, datalen, 0, addr, addrlen);
+      int datalen, uint64_t received_ns, QueryLog::Outcome outcome) {
+   if (rrl_.enabled() && rrl_.Check(*(struct sockaddr_in6*) addr, buf_,
+         &datalen, now_ms_) == RateLimiter::kDrop) {
+      LOG << "Rate limited " << datalen << " bytes" << std::endl;
+      query_log_.Log(*(struct sockaddr_in6*) addr, buf_, datalen,
+            received_ns, QueryLog::kRateLimited);
+      return;
+   }
+   metrics_.Response(buf_);
+   query_log_.Log(*(struct sockaddr_in6*) addr, buf_, datalen, received_ns,
+         outcome);
 
-   char* ip_dots_and_numbers =
-      inet_ntoa(((struct sockaddr_in*) addr)->sin_addr);
-   LOG << "Sent " << datalen << " bytes to " << ip_dots_and_numbers <<
-         std::endl;
+   if (!pipeline_ ||
+       !pipeline_->Send(*(struct sockaddr_in6*) addr, buf_, datalen))
+      SendDatagram(*(struct sockaddr_in6*) addr, buf_, datalen);
+
+   LOG << "Sent " << datalen << " bytes to " <<
+         AddrToString(*(struct sockaddr_in6*) addr) << std::endl;
 }
 
-int DnsServer::ReadIntoBuffer(struct sockaddr* client_addr,
-                              socklen_t* client_addr_len) {
-   int rlen;
-   SYSCALL((rlen = recvfrom(sock_, buf_, ETH_DATA_LEN, 0,
-         client_addr, client_addr_len)), "recvfrom");
-   LOG << "Read " << rlen << " bytes into buffer." << std::endl;
-   return rlen;
+void DnsServer::SendDatagram(const struct sockaddr_in6& addr,
+                             const char* data, int len) {
+   bool retried = false;
+   while (sendto(sock_, data, len, 0, (const struct sockaddr*) &addr,
+                 sizeof(struct sockaddr_in6)) < 0) {
+      SocketMonitor::Error error = SocketMonitor::Classify(errno);
+      if (error == SocketMonitor::kRetry)
+         continue;
+
+      // Most likely the ICMP error of an earlier datagram, which the socket
+      // reports on this one instead of sending it
+      if (error == SocketMonitor::kUnreachable && !retried) {
+         socket_monitor_.ReadErrors();
+         retried = true;
+         continue;
+      }
+
+      // No route to |addr|: the resolver hears of it as of an ICMP error
+      if (error == SocketMonitor::kUnreachable) {
+         SocketMonitor::SentError sent_error;
+         sent_error.to_ = addr;
+         memcpy(&sent_error.id_, data, sizeof(sent_error.id_));
+         socket_monitor_.PushError(sent_error);
+      }
+      socket_monitor_.CountError(error);
+      return;
+   }
 }
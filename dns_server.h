@@ -16,90 +16,245 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include <list>
+#include <atomic>
+#include <map>
+#include <string>
 
 #include "checksum.h"
 #include "smartalloc.h"
 
+#include "acl.h"
+#include "admission.h"
+#include "arena.h"
+#include "clock.h"
 #include "dns_packet.h"
 #include "dns_cache.h"
+#include "infra_cache.h"
+#include "latency_stats.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "query_log.h"
+#include "query_trace.h"
+#include "rate_limiter.h"
+#include "resolver.h"
+#include "scheduler.h"
+#include "shared_cache.h"
+#include "slab_arena.h"
+#include "socket_monitor.h"
+#include "task.h"
+#include "tcp_connection_pool.h"
 #include "udp_server.h"
 
-class DnsServer : public UdpServer {
+// The recursive server: reads client queries and upstream responses off one
+// UDP socket (and upstream TCP connections), answers what it can from cache,
+// and starts a Resolver task for the rest.
+//
+// Optionally, a Pipeline does the socket I/O and the answering from cache on
+// threads of its own, and the event loop only sees cache misses and
+// upstream responses. The resolver stays on the event loop's thread.
+class DnsServer : public UdpServer, public Transport,
+                  public Pipeline::Handler {
   public:
-   DnsServer();
-   virtual ~DnsServer();
+   struct Options : public Resolver::Options {
+      Options();
 
-   struct QueryInfo {
-      QueryInfo(DnsQuery& query, RRVec& authority_rrs, RRVec& additional_rrs);
+      // UDP port clients query; processes sharing a cache each need
+      // their own, as upstream responses come back to it
+      int port_;
 
-      DnsQuery query_;
-      RRVec authority_rrs_;
-      RRVec additional_rrs_;
-   };
+      // Bytes of socket buffer to ask the kernel for; its defaults if 0
+      int rcvbuf_;
+      int sndbuf_;
 
-   typedef std::list<QueryInfo, STLsmartalloc<QueryInfo> > QueryInfoList;
+      // What backs the cache's memory
+      SlabArena::HugePages cache_huge_pages_;
 
-   struct ClientInfo {
-      ClientInfo(struct sockaddr_in6 client_addr, uint16_t id, DnsQuery& query,
-            RRVec& authority_rrs, RRVec& additional_rrs);
+      // Shared memory segment to cache in alongside other processes, and
+      // its size in RRsets if this process creates it. No sharing if empty.
+      std::string shared_cache_name_;
+      uint32_t shared_cache_slots_;
 
-      struct sockaddr_in6 client_addr_;
-      uint16_t id_;   // network order
-      time_t timeout_; // host order
-      QueryInfoList query_info_list_;
+      // Threads of each pipeline stage; no pipeline unless |use_pipeline_|
+      bool use_pipeline_;
+      Pipeline::Options pipeline_;
+
+      // How the event loop orders its work
+      Scheduler::Options scheduler_;
+
+      // Limits on recursions
+      AdmissionControl::Options admission_;
+
+      // Limits on responses; off unless it has a rate
+      RateLimiter::Options rrl_;
+
+      // File of client access rules (see Acl::Load); everyone may query
+      // if empty
+      std::string acl_path_;
+
+      // File of root hints (see DnsCache::LoadRootHints); IANA's root
+      // servers if empty
+      std::string root_hints_path_;
 
-      // Compare ids
-      bool operator==(const uint16_t id) const;
+      // Time each stage of answering queries (see LatencyStats)
+      bool latency_stats_;
 
-      // Compare ClientInfos by timeout, reverse. This is so a low timeout
-      // (i.e. ending soon) will put the ClientInfo at the top of the heap.
-      bool operator<(const struct ClientInfo& client_info) const;
+      // Loopback port to serve Prometheus metrics on; none if 0
+      int metrics_port_;
+
+      // Where to log responses to clients (see QueryLog::Open); no log if
+      // empty
+      std::string query_log_path_;
+
+      // Where to write traces of resolutions (see Tracer::Open), in what
+      // format, and which: every Nth, and those taking at least slow ms
+      // (0 for neither). No tracing if the path is empty.
+      std::string trace_path_;
+      Tracer::Format trace_format_;
+      int trace_sample_;
+      int trace_slow_ms_;
+
+      // What timers and TTLs run on; the system's if NULL
+      const Clock* clock_;
    };
 
-   typedef std::vector<ClientInfo, STLsmartalloc<ClientInfo> > ClientInfoVec;
+   // A client query being resolved, and the table of them (client ->
+   // when it arrived) that catches retransmissions
+   struct ClientKey {
+      ClientKey(const struct sockaddr_in6& client_addr, uint16_t id);
+
+      struct sockaddr_in6 client_addr_;
+      uint16_t id_;   // network order, as the client sent it
 
-   // Update the timeout of the specified ClientInfo (by id) to NOW + 2 seconds.
-   // Also sort the list, so that the lowest timeout is on top.
-   // Return true if the update was successful (it always should be).
-   bool UpdateTimeout(uint16_t id);
+      bool operator<(const ClientKey& key) const;
+   };
 
-   RRVec::iterator FindNameserverIp(DnsResourceRecord& auth_rr,
-                                    RRVec& addl_rrs,
-                                    bool v4);
+   typedef std::map<ClientKey, uint64_t, std::less<ClientKey>,
+         STLsmartalloc<std::pair<const ClientKey, uint64_t> > > ClientMap;
 
-   ClientInfoVec::iterator GetClient(uint16_t id);
-   bool RemoveClient(uint16_t id);
-   bool RemoveClient(ClientInfoVec::iterator it);
+   DnsServer(const Options& options);
+   virtual ~DnsServer();
 
    void Run();
-   bool Resolve(DnsQuery& query, uint16_t id, uint16_t* response_code);
 
-   int ReadIntoBuffer(struct sockaddr* client_addr, socklen_t* client_addr_len);
+   // Transport
+   virtual void SendUdp(const struct sockaddr_in6& addr, const char* packet,
+         int len);
+   virtual bool SendTcp(const struct sockaddr_in6& addr, const char* packet,
+         int len, uint16_t id, uint64_t now_ms);
 
-   // Sends the top query of a ClientInfo upstream, after possible pushing
-   // more queries to resolve (such as A records of NS). Returns true if a
-   // query was sent upstream, false if the client ran out of authorities to
-   // try (all SOAs).
-   bool SendQueryUpstream(ClientInfo* client_info);
+   // Pipeline::Handler. Runs on the pipeline's worker threads.
+   virtual bool AnswerQuery(Datagram* query, Datagram* reply, Arena* arena);
 
-   // Sends a DnsQuery to an upstream server, fills in addr info (TODO i6)
-   void SendQueryUpstream(struct sockaddr* addr, socklen_t addrlen,
-         DnsQuery& query, uint16_t id);
+   // Prints resolver and upstream connection statistics.
+   void PrintStats(FILE* out) const;
 
-   // Caches all resource records of a packet.
-   bool CacheAllResourceRecords(DnsPacket& packet);
-   bool CacheAllResourceRecords(DnsPacket& packet, DnsQuery& query);
+   // Has the event loop reread the ACL file, and put the new rules in
+   // place if they parse. Safe to call from a signal handler.
+   void ReloadAcl() { reload_acl_.store(true, std::memory_order_relaxed); }
 
-   // Sends buf_ to the specified address.
-   void SendBufferToAddr(struct sockaddr* addr, socklen_t addrlen, int datalen);
+   // Has the event loop print the latency histograms to stdout, while the
+   // pipeline's threads go on answering. Safe to call from a signal handler.
+   void DumpLatency() {
+      dump_latency_.store(true, std::memory_order_relaxed);
+   }
 
   private:
+   // Answers a client query (sitting in buf_) from cache, or starts
+   // resolving it if admission control lets it. |queued_us| is how long it
+   // waited to be handled; |received_ns| is when it was read. If
+   // |cache_missed|, a lookup has missed it already and is not repeated.
+   void HandleClientQuery(DnsPacket& packet, struct sockaddr_in6& client_addr,
+         uint64_t queued_us, uint64_t received_ns, bool cache_missed);
+
+   // Writes the answer to |packet| into |out| (at least 512 bytes) if the
+   // cache has it as of |now_ms|, or if the client did not ask for
+   // recursion. Returns its length, or 0. Thread-safe; |arena| holds the
+   // temporaries. With latency stats on, |*now_ns| is a recent
+   // LatencyStats::NowNs(), and is moved on to when the answer was ready,
+   // so the stages share clock reads.
+   int AnswerFromCache(DnsPacket& packet, DnsQuery& query, uint64_t now_ms,
+         Arena* arena, char* out, uint64_t* now_ns);
+
+   // Resolves |query| and answers the client that asked it.
+   DetachedTask ServeClient(struct sockaddr_in6 client_addr, uint16_t id,
+         uint16_t opcode, DnsQuery query, uint64_t received_ns);
+
+   // Queues what is waiting on the socket (or from the pipeline) with the
+   // scheduler.
+   void ReadDatagrams();
+
+   // What the ACL says about |client_addr|. Thread-safe.
+   Acl::Action ClientAction(const struct sockaddr_in6& client_addr);
+
+   // Loads the ACL file and swaps it in for the rules in use, which are
+   // freed once no thread can be reading them.
+   void SwapAcl();
+
+   // Handles one queued item: answers a client query from cache (if it is
+   // in the fast lane; a miss moves it to the slow lane), starts resolving
+   // it, or hands an upstream response to the resolver.
+   void Serve(Datagram* datagram, Scheduler::Lane lane);
+
+   // Sends buf_ to the specified address, unless the rate limiter drops it,
+   // and logs it. |received_ns| is when the query it answers was read.
+   void SendBufferToAddr(struct sockaddr* addr, socklen_t addrlen, int datalen,
+         uint64_t received_ns, QueryLog::Outcome outcome);
+
+   // Sends |len| bytes of |data| to |addr| on the UDP socket, dropping them
+   // if it is full. If |addr| cannot be reached, the resolver is told on
+   // the next turn of the event loop, as for an ICMP error.
+   void SendDatagram(const struct sockaddr_in6& addr, const char* data,
+         int len);
+
+   // Hands metrics_ the numbers only the event loop can read.
+   void PublishMetrics();
+
+   // Moves the event loop's time on: one clock read for both units
+   void ReadClock() {
+      now_us_ = clock_->NowUs();
+      now_ms_ = now_us_ / 1000;
+   }
+
+   // Temporaries of the client query being answered from cache
+   Arena request_arena_;
+
+   const Clock* const clock_;
+
+   // The event loop's time: read once before it waits, and once after, and
+   // used for everything it handles in between, from timers to the
+   // scheduler's queueing delays
+   uint64_t now_us_;
+   uint64_t now_ms_;
+
+   SocketMonitor socket_monitor_;
+   Pipeline* pipeline_;
+   Scheduler scheduler_;
+   AdmissionControl admission_;
+   RateLimiter rrl_;
+   LatencyStats latency_;
+   std::atomic<bool> dump_latency_;
+   Metrics metrics_;
+   QueryLog query_log_;
+   Tracer tracer_;
+
+   // Client access rules, replaced whole; NULL if there are none
+   const std::string acl_path_;
+   std::atomic<Acl*> acl_;
+   std::atomic<bool> reload_acl_;
+   std::atomic<uint64_t> acl_refused_;      // also counted by workers
+   uint64_t acl_kept_from_recursion_;
+
+   SharedCache* shared_cache_;
    DnsCache* cache_;
+   InfraCache* infra_;
+   TcpConnectionPool* tcp_pool_;
+   Resolver* resolver_;
 
-   ClientInfoVec client_info_vec_;
+   // Client queries being resolved -> when they arrived
+   ClientMap clients_;
 
-   char buf_[ETH_DATA_LEN];
+   // Large enough for a response read over TCP
+   char buf_[65535];
 
    const int port_;
    const std::string port_str_;
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "epoch.h"
+
+// static
+EpochManager* EpochManager::Instance() {
+   static EpochManager manager;
+   return &manager;
+}
+
+EpochManager::EpochManager()
+      : epoch_(0) {
+   for (int i = 0; i < kMaxThreads; ++i) {
+      slots_[i].state_.store(0, std::memory_order_relaxed);
+      slots_[i].taken_.store(false, std::memory_order_relaxed);
+   }
+}
+
+EpochManager::ThreadSlot::ThreadSlot()
+      : slot_(NULL),
+        depth_(0) {
+   EpochManager* manager = EpochManager::Instance();
+   for (int i = 0; i < kMaxThreads; ++i) {
+      bool taken = false;
+      if (manager->slots_[i].taken_.compare_exchange_strong(taken, true)) {
+         slot_ = &manager->slots_[i];
+         return;
+      }
+   }
+
+   fprintf(stderr, "More than %d threads reading epoch-protected data\n",
+         kMaxThreads);
+   exit(EXIT_FAILURE);
+}
+
+EpochManager::ThreadSlot::~ThreadSlot() {
+   slot_->state_.store(0, std::memory_order_release);
+   slot_->taken_.store(false, std::memory_order_release);
+}
+
+EpochManager::ThreadSlot* EpochManager::Local() {
+   static thread_local ThreadSlot slot;
+   return &slot;
+}
+
+void EpochManager::Enter() {
+   ThreadSlot* local = Local();
+   if (local->depth_++)
+      return;
+
+   local->slot_->state_.store(epoch_.load(std::memory_order_relaxed) << 1 | 1,
+         std::memory_order_seq_cst);
+
+   // The announcement must be visible before anything the reader loads
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void EpochManager::Exit() {
+   ThreadSlot* local = Local();
+   if (--local->depth_)
+      return;
+
+   local->slot_->state_.store(0, std::memory_order_release);
+}
+
+bool EpochManager::Reclaimable(uint64_t retired) {
+   while (epoch() < retired + 2) {
+      if (!TryAdvance())
+         return false;
+   }
+
+   return true;
+}
+
+bool EpochManager::TryAdvance() {
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+
+   // Readers that entered at an older epoch may still see what was unlinked
+   // in it
+   for (int i = 0; i < kMaxThreads; ++i) {
+      if (!slots_[i].taken_.load(std::memory_order_acquire))
+         continue;
+
+      uint64_t state = slots_[i].state_.load(std::memory_order_seq_cst);
+      if ((state & 1) && state >> 1 != epoch)
+         return false;
+   }
+
+   // Losing the race means another thread advanced it
+   epoch_.compare_exchange_strong(epoch, epoch + 1);
+   return true;
+}
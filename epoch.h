@@ -0,0 +1,78 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// Epoch-based reclamation, for structures whose readers take no locks.
+// Readers bracket each lookup with Enter() and Exit(), which are wait-free:
+// each is a store to the thread's own slot. A writer that unlinks an object
+// retires it at the current epoch() and frees it once Reclaimable() says no
+// reader can still hold it, i.e. every reader active since then has moved
+// on at least two epochs.
+//
+// One instance per process; each thread takes a slot the first time it
+// enters, and gives it back when it exits.
+class EpochManager {
+  public:
+   static const int kMaxThreads = 128;
+
+   static EpochManager* Instance();
+
+   // Starts and ends a read-side critical section. They nest.
+   void Enter();
+   void Exit();
+
+   uint64_t epoch() const { return epoch_.load(std::memory_order_acquire); }
+
+   // True if what was retired at |retired| may be freed. Advances the epoch
+   // first, if every active reader has caught up with it.
+   bool Reclaimable(uint64_t retired);
+
+  private:
+   // A reader's announcement: the epoch it entered at, shifted up one, with
+   // the low bit set while it is inside a critical section
+   struct alignas(64) Slot {
+      std::atomic<uint64_t> state_;
+      std::atomic<bool> taken_;
+   };
+
+   // Gives the calling thread's slot back when the thread exits
+   struct ThreadSlot {
+      ThreadSlot();
+      ~ThreadSlot();
+
+      Slot* slot_;
+      int depth_;
+   };
+
+   EpochManager();
+
+   ThreadSlot* Local();
+
+   // Moves the epoch on, unless a reader is still in an older one. Returns
+   // false if one is.
+   bool TryAdvance();
+
+   std::atomic<uint64_t> epoch_;
+   Slot slots_[kMaxThreads];
+
+   EpochManager(const EpochManager&);
+   void operator=(const EpochManager&);
+};
+
+// Holds a read-side critical section for its scope.
+class EpochGuard {
+  public:
+   EpochGuard() { EpochManager::Instance()->Enter(); }
+   ~EpochGuard() { EpochManager::Instance()->Exit(); }
+
+  private:
+   EpochGuard(const EpochGuard&);
+   void operator=(const EpochGuard&);
+};
+
+#endif   // _EPOCH_H_
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "frame_pool.h"
+
+FramePool* FramePool::Instance() {
+   static FramePool pool;
+   return &pool;
+}
+
+FramePool::FramePool() {
+   memset(free_lists_, 0, sizeof(free_lists_));
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+FramePool::~FramePool() {
+   for (size_t i = 0; i < kClasses; ++i) {
+      while (free_lists_[i]) {
+         FreeFrame* frame = free_lists_[i];
+         free_lists_[i] = frame->next_;
+         free(frame);
+      }
+   }
+}
+
+void* FramePool::Allocate(size_t size) {
+   stats_.allocations++;
+   stats_.outstanding++;
+   stats_.bytes_outstanding += size;
+   if (stats_.outstanding > stats_.peak_outstanding)
+      stats_.peak_outstanding = stats_.outstanding;
+
+   if (size > kMaxPooledSize) {
+      stats_.oversized++;
+      void* p = malloc(size);
+      MALLOCCHECK(p);
+      return p;
+   }
+
+   size_t clz = (size + kGranularity - 1) / kGranularity - 1;
+   if (free_lists_[clz]) {
+      FreeFrame* frame = free_lists_[clz];
+      free_lists_[clz] = frame->next_;
+      stats_.reused++;
+      return frame;
+   }
+
+   size_t rounded = (clz + 1) * kGranularity;
+   void* p = malloc(rounded);
+   MALLOCCHECK(p);
+
+   stats_.bytes_reserved += rounded;
+   return p;
+}
+
+void FramePool::Free(void* p, size_t size) {
+   stats_.outstanding--;
+   stats_.bytes_outstanding -= size;
+
+   if (size > kMaxPooledSize) {
+      free(p);
+      return;
+   }
+
+   size_t clz = (size + kGranularity - 1) / kGranularity - 1;
+   FreeFrame* frame = (FreeFrame*) p;
+   frame->next_ = free_lists_[clz];
+   free_lists_[clz] = frame;
+}
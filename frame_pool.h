@@ -0,0 +1,50 @@
+#ifndef _FRAME_POOL_H_
+#define _FRAME_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "smartalloc.h"
+
+// Allocator for coroutine frames. Frames are rounded up to a size class and
+// returned to a per-class free list when the coroutine finishes, so a busy
+// resolver reuses the same few hundred frames instead of going to malloc for
+// every task. Frames larger than the biggest class go straight to malloc.
+//
+// Not thread-safe; the resolver runs on one thread.
+class FramePool {
+  public:
+   struct Stats {
+      uint64_t allocations;
+      uint64_t reused;        // allocations served from a free list
+      uint64_t oversized;     // allocations too big to pool
+      uint64_t outstanding;   // frames currently alive
+      uint64_t peak_outstanding;
+      uint64_t bytes_reserved; // held by the pool, in use or free
+      uint64_t bytes_outstanding; // in frames currently alive
+   };
+
+   static FramePool* Instance();
+
+   void* Allocate(size_t size);
+   void Free(void* p, size_t size);
+
+   const Stats& stats() const { return stats_; }
+
+  private:
+   static const size_t kGranularity = 64;
+   static const size_t kMaxPooledSize = 16384;
+   static const size_t kClasses = kMaxPooledSize / kGranularity;
+
+   struct FreeFrame {
+      FreeFrame* next_;
+   };
+
+   FramePool();
+   ~FramePool();
+
+   FreeFrame* free_lists_[kClasses];
+   Stats stats_;
+};
+
+#endif   // _FRAME_POOL_H_
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "histogram.h"
+
+Histogram::Histogram() {
+   Clear();
+}
+
+void Histogram::Record(uint64_t value) {
+   Add(&counts_[IndexOf(value)], 1);
+   if (!Load(count_) || value < Load(min_))
+      min_.store(value, std::memory_order_relaxed);
+   if (value > Load(max_))
+      max_.store(value, std::memory_order_relaxed);
+   Add(&sum_, value);
+   Add(&count_, 1);
+}
+
+void Histogram::Merge(const Histogram& other) {
+   uint64_t other_count = other.count();
+   if (!other_count)
+      return;
+
+   for (int i = 0; i < kBuckets; ++i)
+      Add(&counts_[i], Load(other.counts_[i]));
+   if (!Load(count_) || Load(other.min_) < Load(min_))
+      min_.store(Load(other.min_), std::memory_order_relaxed);
+   if (Load(other.max_) > Load(max_))
+      max_.store(Load(other.max_), std::memory_order_relaxed);
+   Add(&sum_, Load(other.sum_));
+   Add(&count_, other_count);
+}
+
+void Histogram::Clear() {
+   for (int i = 0; i < kBuckets; ++i)
+      counts_[i].store(0, std::memory_order_relaxed);
+   count_.store(0, std::memory_order_relaxed);
+   sum_.store(0, std::memory_order_relaxed);
+   min_.store(0, std::memory_order_relaxed);
+   max_.store(0, std::memory_order_relaxed);
+}
+
+double Histogram::mean() const {
+   uint64_t count = Load(count_);
+   return count ? (double) Load(sum_) / count : 0;
+}
+
+uint64_t Histogram::Percentile(double fraction) const {
+   uint64_t count = Load(count_);
+   uint64_t max = Load(max_);
+   if (!count)
+      return 0;
+
+   uint64_t rank = (uint64_t) (fraction * count + 0.5);
+   if (rank < 1)
+      rank = 1;
+
+   uint64_t seen = 0;
+   for (int i = 0; i < kBuckets; ++i) {
+      seen += Load(counts_[i]);
+      if (seen >= rank) {
+         uint64_t bound = UpperBound(i);
+         return bound < max ? bound : max;
+      }
+   }
+
+   // Read while being written: the buckets fell short of the count
+   return max;
+}
+
+void Histogram::Print(FILE* out, double scale) const {
+   uint64_t count = Load(count_);
+   uint64_t seen = 0;
+   for (int i = 0; i < kBuckets; ++i) {
+      uint64_t bucket = Load(counts_[i]);
+      if (!bucket)
+         continue;
+
+      seen += bucket;
+      fprintf(out, "%12.3f %10llu %9.6f\n", UpperBound(i) / scale,
+            (unsigned long long) bucket, (double) seen / count);
+   }
+}
+
+// static
+int Histogram::IndexOf(uint64_t value) {
+   // Values below 2 * kSubBuckets get a bucket each; above, each power of
+   // two is split kSubBuckets ways
+   if (value < 2 * kSubBuckets)
+      return value;
+
+   int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+   return (shift + 1) * kSubBuckets + (value >> shift) - kSubBuckets;
+}
+
+// static
+uint64_t Histogram::UpperBound(int index) {
+   if (index < 2 * kSubBuckets)
+      return index;
+
+   int shift = index / kSubBuckets - 1;
+   uint64_t sub = index % kSubBuckets + kSubBuckets;
+   return ((sub + 1) << shift) - 1;
+}
@@ -0,0 +1,73 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// A latency histogram in the manner of HdrHistogram: buckets are linear
+// within each power of two and double in width from one power to the
+// next, so every value is kept to within 1/kSubBuckets (about 3%) of
+// itself, from 1 to 2^64, in a fixed 15 KiB. Recording is an index
+// computation and an increment. Units are the caller's.
+//
+// One thread records into a histogram; any thread may read it (Merge(),
+// Percentile(), ...) meanwhile, and sees it as it was a moment ago, never
+// torn. The counters are relaxed atomics that the writer only loads and
+// stores, so recording costs what it would with plain integers. Give each
+// recording thread its own and Merge() them.
+class Histogram {
+  public:
+   Histogram();
+
+   void Record(uint64_t value);
+   void Merge(const Histogram& other);
+   void Clear();
+
+   // The smallest recorded value at or above |fraction| (0 to 1) of them,
+   // to the histogram's precision. 0 if it is empty.
+   uint64_t Percentile(double fraction) const;
+
+   uint64_t count() const { return Load(count_); }
+   uint64_t min() const { return count() ? Load(min_) : 0; }
+   uint64_t max() const { return Load(max_); }
+   double mean() const;
+
+   // Prints one line per non-empty bucket: its upper bound divided by
+   // |scale|, its count, and the fraction of values at or below it.
+   void Print(FILE* out, double scale) const;
+
+  private:
+   static const int kSubBucketBits = 5;
+   static const int kSubBuckets = 1 << kSubBucketBits;
+   static const int kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+   static int IndexOf(uint64_t value);
+
+   static uint64_t Load(const std::atomic<uint64_t>& counter) {
+      return counter.load(std::memory_order_relaxed);
+   }
+
+   // By the one writer: no read-modify-write needed
+   static void Add(std::atomic<uint64_t>* counter, uint64_t n) {
+      counter->store(Load(*counter) + n, std::memory_order_relaxed);
+   }
+
+   // The largest value that lands in bucket |index|
+   static uint64_t UpperBound(int index);
+
+   std::atomic<uint64_t> counts_[kBuckets];
+   std::atomic<uint64_t> count_;
+   std::atomic<uint64_t> sum_;
+   std::atomic<uint64_t> min_;
+   std::atomic<uint64_t> max_;
+
+   Histogram(const Histogram&);
+   void operator=(const Histogram&);
+};
+
+#endif   // _HISTOGRAM_H_
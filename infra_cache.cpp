@@ -0,0 +1,192 @@
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "infra_cache.h"
+
+namespace {
+// Assumed for servers we have never heard from.
+const uint32_t kUnknownSrttMs = 376;
+const uint32_t kInitialRtoMs = 1000;
+
+const uint32_t kMinRtoMs = 50;
+const uint32_t kMaxRtoMs = 4000;
+
+// Timeouts double the RTO and selection RTT at most this many times.
+const uint32_t kMaxBackoffShift = 5;
+
+// Unknown candidates (no glue) rank behind this.
+const uint32_t kNoAddressRttMs = 0xFFFFFFFF;
+
+// Entries not updated for this long are forgotten, so a server that was
+// down gets a fresh chance.
+const uint64_t kEntryTtlMs = 15 * 60 * 1000;
+
+const size_t kMaxEntries = 100000;
+
+uint32_t Backoff(uint32_t ms, uint32_t timeouts) {
+   uint64_t backed_off = (uint64_t) ms <<
+         (timeouts < kMaxBackoffShift ? timeouts : kMaxBackoffShift);
+   return backed_off > 0xFFFFFFF0 ? 0xFFFFFFF0 : backed_off;
+}
+}
+
+InfraCache::InfraCache(double explore_probability)
+      : explore_probability_(explore_probability) {
+}
+
+void InfraCache::RecordRtt(const struct in6_addr& addr,
+                           uint32_t rtt_ms,
+                           uint64_t now_ms) {
+   ServerInfo* info = Get(addr, now_ms);
+
+   if (!info->responses_) {
+      info->srtt_ms_ = rtt_ms;
+      info->rttvar_ms_ = rtt_ms / 2;
+   } else {
+      uint32_t delta = info->srtt_ms_ > rtt_ms ? info->srtt_ms_ - rtt_ms :
+            rtt_ms - info->srtt_ms_;
+      info->rttvar_ms_ = (3 * info->rttvar_ms_ + delta) / 4;
+      info->srtt_ms_ = (7 * info->srtt_ms_ + rtt_ms) / 8;
+   }
+
+   info->responses_++;
+   info->consecutive_timeouts_ = 0;
+
+   LOG << "RTT sample " << rtt_ms << " ms, srtt now " << info->srtt_ms_ <<
+         " ms" << std::endl;
+}
+
+void InfraCache::RecordTimeout(const struct in6_addr& addr, uint64_t now_ms) {
+   ServerInfo* info = Get(addr, now_ms);
+   info->consecutive_timeouts_++;
+   info->total_timeouts_++;
+}
+
+void InfraCache::RecordEdns(const struct in6_addr& addr,
+                            EdnsStatus edns,
+                            uint64_t now_ms) {
+   Get(addr, now_ms)->edns_ = edns;
+}
+
+uint32_t InfraCache::SelectionRttMs(const struct in6_addr& addr,
+                                    uint64_t now_ms) const {
+   const ServerInfo* info = Lookup(addr, now_ms);
+   if (!info)
+      return kUnknownSrttMs;
+
+   uint32_t srtt = info->responses_ ? info->srtt_ms_ : kUnknownSrttMs;
+   return Backoff(srtt, info->consecutive_timeouts_);
+}
+
+uint32_t InfraCache::RetransmitTimeoutMs(const struct in6_addr& addr,
+                                         uint64_t now_ms) const {
+   const ServerInfo* info = Lookup(addr, now_ms);
+   uint32_t rto = kInitialRtoMs;
+   uint32_t timeouts = 0;
+
+   if (info) {
+      if (info->responses_)
+         rto = info->srtt_ms_ + 4 * info->rttvar_ms_;
+      timeouts = info->consecutive_timeouts_;
+   }
+
+   rto = Backoff(rto, timeouts);
+
+   if (rto < kMinRtoMs)
+      return kMinRtoMs;
+   if (rto > kMaxRtoMs)
+      return kMaxRtoMs;
+   return rto;
+}
+
+uint32_t InfraCache::HedgeDelayMs(const struct in6_addr& addr,
+                                  uint64_t now_ms) const {
+   const ServerInfo* info = Lookup(addr, now_ms);
+   uint32_t delay = kUnknownSrttMs;
+
+   if (info && info->responses_)
+      delay = info->srtt_ms_ + 2 * info->rttvar_ms_;
+
+   return delay < kMinRtoMs ? kMinRtoMs : delay;
+}
+
+int InfraCache::Select(const std::vector<const struct in6_addr*>& candidates,
+                       uint64_t now_ms) {
+   if (candidates.empty())
+      return -1;
+
+   if (candidates.size() > 1 &&
+       random() < explore_probability_ * RAND_MAX) {
+      LOG << "Exploring a random authority" << std::endl;
+      return random() % candidates.size();
+   }
+
+   int best = 0;
+   uint32_t best_rtt = 0;
+   int ties = 0;
+
+   for (size_t i = 0; i < candidates.size(); ++i) {
+      uint32_t rtt = candidates[i] ?
+            SelectionRttMs(*candidates[i], now_ms) : kNoAddressRttMs;
+
+      if (!i || rtt < best_rtt) {
+         best = i;
+         best_rtt = rtt;
+         ties = 1;
+      } else if (rtt == best_rtt && !(random() % ++ties)) {
+         // Reservoir sample among equally good candidates, so unmeasured
+         // servers share the load
+         best = i;
+      }
+   }
+
+   return best;
+}
+
+const InfraCache::ServerInfo* InfraCache::Lookup(const struct in6_addr& addr,
+                                                 uint64_t now_ms) const {
+   ServerMap::const_iterator it = servers_.find(addr);
+   if (it == servers_.end() || now_ms - it->second.updated_ms_ > kEntryTtlMs)
+      return NULL;
+
+   return &it->second;
+}
+
+InfraCache::ServerInfo* InfraCache::Get(const struct in6_addr& addr,
+                                        uint64_t now_ms) {
+   ServerMap::iterator it = servers_.find(addr);
+
+   if (it == servers_.end()) {
+      // Make room by dropping stale entries, or an arbitrary one if none are
+      if (servers_.size() >= kMaxEntries) {
+         ServerMap::iterator it2 = servers_.begin();
+         while (it2 != servers_.end()) {
+            if (now_ms - it2->second.updated_ms_ > kEntryTtlMs)
+               servers_.erase(it2++);
+            else
+               ++it2;
+         }
+
+         if (servers_.size() >= kMaxEntries)
+            servers_.erase(servers_.begin());
+      }
+
+      it = servers_.insert(std::pair<const struct in6_addr, ServerInfo>(
+            addr, ServerInfo())).first;
+      memset(&it->second, 0, sizeof(ServerInfo));
+   } else if (now_ms - it->second.updated_ms_ > kEntryTtlMs) {
+      memset(&it->second, 0, sizeof(ServerInfo));
+   }
+
+   it->second.updated_ms_ = now_ms;
+   return &it->second;
+}
@@ -0,0 +1,90 @@
+#ifndef _INFRA_CACHE_H_
+#define _INFRA_CACHE_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+#include "smartalloc.h"
+
+// What we have learned about each upstream server, keyed by address: a
+// smoothed round trip time and its variance (Jacobson/Karels, as in TCP),
+// timeout counts and EDNS support. Used to pick which authority to ask next
+// and how long to wait for it before giving up.
+class InfraCache {
+  public:
+   enum EdnsStatus {
+      kEdnsUnknown,
+      kEdnsSupported,
+      kEdnsUnsupported
+   };
+
+   struct ServerInfo {
+      uint32_t srtt_ms_;
+      uint32_t rttvar_ms_;
+      uint32_t consecutive_timeouts_;
+      uint64_t total_timeouts_;
+      uint64_t responses_;
+      EdnsStatus edns_;
+      uint64_t updated_ms_;   // entries this old are forgotten
+   };
+
+   // |explore_probability| is the chance Select() ignores the statistics and
+   // picks a random candidate, so that servers that were slow once get
+   // re-measured.
+   InfraCache(double explore_probability);
+
+   void RecordRtt(const struct in6_addr& addr, uint32_t rtt_ms,
+         uint64_t now_ms);
+   void RecordTimeout(const struct in6_addr& addr, uint64_t now_ms);
+   void RecordEdns(const struct in6_addr& addr, EdnsStatus edns,
+         uint64_t now_ms);
+
+   // Expected round trip to |addr|, penalized by recent timeouts. Servers we
+   // know nothing about get a middling default so they are tried before
+   // servers known to be slow.
+   uint32_t SelectionRttMs(const struct in6_addr& addr, uint64_t now_ms) const;
+
+   // How long to wait for |addr| before moving on: SRTT + 4 * RTTVAR, doubled
+   // for every consecutive timeout and clamped.
+   uint32_t RetransmitTimeoutMs(const struct in6_addr& addr,
+         uint64_t now_ms) const;
+
+   // How long to give |addr| before hedging: its usual worst case round trip,
+   // SRTT + 2 * RTTVAR.
+   uint32_t HedgeDelayMs(const struct in6_addr& addr, uint64_t now_ms) const;
+
+   // Returns the index of the candidate to query next: usually the one with
+   // the lowest SelectionRttMs() (ties broken at random), occasionally a
+   // random one. Candidates without a known address should be given as
+   // NULL; they are only picked if every other candidate is.
+   int Select(const std::vector<const struct in6_addr*>& candidates,
+         uint64_t now_ms);
+
+   // Returns NULL if there is no fresh entry for |addr|.
+   const ServerInfo* Lookup(const struct in6_addr& addr, uint64_t now_ms) const;
+
+   int size() const { return servers_.size(); }
+
+  private:
+   struct AddrLess {
+      bool operator()(const struct in6_addr& a, const struct in6_addr& b) const {
+         return memcmp(&a, &b, sizeof(struct in6_addr)) < 0;
+      }
+   };
+
+   typedef std::map<struct in6_addr, ServerInfo, AddrLess,
+         STLsmartalloc<std::pair<const struct in6_addr, ServerInfo> > >
+         ServerMap;
+
+   // Finds or creates the entry for |addr|, resetting it if it went stale.
+   ServerInfo* Get(const struct in6_addr& addr, uint64_t now_ms);
+
+   const double explore_probability_;
+   ServerMap servers_;
+};
+
+#endif   // _INFRA_CACHE_H_
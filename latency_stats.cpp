@@ -0,0 +1,156 @@
+#include <arpa/inet.h>
+#include <time.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "latency_stats.h"
+
+namespace {
+// Percentiles Print() shows
+const double kFractions[] = { 0.5, 0.9, 0.99, 0.999 };
+const int kNumFractions = sizeof(kFractions) / sizeof(kFractions[0]);
+
+void PrintLine(FILE* out, const char* name, const Histogram& histogram,
+               double scale) {
+   fprintf(out, "  %-16s %10llu", name,
+         (unsigned long long) histogram.count());
+   for (int i = 0; i < kNumFractions; ++i)
+      fprintf(out, " %9.1f", histogram.Percentile(kFractions[i]) / scale);
+   fprintf(out, " %9.1f\n", histogram.max() / scale);
+}
+
+void PrintHeader(FILE* out, const char* title) {
+   fprintf(out, "%-18s %10s %9s %9s %9s %9s %9s\n", title, "count", "p50",
+         "p90", "p99", "p99.9", "max");
+}
+}
+
+LatencyStats::LatencyStats(bool enabled)
+      : enabled_(enabled),
+        servers_(NULL) {
+   if (enabled_) {
+      servers_ = new ServerTable<std::atomic<Histogram*> >(kServerSlots,
+            kMaxServers);
+      MALLOCCHECK(servers_);
+   }
+}
+
+LatencyStats::~LatencyStats() {
+   if (servers_) {
+      servers_->ForEach([](const struct in6_addr&,
+                           const std::atomic<Histogram*>& rtt) {
+         delete rtt.load(std::memory_order_relaxed);
+      });
+      delete servers_;
+   }
+}
+
+void LatencyStats::Record(Stage stage, uint64_t ns) {
+   Recorder* recorder = recorders_.Local();
+   if (recorder)
+      recorder->stages_[stage].Record(ns);
+}
+
+void LatencyStats::RecordUpstreamRtt(const struct in6_addr& addr,
+                                     uint32_t rtt_ms) {
+   all_servers_.Record(rtt_ms);
+
+   std::atomic<Histogram*>* entry = servers_->Find(addr);
+   if (!entry) {
+      other_servers_.Record(rtt_ms);
+      return;
+   }
+
+   // A server not seen before
+   Histogram* rtt = entry->load(std::memory_order_relaxed);
+   if (!rtt) {
+      rtt = new Histogram;
+      MALLOCCHECK(rtt);
+      entry->store(rtt, std::memory_order_release);
+   }
+   rtt->Record(rtt_ms);
+}
+
+void LatencyStats::Print(FILE* out) const {
+   if (!enabled_)
+      return;
+
+   Histogram merged;
+   PrintHeader(out, "Latency (us)");
+   for (int stage = 0; stage < kStages; ++stage) {
+      merged.Clear();
+      recorders_.ForEach([&](const Recorder& recorder) {
+         merged.Merge(recorder.stages_[stage]);
+      });
+      PrintLine(out, StageName((Stage) stage), merged, 1000.0);
+   }
+
+   // Busiest servers first
+   struct Server {
+      uint64_t count_;
+      struct in6_addr addr_;
+      const Histogram* rtt_;
+   };
+   std::vector<Server> busiest;
+   servers_->ForEach([&](const struct in6_addr& addr,
+                         const std::atomic<Histogram*>& entry) {
+      const Histogram* rtt = entry.load(std::memory_order_acquire);
+      if (rtt) {
+         Server server = { rtt->count(), addr, rtt };
+         busiest.push_back(server);
+      }
+   });
+   std::sort(busiest.begin(), busiest.end(),
+         [](const Server& a, const Server& b) {
+      return a.count_ > b.count_;
+   });
+
+   PrintHeader(out, "Upstream RTT (ms)");
+   PrintLine(out, "all", all_servers_, 1.0);
+   for (size_t i = 0; i < busiest.size() && (int) i < kPrintedServers; ++i) {
+      char name[INET6_ADDRSTRLEN];
+      const struct in6_addr& addr = busiest[i].addr_;
+      if (IN6_IS_ADDR_V4MAPPED(&addr))
+         inet_ntop(AF_INET, &addr.s6_addr[12], name, sizeof(name));
+      else
+         inet_ntop(AF_INET6, &addr, name, sizeof(name));
+      PrintLine(out, name, *busiest[i].rtt_, 1.0);
+   }
+   if ((int) busiest.size() > kPrintedServers)
+      fprintf(out, "  (%llu more servers)\n",
+            (unsigned long long) (busiest.size() - kPrintedServers));
+   if (other_servers_.count())
+      PrintLine(out, "untracked", other_servers_, 1.0);
+}
+
+// static
+uint64_t LatencyStats::NowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// static
+const char* LatencyStats::StageName(Stage stage) {
+   switch (stage) {
+      case kKernelQueue:
+         return "kernel-queue";
+      case kReceiveToParse:
+         return "receive-parse";
+      case kCacheLookup:
+         return "cache-lookup";
+      case kEncode:
+         return "encode";
+      case kCacheAnswer:
+         return "total-cached";
+      case kResolvedAnswer:
+         return "total-resolved";
+      default:
+         return "?";
+   }
+}
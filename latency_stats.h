@@ -0,0 +1,88 @@
+#ifndef _LATENCY_STATS_H_
+#define _LATENCY_STATS_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+#include "histogram.h"
+#include "per_thread.h"
+#include "server_table.h"
+
+// Where the time goes in answering a query: a histogram of each stage of
+// the request path, in nanoseconds, and of the round trips to each upstream
+// server. Every thread records into histograms of its own, so recording
+// shares no cache lines and takes no locks; Print() merges them as they
+// stand while the threads carry on.
+//
+// Off unless enabled. Each timed point then costs a read of the monotonic
+// clock (vDSO, no system call) and a histogram increment.
+class LatencyStats {
+  public:
+   enum Stage {
+      kKernelQueue,      // query arrived -> read off the socket
+      kReceiveToParse,   // datagram read -> question parsed
+      kCacheLookup,      // DnsCache::Get()
+      kEncode,           // response built from its records
+      kCacheAnswer,      // datagram read -> answer from cache ready to send
+      kResolvedAnswer,   // datagram read -> resolved answer sent
+      kStages
+   };
+
+   LatencyStats(bool enabled);
+   ~LatencyStats();
+
+   bool enabled() const { return enabled_; }
+
+   // Records |ns| against |stage|, for the calling thread.
+   void Record(Stage stage, uint64_t ns);
+
+   // Records the time since |start_ns| (a NowNs()) against |stage|.
+   void RecordSince(Stage stage, uint64_t start_ns) {
+      Record(stage, NowNs() - start_ns);
+   }
+
+   // Records a round trip to |addr|. Called from one thread only (the
+   // resolver's).
+   void RecordUpstreamRtt(const struct in6_addr& addr, uint32_t rtt_ms);
+
+   // Prints percentiles of each stage, over all threads, and of the round
+   // trips to the busiest upstream servers. Thread-safe, but not safe to
+   // call from a signal handler (it allocates and uses stdio): a handler
+   // should have the event loop call it.
+   void Print(FILE* out) const;
+
+   static uint64_t NowNs();
+   static const char* StageName(Stage stage);
+
+  private:
+   // Upstream servers tracked one by one (of kServerSlots); the rest are
+   // counted together
+   static const int kServerSlots = 256;
+   static const int kMaxServers = 192;
+
+   // Servers Print() lists
+   static const int kPrintedServers = 10;
+
+   struct Recorder {
+      Histogram stages_[kStages];
+   };
+
+   const bool enabled_;
+   PerThread<Recorder> recorders_;
+
+   // NULL unless enabled. A server's histogram is allocated when it is
+   // first seen, so its entry is NULL for a moment after it is claimed.
+   ServerTable<std::atomic<Histogram*> >* servers_;
+   Histogram other_servers_;
+   Histogram all_servers_;
+
+   LatencyStats(const LatencyStats&);
+   void operator=(const LatencyStats&);
+};
+
+#endif   // _LATENCY_STATS_H_
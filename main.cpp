@@ -1,13 +1,16 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <iostream>
@@ -21,9 +24,256 @@
 
 DnsServer* server;
 
-void sigint_handler(int signum);
+void signal_handler(int signum);
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --hedge               ask a second authority if the first is slow\n"
+         "  --max-hedges=N        extra authorities asked per query (1)\n"
+         "  --hedge-budget=F      hedges per upstream query, on average (0.1)\n"
+         "  --huge-pages=MODE     back the cache with huge pages: none, thp\n"
+         "                        (transparent) or explicit (none)\n"
+         "  --port=N              UDP port to serve on (53)\n"
+         "  --rcvbuf=BYTES        its receive buffer (the kernel's default)\n"
+         "  --sndbuf=BYTES        its send buffer (the kernel's default)\n"
+         "  --shared-cache=NAME   also cache in shared memory segment NAME\n"
+         "                        (e.g. /dns_cache), with the other\n"
+         "                        processes attached to it\n"
+         "  --shared-cache-slots=N\n"
+         "                        RRsets the segment holds, if this process\n"
+         "                        creates it (65536)\n"
+         "  --pipeline=R,W,S      receive, answer from cache and send on R, W\n"
+         "                        and S threads of their own\n"
+         "  --fast-weight=N       cache hits served per resolver work item,\n"
+         "                        when both are queued (8)\n"
+         "  --slow-budget-ms=N    longest resolver work waits behind cache\n"
+         "                        hits (50)\n"
+         "  --max-recursions=N    recursions in flight at once (2000)\n"
+         "  --max-per-prefix=N    of them from one /24 or /56 (200)\n"
+         "  --max-queue-delay-ms=N\n"
+         "                        shed cache misses queued longer (200)\n"
+         "  --max-frame-mb=N      shed cache misses while recursions hold\n"
+         "                        more (64)\n"
+         "  --shed=ACTION         refuse or drop shed queries (refuse)\n"
+         "  --rrl=N               responses a second to one /24 or /56, per\n"
+         "                        name and kind of response (off)\n"
+         "  --rrl-burst=N         of them sent at once after a pause (N)\n"
+         "  --rrl-slip=N          send every Nth dropped response truncated,\n"
+         "                        0 never (2)\n"
+         "  --rrl-log-only        count what would be dropped, but send it\n"
+         "  --rrl-slots=N         buckets in the rate limiter's table (65536)\n"
+         "  --acl=FILE            client access rules, reread on SIGHUP\n"
+         "  --root-hints=FILE     root servers to start from, \"name address\"\n"
+         "                        a line (IANA's)\n"
+         "  --upstream-port=N     port to query authorities on (53)\n"
+         "  --latency-stats       time each stage of answering queries;\n"
+         "                        printed on SIGUSR1 and on exit\n"
+         "  --metrics-port=N      serve Prometheus metrics at\n"
+         "                        http://127.0.0.1:N/metrics (off)\n"
+         "  --query-log=PATH      log every response, in binary, to a file\n"
+         "                        or, as unix:PATH, a unix socket (off)\n"
+         "  --trace=FILE          append traces of resolutions to FILE: each\n"
+         "                        upstream send, response, timeout, cache\n"
+         "                        consult and nameserver lookup (off)\n"
+         "  --trace-format=FMT    json (a trace a line) or chrome (for\n"
+         "                        chrome://tracing or Perfetto) (json)\n"
+         "  --trace-sample=N      trace every Nth resolution (off)\n"
+         "  --trace-slow-ms=N     and every one taking N ms or more (off)\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
 
 int main(int argc, char** argv) {
+   DnsServer::Options options;
+
+   static struct option long_options[] = {
+      { "hedge",        no_argument,       NULL, 'h' },
+      { "max-hedges",   required_argument, NULL, 'm' },
+      { "hedge-budget", required_argument, NULL, 'b' },
+      { "huge-pages",   required_argument, NULL, 'p' },
+      { "port",         required_argument, NULL, 'P' },
+      { "rcvbuf",       required_argument, NULL, 'v' },
+      { "sndbuf",       required_argument, NULL, 'V' },
+      { "shared-cache", required_argument, NULL, 's' },
+      { "shared-cache-slots", required_argument, NULL, 'S' },
+      { "pipeline",     required_argument, NULL, 'l' },
+      { "fast-weight",  required_argument, NULL, 'w' },
+      { "slow-budget-ms", required_argument, NULL, 'B' },
+      { "max-recursions", required_argument, NULL, 'r' },
+      { "max-per-prefix", required_argument, NULL, 'x' },
+      { "max-queue-delay-ms", required_argument, NULL, 'q' },
+      { "max-frame-mb", required_argument, NULL, 'f' },
+      { "shed",         required_argument, NULL, 'd' },
+      { "rrl",          required_argument, NULL, 'R' },
+      { "rrl-burst",    required_argument, NULL, 'u' },
+      { "rrl-slip",     required_argument, NULL, 'i' },
+      { "rrl-log-only", no_argument,       NULL, 'o' },
+      { "rrl-slots",    required_argument, NULL, 't' },
+      { "acl",          required_argument, NULL, 'a' },
+      { "root-hints",   required_argument, NULL, 'H' },
+      { "upstream-port", required_argument, NULL, 'U' },
+      { "latency-stats", no_argument,      NULL, 'L' },
+      { "metrics-port", required_argument, NULL, 'M' },
+      { "query-log",    required_argument, NULL, 'Q' },
+      { "trace",        required_argument, NULL, 'T' },
+      { "trace-format", required_argument, NULL, 'F' },
+      { "trace-sample", required_argument, NULL, 'n' },
+      { "trace-slow-ms", required_argument, NULL, 'W' },
+      { NULL,           0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 'h':
+            options.hedge_ = true;
+            break;
+         case 'm':
+            options.max_hedges_ = atoi(optarg);
+            break;
+         case 'b':
+            options.hedge_budget_ = atof(optarg);
+            break;
+         case 'p':
+            if (!strcmp(optarg, "none"))
+               options.cache_huge_pages_ = SlabArena::kNoHugePages;
+            else if (!strcmp(optarg, "thp"))
+               options.cache_huge_pages_ = SlabArena::kTransparentHugePages;
+            else if (!strcmp(optarg, "explicit"))
+               options.cache_huge_pages_ = SlabArena::kExplicitHugePages;
+            else
+               usage(argv[0]);
+            break;
+         case 'P':
+            options.port_ = atoi(optarg);
+            if (options.port_ < 1 || options.port_ > 65535)
+               usage(argv[0]);
+            break;
+         case 'v':
+            options.rcvbuf_ = atoi(optarg);
+            if (options.rcvbuf_ < 1)
+               usage(argv[0]);
+            break;
+         case 'V':
+            options.sndbuf_ = atoi(optarg);
+            if (options.sndbuf_ < 1)
+               usage(argv[0]);
+            break;
+         case 's':
+            options.shared_cache_name_ = optarg;
+            break;
+         case 'S':
+            if (atoi(optarg) < 1)
+               usage(argv[0]);
+            options.shared_cache_slots_ = atoi(optarg);
+            break;
+         case 'l':
+            if (sscanf(optarg, "%d,%d,%d", &options.pipeline_.receivers_,
+                       &options.pipeline_.workers_,
+                       &options.pipeline_.senders_) != 3 ||
+                options.pipeline_.receivers_ < 1 ||
+                options.pipeline_.workers_ < 1 ||
+                options.pipeline_.senders_ < 1)
+               usage(argv[0]);
+            options.use_pipeline_ = true;
+            break;
+         case 'w':
+            options.scheduler_.fast_weight_ = atoi(optarg);
+            if (options.scheduler_.fast_weight_ < 1)
+               usage(argv[0]);
+            break;
+         case 'B':
+            options.scheduler_.budget_us_[Scheduler::kSlow] =
+                  atoi(optarg) * 1000;
+            break;
+         case 'r':
+            options.admission_.max_recursions_ = atoi(optarg);
+            break;
+         case 'x':
+            options.admission_.max_per_prefix_ = atoi(optarg);
+            break;
+         case 'q':
+            options.admission_.max_queue_delay_us_ = atoi(optarg) * 1000ULL;
+            break;
+         case 'f':
+            options.admission_.max_frame_bytes_ = atoi(optarg) * 1048576ULL;
+            break;
+         case 'd':
+            if (!strcmp(optarg, "refuse"))
+               options.admission_.refuse_ = true;
+            else if (!strcmp(optarg, "drop"))
+               options.admission_.refuse_ = false;
+            else
+               usage(argv[0]);
+            break;
+         case 'R':
+            options.rrl_.rate_ = atoi(optarg);
+            if (options.rrl_.rate_ < 1)
+               usage(argv[0]);
+            break;
+         case 'u':
+            options.rrl_.burst_ = atoi(optarg);
+            break;
+         case 'i':
+            options.rrl_.slip_ = atoi(optarg);
+            break;
+         case 'o':
+            options.rrl_.log_only_ = true;
+            break;
+         case 't':
+            if (atoi(optarg) < 1)
+               usage(argv[0]);
+            options.rrl_.slots_ = atoi(optarg);
+            break;
+         case 'a':
+            options.acl_path_ = optarg;
+            break;
+         case 'H':
+            options.root_hints_path_ = optarg;
+            break;
+         case 'U':
+            options.upstream_port_ = atoi(optarg);
+            if (options.upstream_port_ < 1 || options.upstream_port_ > 65535)
+               usage(argv[0]);
+            break;
+         case 'L':
+            options.latency_stats_ = true;
+            break;
+         case 'M':
+            options.metrics_port_ = atoi(optarg);
+            if (options.metrics_port_ < 1 || options.metrics_port_ > 65535)
+               usage(argv[0]);
+            break;
+         case 'Q':
+            options.query_log_path_ = optarg;
+            break;
+         case 'T':
+            options.trace_path_ = optarg;
+            break;
+         case 'F':
+            if (!strcmp(optarg, "json"))
+               options.trace_format_ = Tracer::kJson;
+            else if (!strcmp(optarg, "chrome"))
+               options.trace_format_ = Tracer::kChrome;
+            else
+               usage(argv[0]);
+            break;
+         case 'n':
+            options.trace_sample_ = atoi(optarg);
+            if (options.trace_sample_ < 1)
+               usage(argv[0]);
+            break;
+         case 'W':
+            options.trace_slow_ms_ = atoi(optarg);
+            if (options.trace_slow_ms_ < 1)
+               usage(argv[0]);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
    // check for root
    if (getuid() || geteuid()) {
       fprintf(stderr, "Must be root to run %s\n", argv[0]);
@@ -33,17 +283,30 @@ int main(int argc, char** argv) {
    // set up signal handling
    struct sigaction sigact;
    memset(&sigact, 0, sizeof(struct sigaction));
-   sigact.sa_handler = sigint_handler;
+   sigact.sa_handler = signal_handler;
+   sigact.sa_flags = SA_RESTART;
    SYSCALL(sigaction(SIGINT, &sigact, NULL), "sigaction");
+   SYSCALL(sigaction(SIGHUP, &sigact, NULL), "sigaction");
+   SYSCALL(sigaction(SIGUSR1, &sigact, NULL), "sigaction");
+
+   // seed authority selection
+   srandom(time(NULL) ^ getpid());
 
-   server = new DnsServer();
+   server = new DnsServer(options);
    server->Run();
 }
 
-void sigint_handler(int signum) {
+void signal_handler(int signum) {
    switch (signum) {
+      case SIGHUP:
+         server->ReloadAcl();
+         break;
+      case SIGUSR1:
+         server->DumpLatency();
+         break;
       case SIGINT:
          close(server->sock());
+         server->PrintStats(stdout);
          delete server;
 
          fprintf(stdout, "Server exiting cleanly.\n");
@@ -0,0 +1,435 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "concurrency.h"
+#include "dns_packet.h"
+#include "metrics.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+// Scrapes waiting to be accepted
+const int kListenBacklog = 16;
+
+// Longest a scraper may take to send its request or read the response
+const int kScrapeTimeoutS = 1;
+
+// Bytes of request read; only the request line matters
+const size_t kMaxRequest = 4096;
+
+struct ValueInfo {
+   const char* name_;
+   const char* type_;
+   const char* help_;
+};
+
+// In Metrics::Value order
+const ValueInfo kValueInfo[] = {
+   { "dns_recursions_in_flight", "gauge",
+     "Client queries being resolved." },
+   { "dns_upstream_queries_pending", "gauge",
+     "Upstream queries waiting on a response." },
+   { "dns_cache_entries", "gauge",
+     "RRsets in the cache." },
+   { "dns_cache_bytes", "gauge",
+     "Bytes of cache memory in use." },
+   { "dns_upstream_servers", "gauge",
+     "Upstream servers with round trip statistics." },
+   { "dns_resolutions_started_total", "counter",
+     "Resolver tasks started, for clients and for nameserver addresses." },
+   { "dns_upstream_hedges_total", "counter",
+     "Hedged upstream queries sent." },
+   { "dns_upstream_tcp_retries_total", "counter",
+     "Upstream queries retried over TCP after a truncated response." },
+   { "dns_acl_refused_total", "counter",
+     "Client queries refused by the ACL." },
+   { "dns_recursions_shed_total", "counter",
+     "Cache misses shed by admission control." },
+   { "dns_responses_rate_limited_total", "counter",
+     "Responses dropped by the rate limiter." },
+   { "dns_queue_dropped_total", "counter",
+     "Datagrams dropped on a full queue (scheduler or pipeline)." },
+};
+
+static_assert(sizeof(kValueInfo) / sizeof(kValueInfo[0]) == Metrics::kValues,
+      "kValueInfo must name every Metrics::Value");
+
+const char* const kRcodeNames[] = {
+   "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+   "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", "RCODE11",
+   "RCODE12", "RCODE13", "RCODE14", "RCODE15"
+};
+
+// Adds to a counter only its own thread writes
+void Bump(std::atomic<uint64_t>* counter) {
+   counter->store(counter->load(std::memory_order_relaxed) + 1,
+         std::memory_order_relaxed);
+}
+
+uint64_t Load(const std::atomic<uint64_t>& counter) {
+   return counter.load(std::memory_order_relaxed);
+}
+
+void AppendFamily(std::string* out, const char* name, const char* type,
+                  const char* help) {
+   *out += "# HELP ";
+   *out += name;
+   *out += ' ';
+   *out += help;
+   *out += "\n# TYPE ";
+   *out += name;
+   *out += ' ';
+   *out += type;
+   *out += '\n';
+}
+
+// |labels| is NULL, or the inside of the braces
+void AppendSample(std::string* out, const char* name, const char* labels,
+                  uint64_t value) {
+   char line[256];
+   snprintf(line, sizeof(line), "%s%s%s%s %llu\n", name,
+         labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+         (unsigned long long) value);
+   *out += line;
+}
+
+// Writes all of |len| bytes, or gives up
+void SendAll(int fd, const char* data, size_t len) {
+   while (len) {
+      ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+      if (n <= 0)
+         return;
+      data += n;
+      len -= n;
+   }
+}
+}
+
+Metrics::Counters::Counters()
+      : ncache_hits_(0),
+        truncated_(0) {
+   for (int i = 0; i < kQueryTypes; ++i) {
+      cache_hits_[i].store(0, std::memory_order_relaxed);
+      cache_misses_[i].store(0, std::memory_order_relaxed);
+   }
+   for (int i = 0; i < kRcodes; ++i)
+      rcodes_[i].store(0, std::memory_order_relaxed);
+}
+
+Metrics::Server::Server()
+      : queries_(0),
+        timeouts_(0) {
+}
+
+Metrics::Metrics(bool enabled)
+      : enabled_(enabled),
+        servers_(NULL),
+        listen_fd_(-1),
+        sock_(-1) {
+   for (int i = 0; i < kValues; ++i)
+      values_[i].store(0, std::memory_order_relaxed);
+
+   if (enabled_) {
+      servers_ = new ServerTable<Server>(kServerSlots, kMaxServers);
+      MALLOCCHECK(servers_);
+   }
+}
+
+Metrics::~Metrics() {
+   // Wakes the thread out of accept()
+   if (listen_fd_ >= 0) {
+      shutdown(listen_fd_, SHUT_RDWR);
+      thread_.join();
+      close(listen_fd_);
+   }
+
+   delete servers_;
+}
+
+void Metrics::UpstreamQuery(const struct in6_addr& addr) {
+   if (enabled_)
+      Bump(&FindServer(addr)->queries_);
+}
+
+void Metrics::UpstreamTimeout(const struct in6_addr& addr) {
+   if (enabled_)
+      Bump(&FindServer(addr)->timeouts_);
+}
+
+bool Metrics::Serve(int port, int sock) {
+   sock_ = sock;
+
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) {
+      perror("metrics socket");
+      return false;
+   }
+
+   int on = 1;
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+       listen(fd, kListenBacklog) < 0) {
+      perror("metrics listen");
+      close(fd);
+      return false;
+   }
+   listen_fd_ = fd;
+
+   thread_ = StartThread(&Metrics::Accept, this);
+   return true;
+}
+
+std::string Metrics::Render() const {
+   std::string out;
+   char labels[64];
+
+   // Per-thread counters, added up
+   uint64_t hits[kQueryTypes] = { 0 };
+   uint64_t misses[kQueryTypes] = { 0 };
+   uint64_t rcodes[kRcodes] = { 0 };
+   uint64_t ncache_hits = 0;
+   uint64_t truncated = 0;
+   counters_.ForEach([&](const Counters& counters) {
+      for (int i = 0; i < kQueryTypes; ++i) {
+         hits[i] += Load(counters.cache_hits_[i]);
+         misses[i] += Load(counters.cache_misses_[i]);
+      }
+      for (int i = 0; i < kRcodes; ++i)
+         rcodes[i] += Load(counters.rcodes_[i]);
+      ncache_hits += Load(counters.ncache_hits_);
+      truncated += Load(counters.truncated_);
+   });
+
+   AppendFamily(&out, "dns_cache_hits_total", "counter",
+         "Client queries answered from cache, by query type.");
+   for (int i = 0; i < kQueryTypes; ++i) {
+      snprintf(labels, sizeof(labels), "qtype=\"%s\"", TypeName(i));
+      AppendSample(&out, "dns_cache_hits_total", labels, hits[i]);
+   }
+   AppendFamily(&out, "dns_cache_misses_total", "counter",
+         "Client queries the cache could not answer, by query type.");
+   for (int i = 0; i < kQueryTypes; ++i) {
+      snprintf(labels, sizeof(labels), "qtype=\"%s\"", TypeName(i));
+      AppendSample(&out, "dns_cache_misses_total", labels, misses[i]);
+   }
+   AppendFamily(&out, "dns_ncache_hits_total", "counter",
+         "Cache hits that were negative answers.");
+   AppendSample(&out, "dns_ncache_hits_total", NULL, ncache_hits);
+
+   AppendFamily(&out, "dns_responses_total", "counter",
+         "Responses sent to clients, by response code.");
+   for (int i = 0; i < kRcodes; ++i) {
+      if (i > constants::response_code::NotZone && !rcodes[i])
+         continue;
+      snprintf(labels, sizeof(labels), "rcode=\"%s\"", kRcodeNames[i]);
+      AppendSample(&out, "dns_responses_total", labels, rcodes[i]);
+   }
+   AppendFamily(&out, "dns_responses_truncated_total", "counter",
+         "Responses sent to clients with the TC bit set.");
+   AppendSample(&out, "dns_responses_truncated_total", NULL, truncated);
+
+   // What the event loop publishes
+   for (int i = 0; i < kValues; ++i) {
+      AppendFamily(&out, kValueInfo[i].name_, kValueInfo[i].type_,
+            kValueInfo[i].help_);
+      AppendSample(&out, kValueInfo[i].name_, NULL, Load(values_[i]));
+   }
+
+   // Upstream servers; servers_ is only NULL when disabled
+   const char* families[][2] = {
+      { "dns_upstream_queries_total", "Queries sent to upstream servers." },
+      { "dns_upstream_timeouts_total",
+        "Upstream queries that timed out." },
+   };
+   for (int family = 0; family < 2; ++family) {
+      const char* name = families[family][0];
+      AppendFamily(&out, name, "counter", families[family][1]);
+      if (servers_) {
+         servers_->ForEach([&](const struct in6_addr& addr,
+                               const Server& server) {
+            char ip[INET6_ADDRSTRLEN];
+            if (IN6_IS_ADDR_V4MAPPED(&addr))
+               inet_ntop(AF_INET, &addr.s6_addr[12], ip, sizeof(ip));
+            else
+               inet_ntop(AF_INET6, &addr, ip, sizeof(ip));
+            snprintf(labels, sizeof(labels), "server=\"%s\"", ip);
+            AppendSample(&out, name, labels,
+                  Load(family ? server.timeouts_ : server.queries_));
+         });
+      }
+      uint64_t other = Load(family ? other_servers_.timeouts_ :
+            other_servers_.queries_);
+      if (other)
+         AppendSample(&out, name, "server=\"other\"", other);
+   }
+
+   // The kernel's view of the client socket
+   uint32_t meminfo[SK_MEMINFO_VARS];
+   socklen_t len = sizeof(meminfo);
+   if (sock_ >= 0 &&
+       !getsockopt(sock_, SOL_SOCKET, SO_MEMINFO, meminfo, &len) &&
+       len >= sizeof(meminfo)) {
+      AppendFamily(&out, "dns_socket_receive_drops_total", "counter",
+            "Datagrams the kernel dropped on the client socket.");
+      AppendSample(&out, "dns_socket_receive_drops_total", NULL,
+            meminfo[SK_MEMINFO_DROPS]);
+      AppendFamily(&out, "dns_socket_receive_queue_bytes", "gauge",
+            "Bytes queued on the client socket, unread.");
+      AppendSample(&out, "dns_socket_receive_queue_bytes", NULL,
+            meminfo[SK_MEMINFO_RMEM_ALLOC]);
+      AppendFamily(&out, "dns_socket_receive_buffer_bytes", "gauge",
+            "The client socket's receive buffer size.");
+      AppendSample(&out, "dns_socket_receive_buffer_bytes", NULL,
+            meminfo[SK_MEMINFO_RCVBUF]);
+      AppendFamily(&out, "dns_socket_send_queue_bytes", "gauge",
+            "Bytes queued on the client socket, unsent.");
+      AppendSample(&out, "dns_socket_send_queue_bytes", NULL,
+            meminfo[SK_MEMINFO_WMEM_ALLOC]);
+      AppendFamily(&out, "dns_socket_send_buffer_bytes", "gauge",
+            "The client socket's send buffer size.");
+      AppendSample(&out, "dns_socket_send_buffer_bytes", NULL,
+            meminfo[SK_MEMINFO_SNDBUF]);
+   }
+
+   return out;
+}
+
+// static
+Metrics::QueryType Metrics::TypeOf(uint16_t type) {
+   type = ntohs(type);
+   if (type == constants::type::A)
+      return kTypeA;
+   if (type == constants::type::NS)
+      return kTypeNs;
+   if (type == constants::type::CNAME)
+      return kTypeCname;
+   if (type == constants::type::SOA)
+      return kTypeSoa;
+   if (type == constants::type::PTR)
+      return kTypePtr;
+   if (type == constants::type::MX)
+      return kTypeMx;
+   if (type == constants::type::TXT)
+      return kTypeTxt;
+   if (type == constants::type::AAAA)
+      return kTypeAaaa;
+   if (type == constants::type::SRV)
+      return kTypeSrv;
+   return kOtherType;
+}
+
+// static
+const char* Metrics::TypeName(int type) {
+   static const char* const kNames[] = {
+      "A", "NS", "CNAME", "SOA", "PTR", "MX", "TXT", "AAAA", "SRV", "other"
+   };
+   return kNames[type];
+}
+
+void Metrics::CountCacheHit(uint16_t type, bool negative) {
+   Counters* counters = counters_.Local();
+   if (!counters)
+      return;
+
+   Bump(&counters->cache_hits_[TypeOf(type)]);
+   if (negative)
+      Bump(&counters->ncache_hits_);
+}
+
+void Metrics::CountCacheMiss(uint16_t type) {
+   Counters* counters = counters_.Local();
+   if (counters)
+      Bump(&counters->cache_misses_[TypeOf(type)]);
+}
+
+void Metrics::CountResponse(const char* response) {
+   Counters* counters = counters_.Local();
+   if (!counters)
+      return;
+
+   uint16_t flags = ntohs(((const DnsPacket::Header*) response)->flags);
+   Bump(&counters->rcodes_[flags & 0xf]);
+   if (flags & 0x0200)
+      Bump(&counters->truncated_);
+}
+
+Metrics::Server* Metrics::FindServer(const struct in6_addr& addr) {
+   Server* server = servers_->Find(addr);
+   return server ? server : &other_servers_;
+}
+
+void Metrics::Accept() {
+   while (1) {
+      int fd = accept(listen_fd_, NULL, NULL);
+      if (fd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+
+         // Shut down by the destructor
+         return;
+      }
+
+      Answer(fd);
+      close(fd);
+   }
+}
+
+void Metrics::Answer(int fd) {
+   // A stalled scraper holds up only the next scrape
+   struct timeval timeout;
+   timeout.tv_sec = kScrapeTimeoutS;
+   timeout.tv_usec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+   // Read up to the end of the headers
+   char request[kMaxRequest];
+   size_t len = 0;
+   request[0] = '\0';
+   while (len < sizeof(request) - 1 && !strstr(request, "\r\n\r\n")) {
+      ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+      if (n <= 0)
+         break;
+      len += n;
+      request[len] = '\0';
+   }
+
+   std::string body;
+   const char* status;
+   if (!strncmp(request, "GET /metrics ", 13) ||
+       !strncmp(request, "GET /metrics?", 13)) {
+      status = "200 OK";
+      body = Render();
+   } else {
+      status = "404 Not Found";
+      body = "Try /metrics\n";
+   }
+
+   char header[256];
+   int header_len = snprintf(header, sizeof(header),
+         "HTTP/1.0 %s\r\n"
+         "Content-Type: text/plain; version=0.0.4\r\n"
+         "Content-Length: %zu\r\n"
+         "Connection: close\r\n\r\n", status, body.size());
+   SendAll(fd, header, header_len);
+   SendAll(fd, body.data(), body.size());
+}
@@ -0,0 +1,150 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "smartalloc.h"
+
+#include "per_thread.h"
+#include "server_table.h"
+
+// Counters for monitoring the server, served in Prometheus' text format
+// over HTTP on a loopback port, from a thread of its own.
+//
+// What the request path counts (cache hits and misses, response codes) goes
+// into per-thread counters, added up when scraped. What only the event loop
+// knows it counts itself (upstream servers) or publishes with Set() now and
+// then (in-flight recursions, cache size). Scrapes read nothing else of the
+// server's, so they never wait on, or hold up, the packet loop. Off, and
+// counting nothing, unless enabled.
+class Metrics {
+  public:
+   // Values the event loop publishes
+   enum Value {
+      kRecursionsInFlight,   // gauges
+      kUpstreamPending,
+      kCacheEntries,
+      kCacheBytes,
+      kUpstreamServers,
+      kResolutionsStarted,   // counters
+      kHedgesSent,
+      kTcpQueries,
+      kAclRefused,
+      kRecursionsShed,
+      kRateLimited,
+      kQueueDropped,
+      kValues
+   };
+
+   Metrics(bool enabled);
+   ~Metrics();
+
+   bool enabled() const { return enabled_; }
+
+   // Counted per thread, from any thread. |type| is network order.
+   void CacheHit(uint16_t type, bool negative) {
+      if (enabled_)
+         CountCacheHit(type, negative);
+   }
+   void CacheMiss(uint16_t type) {
+      if (enabled_)
+         CountCacheMiss(type);
+   }
+   // Counts |response|'s rcode, and whether it is truncated.
+   void Response(const char* response) {
+      if (enabled_)
+         CountResponse(response);
+   }
+
+   // From the event loop only
+   void UpstreamQuery(const struct in6_addr& addr);
+   void UpstreamTimeout(const struct in6_addr& addr);
+   void Set(Value value, uint64_t n) {
+      values_[value].store(n, std::memory_order_relaxed);
+   }
+
+   // Starts answering GET /metrics on 127.0.0.1:|port|. |sock| is the UDP
+   // socket whose kernel receive drops are reported. Returns false, having
+   // said why, if it cannot listen.
+   bool Serve(int port, int sock);
+
+   // The whole exposition, as of now. Thread-safe.
+   std::string Render() const;
+
+  private:
+   // Query types counted apart; the rest are kOtherType
+   enum QueryType {
+      kTypeA,
+      kTypeNs,
+      kTypeCname,
+      kTypeSoa,
+      kTypePtr,
+      kTypeMx,
+      kTypeTxt,
+      kTypeAaaa,
+      kTypeSrv,
+      kOtherType,
+      kQueryTypes
+   };
+
+   static const int kRcodes = 16;
+
+   // Upstream servers counted one by one (of kServerSlots); the rest are
+   // counted together
+   static const int kServerSlots = 1024;
+   static const int kMaxServers = 768;
+
+   struct Counters {
+      Counters();
+
+      std::atomic<uint64_t> cache_hits_[kQueryTypes];
+      std::atomic<uint64_t> cache_misses_[kQueryTypes];
+      std::atomic<uint64_t> ncache_hits_;
+      std::atomic<uint64_t> rcodes_[kRcodes];
+      std::atomic<uint64_t> truncated_;
+   };
+
+   struct Server {
+      Server();
+
+      std::atomic<uint64_t> queries_;
+      std::atomic<uint64_t> timeouts_;
+   };
+
+   static QueryType TypeOf(uint16_t type);
+   static const char* TypeName(int type);
+
+   void CountCacheHit(uint16_t type, bool negative);
+   void CountCacheMiss(uint16_t type);
+   void CountResponse(const char* response);
+
+   // The counters of |addr|, claiming a slot if it is new; other_servers_
+   // once kMaxServers are
+   Server* FindServer(const struct in6_addr& addr);
+
+   // Answers scrapes until the listening socket is shut down
+   void Accept();
+   void Answer(int fd);
+
+   const bool enabled_;
+   PerThread<Counters> counters_;
+
+   ServerTable<Server>* servers_;   // NULL unless enabled
+   Server other_servers_;
+
+   std::atomic<uint64_t> values_[kValues];
+
+   int listen_fd_;   // -1 unless serving
+   int sock_;
+   std::thread thread_;
+
+   Metrics(const Metrics&);
+   void operator=(const Metrics&);
+};
+
+#endif   // _METRICS_H_
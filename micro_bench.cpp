@@ -0,0 +1,496 @@
+// Microbenchmarks of the server's hot paths: parsing names, queries and
+// records off the wire, writing responses with name compression, cache
+// lookups and inserts at several cache sizes, the table of client queries
+// being resolved, the latency stats' timing probes, the clock the server's
+// timers and TTLs run on, and the rate limiter's check of every response.
+// Each runs until it has taken --min-ms, and prints a CSV line:
+//
+//   benchmark,iterations,ns_per_op,allocs_per_op,ops_per_s
+//
+// Allocations count operator new calls and slab pool allocations (release
+// build; the debug one does not replace operator new). Inputs are fixed,
+// seeded the same every run, so two builds' outputs compare line by line.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "clock.h"
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "dns_server.h"
+#include "latency_stats.h"
+#include "rate_limiter.h"
+#include "slab_pool.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+
+// operator new calls so far
+uint64_t news = 0;
+
+}
+
+#ifdef NO_SMARTALLOC
+void* operator new(size_t size) {
+   news++;
+   void* p = malloc(size ? size : 1);
+   if (!p)
+      throw std::bad_alloc();
+   return p;
+}
+
+void* operator new[](size_t size) {
+   news++;
+   void* p = malloc(size ? size : 1);
+   if (!p)
+      throw std::bad_alloc();
+   return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
+namespace {
+
+const int kZones = 1000;
+const int kAddressesPerName = 4;
+const int kCacheSizes[] = { 1000, 10000, 100000 };
+const int kPendingClients = 1000;
+const int kRrlClients = 1000;
+
+struct Options {
+   uint64_t min_ns_;
+   const char* filter_;
+};
+
+uint64_t NowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t Allocations() {
+   return news + SlabPool::Local()->stats().allocations;
+}
+
+uint64_t NextRandom(uint64_t* state) {
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+// Keeps results alive, so the work producing them is not optimized away
+volatile uint64_t sink;
+
+// Runs |body| (which does one operation) in doubling batches until a batch
+// takes the minimum time, and prints that batch's numbers.
+template <typename Body>
+void Run(const Options& options, const std::string& name, Body body) {
+   if (options.filter_ && name.find(options.filter_) == std::string::npos)
+      return;
+
+   uint64_t iterations = 1;
+   for (;;) {
+      uint64_t allocations = Allocations();
+      uint64_t start_ns = NowNs();
+      for (uint64_t i = 0; i < iterations; ++i)
+         body();
+      uint64_t elapsed_ns = NowNs() - start_ns;
+      allocations = Allocations() - allocations;
+
+      if (elapsed_ns >= options.min_ns_) {
+         double ns = (double) elapsed_ns / iterations;
+         printf("%s,%llu,%.1f,%.2f,%.0f\n", name.c_str(),
+               (unsigned long long) iterations, ns,
+               (double) allocations / iterations, 1e9 / ns);
+         fflush(stdout);
+         return;
+      }
+
+      // Aim a little past the minimum, growing at most 100x at a time
+      uint64_t next = elapsed_ns ?
+            iterations * options.min_ns_ * 12 / 10 / elapsed_ns : 0;
+      iterations = next > iterations * 100 ? iterations * 100 :
+            next > iterations * 2 ? next : iterations * 2;
+   }
+}
+
+// h<host>.zone<zone>.com, or zone<zone>.com if |host| < 0, in wire format
+std::string WireName(int host, int zone) {
+   char label[16];
+   std::string name;
+   if (host >= 0) {
+      snprintf(label, sizeof(label), "h%d", host);
+      name += (char) strlen(label);
+      name += label;
+   }
+   snprintf(label, sizeof(label), "zone%d", zone);
+   name += (char) strlen(label);
+   name += label;
+   name += "\x03" "com";
+   return name;
+}
+
+DnsResourceRecord AddressRecord(const std::string& name, int address) {
+   char ip[4] = { 10, 3, (char) (address >> 8), (char) address };
+   return DnsResourceRecord(name, htons(constants::type::A),
+         htons(constants::clz::IN), htonl(3600), htons(4), ip);
+}
+
+// ns<n>.zone<zone>.com, with its terminating zero, as NS rdata
+DnsResourceRecord NsRecord(int zone, int n) {
+   std::string host = WireName(-1, zone);
+   char label[8];
+   snprintf(label, sizeof(label), "ns%d", n);
+   std::string target = std::string(1, (char) strlen(label)) + label + host;
+   target += '\0';
+   return DnsResourceRecord(host, htons(constants::type::NS),
+         htons(constants::clz::IN), htonl(86400), htons(target.size()),
+         (char*) target.data());
+}
+
+std::string NsName(int zone, int n) {
+   char label[8];
+   snprintf(label, sizeof(label), "ns%d", n);
+   return std::string(1, (char) strlen(label)) + label + WireName(-1, zone);
+}
+
+// A typical response: an A query answered with four addresses, two NS
+// records for the zone, and their addresses as glue. Returns its length.
+int BuildResponse(char* buf, Arena* arena) {
+   DnsQuery query(WireName(7, 42), htons(constants::type::A),
+         htons(constants::clz::IN));
+   RRVec answers(arena);
+   RRVec authorities(arena);
+   RRVec additionals(arena);
+   for (int i = 0; i < kAddressesPerName; ++i)
+      answers.push_back(AddressRecord(query.name(), i));
+   for (int i = 0; i < 2; ++i) {
+      authorities.push_back(NsRecord(42, i));
+      additionals.push_back(AddressRecord(NsName(42, i), 100 + i));
+   }
+
+   return DnsPacket::ConstructPacket(buf, htons(0x1234), true,
+         constants::opcode::Query, false, false, true, true,
+         constants::response_code::NoError, query, answers, authorities,
+         additionals);
+}
+
+void PacketBenchmarks(const Options& options) {
+   Arena arena;
+   char response[512];
+   int response_len = BuildResponse(response, &arena);
+   sink = response_len;
+
+   Run(options, "packet/get_name", [&]() {
+      DnsPacket packet(response);
+      sink = packet.GetName().size();
+   });
+
+   // The first answer's owner name is a pointer to the question's
+   Run(options, "packet/get_name_compressed", [&]() {
+      DnsPacket packet(response);
+      packet.GetQuery();
+      sink = packet.GetName().size();
+   });
+
+   Run(options, "parse/query", [&]() {
+      DnsPacket packet(response);
+      sink = packet.GetQuery().name().size();
+   });
+
+   Run(options, "parse/response", [&]() {
+      DnsPacket packet(response);
+      packet.GetQuery();
+      int records = ntohs(((DnsPacket::Header*) response)->answer_rrs) +
+            ntohs(((DnsPacket::Header*) response)->authority_rrs) +
+            ntohs(((DnsPacket::Header*) response)->additional_rrs);
+      for (int i = 0; i < records; ++i)
+         sink = packet.GetResourceRecord().data_len();
+   });
+
+   // Records built once; each run writes them, compressing names
+   DnsQuery query(WireName(7, 42), htons(constants::type::A),
+         htons(constants::clz::IN));
+   RRVec answers(&arena);
+   RRVec authorities(&arena);
+   RRVec additionals(&arena);
+   DnsPacket packet(response);
+   packet.GetQuery();
+   for (int i = 0; i < kAddressesPerName; ++i)
+      answers.push_back(packet.GetResourceRecord());
+   for (int i = 0; i < 2; ++i)
+      authorities.push_back(packet.GetResourceRecord());
+   for (int i = 0; i < 2; ++i)
+      additionals.push_back(packet.GetResourceRecord());
+
+   char out[512];
+   Run(options, "construct/response", [&]() {
+      sink = DnsPacket::ConstructPacket(out, htons(0x1234), true,
+            constants::opcode::Query, false, false, true, true,
+            constants::response_code::NoError, query, answers, authorities,
+            additionals);
+   });
+}
+
+void CacheBenchmarks(const Options& options, int size) {
+   char suffix[16];
+   snprintf(suffix, sizeof(suffix), "/%d", size);
+
+   // |size| names spread over the zones, each with an address, and each
+   // zone with two NS records and their glue. The server passes the cache
+   // its loop's time; one reading does for a run.
+   DnsCache cache;
+   uint64_t now_ms = Clock::System()->NowMs();
+   std::vector<DnsQuery> keys;
+   std::vector<DnsQuery> missing;
+   for (int i = 0; i < size; ++i) {
+      int zone = i % kZones;
+      keys.push_back(DnsQuery(WireName(i / kZones, zone),
+            htons(constants::type::A), htons(constants::clz::IN)));
+      cache.Insert(keys.back(), AddressRecord(keys.back().name(), 0),
+            now_ms);
+      missing.push_back(DnsQuery(WireName(i / kZones + size, zone),
+            htons(constants::type::A), htons(constants::clz::IN)));
+   }
+   for (int zone = 0; zone < kZones && zone < size; ++zone) {
+      for (int n = 0; n < 2; ++n) {
+         cache.Insert(NsRecord(zone, n), now_ms);
+         cache.Insert(AddressRecord(NsName(zone, n), n), now_ms);
+      }
+   }
+
+   uint64_t state = 0x9e3779b97f4a7c15ULL;
+   Arena arena;
+   Run(options, std::string("cache/get_hit") + suffix, [&]() {
+      arena.Reset();
+      RRVec answers(&arena);
+      RRVec authorities(&arena);
+      RRVec additionals(&arena);
+      DnsQuery& query = keys[NextRandom(&state) % keys.size()];
+      sink = cache.Get(query, &answers, &authorities, &additionals, now_ms);
+   });
+
+   Run(options, std::string("cache/get_miss") + suffix, [&]() {
+      arena.Reset();
+      RRVec answers(&arena);
+      RRVec authorities(&arena);
+      RRVec additionals(&arena);
+      DnsQuery& query = missing[NextRandom(&state) % missing.size()];
+      sink = cache.Get(query, &answers, &authorities, &additionals, now_ms);
+   });
+
+   Run(options, std::string("cache/get_recursive") + suffix, [&]() {
+      arena.Reset();
+      RRVec rrs(&arena);
+      DnsQuery& query = keys[NextRandom(&state) % keys.size()];
+      DnsQuery ns_query(query.name(), htons(constants::type::NS),
+            query.clz());
+      cache.GetRecursive(ns_query, &rrs, dns_cache::kCache, now_ms);
+      sink = rrs.size();
+   });
+
+   // Names take more addresses until they have them all; after that,
+   // inserts refresh them
+   Run(options, std::string("cache/insert") + suffix, [&]() {
+      uint64_t r = NextRandom(&state);
+      DnsQuery& query = keys[r % keys.size()];
+      cache.Insert(query, AddressRecord(query.name(),
+            (r >> 32) % kAddressesPerName), now_ms);
+   });
+}
+
+void ClientTableBenchmarks(const Options& options) {
+   // Pending clients: the server adds one per recursion, looks one up per
+   // query missed in cache (retransmission check), and removes it when
+   // the recursion ends
+   DnsServer::ClientMap clients;
+   std::vector<DnsServer::ClientKey> keys;
+   uint64_t state = 0x9e3779b97f4a7c15ULL;
+   for (int i = 0; i < 2 * kPendingClients; ++i) {
+      struct sockaddr_in6 addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin6_family = AF_INET6;
+      addr.sin6_addr.s6_addr[10] = 0xff;
+      addr.sin6_addr.s6_addr[11] = 0xff;
+      uint64_t r = NextRandom(&state);
+      memcpy(&addr.sin6_addr.s6_addr[12], &r, 4);
+      addr.sin6_port = r >> 32;
+      keys.push_back(DnsServer::ClientKey(addr, r >> 48));
+   }
+   for (int i = 0; i < kPendingClients; ++i)
+      clients[keys[i]] = i;
+
+   // Half the lookups find a client, half do not
+   Run(options, "clients/find", [&]() {
+      sink = clients.find(keys[NextRandom(&state) % keys.size()]) !=
+            clients.end();
+   });
+
+   // Churn at a steady size: the oldest pending client finishes as a new
+   // one starts
+   size_t next = kPendingClients;
+   Run(options, "clients/insert_erase", [&]() {
+      clients[keys[next % keys.size()]] = next;
+      clients.erase(keys[(next + kPendingClients) % keys.size()]);
+      next++;
+   });
+}
+
+void LatencyBenchmarks(const Options& options) {
+   // A probe on the request path: a clock read, and the interval since the
+   // last one recorded in the thread's histogram
+   LatencyStats latency(true);
+   Run(options, "latency/now", [&]() {
+      sink = LatencyStats::NowNs();
+   });
+
+   uint64_t last_ns = LatencyStats::NowNs();
+   Run(options, "latency/probe", [&]() {
+      uint64_t now_ns = LatencyStats::NowNs();
+      latency.Record(LatencyStats::kCacheLookup, now_ns - last_ns);
+      last_ns = now_ns;
+   });
+
+   // Merging every stage's histogram and printing them, as on SIGUSR1
+   FILE* null = fopen("/dev/null", "w");
+   Run(options, "latency/print", [&]() {
+      latency.Print(null);
+   });
+   fclose(null);
+}
+
+void ClockBenchmarks(const Options& options) {
+   // What the cache read on every lookup and insert before it was handed
+   // the loop's time, and what it read before that
+   const Clock* clock = Clock::System();
+   Run(options, "clock/secs", [&]() {
+      sink = clock->NowSecs();
+   });
+   Run(options, "clock/time", [&]() {
+      sink = time(NULL);
+   });
+
+   // What the event loop reads each turn
+   Run(options, "clock/ms", [&]() {
+      sink = clock->NowMs();
+   });
+}
+
+// A client on a network of its own: |r| picks the /24, as the rate limiter
+// counts IPv4 clients by
+struct sockaddr_in6 RrlClient(uint64_t r) {
+   struct sockaddr_in6 addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin6_family = AF_INET6;
+   addr.sin6_addr.s6_addr[10] = 0xff;
+   addr.sin6_addr.s6_addr[11] = 0xff;
+   memcpy(&addr.sin6_addr.s6_addr[12], &r, 3);
+   return addr;
+}
+
+void RateLimiterBenchmarks(const Options& options) {
+   // The check every response goes through: a hash of the client's network
+   // and the question, and a compare-and-swap on its bucket. Log only, so
+   // the response is never cut down to a truncated one.
+   RateLimiter::Options rrl_options;
+   rrl_options.rate_ = 100;
+   rrl_options.log_only_ = true;
+   RateLimiter rrl(rrl_options);
+
+   Arena arena;
+   char response[512];
+   int response_len = BuildResponse(response, &arena);
+   uint64_t now_ms = Clock::System()->NowMs();
+
+   // Clients that keep asking: their buckets are in the table
+   std::vector<struct sockaddr_in6> clients;
+   uint64_t state = 0x9e3779b97f4a7c15ULL;
+   for (int i = 0; i < kRrlClients; ++i) {
+      clients.push_back(RrlClient(NextRandom(&state)));
+      int len = response_len;
+      rrl.Check(clients.back(), response, &len, now_ms);
+   }
+
+   Run(options, "rrl/check_hit", [&]() {
+      int len = response_len;
+      sink = rrl.Check(clients[NextRandom(&state) % clients.size()],
+            response, &len, now_ms);
+   });
+
+   // A new network every time: it finds its slot empty, or evicts
+   Run(options, "rrl/check_miss", [&]() {
+      int len = response_len;
+      sink = rrl.Check(RrlClient(NextRandom(&state)), response, &len,
+            now_ms);
+   });
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --min-ms=N            shortest time a benchmark runs for (200)\n"
+         "  --filter=TEXT         run only benchmarks whose name has TEXT\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   Options options;
+   options.min_ns_ = 200 * 1000000ULL;
+   options.filter_ = NULL;
+
+   static struct option long_options[] = {
+      { "min-ms", required_argument, NULL, 'm' },
+      { "filter", required_argument, NULL, 'f' },
+      { NULL,     0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 'm':
+            if (atoi(optarg) < 1)
+               usage(argv[0]);
+            options.min_ns_ = atoi(optarg) * 1000000ULL;
+            break;
+         case 'f':
+            options.filter_ = optarg;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
+   printf("benchmark,iterations,ns_per_op,allocs_per_op,ops_per_s\n");
+   PacketBenchmarks(options);
+   for (size_t i = 0; i < sizeof(kCacheSizes) / sizeof(kCacheSizes[0]); ++i)
+      CacheBenchmarks(options, kCacheSizes[i]);
+   ClientTableBenchmarks(options);
+   LatencyBenchmarks(options);
+   ClockBenchmarks(options);
+   RateLimiterBenchmarks(options);
+   return 0;
+}
@@ -0,0 +1,645 @@
+// Serves a synthetic DNS hierarchy on loopback addresses, for running the
+// real server's resolver against authorities that answer the same way every
+// time: root servers at 127.53.0.x, two servers for each TLD at
+// 127.53.<tld + 1>.1-2, and a server for each zone at 127.54.x.y. Zones
+// answer from SimZones (see sim_network.h), as resolver_bench's do, and
+// each server's responses are held back by a latency of its own, and may be
+// lost.
+//
+// Besides plain delegations with glue, the tree has glueless ones (the
+// zone's nameserver is in another zone, whose address has to be looked up
+// first), CNAME chains that cross zones, and lame nameservers (listed in a
+// delegation, answering REFUSED) at 127.55.x.y.
+//
+// All the servers share one socket, bound to the port on every address:
+// which server a query is for is the address it was sent to, and the
+// response goes out from that address. --hints writes the root hints for
+// dns_server --root-hints, and --names the names the zones hold, for
+// dns_load --queries. Counts of queries by kind of server are printed on
+// SIGINT.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+#include "sim_network.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+const int kMaxRoots = 13;
+const int kMaxTlds = 200;
+const int kMaxZones = 50000;
+const int kZonesPerBlock = 250;
+
+const int kBatch = 32;
+const int kMaxQueryLen = 512;
+const int kMaxResponseLen = 65535;
+
+// Longest ppoll() waits with nothing due, so SIGINT is noticed
+const int kIdleWaitMs = 100;
+
+enum Tier { kRoot = 0, kTld, kZone, kLame, kTiers };
+
+const char* const kTierNames[] = { "root", "tld", "zone", "lame" };
+
+struct Options {
+   int port_;
+   int roots_;
+   int tlds_;
+   int zones_;
+   int hosts_;
+   int glueless_every_;
+   int cname_chain_;
+   int lame_every_;
+   int latency_ms_[kLame];
+   int spread_ms_;
+   int jitter_ms_;
+   double loss_;
+   uint64_t seed_;
+   const char* hints_;
+   const char* names_;
+};
+
+struct Server {
+   std::vector<SimZone*> zones_;   // none if lame
+   Tier tier_;
+   uint32_t latency_us_;
+};
+
+struct TierStats {
+   uint64_t queries;
+   uint64_t lost;
+   uint64_t answered;
+   uint64_t refused;
+};
+
+// A response held back until its server's latency has passed
+struct Delivery {
+   std::string packet_;
+   struct sockaddr_in to_;
+   struct in_addr from_;
+};
+
+typedef std::map<uint32_t, Server> ServerMap;   // by address, host order
+typedef std::multimap<uint64_t, Delivery> DeliveryMap;
+
+volatile sig_atomic_t stop = 0;
+
+void signal_handler(int signum) {
+   stop = 1;
+}
+
+uint64_t NowUs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t NextRandom(uint64_t* state) {
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+// A fraction in [0, 1)
+double RandomFraction(uint64_t* state) {
+   return (NextRandom(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+std::string Ip(int a, int b, int c) {
+   char ip[32];
+   snprintf(ip, sizeof(ip), "127.%d.%d.%d", a, b, c);
+   return ip;
+}
+
+std::string TldName(int tld) {
+   return "tld" + std::to_string(tld);
+}
+
+std::string ZoneName(const Options& options, int zone) {
+   return "zone" + std::to_string(zone) + "." +
+         TldName(zone % options.tlds_);
+}
+
+std::string ZoneIp(int zone) {
+   return Ip(54, zone / kZonesPerBlock, zone % kZonesPerBlock + 1);
+}
+
+std::string LameIp(int zone) {
+   return Ip(55, zone / kZonesPerBlock, zone % kZonesPerBlock + 1);
+}
+
+Server* AddServer(ServerMap* servers, const std::string& ip, Tier tier,
+                  const Options& options, uint64_t* random) {
+   struct in_addr addr;
+   inet_pton(AF_INET, ip.c_str(), &addr);
+
+   Server& server = (*servers)[ntohl(addr.s_addr)];
+   server.tier_ = tier;
+
+   // Lame servers answer at once; the rest take their tier's latency,
+   // give or take the spread
+   int spread_ms = tier == kLame ? 0 : options.spread_ms_;
+   int latency_ms = tier == kLame ? 0 : options.latency_ms_[tier];
+   latency_ms += (int) (NextRandom(random) % (2 * spread_ms + 1)) - spread_ms;
+   server.latency_us_ = std::max(latency_ms, 0) * 1000;
+   return &server;
+}
+
+// Builds the hierarchy, and the names it holds
+void BuildTree(const Options& options, ServerMap* servers,
+               std::vector<SimZone*>* zones, std::vector<std::string>* hints,
+               std::vector<std::string>* names, uint64_t* random) {
+   SimZone* root = new SimZone("");
+   zones->push_back(root);
+   for (int i = 0; i < options.roots_; ++i) {
+      std::string ip = Ip(53, 0, i + 1);
+      AddServer(servers, ip, kRoot, options, random)->zones_.push_back(root);
+      hints->push_back(std::string(1, 'a' + i) + ".root-servers.test " + ip);
+   }
+
+   std::vector<SimZone*> tlds;
+   for (int t = 0; t < options.tlds_; ++t) {
+      std::string tld_name = TldName(t);
+      SimZone* tld = new SimZone(tld_name.c_str());
+      zones->push_back(tld);
+      tlds.push_back(tld);
+
+      for (int i = 0; i < 2; ++i) {
+         std::string ns = std::string(1, 'a' + i) + ".nic." + tld_name;
+         std::string ip = Ip(53, t + 1, i + 1);
+         root->AddDelegation(tld_name.c_str(), ns.c_str(), ip.c_str());
+         tld->AddA(ns.c_str(), ip.c_str());
+         AddServer(servers, ip, kTld, options, random)->zones_.push_back(tld);
+      }
+   }
+
+   for (int z = 0; z < options.zones_; ++z) {
+      std::string zone_name = ZoneName(options, z);
+      SimZone* tld = tlds[z % options.tlds_];
+      SimZone* zone = new SimZone(zone_name.c_str());
+      zones->push_back(zone);
+
+      std::string ns_name = "ns1." + zone_name;
+      std::string ip = ZoneIp(z);
+      zone->AddA(ns_name.c_str(), ip.c_str());
+
+      for (int h = 0; h < options.hosts_; ++h) {
+         std::string host = "h" + std::to_string(h) + "." + zone_name;
+         char host_ip[32];
+         snprintf(host_ip, sizeof(host_ip), "10.%d.%d.%d", z / 256, z % 256,
+               h % 256);
+         zone->AddA(host.c_str(), host_ip);
+         names->push_back(host);
+      }
+
+      std::string www = "www." + zone_name;
+      zone->AddCname(www.c_str(), ("h0." + zone_name).c_str());
+      names->push_back(www);
+
+      // c<k>.zone<z> -> c<k - 1>.zone<z + 1> -> ... -> h0.zone<z + k>
+      std::string next_zone = ZoneName(options, (z + 1) % options.zones_);
+      for (int k = 1; k <= options.cname_chain_; ++k) {
+         std::string name = "c" + std::to_string(k) + "." + zone_name;
+         std::string target = k == 1 ? "h0." + next_zone :
+               "c" + std::to_string(k - 1) + "." + next_zone;
+         zone->AddCname(name.c_str(), target.c_str());
+      }
+      if (options.cname_chain_) {
+         names->push_back("c" + std::to_string(options.cname_chain_) + "." +
+               zone_name);
+      }
+      names->push_back("nx." + zone_name);
+
+      // A lame nameserver, listed first
+      if (options.lame_every_ && z % options.lame_every_ ==
+          options.lame_every_ - 1) {
+         std::string lame_name = "lame." + zone_name;
+         std::string lame_ip = LameIp(z);
+         tld->AddDelegation(zone_name.c_str(), lame_name.c_str(),
+               lame_ip.c_str());
+         AddServer(servers, lame_ip, kLame, options, random);
+      }
+
+      // Glueless: delegated to, and served by, the previous zone's server
+      if (z > 0 && options.glueless_every_ &&
+          z % options.glueless_every_ == options.glueless_every_ - 1) {
+         std::string host_ns = "ns1." + ZoneName(options, z - 1);
+         tld->AddDelegation(zone_name.c_str(), host_ns.c_str(), NULL);
+         struct in_addr addr;
+         inet_pton(AF_INET, ZoneIp(z - 1).c_str(), &addr);
+         (*servers)[ntohl(addr.s_addr)].zones_.push_back(zone);
+      } else {
+         tld->AddDelegation(zone_name.c_str(), ns_name.c_str(), ip.c_str());
+         AddServer(servers, ip, kZone, options, random)->zones_.push_back(zone);
+      }
+   }
+
+   // Spread each zone's names over the list
+   for (size_t i = names->size(); i > 1; --i)
+      std::swap((*names)[i - 1], (*names)[NextRandom(random) % i]);
+}
+
+bool WriteLines(const char* path, const std::vector<std::string>& lines,
+                const char* suffix) {
+   FILE* file = fopen(path, "w");
+   if (!file) {
+      perror(path);
+      return false;
+   }
+   for (size_t i = 0; i < lines.size(); ++i)
+      fprintf(file, "%s%s\n", lines[i].c_str(), suffix);
+   if (fclose(file)) {
+      perror(path);
+      return false;
+   }
+   return true;
+}
+
+// The response of |server| to |query|: its most specific zone's answer, or
+// REFUSED if it has none for the name (as a lame server does). Returns its
+// length, or 0 if |query| is not one.
+int Respond(const Server& server, char* query, int len, char* response,
+            bool* refused) {
+   DnsPacket::Header header;
+   if (len < (int) sizeof(header) + 5)
+      return 0;
+   memcpy(&header, query, sizeof(header));
+   if ((ntohs(header.flags) & 0x8000) || ntohs(header.queries) != 1)
+      return 0;
+
+   // The question has to end inside the packet
+   const char* p = query + sizeof(header);
+   const char* end = query + len;
+   while (p < end && *p)
+      p += 1 + (uint8_t) *p;
+   if (p + 5 > end)
+      return 0;
+
+   DnsPacket packet(query);
+   DnsQuery question = packet.GetQuery();
+
+   SimZone* zone = NULL;
+   std::vector<SimZone*>::const_iterator it;
+   for (it = server.zones_.begin(); it != server.zones_.end(); ++it) {
+      if ((*it)->Contains(question.name()) &&
+          (!zone || (*it)->origin().size() > zone->origin().size()))
+         zone = *it;
+   }
+
+   *refused = !zone;
+   if (zone)
+      return zone->Answer(query, response);
+
+   RRVec none;
+   return DnsPacket::ConstructPacket(response, packet.id(), true,
+         constants::opcode::Query, false, false, false, false,
+         constants::response_code::Refused, question, none, none, none);
+}
+
+void Send(int fd, const Delivery& delivery) {
+   struct iovec iov;
+   iov.iov_base = (void*) delivery.packet_.data();
+   iov.iov_len = delivery.packet_.size();
+
+   // From the server's address, not whichever the socket would pick
+   char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+   memset(control, 0, sizeof(control));
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_name = (void*) &delivery.to_;
+   msg.msg_namelen = sizeof(delivery.to_);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+
+   struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = IPPROTO_IP;
+   cmsg->cmsg_type = IP_PKTINFO;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+   struct in_pktinfo* info = (struct in_pktinfo*) CMSG_DATA(cmsg);
+   info->ipi_spec_dst = delivery.from_;
+
+   if (sendmsg(fd, &msg, 0) < 0)
+      perror("sendmsg");
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --port=N              port every server listens on (5300)\n"
+         "  --roots=N             root servers (2)\n"
+         "  --tlds=N              top-level domains, tld0 on (2)\n"
+         "  --zones=N             zones, zone<i>.tld<i %% tlds> (1000)\n"
+         "  --hosts=N             h<j> A records per zone (10)\n"
+         "  --glueless-every=N    every Nth zone delegated without glue, to\n"
+         "                        the previous zone's nameserver; 0 none,\n"
+         "                        else at least 2 (4)\n"
+         "  --cname-chain=N       c<N>.<zone> leads through N CNAMEs, over\n"
+         "                        N zones, 0 none (3)\n"
+         "  --lame-every=N        every Nth zone lists a lame nameserver\n"
+         "                        first, 0 none (10)\n"
+         "  --root-ms=N           root servers' latency (5)\n"
+         "  --tld-ms=N            TLD servers' latency (10)\n"
+         "  --zone-ms=N           zone servers' latency (20)\n"
+         "  --spread-ms=N         servers' latencies vary by this much (5)\n"
+         "  --jitter-ms=N         responses take up to this much longer (0)\n"
+         "  --loss=F              chance a query goes unanswered (0)\n"
+         "  --seed=N              for latencies, loss and name order (1)\n"
+         "  --hints=FILE          write root hints for dns_server\n"
+         "  --names=FILE          write the zones' names for dns_load\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   Options options;
+   options.port_ = 5300;
+   options.roots_ = 2;
+   options.tlds_ = 2;
+   options.zones_ = 1000;
+   options.hosts_ = 10;
+   options.glueless_every_ = 4;
+   options.cname_chain_ = 3;
+   options.lame_every_ = 10;
+   options.latency_ms_[kRoot] = 5;
+   options.latency_ms_[kTld] = 10;
+   options.latency_ms_[kZone] = 20;
+   options.spread_ms_ = 5;
+   options.jitter_ms_ = 0;
+   options.loss_ = 0;
+   options.seed_ = 1;
+   options.hints_ = NULL;
+   options.names_ = NULL;
+
+   static struct option long_options[] = {
+      { "port",           required_argument, NULL, 'P' },
+      { "roots",          required_argument, NULL, 'r' },
+      { "tlds",           required_argument, NULL, 't' },
+      { "zones",          required_argument, NULL, 'z' },
+      { "hosts",          required_argument, NULL, 'n' },
+      { "glueless-every", required_argument, NULL, 'g' },
+      { "cname-chain",    required_argument, NULL, 'c' },
+      { "lame-every",     required_argument, NULL, 'l' },
+      { "root-ms",        required_argument, NULL, 'R' },
+      { "tld-ms",         required_argument, NULL, 'T' },
+      { "zone-ms",        required_argument, NULL, 'Z' },
+      { "spread-ms",      required_argument, NULL, 's' },
+      { "jitter-ms",      required_argument, NULL, 'j' },
+      { "loss",           required_argument, NULL, 'L' },
+      { "seed",           required_argument, NULL, 'S' },
+      { "hints",          required_argument, NULL, 'H' },
+      { "names",          required_argument, NULL, 'N' },
+      { NULL,             0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 'P':
+            options.port_ = atoi(optarg);
+            break;
+         case 'r':
+            options.roots_ = atoi(optarg);
+            break;
+         case 't':
+            options.tlds_ = atoi(optarg);
+            break;
+         case 'z':
+            options.zones_ = atoi(optarg);
+            break;
+         case 'n':
+            options.hosts_ = atoi(optarg);
+            break;
+         case 'g':
+            options.glueless_every_ = atoi(optarg);
+            break;
+         case 'c':
+            options.cname_chain_ = atoi(optarg);
+            break;
+         case 'l':
+            options.lame_every_ = atoi(optarg);
+            break;
+         case 'R':
+            options.latency_ms_[kRoot] = atoi(optarg);
+            break;
+         case 'T':
+            options.latency_ms_[kTld] = atoi(optarg);
+            break;
+         case 'Z':
+            options.latency_ms_[kZone] = atoi(optarg);
+            break;
+         case 's':
+            options.spread_ms_ = atoi(optarg);
+            break;
+         case 'j':
+            options.jitter_ms_ = atoi(optarg);
+            break;
+         case 'L':
+            options.loss_ = atof(optarg);
+            break;
+         case 'S':
+            options.seed_ = strtoull(optarg, NULL, 10);
+            break;
+         case 'H':
+            options.hints_ = optarg;
+            break;
+         case 'N':
+            options.names_ = optarg;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
+   if (options.port_ < 1 || options.port_ > 65535 || options.roots_ < 1 ||
+       options.roots_ > kMaxRoots || options.tlds_ < 1 ||
+       options.tlds_ > kMaxTlds || options.zones_ < 1 ||
+       options.zones_ > kMaxZones || options.hosts_ < 1 ||
+       options.glueless_every_ < 0 || options.glueless_every_ == 1 ||
+       options.cname_chain_ < 0 ||
+       options.lame_every_ < 0 || options.spread_ms_ < 0 ||
+       options.jitter_ms_ < 0 || options.loss_ < 0 || options.loss_ > 1)
+      usage(argv[0]);
+
+   // xorshift sticks at zero
+   uint64_t random = options.seed_ * 0x9e3779b97f4a7c15ULL + 1;
+
+   ServerMap servers;
+   std::vector<SimZone*> zones;
+   std::vector<std::string> hints;
+   std::vector<std::string> names;
+   BuildTree(options, &servers, &zones, &hints, &names, &random);
+
+   if ((options.hints_ && !WriteLines(options.hints_, hints, "")) ||
+       (options.names_ && !WriteLines(options.names_, names, " A")))
+      exit(EXIT_FAILURE);
+
+   int fd;
+   SYSCALL((fd = socket(AF_INET, SOCK_DGRAM, 0)), "socket");
+   int on = 1;
+   SYSCALL(setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)),
+         "setsockopt");
+
+   // Every address, but only 127/8 gets an answer
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   addr.sin_port = htons(options.port_);
+   SYSCALL(bind(fd, (struct sockaddr*) &addr, sizeof(addr)), "bind");
+
+   struct sigaction sigact;
+   memset(&sigact, 0, sizeof(sigact));
+   sigact.sa_handler = signal_handler;
+   SYSCALL(sigaction(SIGINT, &sigact, NULL), "sigaction");
+   SYSCALL(sigaction(SIGTERM, &sigact, NULL), "sigaction");
+
+   printf("%zu servers for %zu zones on port %d\n", servers.size(),
+         zones.size(), options.port_);
+   fflush(stdout);
+
+   TierStats stats[kTiers];
+   memset(stats, 0, sizeof(stats));
+   uint64_t unserved = 0;
+   DeliveryMap deliveries;
+
+   char bufs[kBatch][kMaxQueryLen];
+   char controls[kBatch][CMSG_SPACE(sizeof(struct in_pktinfo))];
+   struct sockaddr_in froms[kBatch];
+   struct mmsghdr msgs[kBatch];
+   struct iovec iovs[kBatch];
+   char* response = new char[kMaxResponseLen];
+   MALLOCCHECK(response);
+
+   while (!stop) {
+      uint64_t now_us = NowUs();
+      int wait_ms = kIdleWaitMs;
+      if (!deliveries.empty()) {
+         uint64_t due_us = deliveries.begin()->first;
+         wait_ms = due_us <= now_us ? 0 :
+               std::min((uint64_t) kIdleWaitMs, (due_us - now_us + 999) / 1000);
+      }
+
+      struct pollfd pollfd = { fd, POLLIN, 0 };
+      struct timespec wait = { 0, (long) wait_ms * 1000000 };
+      if (ppoll(&pollfd, 1, &wait, NULL) < 0 && errno != EINTR) {
+         perror("ppoll");
+         exit(EXIT_FAILURE);
+      }
+
+      for (int i = 0; i < kBatch; ++i) {
+         iovs[i].iov_base = bufs[i];
+         iovs[i].iov_len = kMaxQueryLen;
+         memset(&msgs[i], 0, sizeof(msgs[i]));
+         msgs[i].msg_hdr.msg_name = &froms[i];
+         msgs[i].msg_hdr.msg_namelen = sizeof(froms[i]);
+         msgs[i].msg_hdr.msg_iov = &iovs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+         msgs[i].msg_hdr.msg_control = controls[i];
+         msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+      }
+
+      int received = (pollfd.revents & POLLIN) ?
+            recvmmsg(fd, msgs, kBatch, MSG_DONTWAIT, NULL) : 0;
+      now_us = NowUs();
+      for (int i = 0; i < received; ++i) {
+         struct in_addr to;
+         to.s_addr = 0;
+         struct cmsghdr* cmsg;
+         for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+              cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_IP &&
+                cmsg->cmsg_type == IP_PKTINFO)
+               to = ((struct in_pktinfo*) CMSG_DATA(cmsg))->ipi_addr;
+         }
+
+         ServerMap::iterator it = servers.find(ntohl(to.s_addr));
+         if (it == servers.end()) {
+            unserved++;
+            continue;
+         }
+
+         const Server& server = it->second;
+         TierStats* tier = &stats[server.tier_];
+         tier->queries++;
+         if (options.loss_ && RandomFraction(&random) < options.loss_) {
+            tier->lost++;
+            continue;
+         }
+
+         bool refused = false;
+         int len = Respond(server, bufs[i], msgs[i].msg_len, response,
+               &refused);
+         if (!len) {
+            unserved++;
+            continue;
+         }
+         if (refused)
+            tier->refused++;
+         else
+            tier->answered++;
+
+         uint64_t delay_us = server.latency_us_;
+         if (options.jitter_ms_)
+            delay_us += NextRandom(&random) % (options.jitter_ms_ * 1000 + 1);
+
+         DeliveryMap::iterator delivery = deliveries.insert(
+               std::pair<const uint64_t, Delivery>(now_us + delay_us,
+               Delivery()));
+         delivery->second.packet_.assign(response, len);
+         delivery->second.to_ = froms[i];
+         delivery->second.from_ = to;
+      }
+
+      while (!deliveries.empty() && deliveries.begin()->first <= now_us) {
+         Send(fd, deliveries.begin()->second);
+         deliveries.erase(deliveries.begin());
+      }
+   }
+
+   uint64_t total = 0;
+   printf("%-6s %10s %10s %10s %10s\n", "server", "queries", "answered",
+         "refused", "lost");
+   for (int i = 0; i < kTiers; ++i) {
+      printf("%-6s %10llu %10llu %10llu %10llu\n", kTierNames[i],
+            (unsigned long long) stats[i].queries,
+            (unsigned long long) stats[i].answered,
+            (unsigned long long) stats[i].refused,
+            (unsigned long long) stats[i].lost);
+      total += stats[i].queries;
+   }
+   printf("total  %10llu  (%llu not for any server)\n",
+         (unsigned long long) total, (unsigned long long) unserved);
+
+   delete[] response;
+   for (size_t i = 0; i < zones.size(); ++i)
+      delete zones[i];
+   close(fd);
+   return 0;
+}
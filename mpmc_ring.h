@@ -0,0 +1,188 @@
+#ifndef _MPMC_RING_H_
+#define _MPMC_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// Bounded lock-free queue for any number of producers and consumers, after
+// Dmitry Vyukov's: a ring of preallocated slots, each with a sequence number
+// saying whether it is ready to be written or read on the current lap. A
+// producer claims a position with one CAS on the head and a consumer with
+// one on the tail; neither takes a lock, and nothing is allocated after
+// construction. Items are copied in and out.
+//
+// Consumers that find the ring empty may block in Pop(), which spins
+// briefly and then sleeps on a futex until a producer or Close() wakes it.
+template <typename T>
+class MpmcRing {
+  public:
+   // |slots| is rounded up to a power of two.
+   explicit MpmcRing(size_t slots);
+   ~MpmcRing();
+
+   // Returns false if the ring is full.
+   bool TryPush(const T& item);
+
+   // Returns false if the ring is empty.
+   bool TryPop(T* item);
+
+   // Waits for an item. Returns false once the ring is closed and empty.
+   bool Pop(T* item);
+
+   // Wakes every blocked consumer; they drain the ring and return.
+   void Close();
+
+   // Items in the ring; approximate while it is in use
+   size_t depth() const;
+
+  private:
+   // TryPop()s a blocked consumer makes before going to sleep
+   static const int kSpins = 64;
+
+   struct alignas(64) Slot {
+      std::atomic<size_t> seq_;
+      T item_;
+   };
+
+   Slot* slots_;
+   size_t mask_;
+
+   alignas(64) std::atomic<size_t> head_;   // next position to write
+   alignas(64) std::atomic<size_t> tail_;   // next position to read
+
+   // Sleeping consumers wait for the signal to change
+   alignas(64) std::atomic<uint32_t> signal_;
+   std::atomic<int> waiters_;
+   std::atomic<bool> closed_;
+
+   MpmcRing(const MpmcRing&);
+   void operator=(const MpmcRing&);
+};
+
+template <typename T>
+MpmcRing<T>::MpmcRing(size_t slots)
+      : head_(0),
+        tail_(0),
+        signal_(0),
+        waiters_(0),
+        closed_(false) {
+   size_t count = 1;
+   while (count < slots)
+      count <<= 1;
+
+   slots_ = new Slot[count];
+   MALLOCCHECK(slots_);
+   mask_ = count - 1;
+   for (size_t i = 0; i < count; ++i)
+      slots_[i].seq_.store(i, std::memory_order_relaxed);
+}
+
+template <typename T>
+MpmcRing<T>::~MpmcRing() {
+   delete[] slots_;
+}
+
+template <typename T>
+bool MpmcRing<T>::TryPush(const T& item) {
+   size_t pos = head_.load(std::memory_order_relaxed);
+   Slot* slot;
+   while (1) {
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq_.load(std::memory_order_acquire);
+      intptr_t lap = (intptr_t) seq - (intptr_t) pos;
+      if (lap == 0) {
+         if (head_.compare_exchange_weak(pos, pos + 1,
+               std::memory_order_relaxed))
+            break;
+      } else if (lap < 0) {
+         // Still holds the item from a lap ago
+         return false;
+      } else {
+         pos = head_.load(std::memory_order_relaxed);
+      }
+   }
+
+   slot->item_ = item;
+   slot->seq_.store(pos + 1, std::memory_order_release);
+
+   // Pairs with the fence in Pop(): either it sees the item, or we see it
+   // waiting
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (waiters_.load(std::memory_order_relaxed)) {
+      signal_.fetch_add(1, std::memory_order_release);
+      signal_.notify_one();
+   }
+   return true;
+}
+
+template <typename T>
+bool MpmcRing<T>::TryPop(T* item) {
+   size_t pos = tail_.load(std::memory_order_relaxed);
+   Slot* slot;
+   while (1) {
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq_.load(std::memory_order_acquire);
+      intptr_t lap = (intptr_t) seq - (intptr_t) (pos + 1);
+      if (lap == 0) {
+         if (tail_.compare_exchange_weak(pos, pos + 1,
+               std::memory_order_relaxed))
+            break;
+      } else if (lap < 0) {
+         // Not written yet
+         return false;
+      } else {
+         pos = tail_.load(std::memory_order_relaxed);
+      }
+   }
+
+   *item = slot->item_;
+   slot->seq_.store(pos + mask_ + 1, std::memory_order_release);
+   return true;
+}
+
+template <typename T>
+bool MpmcRing<T>::Pop(T* item) {
+   while (1) {
+      for (int i = 0; i < kSpins; ++i) {
+         if (TryPop(item))
+            return true;
+      }
+
+      uint32_t signal = signal_.load(std::memory_order_acquire);
+      waiters_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (TryPop(item)) {
+         waiters_.fetch_sub(1, std::memory_order_relaxed);
+         return true;
+      }
+
+      if (closed_.load(std::memory_order_acquire)) {
+         waiters_.fetch_sub(1, std::memory_order_relaxed);
+         return false;
+      }
+
+      signal_.wait(signal, std::memory_order_acquire);
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+   }
+}
+
+template <typename T>
+void MpmcRing<T>::Close() {
+   closed_.store(true, std::memory_order_release);
+   signal_.fetch_add(1, std::memory_order_release);
+   signal_.notify_all();
+}
+
+template <typename T>
+size_t MpmcRing<T>::depth() const {
+   size_t head = head_.load(std::memory_order_relaxed);
+   size_t tail = tail_.load(std::memory_order_relaxed);
+   return head > tail ? head - tail : 0;
+}
+
+#endif   // _MPMC_RING_H_
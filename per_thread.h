@@ -0,0 +1,108 @@
+#ifndef _PER_THREAD_H_
+#define _PER_THREAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// A T for each thread that asks for one, so that threads can count things
+// without sharing cache lines or taking locks, and another thread can add
+// the counts up when it wants them. Local() returns the calling thread's T,
+// allocating it the first time; ForEach() visits every T handed out so far.
+// T's fields must stand being read while their thread writes them: relaxed
+// atomics, or Histograms.
+//
+// Local() remembers the last PerThread<T> the thread used, so a thread that
+// alternates between two of the same T pays an allocation each switch and
+// soon runs out of slots; don't.
+template <typename T>
+class PerThread {
+  public:
+   PerThread();
+   ~PerThread();
+
+   // NULL once kMaxThreads threads have their own
+   T* Local();
+
+   template <typename Visit>
+   void ForEach(Visit visit) const;
+   template <typename Visit>
+   void ForEach(Visit visit);
+
+  private:
+   static const int kMaxThreads = 64;
+
+   const uint64_t id_;   // tells PerThreads apart in the thread-local cache
+   std::atomic<T*> locals_[kMaxThreads];   // NULL while unclaimed
+   std::atomic<int> claimed_;
+
+   static uint64_t NextId();
+
+   PerThread(const PerThread&);
+   void operator=(const PerThread&);
+};
+
+template <typename T>
+PerThread<T>::PerThread()
+      : id_(NextId()),
+        claimed_(0) {
+   for (int i = 0; i < kMaxThreads; ++i)
+      locals_[i].store(NULL, std::memory_order_relaxed);
+}
+
+template <typename T>
+PerThread<T>::~PerThread() {
+   for (int i = 0; i < kMaxThreads; ++i)
+      delete locals_[i].load(std::memory_order_relaxed);
+}
+
+template <typename T>
+T* PerThread<T>::Local() {
+   static thread_local uint64_t owner = 0;
+   static thread_local T* local = NULL;
+   if (owner == id_)
+      return local;
+
+   int i = claimed_.fetch_add(1, std::memory_order_relaxed);
+   if (i < kMaxThreads) {
+      local = new T;
+      MALLOCCHECK(local);
+      locals_[i].store(local, std::memory_order_release);
+   } else {
+      local = NULL;
+   }
+   owner = id_;
+   return local;
+}
+
+template <typename T>
+template <typename Visit>
+void PerThread<T>::ForEach(Visit visit) const {
+   for (int i = 0; i < kMaxThreads; ++i) {
+      const T* local = locals_[i].load(std::memory_order_acquire);
+      if (local)
+         visit(*local);
+   }
+}
+
+template <typename T>
+template <typename Visit>
+void PerThread<T>::ForEach(Visit visit) {
+   for (int i = 0; i < kMaxThreads; ++i) {
+      T* local = locals_[i].load(std::memory_order_acquire);
+      if (local)
+         visit(*local);
+   }
+}
+
+// static
+template <typename T>
+uint64_t PerThread<T>::NextId() {
+   static std::atomic<uint64_t> next(1);
+   return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+#endif   // _PER_THREAD_H_
@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "concurrency.h"
+#include "pipeline.h"
+
+namespace {
+// Longest a receiver waits before checking whether to stop
+const int kReceiveTimeoutMs = 100;
+
+// Longest a sender waits for room in the socket's send buffer before
+// dropping a datagram
+const int kSendTimeoutMs = 10;
+}
+
+Datagram& Datagram::operator=(const Datagram& datagram) {
+   // Only as much of the data as is there
+   addr_ = datagram.addr_;
+   enqueued_ns_ = datagram.enqueued_ns_;
+   queued_us_ = datagram.queued_us_;
+   received_ns_ = datagram.received_ns_;
+   received_ms_ = datagram.received_ms_;
+   kernel_wait_ns_ = datagram.kernel_wait_ns_;
+   cache_missed_ = datagram.cache_missed_;
+   len_ = datagram.len_;
+   memcpy(data_, datagram.data_, len_);
+   return *this;
+}
+
+Pipeline::Options::Options()
+      : receivers_(1),
+        workers_(1),
+        senders_(1),
+        ring_slots_(1024) {
+}
+
+Pipeline::Stage::Stage(size_t slots)
+      : ring_(slots),
+        items_(0),
+        dropped_(0),
+        peak_depth_(0),
+        total_wait_ns_(0),
+        max_wait_ns_(0) {
+}
+
+Pipeline::Pipeline(int sock, const Options& options, Handler* handler,
+                   SocketMonitor* monitor, const Clock* clock)
+      : sock_(sock),
+        options_(options),
+        handler_(handler),
+        monitor_(monitor),
+        clock_(clock),
+        to_workers_(options.ring_slots_),
+        to_owner_(options.ring_slots_),
+        next_sender_(0),
+        stop_(false),
+        receive_batches_(0),
+        send_batches_(0),
+        answered_(0) {
+   SYSCALL((event_fd_ = eventfd(0, EFD_NONBLOCK)), "eventfd");
+
+   for (int i = 0; i < options_.senders_; ++i)
+      to_senders_.push_back(new Stage(options_.ring_slots_));
+}
+
+Pipeline::~Pipeline() {
+   // Stop each stage once the one feeding it has stopped, so nothing is
+   // left in a ring
+   stop_.store(true);
+   size_t i = 0;
+   for (; i < threads_.size() && i < (size_t) options_.receivers_; ++i)
+      threads_[i].join();
+
+   to_workers_.ring_.Close();
+   for (; i < threads_.size() &&
+          i < (size_t) (options_.receivers_ + options_.workers_); ++i)
+      threads_[i].join();
+
+   for (size_t j = 0; j < to_senders_.size(); ++j)
+      to_senders_[j]->ring_.Close();
+   for (; i < threads_.size(); ++i)
+      threads_[i].join();
+
+   for (size_t j = 0; j < to_senders_.size(); ++j)
+      delete to_senders_[j];
+   close(event_fd_);
+}
+
+void Pipeline::Start() {
+   for (int i = 0; i < options_.receivers_; ++i)
+      threads_.push_back(StartThread(&Pipeline::Receive, this));
+   for (int i = 0; i < options_.workers_; ++i)
+      threads_.push_back(StartThread(&Pipeline::Work, this));
+   for (int i = 0; i < options_.senders_; ++i)
+      threads_.push_back(StartThread(&Pipeline::SendBatches, this,
+            to_senders_[i]));
+}
+
+bool Pipeline::PopForOwner(Datagram* datagram) {
+   if (to_owner_.ring_.TryPop(datagram)) {
+      Popped(&to_owner_, *datagram);
+      return true;
+   }
+
+   // Drained: clear the wakeup, then look again for a datagram pushed
+   // before it was cleared
+   uint64_t count;
+   if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      perror("read");
+
+   if (to_owner_.ring_.TryPop(datagram)) {
+      Popped(&to_owner_, *datagram);
+      return true;
+   }
+
+   return false;
+}
+
+bool Pipeline::Send(const struct sockaddr_in6& addr, const char* data,
+                    int len) {
+   if (len > (int) sizeof(((Datagram*) 0)->data_))
+      return false;
+
+   // Not read off the socket, so no receive times. Only the first |len|
+   // bytes of data_ go into the ring, so the rest needs no zeroing.
+   Datagram datagram;
+   datagram.addr_ = addr;
+   datagram.received_ns_ = 0;
+   datagram.received_ms_ = 0;
+   datagram.kernel_wait_ns_ = 0;
+   datagram.cache_missed_ = false;
+   datagram.queued_us_ = 0;
+   datagram.len_ = len;
+   memcpy(datagram.data_, data, len);
+
+   Stage* stage = to_senders_[next_sender_.fetch_add(1,
+         std::memory_order_relaxed) % to_senders_.size()];
+   return Push(stage, &datagram);
+}
+
+Pipeline::Stats Pipeline::stats() const {
+   Stats stats;
+   memset(&stats, 0, sizeof(Stats));
+
+   AddStats(&to_workers_, &stats.to_workers);
+   AddStats(&to_owner_, &stats.to_owner);
+   for (size_t i = 0; i < to_senders_.size(); ++i)
+      AddStats(to_senders_[i], &stats.to_senders);
+
+   stats.receive_batches = receive_batches_.load(std::memory_order_relaxed);
+   stats.send_batches = send_batches_.load(std::memory_order_relaxed);
+   stats.answered = answered_.load(std::memory_order_relaxed);
+   return stats;
+}
+
+// static
+uint64_t Pipeline::NowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// static
+bool Pipeline::Push(Stage* stage, Datagram* datagram) {
+   datagram->enqueued_ns_ = NowNs();
+   if (!stage->ring_.TryPush(*datagram)) {
+      stage->dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+   }
+
+   stage->items_.fetch_add(1, std::memory_order_relaxed);
+   RaiseTo(&stage->peak_depth_, stage->ring_.depth());
+   return true;
+}
+
+// static
+void Pipeline::Popped(Stage* stage, const Datagram& datagram) {
+   uint64_t wait_ns = NowNs() - datagram.enqueued_ns_;
+   stage->total_wait_ns_.fetch_add(wait_ns, std::memory_order_relaxed);
+   RaiseTo(&stage->max_wait_ns_, wait_ns);
+}
+
+// static
+void Pipeline::AddStats(const Stage* stage, StageStats* stats) {
+   stats->items += stage->items_.load(std::memory_order_relaxed);
+   stats->dropped += stage->dropped_.load(std::memory_order_relaxed);
+   stats->depth += stage->ring_.depth();
+   stats->peak_depth = std::max(stats->peak_depth,
+         (uint64_t) stage->peak_depth_.load(std::memory_order_relaxed));
+   stats->total_wait_ns += stage->total_wait_ns_.load(
+         std::memory_order_relaxed);
+   stats->max_wait_ns = std::max(stats->max_wait_ns,
+         (uint64_t) stage->max_wait_ns_.load(std::memory_order_relaxed));
+}
+
+void Pipeline::Receive() {
+   Datagram batch[kBatch];
+   struct mmsghdr msgs[kBatch];
+   struct iovec iovs[kBatch];
+   char controls[kBatch][SocketMonitor::kControlLen];
+   struct pollfd pollfd;
+   pollfd.fd = sock_;
+   pollfd.events = POLLIN;
+
+   while (!stop_.load(std::memory_order_relaxed)) {
+      // Wait for a datagram, but not so long as to miss being stopped
+      if (poll(&pollfd, 1, kReceiveTimeoutMs) <= 0)
+         continue;
+
+      // ICMP errors about datagrams sent earlier, for the owner
+      if (pollfd.revents & POLLERR)
+         ReadErrors();
+
+      memset(msgs, 0, sizeof(msgs));
+      for (int i = 0; i < kBatch; ++i) {
+         iovs[i].iov_base = batch[i].data_;
+         iovs[i].iov_len = sizeof(batch[i].data_);
+         msgs[i].msg_hdr.msg_name = &batch[i].addr_;
+         msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+         msgs[i].msg_hdr.msg_iov = &iovs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+         msgs[i].msg_hdr.msg_control = controls[i];
+         msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+      }
+
+      int n = recvmmsg(sock_, msgs, kBatch, 0, NULL);
+      if (n < 0) {
+         SocketMonitor::Error error = SocketMonitor::Classify(errno);
+
+         // The socket was closed under us
+         if (error == SocketMonitor::kFatal)
+            break;
+
+         if (error == SocketMonitor::kUnreachable)
+            ReadErrors();
+         else if (error == SocketMonitor::kDrop)
+            monitor_->CountError(error);
+         continue;
+      }
+
+      // One read of each clock stamps the batch
+      receive_batches_.fetch_add(1, std::memory_order_relaxed);
+      uint64_t received_ns = NowNs();
+      uint64_t received_ms = clock_->NowMs();
+      uint64_t realtime_ns = SocketMonitor::RealtimeNs();
+      uint64_t total_wait_ns = 0;
+      uint64_t max_wait_ns = 0;
+      for (int i = 0; i < n; ++i) {
+         batch[i].len_ = msgs[i].msg_len;
+         batch[i].received_ns_ = received_ns;
+         batch[i].received_ms_ = received_ms;
+         batch[i].kernel_wait_ns_ = monitor_->KernelWait(msgs[i].msg_hdr,
+               realtime_ns);
+         batch[i].cache_missed_ = false;
+         batch[i].queued_us_ = 0;
+         total_wait_ns += batch[i].kernel_wait_ns_;
+         max_wait_ns = std::max(max_wait_ns, batch[i].kernel_wait_ns_);
+         Push(&to_workers_, &batch[i]);
+      }
+      monitor_->Count(n, total_wait_ns, max_wait_ns);
+   }
+}
+
+void Pipeline::Work() {
+   Arena arena;
+   Datagram query;
+
+   // Replies are not read off the socket, so they have no receive times;
+   // the handler fills in only the data
+   Datagram reply;
+   reply.received_ns_ = 0;
+   reply.received_ms_ = 0;
+   reply.kernel_wait_ns_ = 0;
+   reply.cache_missed_ = false;
+   reply.queued_us_ = 0;
+
+   while (to_workers_.ring_.Pop(&query)) {
+      Popped(&to_workers_, query);
+
+      arena.Reset();
+      if (!handler_->AnswerQuery(&query, &reply, &arena)) {
+         PushForOwner(&query);
+         continue;
+      }
+
+      answered_.fetch_add(1, std::memory_order_relaxed);
+      if (!reply.len_)
+         continue;
+
+      reply.addr_ = query.addr_;
+      Stage* stage = to_senders_[next_sender_.fetch_add(1,
+            std::memory_order_relaxed) % to_senders_.size()];
+      Push(stage, &reply);
+   }
+}
+
+void Pipeline::SendBatches(Stage* stage) {
+   Datagram batch[kBatch];
+   struct mmsghdr msgs[kBatch];
+   struct iovec iovs[kBatch];
+
+   while (stage->ring_.Pop(&batch[0])) {
+      // Whatever else is already waiting goes in the same call
+      int n = 1;
+      Popped(stage, batch[0]);
+      while (n < kBatch && stage->ring_.TryPop(&batch[n])) {
+         Popped(stage, batch[n]);
+         n++;
+      }
+
+      memset(msgs, 0, n * sizeof(struct mmsghdr));
+      for (int i = 0; i < n; ++i) {
+         iovs[i].iov_base = batch[i].data_;
+         iovs[i].iov_len = batch[i].len_;
+         msgs[i].msg_hdr.msg_name = &batch[i].addr_;
+         msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+         msgs[i].msg_hdr.msg_iov = &iovs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      // A datagram that cannot be sent is counted and skipped
+      send_batches_.fetch_add(1, std::memory_order_relaxed);
+      int sent = 0;
+      bool retried = false;
+      while (sent < n) {
+         int ret = sendmmsg(sock_, msgs + sent, n - sent, 0);
+         if (ret > 0) {
+            sent += ret;
+            retried = false;
+            continue;
+         }
+
+         SocketMonitor::Error error = SocketMonitor::Classify(errno);
+         if (error == SocketMonitor::kRetry)
+            continue;
+         if (error == SocketMonitor::kWouldBlock) {
+            // The send buffer is full: wait for room
+            struct pollfd pollfd;
+            pollfd.fd = sock_;
+            pollfd.events = POLLOUT;
+            if (poll(&pollfd, 1, kSendTimeoutMs) > 0)
+               continue;
+         } else if (error == SocketMonitor::kUnreachable && !retried) {
+            // Most likely an earlier datagram's ICMP error, reported on
+            // this one instead of sending it
+            ReadErrors();
+            retried = true;
+            continue;
+         }
+         monitor_->CountError(error);
+         sent++;
+         retried = false;
+      }
+   }
+}
+
+void Pipeline::PushForOwner(Datagram* datagram) {
+   if (Push(&to_owner_, datagram))
+      WakeOwner();
+}
+
+void Pipeline::ReadErrors() {
+   if (monitor_->ReadErrors())
+      WakeOwner();
+}
+
+void Pipeline::WakeOwner() {
+   uint64_t one = 1;
+   if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("write");
+}
@@ -0,0 +1,176 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "clock.h"
+#include "mpmc_ring.h"
+#include "socket_monitor.h"
+
+// A datagram passing between pipeline stages, with its peer
+struct Datagram {
+   Datagram& operator=(const Datagram& datagram);
+
+   struct sockaddr_in6 addr_;
+   uint64_t enqueued_ns_;   // when it entered its current ring
+   uint64_t queued_us_;     // when the event loop first queued it, on its
+                            // clock; moving to another lane keeps it
+   uint64_t received_ns_;   // when it was read off the socket
+   uint64_t received_ms_;   // the same, on the server's Clock
+   uint64_t kernel_wait_ns_;   // in the socket's buffer before that
+   bool cache_missed_;   // a query a cache lookup has missed already
+   int len_;
+   char data_[ETH_DATA_LEN];
+};
+
+// Staged handling of a UDP socket, as an alternative to one thread doing
+// everything. Receiver threads read datagrams off the socket in batches
+// (recvmmsg) and hand them through an MpmcRing to worker threads. Workers
+// answer what they can (cache hits) through a Handler and pass the rest
+// (cache misses, upstream responses) to the owner's thread through another
+// ring, which wakes it through event_fd(). Replies go through one ring per
+// sender thread, which writes them out in batches (sendmmsg).
+//
+// The stages share nothing but the rings, whose slots are allocated up
+// front, so handing a datagram on is a copy into a slot and allocates
+// nothing. Each ring counts its traffic, depth and how long items waited.
+class Pipeline {
+  public:
+   struct Options {
+      Options();
+
+      int receivers_;
+      int workers_;
+      int senders_;
+      size_t ring_slots_;   // per ring
+   };
+
+   // Runs on the worker threads.
+   class Handler {
+     public:
+      virtual ~Handler() { }
+
+      // Answers |query| into |reply| and returns true, or returns false to
+      // have the owner's thread deal with it. A reply left empty is not
+      // sent. |arena| is the worker's own, reset before each call. The
+      // time to answer at is |query|'s received_ms_, read once for the
+      // batch it came in. A query passed on after missing in cache should
+      // have its cache_missed_ set, so the owner does not look again.
+      virtual bool AnswerQuery(Datagram* query, Datagram* reply,
+            Arena* arena) = 0;
+   };
+
+   // A ring between stages
+   struct StageStats {
+      uint64_t items;
+      uint64_t dropped;         // ring full
+      uint64_t depth;
+      uint64_t peak_depth;
+      uint64_t total_wait_ns;
+      uint64_t max_wait_ns;
+   };
+
+   struct Stats {
+      StageStats to_workers;
+      StageStats to_owner;
+      StageStats to_senders;    // over all senders
+      uint64_t receive_batches;
+      uint64_t send_batches;
+      uint64_t answered;        // by workers
+   };
+
+   // Reads from and writes to |sock|, which does not block, and tells
+   // |monitor| about what it reads and the errors it runs into. Datagrams
+   // read are stamped with the time on |clock|.
+   Pipeline(int sock, const Options& options, Handler* handler,
+         SocketMonitor* monitor, const Clock* clock);
+
+   // Stops and joins the threads.
+   ~Pipeline();
+
+   void Start();
+
+   // Readable while the owner has datagrams waiting, or |monitor| has
+   // errors.
+   int event_fd() const { return event_fd_; }
+
+   // Takes a datagram passed to the owner. Returns false if none is left.
+   bool PopForOwner(Datagram* datagram);
+
+   // Queues |len| bytes for a sender thread to send to |addr|. Returns false
+   // if they do not fit in a datagram or its ring is full.
+   bool Send(const struct sockaddr_in6& addr, const char* data, int len);
+
+   Stats stats() const;
+
+  private:
+   // Datagrams a receiver or sender handles per system call
+   static const int kBatch = 32;
+
+   struct Stage {
+      Stage(size_t slots);
+
+      MpmcRing<Datagram> ring_;
+      std::atomic<uint64_t> items_;
+      std::atomic<uint64_t> dropped_;
+      std::atomic<uint64_t> peak_depth_;
+      std::atomic<uint64_t> total_wait_ns_;
+      std::atomic<uint64_t> max_wait_ns_;
+   };
+
+   static uint64_t NowNs();
+
+   // Stamps |datagram| and puts it on |stage|'s ring, counting it.
+   static bool Push(Stage* stage, Datagram* datagram);
+
+   // Counts how long |datagram| waited on |stage|.
+   static void Popped(Stage* stage, const Datagram& datagram);
+
+   static void AddStats(const Stage* stage, StageStats* stats);
+
+   void Receive();
+   void Work();
+   void SendBatches(Stage* stage);
+
+   // Passes |datagram| to the owner's thread, waking it.
+   void PushForOwner(Datagram* datagram);
+
+   // Has the monitor read the socket's errors, and the owner woken to take
+   // them.
+   void ReadErrors();
+   void WakeOwner();
+
+   const int sock_;
+   const Options options_;
+   Handler* handler_;
+   SocketMonitor* monitor_;
+   const Clock* const clock_;
+   int event_fd_;
+
+   Stage to_workers_;
+   Stage to_owner_;
+   std::vector<Stage*> to_senders_;
+   std::atomic<uint64_t> next_sender_;
+
+   std::atomic<bool> stop_;
+   std::vector<std::thread> threads_;
+
+   std::atomic<uint64_t> receive_batches_;
+   std::atomic<uint64_t> send_batches_;
+   std::atomic<uint64_t> answered_;
+
+   Pipeline(const Pipeline&);
+   void operator=(const Pipeline&);
+};
+
+#endif   // _PIPELINE_H_
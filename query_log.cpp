@@ -0,0 +1,255 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "concurrency.h"
+#include "dns_packet.h"
+#include "query_log.h"
+
+namespace {
+const char kUnixPrefix[] = "unix:";
+
+uint64_t NowNs(clockid_t clock) {
+   struct timespec ts;
+   clock_gettime(clock, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Put8(std::vector<char>* out, uint8_t value) {
+   out->push_back(value);
+}
+
+void Put16(std::vector<char>* out, uint16_t value) {
+   out->push_back(value >> 8);
+   out->push_back(value);
+}
+
+void Put32(std::vector<char>* out, uint32_t value) {
+   Put16(out, value >> 16);
+   Put16(out, value);
+}
+
+void Put64(std::vector<char>* out, uint64_t value) {
+   Put32(out, value >> 32);
+   Put32(out, value);
+}
+
+// Writes all of |out|. Returns false on an error.
+bool WriteAll(int fd, const std::vector<char>& out) {
+   size_t done = 0;
+   while (done < out.size()) {
+      ssize_t n = write(fd, &out[done], out.size() - done);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return false;
+      done += n;
+   }
+   return true;
+}
+}
+
+const char QueryLog::kMagic[8] = { 'D', 'N', 'S', 'Q', 'L', 'O', 'G', 1 };
+
+QueryLog::Ring::Ring()
+      : head_(0),
+        tail_(0),
+        dropped_(0) {
+}
+
+QueryLog::QueryLog()
+      : fd_(-1),
+        realtime_offset_ns_(0),
+        stop_(false),
+        dropped_reported_(0),
+        logged_(0),
+        write_errors_(0) {
+}
+
+QueryLog::~QueryLog() {
+   // The thread drains what is left before it returns
+   if (fd_ >= 0) {
+      stop_.store(true, std::memory_order_relaxed);
+      thread_.join();
+      close(fd_);
+   }
+}
+
+bool QueryLog::Open(const std::string& path) {
+   int fd;
+   bool fresh = true;
+   if (!path.compare(0, sizeof(kUnixPrefix) - 1, kUnixPrefix)) {
+      std::string socket_path = path.substr(sizeof(kUnixPrefix) - 1);
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+         fprintf(stderr, "%s: bad socket path\n", path.c_str());
+         return false;
+      }
+      strcpy(addr.sun_path, socket_path.c_str());
+
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+         perror(path.c_str());
+         if (fd >= 0)
+            close(fd);
+         return false;
+      }
+   } else {
+      fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      struct stat st;
+      if (fd < 0 || fstat(fd, &st) < 0) {
+         perror(path.c_str());
+         if (fd >= 0)
+            close(fd);
+         return false;
+      }
+
+      // Appending to an earlier log: it already starts with the magic
+      fresh = !st.st_size;
+   }
+
+   if (fresh &&
+       !WriteAll(fd, std::vector<char>(kMagic, kMagic + sizeof(kMagic)))) {
+      perror(path.c_str());
+      close(fd);
+      return false;
+   }
+
+   realtime_offset_ns_ = NowNs(CLOCK_REALTIME) - NowNs(CLOCK_MONOTONIC);
+   fd_ = fd;
+
+   thread_ = StartThread(&QueryLog::Drain, this);
+   return true;
+}
+
+QueryLog::Stats QueryLog::stats() const {
+   Stats stats;
+   stats.logged = logged_.load(std::memory_order_relaxed);
+   stats.dropped = 0;
+   rings_.ForEach([&](const Ring& ring) {
+      stats.dropped += ring.dropped_.load(std::memory_order_relaxed);
+   });
+   stats.write_errors = write_errors_.load(std::memory_order_relaxed);
+   return stats;
+}
+
+void QueryLog::Append(const struct sockaddr_in6& client, const char* response,
+                      int len, uint64_t received_ns, Outcome outcome) {
+   Ring* ring = rings_.Local();
+   if (!ring)
+      return;
+
+   uint64_t head = ring->head_.load(std::memory_order_relaxed);
+   if (head - ring->tail_.load(std::memory_order_acquire) == kRingSlots) {
+      ring->dropped_.store(ring->dropped_.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+      return;
+   }
+
+   Slot* slot = &ring->slots_[head % kRingSlots];
+   const DnsPacket::Header* header = (const DnsPacket::Header*) response;
+   slot->received_ns_ = received_ns;
+   slot->answered_ns_ = NowNs(CLOCK_MONOTONIC);
+   slot->addr_ = client.sin6_addr;
+   slot->port_ = client.sin6_port;
+   slot->id_ = header->id;
+   slot->flags_ = header->flags;
+   slot->outcome_ = outcome;
+
+   // The question: a name of uncompressed labels, then type and class
+   int question_len = 0;
+   if (header->queries) {
+      int end = sizeof(DnsPacket::Header);
+      while (end < len && response[end] && !(response[end] & 0xc0))
+         end += (uint8_t) response[end] + 1;
+      end += 1 + 4;
+      if (end <= len && end - (int) sizeof(DnsPacket::Header) <= kMaxQuestion)
+         question_len = end - sizeof(DnsPacket::Header);
+   }
+   slot->question_len_ = question_len;
+   memcpy(slot->question_, response + sizeof(DnsPacket::Header),
+         question_len);
+
+   ring->head_.store(head + 1, std::memory_order_release);
+}
+
+void QueryLog::Drain() {
+   std::vector<char> out;
+   bool last = false;
+   while (!last) {
+      // Read stop_ first, so the last pass sees every record logged before
+      // the destructor set it
+      last = stop_.load(std::memory_order_relaxed);
+      if (!last)
+         usleep(kDrainIntervalMs * 1000);
+
+      out.clear();
+      if (!DrainOnce(&out))
+         continue;
+
+      if (!WriteAll(fd_, out))
+         write_errors_.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+bool QueryLog::DrainOnce(std::vector<char>* out) {
+   uint64_t offset = realtime_offset_ns_;
+   uint64_t logged = 0;
+   uint64_t dropped = 0;
+   rings_.ForEach([&](Ring& ring) {
+      dropped += ring.dropped_.load(std::memory_order_relaxed);
+
+      uint64_t tail = ring.tail_.load(std::memory_order_relaxed);
+      uint64_t head = ring.head_.load(std::memory_order_acquire);
+      for (; tail != head; ++tail) {
+         const Slot& slot = ring.slots_[tail % kRingSlots];
+         uint64_t latency_us = slot.received_ns_ &&
+               slot.answered_ns_ > slot.received_ns_ ?
+               (slot.answered_ns_ - slot.received_ns_) / 1000 : 0;
+
+         Put16(out, 1 + 8 + 4 + 16 + 2 + 2 + 2 + 1 + 1 + slot.question_len_);
+         Put8(out, kQuery);
+         Put64(out, slot.answered_ns_ + offset);
+         Put32(out, latency_us > UINT32_MAX ? UINT32_MAX : latency_us);
+         out->insert(out->end(), (const char*) &slot.addr_,
+               (const char*) &slot.addr_ + sizeof(slot.addr_));
+         Put16(out, ntohs(slot.port_));
+         Put16(out, ntohs(slot.id_));
+         Put16(out, ntohs(slot.flags_));
+         Put8(out, slot.outcome_);
+         Put8(out, slot.question_len_);
+         out->insert(out->end(), slot.question_,
+               slot.question_ + slot.question_len_);
+         logged++;
+      }
+      ring.tail_.store(tail, std::memory_order_release);
+   });
+
+   if (dropped > dropped_reported_) {
+      Put16(out, 1 + 8 + 8);
+      Put8(out, kDrops);
+      Put64(out, NowNs(CLOCK_REALTIME));
+      Put64(out, dropped - dropped_reported_);
+      dropped_reported_ = dropped;
+   }
+
+   logged_.fetch_add(logged, std::memory_order_relaxed);
+   return !out->empty();
+}
@@ -0,0 +1,137 @@
+#ifndef _QUERY_LOG_H_
+#define _QUERY_LOG_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smartalloc.h"
+
+#include "per_thread.h"
+
+// A log of every response sent to a client, in the manner of dnstap: the
+// thread sending it copies the response's header and question, the client
+// and two timestamps into a fixed-size slot of a ring of its own (one
+// memcpy, no lock, no system call), and a background thread drains the
+// rings every kDrainIntervalMs into a file or a unix socket. A full ring
+// drops the record and counts it rather than slow the sender down; the
+// count goes into the log too.
+//
+// The log is a stream of frames, every integer in network byte order:
+//
+//   file:    "DNSQLOG" 0x01, then frames
+//   frame:   u16 length of what follows, u8 kind, then by kind:
+//   kQuery:  u64 wall time answered, ns since the epoch
+//            u32 us from receipt to answer
+//            16 bytes client address (IPv6, IPv4-mapped), u16 client port
+//            u16 DNS id, u16 DNS flags of the response (rcode, TC, ...)
+//            u8 outcome (Outcome), u8 question length
+//            the question as on the wire: name, type, class
+//   kDrops:  u64 wall time, u64 records dropped since the last kDrops
+//
+// query_log_dump decodes it.
+class QueryLog {
+  public:
+   enum Kind {
+      kQuery = 1,
+      kDrops = 2
+   };
+
+   enum Outcome {
+      kCached = 0,      // answered from cache
+      kResolved = 1,    // answered after resolving
+      kRefused = 2,     // refused (ACL or admission control)
+      kRateLimited = 3, // dropped by the rate limiter, not sent
+      kFailed = 4       // resolution failed, answered SERVFAIL
+   };
+
+   static const char kMagic[8];
+
+   // Longest question logged, as its length is a byte on the wire; longer
+   // ones (names near the 255 limit, with type and class) are logged
+   // without it
+   static const int kMaxQuestion = 255;
+
+   struct Stats {
+      uint64_t logged;
+      uint64_t dropped;
+      uint64_t write_errors;
+   };
+
+   QueryLog();
+   ~QueryLog();
+
+   // Starts logging to |path|, appended to, or if it is "unix:PATH", to the
+   // unix stream socket listening there. Returns false, having said why, if
+   // it cannot be opened.
+   bool Open(const std::string& path);
+
+   bool enabled() const { return fd_ >= 0; }
+
+   // Logs |response| (|len| bytes) as sent to |client|. |received_ns| is
+   // when the query was read (LatencyStats::NowNs()). From any thread.
+   void Log(const struct sockaddr_in6& client, const char* response, int len,
+         uint64_t received_ns, Outcome outcome) {
+      if (fd_ >= 0)
+         Append(client, response, len, received_ns, outcome);
+   }
+
+   Stats stats() const;
+
+  private:
+   static const int kRingSlots = 2048;   // per thread
+   static const int kDrainIntervalMs = 10;
+
+   struct Slot {
+      uint64_t received_ns_;
+      uint64_t answered_ns_;
+      struct in6_addr addr_;
+      uint16_t port_;         // network order, as are id_ and flags_
+      uint16_t id_;
+      uint16_t flags_;
+      uint8_t outcome_;
+      uint8_t question_len_;
+      char question_[kMaxQuestion];
+   };
+
+   // Single producer (its thread), single consumer (the drain thread)
+   struct Ring {
+      Ring();
+
+      std::atomic<uint64_t> head_;   // next slot written
+      std::atomic<uint64_t> tail_;   // next slot read
+      std::atomic<uint64_t> dropped_;
+      Slot slots_[kRingSlots];
+   };
+
+   void Append(const struct sockaddr_in6& client, const char* response,
+         int len, uint64_t received_ns, Outcome outcome);
+
+   // Runs until the destructor stops it, draining every interval
+   void Drain();
+
+   // Moves what the rings hold into |out|, as frames. Returns false if
+   // there was nothing.
+   bool DrainOnce(std::vector<char>* out);
+
+   int fd_;   // -1 until opened
+   int64_t realtime_offset_ns_;   // wall clock minus monotonic clock
+   PerThread<Ring> rings_;
+   std::thread thread_;
+   std::atomic<bool> stop_;
+
+   // Written by the drain thread
+   uint64_t dropped_reported_;
+   std::atomic<uint64_t> logged_;
+   std::atomic<uint64_t> write_errors_;
+
+   QueryLog(const QueryLog&);
+   void operator=(const QueryLog&);
+};
+
+#endif   // _QUERY_LOG_H_
@@ -0,0 +1,272 @@
+// Prints a query log written by dns_server --query-log (see query_log.h),
+// one line a response:
+//
+//   2026-10-19T12:00:00.123456Z 192.0.2.1#53000 id=4711 www.example.com A
+//         NOERROR cached 12us
+//
+// from a file, from standard input, or, with --listen, from the unix socket
+// it makes for a server to connect to. Records the server had to drop are
+// reported where they were missed.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+#include "query_log.h"
+
+namespace {
+const int kMaxFrame = 65535;
+
+const char* const kRcodeNames[] = { "NOERROR", "FORMERR", "SERVFAIL",
+      "NXDOMAIN", "NOTIMP", "REFUSED" };
+
+const char* const kOutcomeNames[] = { "cached", "resolved", "refused",
+      "rate-limited", "failed" };
+
+// Reads exactly |len| bytes. Returns false at the end of the input, or on
+// an error, having said which.
+bool ReadAll(int fd, char* buf, size_t len, bool* eof) {
+   size_t done = 0;
+   while (done < len) {
+      ssize_t n = read(fd, buf + done, len - done);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0) {
+         perror("read");
+         return false;
+      }
+      if (!n) {
+         *eof = !done;
+         if (done)
+            fprintf(stderr, "Log ends in the middle of a record\n");
+         return false;
+      }
+      done += n;
+   }
+   return true;
+}
+
+uint16_t Get16(const uint8_t* p) {
+   return (uint16_t) p[0] << 8 | p[1];
+}
+
+uint32_t Get32(const uint8_t* p) {
+   return (uint32_t) Get16(p) << 16 | Get16(p + 2);
+}
+
+uint64_t Get64(const uint8_t* p) {
+   return (uint64_t) Get32(p) << 32 | Get32(p + 4);
+}
+
+std::string FormatTime(uint64_t ns) {
+   time_t secs = ns / 1000000000;
+   struct tm tm;
+   gmtime_r(&secs, &tm);
+   char buf[64];
+   size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+   snprintf(buf + len, sizeof(buf) - len, ".%06uZ",
+         (unsigned) (ns % 1000000000 / 1000));
+   return buf;
+}
+
+std::string FormatClient(const uint8_t* addr, uint16_t port) {
+   struct in6_addr addr6;
+   memcpy(&addr6, addr, sizeof(addr6));
+   char buf[INET6_ADDRSTRLEN];
+   if (IN6_IS_ADDR_V4MAPPED(&addr6))
+      inet_ntop(AF_INET, &addr6.s6_addr[12], buf, sizeof(buf));
+   else
+      inet_ntop(AF_INET6, &addr6, buf, sizeof(buf));
+   return std::string(buf) + "#" + std::to_string(port);
+}
+
+// The question's name and type, or "-" if the response had none
+std::string FormatQuestion(const uint8_t* question, int len) {
+   if (len < 5)
+      return "-";
+
+   std::string name;
+   int i = 0;
+   while (i < len - 4 && question[i]) {
+      if (!name.empty())
+         name += '.';
+      name.append((const char*) question + i + 1, question[i]);
+      i += question[i] + 1;
+   }
+   if (name.empty())
+      name = ".";
+
+   uint16_t type = Get16(question + len - 4);
+   std::string type_name = DnsPacket::TypeToString(type);
+   if (type_name == "UNKNOWN")
+      type_name = "TYPE" + std::to_string(type);
+   return name + " " + type_name;
+}
+
+void PrintQuery(const uint8_t* frame, int len) {
+   const int kFixed = 8 + 4 + 16 + 2 + 2 + 2 + 1 + 1;
+   if (len < kFixed || len < kFixed + frame[kFixed - 1]) {
+      fprintf(stderr, "Short query record, %d bytes\n", len);
+      return;
+   }
+
+   uint64_t wall_ns = Get64(frame);
+   uint32_t latency_us = Get32(frame + 8);
+   uint16_t port = Get16(frame + 28);
+   uint16_t id = Get16(frame + 30);
+   uint16_t flags = Get16(frame + 32);
+   uint8_t outcome = frame[34];
+   uint8_t question_len = frame[35];
+
+   int rcode = flags & 0xf;
+   std::string rcode_name = rcode < (int) (sizeof(kRcodeNames) /
+         sizeof(*kRcodeNames)) ? kRcodeNames[rcode] :
+         "RCODE" + std::to_string(rcode);
+   const char* outcome_name = outcome < sizeof(kOutcomeNames) /
+         sizeof(*kOutcomeNames) ? kOutcomeNames[outcome] : "?";
+
+   printf("%s %s id=%u %s %s%s %s %uus\n", FormatTime(wall_ns).c_str(),
+         FormatClient(frame + 12, port).c_str(), id,
+         FormatQuestion(frame + kFixed, question_len).c_str(),
+         rcode_name.c_str(), flags & 0x0200 ? " TC" : "", outcome_name,
+         latency_us);
+}
+
+void PrintDrops(const uint8_t* frame, int len) {
+   if (len < 16) {
+      fprintf(stderr, "Short drops record, %d bytes\n", len);
+      return;
+   }
+   printf("%s -- %llu records dropped\n", FormatTime(Get64(frame)).c_str(),
+         (unsigned long long) Get64(frame + 8));
+}
+
+// Prints the log read from |fd|. Returns false if it is not one, or is cut
+// short.
+bool Dump(int fd) {
+   char magic[sizeof(QueryLog::kMagic)];
+   bool eof = false;
+   if (!ReadAll(fd, magic, sizeof(magic), &eof) ||
+       memcmp(magic, QueryLog::kMagic, sizeof(magic))) {
+      fprintf(stderr, "Not a query log\n");
+      return false;
+   }
+
+   uint8_t frame[kMaxFrame];
+   for (;;) {
+      uint8_t length[2];
+      if (!ReadAll(fd, (char*) length, sizeof(length), &eof))
+         return eof;
+      int len = Get16(length);
+      if (!len || !ReadAll(fd, (char*) frame, len, &eof)) {
+         if (!len)
+            fprintf(stderr, "Empty record\n");
+         return false;
+      }
+
+      // Kinds this doesn't know are skipped; the length says how far
+      if (frame[0] == QueryLog::kQuery)
+         PrintQuery(frame + 1, len - 1);
+      else if (frame[0] == QueryLog::kDrops)
+         PrintDrops(frame + 1, len - 1);
+   }
+}
+
+// Makes a unix socket at |path| and returns the first connection to it, or
+// -1, having said why
+int AcceptOne(const char* path) {
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "%s: path too long\n", path);
+      return -1;
+   }
+   strcpy(addr.sun_path, path);
+
+   int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listen_fd < 0) {
+      perror("socket");
+      return -1;
+   }
+   unlink(path);
+   if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+       listen(listen_fd, 1) < 0) {
+      perror(path);
+      close(listen_fd);
+      return -1;
+   }
+
+   int fd = accept(listen_fd, NULL, NULL);
+   if (fd < 0)
+      perror("accept");
+   close(listen_fd);
+   unlink(path);
+   return fd;
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options] [FILE]\n"
+         "  FILE                  the log to print (standard input)\n"
+         "  --listen=PATH         instead, make a unix socket at PATH and\n"
+         "                        print what the server sends to it, as\n"
+         "                        --query-log=unix:PATH\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   const char* listen_path = NULL;
+
+   static struct option long_options[] = {
+      { "listen",      required_argument, NULL, 'l' },
+      { NULL,          0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 'l':
+            listen_path = optarg;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (argc - optind > 1 || (listen_path && optind < argc))
+      usage(argv[0]);
+
+   int fd = STDIN_FILENO;
+   if (listen_path) {
+      fd = AcceptOne(listen_path);
+   } else if (optind < argc) {
+      fd = open(argv[optind], O_RDONLY);
+      if (fd < 0)
+         perror(argv[optind]);
+   }
+   if (fd < 0)
+      exit(EXIT_FAILURE);
+
+   bool ok = Dump(fd);
+   if (fd != STDIN_FILENO)
+      close(fd);
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
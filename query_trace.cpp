@@ -0,0 +1,261 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+#include "latency_stats.h"
+#include "query_trace.h"
+
+namespace {
+// "www.example.com A"
+std::string QueryName(const DnsQuery& query) {
+   std::string name;
+   const char* p = query.name().c_str();
+   while (*p) {
+      name.append(p + 1, *p);
+      name.push_back('.');
+      p += *p + 1;
+   }
+   if (name.empty())
+      name = ".";
+
+   return name + " " + DnsPacket::TypeToString(ntohs(query.type()));
+}
+
+// "192.0.2.1#53"
+std::string ServerName(const struct sockaddr_in6& addr) {
+   char buf[INET6_ADDRSTRLEN];
+   if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr))
+      inet_ntop(AF_INET, &addr.sin6_addr.s6_addr[12], buf, sizeof(buf));
+   else
+      inet_ntop(AF_INET6, &addr.sin6_addr, buf, sizeof(buf));
+   return std::string(buf) + "#" + std::to_string(ntohs(addr.sin6_port));
+}
+
+// |text| as a JSON string, quotes and all
+std::string JsonString(const std::string& text) {
+   std::string out = "\"";
+   for (size_t i = 0; i < text.size(); ++i) {
+      unsigned char c = text[i];
+      if (c == '"' || c == '\\') {
+         out.push_back('\\');
+         out.push_back(c);
+      } else if (c < 0x20 || c >= 0x7f) {
+         char escape[8];
+         snprintf(escape, sizeof(escape), "\\u%04x", c);
+         out.append(escape);
+      } else {
+         out.push_back(c);
+      }
+   }
+   out.push_back('"');
+   return out;
+}
+}
+
+QueryTrace::QueryTrace(Tracer* tracer, uint64_t id, const DnsQuery& query,
+                       const struct sockaddr_in6& client, bool sampled)
+      : tracer_(tracer),
+        id_(id),
+        query_(QueryName(query)),
+        client_(client),
+        sampled_(sampled),
+        start_ns_(LatencyStats::NowNs()),
+        finished_ns_(0),
+        refs_(1) {
+   lanes_.push_back(query_);
+}
+
+void QueryTrace::Add(int lane, Phase phase, const char* name,
+                     const DnsQuery* query,
+                     const struct sockaddr_in6* server, const char* note,
+                     int64_t value) {
+   events_.push_back(Event());
+   Event& event = events_.back();
+   event.ns_ = LatencyStats::NowNs();
+   event.phase_ = phase;
+   event.lane_ = lane;
+   event.name_ = name;
+   if (query)
+      event.query_ = QueryName(*query);
+   event.has_server_ = server != NULL;
+   if (server)
+      event.server_ = *server;
+   event.note_ = note;
+   event.value_ = value;
+}
+
+int QueryTrace::NewLane(const DnsQuery& query) {
+   lanes_.push_back(QueryName(query));
+   return lanes_.size() - 1;
+}
+
+void QueryTrace::Unref() {
+   if (!--refs_)
+      tracer_->Done(this);
+}
+
+void QueryTrace::Finish() {
+   finished_ns_ = LatencyStats::NowNs();
+   Unref();
+}
+
+void QueryTrace::WriteJson(FILE* out, int64_t realtime_offset_ns) const {
+   fprintf(out, "{\"id\":%llu,\"query\":%s,\"client\":%s,\"start_ns\":%llu,"
+         "\"duration_us\":%llu,\"sampled\":%s,\"lanes\":[",
+         (unsigned long long) id_, JsonString(query_).c_str(),
+         JsonString(ServerName(client_)).c_str(),
+         (unsigned long long) (start_ns_ + realtime_offset_ns),
+         (unsigned long long) (duration_ns() / 1000),
+         sampled_ ? "true" : "false");
+   for (size_t i = 0; i < lanes_.size(); ++i)
+      fprintf(out, "%s%s", i ? "," : "", JsonString(lanes_[i]).c_str());
+   fprintf(out, "],\"events\":[");
+
+   for (size_t i = 0; i < events_.size(); ++i) {
+      const Event& event = events_[i];
+      fprintf(out, "%s{\"us\":%.3f,\"lane\":%d,\"ph\":\"%c\",\"name\":\"%s\"",
+            i ? "," : "", (event.ns_ - start_ns_) / 1000.0, event.lane_,
+            event.phase_, event.name_);
+      if (!event.query_.empty())
+         fprintf(out, ",\"query\":%s", JsonString(event.query_).c_str());
+      if (event.has_server_)
+         fprintf(out, ",\"server\":%s",
+               JsonString(ServerName(event.server_)).c_str());
+      if (event.note_)
+         fprintf(out, ",\"note\":\"%s\"", event.note_);
+      if (event.value_ >= 0)
+         fprintf(out, ",\"value\":%lld", (long long) event.value_);
+      fprintf(out, "}");
+   }
+   fprintf(out, "]}\n");
+}
+
+void QueryTrace::WriteChrome(FILE* out) const {
+   std::string process = "#" + std::to_string(id_) + " " + query_ + " for " +
+         ServerName(client_);
+   fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%llu,"
+         "\"args\":{\"name\":%s}},\n", (unsigned long long) id_,
+         JsonString(process).c_str());
+   for (size_t i = 0; i < lanes_.size(); ++i) {
+      std::string thread = (i ? "lookup " : "client ") + lanes_[i];
+      fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%llu,"
+            "\"tid\":%d,\"args\":{\"name\":%s}},\n",
+            (unsigned long long) id_, (int) i, JsonString(thread).c_str());
+   }
+
+   for (size_t i = 0; i < events_.size(); ++i) {
+      const Event& event = events_[i];
+      fprintf(out, "{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%.3f,"
+            "\"pid\":%llu,\"tid\":%d,\"args\":{", event.name_, event.phase_,
+            event.phase_ == kInstant ? "\"s\":\"t\"," : "",
+            event.ns_ / 1000.0, (unsigned long long) id_, event.lane_);
+      const char* separator = "";
+      if (!event.query_.empty()) {
+         fprintf(out, "\"query\":%s", JsonString(event.query_).c_str());
+         separator = ",";
+      }
+      if (event.has_server_) {
+         fprintf(out, "%s\"server\":%s", separator,
+               JsonString(ServerName(event.server_)).c_str());
+         separator = ",";
+      }
+      if (event.note_) {
+         fprintf(out, "%s\"note\":\"%s\"", separator, event.note_);
+         separator = ",";
+      }
+      if (event.value_ >= 0)
+         fprintf(out, "%s\"value\":%lld", separator, (long long) event.value_);
+      fprintf(out, "}},\n");
+   }
+}
+
+TraceLane TraceLane::Fork(const DnsQuery& query) const {
+   if (!trace_)
+      return TraceLane();
+
+   trace_->Ref();
+   return TraceLane(trace_, trace_->NewLane(query));
+}
+
+Tracer::Tracer()
+      : out_(NULL),
+        format_(kJson),
+        sample_(0),
+        slow_ns_(0),
+        realtime_offset_ns_(0),
+        resolutions_(0) {
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+Tracer::~Tracer() {
+   if (out_)
+      fclose(out_);
+}
+
+bool Tracer::Open(const std::string& path, Format format, int sample,
+                  int slow_ms) {
+   if (sample <= 0 && slow_ms <= 0) {
+      fprintf(stderr, "%s: no resolutions would be traced; give a sample "
+            "rate or a latency threshold\n", path.c_str());
+      return false;
+   }
+
+   out_ = fopen(path.c_str(), "a");
+   if (!out_) {
+      perror(path.c_str());
+      return false;
+   }
+
+   // Chrome's array format may be left unterminated, so traces can be
+   // appended for as long as the server runs
+   fseek(out_, 0, SEEK_END);
+   if (format == kChrome && !ftell(out_))
+      fprintf(out_, "[\n");
+
+   struct timespec realtime;
+   clock_gettime(CLOCK_REALTIME, &realtime);
+   realtime_offset_ns_ = (uint64_t) realtime.tv_sec * 1000000000 +
+         realtime.tv_nsec - LatencyStats::NowNs();
+
+   format_ = format;
+   sample_ = sample > 0 ? sample : 0;
+   slow_ns_ = slow_ms > 0 ? (uint64_t) slow_ms * 1000000 : 0;
+   return true;
+}
+
+QueryTrace* Tracer::StartTrace(const DnsQuery& query,
+                               const struct sockaddr_in6& client) {
+   resolutions_++;
+   bool sampled = sample_ && !(resolutions_ % sample_);
+   if (!sampled && !slow_ns_)
+      return NULL;
+
+   stats_.started++;
+   QueryTrace* trace = new QueryTrace(this, resolutions_, query, client,
+         sampled);
+   MALLOCCHECK(trace);
+   return trace;
+}
+
+void Tracer::Done(QueryTrace* trace) {
+   if (trace->sampled() || (slow_ns_ && trace->duration_ns() >= slow_ns_)) {
+      if (format_ == kChrome)
+         trace->WriteChrome(out_);
+      else
+         trace->WriteJson(out_, realtime_offset_ns_);
+      fflush(out_);
+      stats_.written++;
+   }
+
+   delete trace;
+}
@@ -0,0 +1,226 @@
+#ifndef _QUERY_TRACE_H_
+#define _QUERY_TRACE_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+
+class Tracer;
+
+// Everything the resolver did for one client query: each Resolve() of it
+// and of the names it led to (CNAME targets, nameserver addresses), each
+// cache consult, each upstream send, response and timeout, with the time
+// it happened. Tasks that run alongside the client's (nameserver lookups)
+// record into lanes of their own, so spans nest within a lane.
+//
+// A lookup started for one client may outlive it, and keeps the trace
+// alive with Ref() until it is done; the last Unref() hands the trace back
+// to its Tracer, which writes it out or drops it. Event loop only.
+class QueryTrace {
+  public:
+   enum Phase {
+      kBegin = 'B',
+      kEnd = 'E',
+      kInstant = 'i'
+   };
+
+   QueryTrace(Tracer* tracer, uint64_t id, const DnsQuery& query,
+         const struct sockaddr_in6& client, bool sampled);
+
+   // Records an event in |lane|. |query|, |server| and |note| may be NULL;
+   // |value| is left out if negative.
+   void Add(int lane, Phase phase, const char* name, const DnsQuery* query,
+         const struct sockaddr_in6* server, const char* note, int64_t value);
+
+   // A new lane, for a task resolving |query|
+   int NewLane(const DnsQuery& query);
+
+   void Ref() { refs_++; }
+   void Unref();
+
+   // The client's answer is ready (or it will get none)
+   void Finish();
+
+   uint64_t id() const { return id_; }
+   bool sampled() const { return sampled_; }
+
+   // From the start to Finish()
+   uint64_t duration_ns() const { return finished_ns_ - start_ns_; }
+
+   // One JSON object, on one line
+   void WriteJson(FILE* out, int64_t realtime_offset_ns) const;
+
+   // Events in Chrome's trace event format, each followed by a comma: a
+   // process per trace, a thread per lane
+   void WriteChrome(FILE* out) const;
+
+  private:
+   struct Event {
+      uint64_t ns_;
+      char phase_;
+      int lane_;
+      const char* name_;
+      std::string query_;
+      struct sockaddr_in6 server_;
+      bool has_server_;
+      const char* note_;
+      int64_t value_;
+   };
+
+   Tracer* const tracer_;
+   const uint64_t id_;
+   const std::string query_;
+   const struct sockaddr_in6 client_;
+   const bool sampled_;
+   const uint64_t start_ns_;
+   uint64_t finished_ns_;
+   int refs_;
+
+   typedef std::vector<Event, STLsmartalloc<Event> > EventVec;
+   typedef std::vector<std::string, STLsmartalloc<std::string> > LaneVec;
+
+   EventVec events_;
+   LaneVec lanes_;   // what each lane resolves
+
+   QueryTrace(const QueryTrace&);
+   void operator=(const QueryTrace&);
+};
+
+// Where a task records to: its lane of a trace, or nowhere. Cheap to copy,
+// and to call when there is no trace, which is the usual case.
+class TraceLane {
+  public:
+   TraceLane()
+         : trace_(NULL),
+           lane_(0) { }
+   TraceLane(QueryTrace* trace, int lane)
+         : trace_(trace),
+           lane_(lane) { }
+
+   bool enabled() const { return trace_ != NULL; }
+   QueryTrace* trace() const { return trace_; }
+   int lane() const { return lane_; }
+
+   void Instant(const char* name, const DnsQuery* query = NULL,
+         const struct sockaddr_in6* server = NULL, const char* note = NULL,
+         int64_t value = -1) const {
+      if (trace_)
+         trace_->Add(lane_, QueryTrace::kInstant, name, query, server, note,
+               value);
+   }
+
+   // A new lane of the same trace, for a task of its own resolving |query|,
+   // holding a reference to the trace. Release() drops it.
+   TraceLane Fork(const DnsQuery& query) const;
+   void Release() const {
+      if (trace_)
+         trace_->Unref();
+   }
+
+  private:
+   QueryTrace* trace_;
+   int lane_;
+};
+
+// A span of a lane, from construction to destruction, so that every way
+// out of a coroutine closes it. Note() says how it ended.
+class TraceSpan {
+  public:
+   TraceSpan(const TraceLane& lane, const char* name,
+         const DnsQuery* query = NULL)
+         : lane_(lane),
+           name_(name),
+           note_(NULL),
+           value_(-1) {
+      if (lane_.enabled())
+         lane_.trace()->Add(lane_.lane(), QueryTrace::kBegin, name_, query,
+               NULL, NULL, -1);
+   }
+   ~TraceSpan() {
+      if (lane_.enabled())
+         lane_.trace()->Add(lane_.lane(), QueryTrace::kEnd, name_, NULL,
+               NULL, note_, value_);
+   }
+
+   void Note(const char* note, int64_t value = -1) {
+      note_ = note;
+      value_ = value;
+   }
+
+  private:
+   const TraceLane lane_;
+   const char* const name_;
+   const char* note_;
+   int64_t value_;
+
+   TraceSpan(const TraceSpan&);
+   void operator=(const TraceSpan&);
+};
+
+// Decides which resolutions are traced, and writes their traces to a file:
+// every |sample|th resolution's, and, if |slow_ms| is set, that of every
+// resolution taking at least that long (which means tracing them all until
+// they finish). Off unless opened. Event loop only.
+class Tracer {
+  public:
+   enum Format {
+      kJson,     // a JSON object a line, a trace each
+      kChrome    // Chrome's trace event format (chrome://tracing, Perfetto)
+   };
+
+   struct Stats {
+      uint64_t started;
+      uint64_t written;
+   };
+
+   Tracer();
+   ~Tracer();
+
+   // Starts writing traces to |path| (appending). Returns false, having
+   // said why, if it cannot be opened or nothing would be traced.
+   bool Open(const std::string& path, Format format, int sample, int slow_ms);
+
+   bool enabled() const { return out_ != NULL; }
+
+   // A trace for the resolution of |client|'s |query|, or NULL if it is not
+   // to be traced. Finish() it once the client's answer is ready.
+   QueryTrace* Start(const DnsQuery& query,
+         const struct sockaddr_in6& client) {
+      return out_ ? StartTrace(query, client) : NULL;
+   }
+   void Finish(QueryTrace* trace) {
+      if (trace)
+         trace->Finish();
+   }
+
+   const Stats& stats() const { return stats_; }
+
+  private:
+   friend class QueryTrace;
+
+   QueryTrace* StartTrace(const DnsQuery& query,
+         const struct sockaddr_in6& client);
+
+   // |trace|'s last reference is gone: write it if it is wanted, and free it
+   void Done(QueryTrace* trace);
+
+   FILE* out_;   // NULL unless opened
+   Format format_;
+   int sample_;             // 0 if not sampling
+   uint64_t slow_ns_;       // 0 if not keeping slow traces
+   int64_t realtime_offset_ns_;   // wall clock minus monotonic clock
+   uint64_t resolutions_;
+   Stats stats_;
+
+   Tracer(const Tracer&);
+   void operator=(const Tracer&);
+};
+
+#endif   // _QUERY_TRACE_H_
@@ -0,0 +1,214 @@
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+#include "rate_limiter.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+
+const int kHeaderSize = 12;
+
+// Bucket layout, high bits to low; the rest is when it will be full
+const int kTagShift = 52;        // 12 bits of the key
+const int kSlipShift = 48;       // 4 bits: drops since the last slip
+const uint64_t kTagMask = 0xfff;
+const uint64_t kSlipMask = 0xf;
+const uint64_t kFullMask = 0xffffffffffffULL;   // microseconds, wrapping
+
+const int kMaxSlip = 15;
+
+const uint64_t kFnvOffset = 0xcbf29ce484222325ULL;
+const uint64_t kFnvPrime = 0x100000001b3ULL;
+
+size_t RoundUpToPowerOfTwo(size_t n) {
+   size_t size = 1;
+   while (size < n)
+      size <<= 1;
+   return size;
+}
+
+}
+
+RateLimiter::Options::Options()
+      : rate_(0),
+        burst_(0),
+        slip_(2),
+        log_only_(false),
+        slots_(65536) {
+}
+
+RateLimiter::RateLimiter(const Options& options)
+      : options_(options),
+        slip_(options.slip_ < kMaxSlip ? options.slip_ : kMaxSlip),
+        buckets_(NULL),
+        mask_(0),
+        evictions_(0) {
+   for (int i = 0; i < kCategories; ++i)
+      checked_[i] = 0;
+   for (int i = 0; i < kVerdicts; ++i)
+      verdicts_[i] = 0;
+
+   // A bucket of |burst| tokens, refilled at |rate_| a second, is full
+   // again once it has been left alone for |burst| intervals. A response
+   // takes a token, pushing that time back by an interval; the bucket is
+   // empty when it is more than |burst| intervals away.
+   int burst = options_.burst_ > 0 ? options_.burst_ : options_.rate_;
+   interval_us_ = options_.rate_ > 0 ? 1000000 / options_.rate_ : 0;
+   burst_us_ = interval_us_ * burst;
+
+   if (!enabled())
+      return;
+
+   size_t slots = RoundUpToPowerOfTwo(options_.slots_);
+   buckets_ = new std::atomic<uint64_t>[slots];
+   MALLOCCHECK(buckets_);
+   for (size_t i = 0; i < slots; ++i)
+      buckets_[i].store(0, std::memory_order_relaxed);
+   mask_ = slots - 1;
+}
+
+RateLimiter::~RateLimiter() {
+   delete[] buckets_;
+}
+
+RateLimiter::Verdict RateLimiter::Check(const struct sockaddr_in6& client,
+      char* response, int* len, uint64_t now_ms) {
+   if (*len < kHeaderSize)
+      return kSend;
+
+   Category category = CategoryOf(response);
+   int question_end;
+   uint64_t key = Key(client, category, response, *len, &question_end);
+   uint64_t tag = key >> kTagShift & kTagMask;
+   std::atomic<uint64_t>* bucket = &buckets_[key & mask_];
+   uint64_t now = now_ms * 1000 & kFullMask;
+
+   uint64_t old = bucket->load(std::memory_order_relaxed);
+   Verdict verdict;
+   bool evicted;
+   for (;;) {
+      // How long until the bucket is full, and the drops since a slip
+      uint64_t ahead, slips;
+      evicted = old && (old >> kTagShift & kTagMask) != tag;
+      if (!old || evicted) {
+         ahead = 0;
+         slips = 0;
+      } else {
+         ahead = ((old & kFullMask) - now) & kFullMask;
+         slips = old >> kSlipShift & kSlipMask;
+
+         // Full some time ago (the clock wraps): as full as it gets
+         if (ahead > kFullMask / 2)
+            ahead = 0;
+      }
+
+      if (ahead + interval_us_ <= burst_us_) {
+         ahead += interval_us_;
+         verdict = kSend;
+      } else if (slip_ && ++slips >= (uint64_t) slip_) {
+         slips = 0;
+         verdict = kSlip;
+      } else {
+         verdict = kDrop;
+      }
+
+      uint64_t updated = tag << kTagShift | slips << kSlipShift |
+            ((now + ahead) & kFullMask);
+      if (bucket->compare_exchange_weak(old, updated,
+            std::memory_order_relaxed))
+         break;
+   }
+
+   checked_[category].fetch_add(1, std::memory_order_relaxed);
+   verdicts_[verdict].fetch_add(1, std::memory_order_relaxed);
+   if (evicted)
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+
+   if (options_.log_only_)
+      return kSend;
+
+   if (verdict == kSlip) {
+      if (!question_end)
+         return kDrop;
+
+      // Header and question only, with TC set and the counts to match
+      response[2] |= 0x02;
+      memset(response + 6, 0, 6);
+      *len = question_end;
+   }
+   return verdict;
+}
+
+RateLimiter::Stats RateLimiter::stats() const {
+   Stats stats;
+   for (int i = 0; i < kCategories; ++i)
+      stats.checked[i] = checked_[i].load(std::memory_order_relaxed);
+   for (int i = 0; i < kVerdicts; ++i)
+      stats.verdicts[i] = verdicts_[i].load(std::memory_order_relaxed);
+   stats.evictions = evictions_.load(std::memory_order_relaxed);
+   return stats;
+}
+
+// static
+uint64_t RateLimiter::Key(const struct sockaddr_in6& client,
+      Category category, const char* response, int len, int* question_end) {
+   const uint8_t* addr = client.sin6_addr.s6_addr;
+   uint64_t hash = kFnvOffset;
+
+   // The client's /24 if IPv4 (mapped), else its /56
+   int first = IN6_IS_ADDR_V4MAPPED(&client.sin6_addr) ? 12 : 0;
+   int last = first ? 15 : 7;
+   for (int i = first; i < last; ++i)
+      hash = (hash ^ addr[i]) * kFnvPrime;
+   hash = (hash ^ (uint8_t) category) * kFnvPrime;
+
+   // The query name, case folded; only the question is hashed, so a
+   // compression pointer cannot appear
+   *question_end = 0;
+   uint16_t questions = (uint8_t) response[4] << 8 | (uint8_t) response[5];
+   int offset = kHeaderSize;
+   while (questions && offset < len) {
+      uint8_t label = response[offset++];
+      if (!label) {
+         if (offset + 4 <= len)
+            *question_end = offset + 4;
+         break;
+      }
+      if (label > 63 || offset + label > len)
+         break;
+      for (int i = 0; i < label; ++i) {
+         uint8_t c = response[offset + i];
+         if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+         hash = (hash ^ c) * kFnvPrime;
+      }
+      hash = (hash ^ '.') * kFnvPrime;
+      offset += label;
+   }
+
+   // Spread FNV's weak high bits, which make the tag
+   hash ^= hash >> 29;
+   hash *= 0xbf58476d1ce4e5b9ULL;
+   hash ^= hash >> 32;
+   return hash;
+}
+
+// static
+RateLimiter::Category RateLimiter::CategoryOf(const char* response) {
+   int rcode = response[3] & 0x0f;
+   uint16_t answers = (uint8_t) response[6] << 8 | (uint8_t) response[7];
+   if (rcode == constants::response_code::NoError)
+      return answers ? kAnswer : kNoData;
+   if (rcode == constants::response_code::NameError)
+      return kNxDomain;
+   return kError;
+}
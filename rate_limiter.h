@@ -0,0 +1,104 @@
+#ifndef _RATE_LIMITER_H_
+#define _RATE_LIMITER_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// Response Rate Limiting: caps the responses sent per (client network,
+// response category, query name), so the server makes a poor reflection
+// amplifier. A spoofed flood aimed at a victim repeats the same few keys
+// and runs their buckets dry; real clients, asking for many names, do not.
+//
+// Each key has a token bucket, refilled at |rate_| tokens a second up to
+// |burst_|. A response that finds its bucket empty is dropped, except
+// every |slip_|th one, which is sent truncated instead: a real client
+// behind a spoofed address retries over TCP, and the attacker gains
+// nothing. In log-only mode every response is sent, and the counts say
+// what would have been dropped.
+//
+// Buckets live in a fixed, direct-mapped table of 64-bit words: a tag of
+// the key, a slip counter, and the time the bucket will be full again,
+// from which its tokens follow, so refilling is lazy and exact. A key
+// whose slot is taken by another evicts it and starts with a full bucket.
+// A check is a hash, one load and one compare-and-swap, with no locks and
+// no allocation, so it is safe from any thread.
+class RateLimiter {
+  public:
+   enum Category {
+      kAnswer = 0,   // NOERROR with answers
+      kNoData,       // NOERROR without (including referrals)
+      kNxDomain,
+      kError,        // any other rcode
+      kCategories
+   };
+
+   enum Verdict {
+      kSend = 0,
+      kDrop,
+      kSlip,         // send truncated
+      kVerdicts
+   };
+
+   struct Options {
+      Options();
+
+      int rate_;          // responses per second per key; 0 turns it off
+      int burst_;         // bucket size; 0 means one second's worth
+      int slip_;          // truncate every Nth drop (up to 15); 0 never
+      bool log_only_;
+      size_t slots_;      // rounded up to a power of two
+   };
+
+   struct Stats {
+      uint64_t checked[kCategories];
+      uint64_t verdicts[kVerdicts];   // in log-only mode, what they would be
+      uint64_t evictions;
+   };
+
+   explicit RateLimiter(const Options& options);
+   ~RateLimiter();
+
+   bool enabled() const { return options_.rate_ > 0; }
+   bool log_only() const { return options_.log_only_; }
+
+   // Decides what to do with |response|, about to go to |client|. On kSlip
+   // it has already been cut down to a truncated response, and |*len| set
+   // to match.
+   Verdict Check(const struct sockaddr_in6& client, char* response, int* len,
+         uint64_t now_ms);
+
+   Stats stats() const;
+
+  private:
+   // Hashes the client's network, the category and the query name.
+   // Returns the end of the question in |*question_end|, or 0 if there is
+   // none.
+   static uint64_t Key(const struct sockaddr_in6& client, Category category,
+         const char* response, int len, int* question_end);
+
+   static Category CategoryOf(const char* response);
+
+   const Options options_;
+   const int slip_;
+
+   // Time to refill a token, and the whole bucket
+   uint64_t interval_us_;
+   uint64_t burst_us_;
+
+   std::atomic<uint64_t>* buckets_;
+   size_t mask_;
+
+   std::atomic<uint64_t> checked_[kCategories];
+   std::atomic<uint64_t> verdicts_[kVerdicts];
+   std::atomic<uint64_t> evictions_;
+
+   RateLimiter(const RateLimiter&);
+   void operator=(const RateLimiter&);
+};
+
+#endif   // _RATE_LIMITER_H_
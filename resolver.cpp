@@ -0,0 +1,878 @@
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "dns_packet.h"
+#include "latency_stats.h"
+#include "metrics.h"
+#include "resolver.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+// Cap on saved-up hedge tokens, so a quiet period cannot fund a burst
+const double kMaxHedgeTokens = 10;
+
+// Outstanding sends remembered per exchange
+const size_t kMaxInFlight = 8;
+
+// Glueless delegations: nameserver addresses looked up at once, and how
+// long to wait on them
+const int kMaxNsLookups = 3;
+const uint32_t kNsLookupWaitMs = 6000;
+
+// Bounds on a single resolution: nested Resolve()s (CNAME targets and
+// nameserver addresses), and referrals followed by each
+const int kMaxDepth = 8;
+const int kMaxReferrals = 16;
+
+const char* const kRcodeNames[] = { "NOERROR", "FORMERR", "SERVFAIL",
+      "NXDOMAIN", "NOTIMP", "REFUSED" };
+
+bool SameServer(const struct sockaddr_in6& a, const struct sockaddr_in6& b) {
+   return a.sin6_port == b.sin6_port &&
+         !memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(struct in6_addr));
+}
+}
+
+Resolver::Options::Options()
+      : hedge_(false),
+        max_hedges_(1),
+        hedge_budget_(0.1),
+        upstream_port_(53) {
+}
+
+Resolver::Answer::Answer()
+      : resolved_(false) {
+}
+
+Resolver::Waiter::Waiter()
+      : woken_(false),
+        timed_out_(false),
+        has_timer_(false) {
+}
+
+Resolver::UpstreamSend::UpstreamSend(const struct sockaddr_in6& addr,
+                                     uint64_t sent_ms,
+                                     bool hedge)
+      : addr_(addr),
+        sent_ms_(sent_ms),
+        hedge_(hedge) {
+}
+
+Resolver::Exchange::Exchange(const DnsQuery& query, uint16_t id)
+      : query_(query),
+        id_(id),
+        answered_(false),
+        failed_(false) {
+   memset(&from_, 0, sizeof(struct sockaddr_in6));
+}
+
+int Resolver::Exchange::FindInFlight(const struct sockaddr_in6& addr) const {
+   for (size_t i = 0; i < in_flight_.size(); ++i) {
+      if (SameServer(in_flight_[i].addr_, addr))
+         return i;
+   }
+
+   return -1;
+}
+
+Resolver::QueryInfo::QueryInfo(const DnsQuery& query,
+                               RRVec& authority_rrs,
+                               RRVec& additional_rrs)
+      : query_(query),
+        authority_rrs_(std::move(authority_rrs)),
+        additional_rrs_(std::move(additional_rrs)) {
+}
+
+Resolver::LookupWaiter::LookupWaiter()
+      : pending_(0) {
+}
+
+Resolver::Resolver(const Options& options, DnsCache* cache,
+                   InfraCache* infra, Transport* transport)
+      : options_(options),
+        cache_(cache),
+        infra_(infra),
+        transport_(transport),
+        latency_(NULL),
+        metrics_(NULL),
+        now_ms_(0),
+        hedge_tokens_(0),
+        running_(false) {
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+Resolver::~Resolver() {
+   NsLookupMap::iterator it;
+   for (it = ns_lookups_.begin(); it != ns_lookups_.end(); ++it)
+      delete it->second;
+}
+
+Task<Resolver::Answer> Resolver::Resolve(DnsQuery query, Arena* arena,
+                                         int depth, TraceLane trace) {
+   Answer answer;
+   TraceSpan span(trace, "resolve", &query);
+
+   for (int referrals = 0; referrals < kMaxReferrals; ++referrals) {
+      RRVec answer_rrs(arena);
+      RRVec authority_rrs(arena);
+      RRVec additional_rrs(arena);
+
+      // Each response is cached, so the cache always holds our best
+      // knowledge: the answer, or the closest delegation to ask next
+      if (cache_->Get(query, &answer_rrs, &authority_rrs, &additional_rrs,
+            now_ms_)) {
+         trace.Instant("cache", &query, NULL, "answer", answer_rrs.size());
+         span.Note("resolved");
+         answer.resolved_ = true;
+         answer.answer_rrs_.swap(answer_rrs);
+         answer.authority_rrs_.swap(authority_rrs);
+         answer.additional_rrs_.swap(additional_rrs);
+         co_return answer;
+      }
+
+      if (depth >= kMaxDepth) {
+         LOG << "Giving up on " << query.ToString() << " -- too deep" <<
+               std::endl;
+         span.Note("too deep");
+         co_return answer;
+      }
+
+      // The cache holds a CNAME we don't know the target of yet. Once the
+      // target is resolved, the whole chain answers from cache.
+      if (answer_rrs.size()) {
+         DnsQuery target(answer_rrs.back().data(), query.type(),
+               query.clz());
+
+         LOG << "Following CNAME to " << target.ToString() << std::endl;
+         trace.Instant("cache", &target, NULL, "cname");
+         Answer target_answer = co_await Resolve(target, arena, depth + 1,
+               trace);
+         if (!target_answer.resolved_) {
+            span.Note("cname unresolved");
+            co_return target_answer;
+         }
+         continue;
+      }
+
+      // The closest delegation, and how many authorities it has
+      if (trace.enabled() && authority_rrs.size()) {
+         DnsQuery zone(authority_rrs.front().name(),
+               htons(constants::type::NS), query.clz());
+         trace.Instant("cache", &zone, NULL, "delegation",
+               authority_rrs.size());
+      }
+
+      QueryInfo query_info(query, authority_rrs, additional_rrs);
+      std::string response;
+      struct sockaddr_in6 from;
+
+      if (!co_await QueryAuthorities(&query_info, depth, trace, &response,
+            &from)) {
+         LOG << "Ran out of authorities for " << query.ToString() <<
+               std::endl;
+         span.Note("no authority answered");
+         co_return answer;
+      }
+
+      DnsPacket packet(&response[0]);
+      DnsQuery response_query = packet.GetQuery();
+
+      // If the packet contained an SOA, just forward it to the
+      // client. Shitty, I know.
+      bool has_edns = false;
+      bool contains_soa = CacheAllResourceRecords(packet, response_query,
+            &has_edns);
+
+      if (has_edns) {
+         infra_->RecordEdns(from.sin6_addr, InfraCache::kEdnsSupported,
+               now_ms_);
+      }
+
+      if (contains_soa) {
+         span.Note("negative");
+         answer.response_.swap(response);
+         co_return answer;
+      }
+
+      // Any other error (NXDOMAIN without an SOA, say) is final as well
+      if (packet.rcode() != constants::response_code::NoError) {
+         span.Note("error");
+         answer.response_.swap(response);
+         co_return answer;
+      }
+   }
+
+   LOG << "Giving up on " << query.ToString() << " -- too many referrals" <<
+         std::endl;
+   span.Note("too many referrals");
+   co_return answer;
+}
+
+Task<bool> Resolver::QueryAuthorities(QueryInfo* query_info, int depth,
+                                      TraceLane trace, std::string* response,
+                                      struct sockaddr_in6* from) {
+   RRVec& auth_rrs = query_info->authority_rrs_;
+   RRVec& addl_rrs = query_info->additional_rrs_;
+   TraceSpan span(trace, "authorities", &query_info->query_);
+
+   Exchange exchange(query_info->query_, AllocateUpstreamId());
+   exchange.trace_ = trace;
+   exchanges_[exchange.id_] = &exchange;
+
+   while (!auth_rrs.empty()) {
+      // An earlier primary may have answered while we looked up nameservers
+      if (exchange.answered_)
+         break;
+
+      // Move the authority we would most like to ask to the front
+      SelectAuthority(query_info);
+      RRVec::iterator it = FindNameserverIp(auth_rrs.front(), addl_rrs);
+
+      // A random pick may have landed on an authority without glue
+      if (it == addl_rrs.end())
+         it = PromoteGluedAuthority(query_info);
+
+      // Their addresses may have been looked up already
+      if (it == addl_rrs.end() && FillGlueFromCache(query_info))
+         it = PromoteGluedAuthority(query_info);
+
+      // None of the authorities came with glue. Look some up and try again.
+      if (it == addl_rrs.end()) {
+         if (!co_await LookupNameservers(query_info, depth, trace))
+            break;
+         continue;
+      }
+
+      struct sockaddr_in6 addr;
+      NameserverAddr(*it, &addr);
+      SendQuery(&exchange, addr, false);
+
+      // Each query earns a fraction of a hedge
+      int hedges = 0;
+      uint64_t hedge_ms = 0;
+      if (options_.hedge_ && options_.max_hedges_ > 0) {
+         hedge_tokens_ = std::min(hedge_tokens_ + options_.hedge_budget_,
+               kMaxHedgeTokens);
+         hedge_ms = now_ms_ + infra_->HedgeDelayMs(addr.sin6_addr, now_ms_);
+      }
+
+      // Give the server as long as it usually takes
+      uint64_t timeout_ms = now_ms_ +
+            infra_->RetransmitTimeoutMs(addr.sin6_addr, now_ms_);
+
+      while (!exchange.answered_) {
+         if (hedge_ms && hedge_ms < timeout_ms)
+            ArmTimer(&exchange, hedge_ms);
+         else
+            ArmTimer(&exchange, timeout_ms);
+
+         co_await Suspend{&exchange};
+
+         if (exchange.answered_ || exchange.failed_ ||
+             now_ms_ >= timeout_ms)
+            break;
+
+         // If it is time to hedge, ask a second authority
+         if (hedge_ms && now_ms_ >= hedge_ms)
+            hedge_ms = SendHedge(&exchange, query_info, &hedges);
+      }
+
+      if (exchange.answered_)
+         break;
+
+      if (exchange.failed_) {
+         // Counted, and traced, when it was reported
+         LOG << "Unreachable or failed. Deleting top authority record and "
+               "querying another server." << std::endl;
+         exchange.failed_ = false;
+      } else {
+         LOG << "Timeout. Deleting top authority record and querying "
+               "another server." << std::endl;
+         stats_.timeouts++;
+         if (exchange.in_flight_.size()) {
+            trace.Instant("timeout", NULL,
+                  &exchange.in_flight_.front().addr_);
+            infra_->RecordTimeout(
+                  exchange.in_flight_.front().addr_.sin6_addr, now_ms_);
+            if (metrics_)
+               metrics_->UpstreamTimeout(
+                     exchange.in_flight_.front().addr_.sin6_addr);
+         }
+      }
+
+      auth_rrs.erase(auth_rrs.begin());
+   }
+
+   if (exchange.answered_) {
+      RecordUpstreamRtt(&exchange);
+
+      // A truncated response is useless to us -- ask again over TCP. It
+      // needs a handshake as well as the query itself, so allow two round
+      // trips.
+      DnsPacket packet(&exchange.response_[0]);
+      if (packet.tc_flag() && RetryOverTcp(&exchange)) {
+         ArmTimer(&exchange, now_ms_ + 2 *
+               infra_->RetransmitTimeoutMs(exchange.from_.sin6_addr, now_ms_));
+         co_await Suspend{&exchange};
+
+         if (!exchange.answered_ && !exchange.failed_) {
+            trace.Instant("timeout", NULL, &exchange.from_, "tcp");
+            stats_.timeouts++;
+            infra_->RecordTimeout(exchange.from_.sin6_addr, now_ms_);
+            if (metrics_)
+               metrics_->UpstreamTimeout(exchange.from_.sin6_addr);
+         }
+      }
+   }
+
+   exchanges_.erase(exchange.id_);
+
+   if (!exchange.answered_) {
+      span.Note("exhausted");
+      co_return false;
+   }
+
+   span.Note("answered");
+   response->swap(exchange.response_);
+   *from = exchange.from_;
+   co_return true;
+}
+
+Task<bool> Resolver::LookupNameservers(QueryInfo* query_info, int depth,
+                                       TraceLane trace) {
+   RRVec& auth_rrs = query_info->authority_rrs_;
+   TraceSpan span(trace, "nameserver lookups");
+
+   int tried = std::min((int) auth_rrs.size(), kMaxNsLookups);
+   std::vector<DnsQuery> queries;
+   LookupWaiter waiter;
+
+   for (int i = 0; i < tried; ++i) {
+      DnsQuery query(auth_rrs[i].data(), htons(constants::type::A),
+            htons(constants::clz::IN));
+      if (JoinNsLookup(query, &waiter, depth, trace))
+         queries.push_back(query);
+   }
+
+   if (queries.size()) {
+      waiter.pending_ = queries.size();
+      ArmTimer(&waiter, now_ms_ + kNsLookupWaitMs);
+      co_await Suspend{&waiter};
+      if (waiter.timed_out_)
+         trace.Instant("lookup timeout");
+
+      // Stop waiting on the lookups that are still going
+      for (size_t i = 0; i < queries.size(); ++i) {
+         NsLookupMap::iterator it = ns_lookups_.find(queries[i]);
+         if (it == ns_lookups_.end())
+            continue;
+
+         LookupWaiterVec& waiters = it->second->waiters_;
+         waiters.erase(std::remove(waiters.begin(), waiters.end(), &waiter),
+               waiters.end());
+      }
+
+      if (FillGlueFromCache(query_info)) {
+         span.Note("found");
+         co_return true;
+      }
+   }
+
+   // Don't try these nameservers again
+   LOG << "No nameserver address could be looked up" << std::endl;
+   span.Note("none found", tried);
+   auth_rrs.erase(auth_rrs.begin(), auth_rrs.begin() + tried);
+   co_return !auth_rrs.empty();
+}
+
+DetachedTask Resolver::RunNsLookup(DnsQuery query, int depth,
+                                   TraceLane trace) {
+   Arena arena;
+   Answer answer = co_await Resolve(query, &arena, depth, trace);
+
+   if (answer.resolved_)
+      stats_.ns_lookups_resolved++;
+   else
+      stats_.ns_lookups_failed++;
+
+   NsLookupMap::iterator it = ns_lookups_.find(query);
+   NsLookup* lookup = it->second;
+   ns_lookups_.erase(it);
+
+   // Carry on as soon as one address is known, or once every lookup failed
+   for (size_t i = 0; i < lookup->waiters_.size(); ++i) {
+      LookupWaiter* waiter = lookup->waiters_[i];
+      waiter->pending_--;
+      if (answer.resolved_ || !waiter->pending_)
+         Wake(waiter);
+   }
+
+   delete lookup;
+   trace.Release();
+}
+
+bool Resolver::JoinNsLookup(const DnsQuery& query, LookupWaiter* waiter,
+                            int depth, TraceLane trace) {
+   // Someone is already looking this nameserver up -- wait for them
+   NsLookupMap::iterator it = ns_lookups_.find(query);
+   if (it != ns_lookups_.end()) {
+      LOG << "Joining lookup of " << query.ToString() << std::endl;
+      trace.Instant("join lookup", &query);
+      it->second->waiters_.push_back(waiter);
+      stats_.ns_lookups_joined++;
+      return true;
+   }
+
+   DnsQuery cache_query(query);
+   RRVec answer_rrs;
+   RRVec authority_rrs;
+   RRVec additional_rrs;
+
+   // Answered already (the caller found no address, so this is a negative
+   // answer) or nowhere to ask
+   if (cache_->Get(cache_query, &answer_rrs, &authority_rrs,
+         &additional_rrs, now_ms_) || authority_rrs.empty() ||
+       depth + 1 >= kMaxDepth)
+      return false;
+
+   LOG << "Starting lookup of " << query.ToString() << std::endl;
+
+   NsLookup* lookup = new NsLookup();
+   lookup->waiters_.push_back(waiter);
+   ns_lookups_[query] = lookup;
+   stats_.ns_lookups_started++;
+
+   // Runs once the current task suspends, in a lane of its own
+   TraceLane lookup_trace = trace.Fork(query);
+   trace.Instant("start lookup", &query, NULL, NULL, lookup_trace.lane());
+   stats_.tasks_started++;
+   ready_.push_back(RunNsLookup(query, depth + 1, lookup_trace).Release());
+   return true;
+}
+
+uint64_t Resolver::SendHedge(Exchange* exchange, QueryInfo* query_info,
+                             int* hedges) {
+   if (*hedges >= options_.max_hedges_ || hedge_tokens_ < 1) {
+      LOG << "Hedge budget exhausted" << std::endl;
+      exchange->trace_.Instant("hedge denied");
+      stats_.hedges_denied++;
+      return 0;
+   }
+
+   // Pick the best authority with glue that we have not asked yet
+   RRVec& auth_rrs = query_info->authority_rrs_;
+   RRVec& addl_rrs = query_info->additional_rrs_;
+
+   std::vector<struct sockaddr_in6> addrs(auth_rrs.size());
+   std::vector<const struct in6_addr*> candidates(auth_rrs.size());
+
+   for (size_t i = 0; i < auth_rrs.size(); ++i) {
+      RRVec::iterator it = FindNameserverIp(auth_rrs[i], addl_rrs);
+      candidates[i] = NULL;
+      if (it != addl_rrs.end()) {
+         NameserverAddr(*it, &addrs[i]);
+         if (exchange->FindInFlight(addrs[i]) < 0)
+            candidates[i] = &addrs[i].sin6_addr;
+      }
+   }
+
+   int best = infra_->Select(candidates, now_ms_);
+   if (best < 0 || !candidates[best])
+      return 0;
+
+   LOG << "Hedging " << exchange->query_.ToString() << std::endl;
+   SendQuery(exchange, addrs[best], true);
+   (*hedges)++;
+   hedge_tokens_ -= 1;
+   stats_.hedges_sent++;
+
+   if (*hedges >= options_.max_hedges_)
+      return 0;
+   return now_ms_ + infra_->HedgeDelayMs(addrs[best].sin6_addr, now_ms_);
+}
+
+void Resolver::SendQuery(Exchange* exchange, const struct sockaddr_in6& addr,
+                         bool hedge) {
+   char buf[ETH_DATA_LEN];
+   char* p = DnsPacket::ConstructQuery(buf, exchange->id_,
+         constants::opcode::Query, false, exchange->query_);
+
+   LOG << "Sending query " << exchange->query_.ToString() << " with id " <<
+         exchange->id_ << " upstream." << std::endl;
+   transport_->SendUdp(addr, buf, p - buf);
+   exchange->trace_.Instant("send", NULL, &addr, hedge ? "hedge" : "primary");
+   stats_.upstream_queries++;
+
+   // Remember who we asked, primaries first
+   UpstreamSendVec& in_flight = exchange->in_flight_;
+   if (hedge) {
+      in_flight.push_back(UpstreamSend(addr, now_ms_, true));
+   } else {
+      in_flight.insert(in_flight.begin(), UpstreamSend(addr, now_ms_, false));
+      if (in_flight.size() > kMaxInFlight)
+         in_flight.pop_back();
+   }
+}
+
+bool Resolver::RetryOverTcp(Exchange* exchange) {
+   char buf[ETH_DATA_LEN];
+   char* p = DnsPacket::ConstructQuery(buf, exchange->id_,
+         constants::opcode::Query, false, exchange->query_);
+
+   LOG << "Truncated response. Retrying " << exchange->query_.ToString() <<
+         " over TCP." << std::endl;
+
+   if (!transport_->SendTcp(exchange->from_, buf, p - buf, exchange->id_,
+         now_ms_)) {
+      exchange->trace_.Instant("send", NULL, &exchange->from_,
+            "tcp failed");
+      return false;
+   }
+   exchange->trace_.Instant("send", NULL, &exchange->from_, "tcp");
+
+   stats_.tcp_retries++;
+   exchange->answered_ = false;
+   exchange->response_.clear();
+   exchange->in_flight_.clear();
+   exchange->in_flight_.push_back(UpstreamSend(exchange->from_, now_ms_,
+         false));
+   return true;
+}
+
+void Resolver::RecordUpstreamRtt(Exchange* exchange) {
+   int i = exchange->FindInFlight(exchange->from_);
+   if (i < 0)
+      return;
+
+   const UpstreamSend& send = exchange->in_flight_[i];
+   infra_->RecordRtt(exchange->from_.sin6_addr, now_ms_ - send.sent_ms_,
+         now_ms_);
+   if (latency_)
+      latency_->RecordUpstreamRtt(exchange->from_.sin6_addr,
+            now_ms_ - send.sent_ms_);
+
+   if (send.hedge_) {
+      LOG << "Hedged query answered first" << std::endl;
+      stats_.hedges_won++;
+   }
+}
+
+void Resolver::Start(DetachedTask task, uint64_t now_ms) {
+   now_ms_ = now_ms;
+   stats_.tasks_started++;
+   ready_.push_back(task.Release());
+   RunReady();
+}
+
+void Resolver::HandleResponse(char* packet, int len,
+                              const struct sockaddr_in6& from,
+                              uint64_t now_ms) {
+   now_ms_ = now_ms;
+
+   if (len < (int) sizeof(DnsPacket::Header))
+      return;
+
+   DnsPacket dns_packet(packet);
+   DnsQuery query = dns_packet.GetQuery();
+
+   // Only accept responses to a question we are waiting on, from a server
+   // it was asked of. This also drops the slower answers to a hedged query.
+   ExchangeMap::iterator it = exchanges_.find(dns_packet.id());
+   if (it == exchanges_.end() || it->second->answered_ ||
+       !(query == it->second->query_) ||
+       it->second->FindInFlight(from) < 0) {
+      LOG << "Dropping unexpected response for " << query.ToString() <<
+            std::endl;
+      if (it != exchanges_.end())
+         it->second->trace_.Instant("response dropped", NULL, &from,
+               it->second->answered_ ? "late" : "unexpected");
+      return;
+   }
+
+   Exchange* exchange = it->second;
+   if (exchange->trace_.enabled()) {
+      // What came back, and after how many ms
+      int rcode = dns_packet.rcode();
+      const char* note = dns_packet.tc_flag() ? "truncated" :
+            rcode < (int) (sizeof(kRcodeNames) / sizeof(*kRcodeNames)) ?
+            kRcodeNames[rcode] : "other rcode";
+      const UpstreamSend& send =
+            exchange->in_flight_[exchange->FindInFlight(from)];
+      exchange->trace_.Instant("response", NULL, &from, note,
+            now_ms - send.sent_ms_);
+   }
+
+   // The server cannot answer it: a lame delegation, or a broken server
+   int rcode = dns_packet.rcode();
+   if (rcode == constants::response_code::Refused ||
+       rcode == constants::response_code::ServerFailure ||
+       rcode == constants::response_code::NotImplemented ||
+       rcode == constants::response_code::FormatError) {
+      LOG << "Upstream server failed " << query.ToString() << std::endl;
+      stats_.errors++;
+      DropInFlight(exchange, exchange->FindInFlight(from));
+      return;
+   }
+
+   exchange->answered_ = true;
+   exchange->response_.assign(packet, len);
+   exchange->from_ = from;
+   Wake(exchange);
+   RunReady();
+}
+
+void Resolver::HandleUnreachable(const struct sockaddr_in6& to, uint16_t id,
+                                 uint64_t now_ms) {
+   now_ms_ = now_ms;
+
+   // Only a question still outstanding at |to| (errors about responses to
+   // clients come here too)
+   ExchangeMap::iterator it = exchanges_.find(id);
+   if (it == exchanges_.end() || it->second->answered_)
+      return;
+
+   Exchange* exchange = it->second;
+   int i = exchange->FindInFlight(to);
+   if (i < 0)
+      return;
+
+   LOG << "Upstream server unreachable for " <<
+         exchange->query_.ToString() << std::endl;
+   exchange->trace_.Instant("unreachable", NULL, &to);
+   stats_.unreachable++;
+   DropInFlight(exchange, i);
+}
+
+void Resolver::DropInFlight(Exchange* exchange, int i) {
+   infra_->RecordTimeout(exchange->in_flight_[i].addr_.sin6_addr, now_ms_);
+
+   // The latest primary is first; the task only waits on the exchange
+   // while it is the one outstanding
+   bool awaited = !i && !exchange->in_flight_[i].hedge_ && exchange->handle_;
+   exchange->in_flight_.erase(exchange->in_flight_.begin() + i);
+   if (awaited) {
+      exchange->failed_ = true;
+      Wake(exchange);
+      RunReady();
+   }
+}
+
+void Resolver::HandleTimers(uint64_t now_ms) {
+   now_ms_ = now_ms;
+
+   while (!timers_.empty() && timers_.begin()->first <= now_ms) {
+      Waiter* waiter = timers_.begin()->second;
+      timers_.erase(timers_.begin());
+      waiter->has_timer_ = false;
+      waiter->timed_out_ = true;
+      Wake(waiter);
+   }
+
+   RunReady();
+}
+
+bool Resolver::NextTimer(uint64_t* when_ms) const {
+   if (timers_.empty())
+      return false;
+
+   *when_ms = timers_.begin()->first;
+   return true;
+}
+
+void Resolver::ArmTimer(Waiter* waiter, uint64_t when_ms) {
+   if (waiter->has_timer_)
+      timers_.erase(waiter->timer_);
+
+   waiter->woken_ = false;
+   waiter->timed_out_ = false;
+   waiter->has_timer_ = true;
+   waiter->timer_ = timers_.insert(
+         std::pair<const uint64_t, Waiter*>(when_ms, waiter));
+}
+
+void Resolver::Wake(Waiter* waiter) {
+   if (waiter->woken_)
+      return;
+
+   waiter->woken_ = true;
+   if (waiter->has_timer_) {
+      timers_.erase(waiter->timer_);
+      waiter->has_timer_ = false;
+   }
+
+   if (waiter->handle_)
+      ready_.push_back(waiter->handle_);
+}
+
+void Resolver::RunReady() {
+   // Tasks queued by a running task wait for the loop below
+   if (running_)
+      return;
+
+   running_ = true;
+   while (!ready_.empty()) {
+      std::coroutine_handle<> handle = ready_.front();
+      ready_.pop_front();
+      handle.resume();
+   }
+   running_ = false;
+}
+
+RRVec::iterator Resolver::FindNameserverIp(DnsResourceRecord& auth_rr,
+                                           RRVec& addl_rrs) {
+   RRVec::iterator it;
+
+   // Upstream servers are reached over IPv4
+   for (it = addl_rrs.begin(); it != addl_rrs.end(); ++it) {
+      if (!it->name().compare(auth_rr.data()) &&
+          it->type() == htons(constants::type::A)) {
+         break;
+      }
+   }
+
+   return it;
+}
+
+void Resolver::NameserverAddr(DnsResourceRecord& addr_rr,
+                              struct sockaddr_in6* addr) {
+   memset(addr, 0, sizeof(struct sockaddr_in6));
+   addr->sin6_family = AF_INET6;
+   addr->sin6_port = htons(options_.upstream_port_);
+
+   if (addr_rr.type() == htons(constants::type::A)) {
+      memcpy(&addr->sin6_addr,
+             "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xFF\xFF",
+             12);
+      memcpy(((char*) &addr->sin6_addr) + 12,
+             addr_rr.data(),
+             sizeof(struct in_addr));
+   } else {
+      memcpy(&addr->sin6_addr, addr_rr.data(), sizeof(struct in6_addr));
+   }
+}
+
+void Resolver::SelectAuthority(QueryInfo* query_info) {
+   RRVec& auth_rrs = query_info->authority_rrs_;
+   RRVec& addl_rrs = query_info->additional_rrs_;
+
+   if (auth_rrs.size() < 2)
+      return;
+
+   // Candidate addresses, or NULL for authorities without glue
+   std::vector<struct sockaddr_in6> addrs(auth_rrs.size());
+   std::vector<const struct in6_addr*> candidates(auth_rrs.size());
+
+   for (size_t i = 0; i < auth_rrs.size(); ++i) {
+      RRVec::iterator it = FindNameserverIp(auth_rrs[i], addl_rrs);
+      if (it == addl_rrs.end()) {
+         candidates[i] = NULL;
+      } else {
+         NameserverAddr(*it, &addrs[i]);
+         candidates[i] = &addrs[i].sin6_addr;
+      }
+   }
+
+   int best = infra_->Select(candidates, now_ms_);
+   if (best > 0)
+      std::iter_swap(auth_rrs.begin(), auth_rrs.begin() + best);
+}
+
+RRVec::iterator Resolver::PromoteGluedAuthority(QueryInfo* query_info) {
+   RRVec& auth_rrs = query_info->authority_rrs_;
+   RRVec& addl_rrs = query_info->additional_rrs_;
+
+   for (size_t i = 0; i < auth_rrs.size(); ++i) {
+      RRVec::iterator it = FindNameserverIp(auth_rrs[i], addl_rrs);
+      if (it != addl_rrs.end()) {
+         std::swap(auth_rrs[0], auth_rrs[i]);
+         return it;
+      }
+   }
+
+   return addl_rrs.end();
+}
+
+bool Resolver::FillGlueFromCache(QueryInfo* query_info) {
+   bool found = false;
+
+   RRVec::iterator it;
+   for (it = query_info->authority_rrs_.begin();
+        it != query_info->authority_rrs_.end(); ++it) {
+      DnsQuery query(it->data(), htons(constants::type::A),
+            htons(constants::clz::IN));
+
+      // In the request's arena, if it has one
+      RRVec answer_rrs(query_info->additional_rrs_.get_allocator());
+      RRVec authority_rrs(query_info->additional_rrs_.get_allocator());
+      RRVec additional_rrs(query_info->additional_rrs_.get_allocator());
+
+      if (!cache_->Get(query, &answer_rrs, &authority_rrs, &additional_rrs,
+            now_ms_))
+         continue;
+
+      // Only the address records themselves, not CNAMEs leading to them
+      RRVec::iterator it2;
+      for (it2 = answer_rrs.begin(); it2 != answer_rrs.end(); ++it2) {
+         if (it2->type() == htons(constants::type::A) &&
+             !it2->name().compare(it->data())) {
+            query_info->additional_rrs_.push_back(*it2);
+            found = true;
+         }
+      }
+   }
+
+   return found;
+}
+
+uint16_t Resolver::AllocateUpstreamId() {
+   uint16_t id;
+
+   do {
+      id = random() & 0xFFFF;
+   } while (exchanges_.find(id) != exchanges_.end());
+
+   return id;
+}
+
+bool Resolver::CacheAllResourceRecords(DnsPacket& packet, DnsQuery& query,
+      bool* has_edns) {
+   int num_rrs = packet.answer_rrs() + packet.authority_rrs() +
+         packet.additional_rrs();
+
+   bool contains_soa = false;
+   *has_edns = false;
+
+   for (int i = 0; i < num_rrs; ++i) {
+      DnsResourceRecord record = packet.GetResourceRecord();
+
+      // The OPT pseudo-record describes the packet, not the domain
+      if (ntohs(record.type()) == constants::type::OPT) {
+         *has_edns = true;
+         continue;
+      }
+
+      if (ntohs(record.type()) == constants::type::SOA) {
+         cache_->Insert(query, record, now_ms_);
+         contains_soa = true;
+      }
+      else {
+         cache_->Insert(record, now_ms_);
+      }
+   }
+
+   return contains_soa;
+}
@@ -0,0 +1,336 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <coroutine>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "infra_cache.h"
+#include "query_trace.h"
+#include "task.h"
+
+class LatencyStats;
+class Metrics;
+
+// How the resolver reaches upstream servers. DnsServer sends over its socket
+// and TCP connection pool; SimNetwork hands queries to simulated authorities.
+class Transport {
+  public:
+   virtual ~Transport() { }
+
+   // Sends |len| bytes of |packet| to |addr| over UDP. A query that cannot
+   // be sent times out like a lost one, unless the owner reports |addr|
+   // unreachable (Resolver::HandleUnreachable()).
+   virtual void SendUdp(const struct sockaddr_in6& addr, const char* packet,
+         int len) = 0;
+
+   // Sends a query over TCP, after |addr| answered it truncated. |id| is its
+   // DNS id, network order. Returns false if it could not be sent.
+   virtual bool SendTcp(const struct sockaddr_in6& addr, const char* packet,
+         int len, uint16_t id, uint64_t now_ms) = 0;
+};
+
+// The iterative resolution algorithm, as coroutines. Each Resolve() is a
+// task that walks down from the best delegation in the cache, suspending
+// while it waits on upstream servers (or on lookups of their addresses), and
+// is resumed by the event loop when a response or timer arrives.
+//
+// The resolver owns no sockets or clocks. Its owner feeds it responses with
+// HandleResponse() and the passage of time with HandleTimers(), and sends
+// through a Transport, so the same engine runs against a simulated network.
+class Resolver {
+  public:
+   struct Options {
+      Options();
+
+      // Hedged queries: if the authority we asked has not answered within
+      // its usual round trip, ask the next best one as well and take
+      // whichever answer comes first.
+      bool hedge_;
+      int max_hedges_;        // extra authorities asked per query
+      double hedge_budget_;   // hedges allowed per upstream query, on average
+
+      // Port authorities are queried on; 53 but for test hierarchies
+      int upstream_port_;
+   };
+
+   struct Answer {
+      Answer();
+
+      // False if no answer could be found (the client gets SERVFAIL)
+      bool resolved_;
+      RRVec answer_rrs_;
+      RRVec authority_rrs_;
+      RRVec additional_rrs_;
+
+      // A negative answer, as the authority sent it
+      std::string response_;
+   };
+
+   struct Stats {
+      uint64_t tasks_started;
+      uint64_t upstream_queries;
+      uint64_t timeouts;
+      uint64_t unreachable;   // upstream queries an ICMP error answered
+      uint64_t errors;        // answered REFUSED, SERVFAIL, NOTIMP or FORMERR
+      uint64_t tcp_retries;
+      uint64_t hedges_sent;
+      uint64_t hedges_won;
+      uint64_t hedges_denied;   // over budget
+      uint64_t ns_lookups_started;
+      uint64_t ns_lookups_joined;
+      uint64_t ns_lookups_resolved;
+      uint64_t ns_lookups_failed;
+   };
+
+   Resolver(const Options& options, DnsCache* cache, InfraCache* infra,
+         Transport* transport);
+   ~Resolver();
+
+   // Resolves |query|, starting from what the cache knows. Temporaries, and
+   // the record vectors of the answer, come from |arena| if one is given; it
+   // must outlive the answer. |depth| counts the Resolve()s this one was
+   // started from (to chase CNAMEs or nameserver addresses), and bounds them.
+   // What it does is recorded to |trace|, if there is one.
+   Task<Answer> Resolve(DnsQuery query, Arena* arena = NULL, int depth = 0,
+         TraceLane trace = TraceLane());
+
+   // Runs |task| until it first waits on something.
+   void Start(DetachedTask task, uint64_t now_ms);
+
+   // Hands an upstream response (over UDP or TCP) to the task waiting on it.
+   // Responses nobody is waiting for are dropped. A REFUSED, SERVFAIL,
+   // NOTIMP or FORMERR is that server failing, not an answer: the task
+   // waits on the others it asked, or moves on, as if it were unreachable.
+   void HandleResponse(char* packet, int len, const struct sockaddr_in6& from,
+         uint64_t now_ms);
+
+   // Has the question sent to |to| under |id| (network order) given up on
+   // it, as an ICMP error (or a failed send, or a TCP connection closed
+   // before it was answered) says it cannot be reached. The
+   // task asking it moves on to the next authority at once, rather than at
+   // its timeout. Errors for anything else are ignored.
+   void HandleUnreachable(const struct sockaddr_in6& to, uint16_t id,
+         uint64_t now_ms);
+
+   // Fires the timers that are due.
+   void HandleTimers(uint64_t now_ms);
+
+   // When the next timer is due. Returns false if none is set.
+   bool NextTimer(uint64_t* when_ms) const;
+
+   // Tasks waiting on an upstream server
+   int pending() const { return exchanges_.size(); }
+
+   const Stats& stats() const { return stats_; }
+
+   // Has round trips to upstream servers recorded in |latency| as well.
+   void set_latency_stats(LatencyStats* latency) { latency_ = latency; }
+
+   // Has upstream timeouts counted, by server, in |metrics| as well.
+   void set_metrics(Metrics* metrics) { metrics_ = metrics; }
+
+   // Caches all resource records of a packet.
+   bool CacheAllResourceRecords(DnsPacket& packet, DnsQuery& query,
+         bool* has_edns);
+
+  private:
+   struct Waiter;
+   typedef std::multimap<uint64_t, Waiter*, std::less<uint64_t>,
+         STLsmartalloc<std::pair<const uint64_t, Waiter*> > > TimerMap;
+
+   // Something a task suspends on: a response, a lookup or a timer. Whoever
+   // completes it calls Wake(), which queues the task to run.
+   struct Waiter {
+      Waiter();
+
+      std::coroutine_handle<> handle_;   // set while suspended
+      bool woken_;
+      bool timed_out_;
+      bool has_timer_;
+      TimerMap::iterator timer_;
+   };
+
+   // Awaiting this suspends until the waiter is woken.
+   struct Suspend {
+      Waiter* waiter_;
+
+      bool await_ready() const { return waiter_->woken_; }
+      void await_suspend(std::coroutine_handle<> handle) {
+         waiter_->handle_ = handle;
+      }
+      void await_resume() { waiter_->handle_ = nullptr; }
+   };
+
+   struct UpstreamSend {
+      UpstreamSend(const struct sockaddr_in6& addr, uint64_t sent_ms,
+            bool hedge);
+
+      struct sockaddr_in6 addr_;
+      uint64_t sent_ms_;
+      bool hedge_;
+   };
+
+   typedef std::vector<UpstreamSend, STLsmartalloc<UpstreamSend> >
+         UpstreamSendVec;
+
+   // One question put to the authorities of one zone, under one upstream id.
+   struct Exchange : public Waiter {
+      Exchange(const DnsQuery& query, uint16_t id);
+
+      DnsQuery query_;
+      uint16_t id_;   // network order
+      TraceLane trace_;
+
+      // Servers the question is outstanding at, the latest primary first.
+      // Earlier primaries stay (a server that timed out may still answer)
+      // until one of them answers.
+      UpstreamSendVec in_flight_;
+
+      bool answered_;
+      std::string response_;
+      struct sockaddr_in6 from_;
+
+      // The latest primary was reported unreachable, or answered with an
+      // error, while it was awaited
+      bool failed_;
+
+      // Index into in_flight_ of the send to |addr|, or -1.
+      int FindInFlight(const struct sockaddr_in6& addr) const;
+   };
+
+   // The delegation a question is put to. Takes over the record vectors it
+   // is given, arena and all.
+   struct QueryInfo {
+      QueryInfo(const DnsQuery& query, RRVec& authority_rrs,
+            RRVec& additional_rrs);
+
+      DnsQuery query_;
+      RRVec authority_rrs_;
+      RRVec additional_rrs_;
+   };
+
+   // A task waiting on lookups of several nameservers' addresses
+   struct LookupWaiter : public Waiter {
+      LookupWaiter();
+
+      int pending_;
+   };
+
+   typedef std::vector<LookupWaiter*, STLsmartalloc<LookupWaiter*> >
+         LookupWaiterVec;
+
+   // A nameserver address lookup under way. Tasks stuck on the same
+   // glueless delegation share it.
+   struct NsLookup {
+      LookupWaiterVec waiters_;
+   };
+
+   typedef std::map<uint16_t, Exchange*, std::less<uint16_t>,
+         STLsmartalloc<std::pair<const uint16_t, Exchange*> > > ExchangeMap;
+   typedef std::map<DnsQuery, NsLookup*, std::less<DnsQuery>,
+         STLsmartalloc<std::pair<const DnsQuery, NsLookup*> > > NsLookupMap;
+   typedef std::list<std::coroutine_handle<>,
+         STLsmartalloc<std::coroutine_handle<> > > ReadyList;
+
+   // Asks the authorities of |query_info|, best first, until one answers.
+   // Hedges and falls back to TCP along the way. Fills in |response| and
+   // |from| and returns true on an answer; returns false once every
+   // authority timed out or none could be reached.
+   Task<bool> QueryAuthorities(QueryInfo* query_info, int depth,
+         TraceLane trace, std::string* response, struct sockaddr_in6* from);
+
+   // Looks up the addresses of the first few authorities of |query_info|,
+   // which came without glue, and waits until one is known. Authorities
+   // whose address could not be found are dropped. Returns false if none are
+   // left.
+   Task<bool> LookupNameservers(QueryInfo* query_info, int depth,
+         TraceLane trace);
+
+   // Resolves a nameserver's address and wakes whoever is waiting on it.
+   // Releases |trace| (a lane of its own) when done.
+   DetachedTask RunNsLookup(DnsQuery query, int depth, TraceLane trace);
+
+   // Has |waiter| wait on a lookup of |query|, starting one if none is under
+   // way. Returns false if it could not be started.
+   bool JoinNsLookup(const DnsQuery& query, LookupWaiter* waiter, int depth,
+         TraceLane trace);
+
+   // Sends |exchange|'s question to the best authority not yet asked, if
+   // the hedge budget allows. Returns when to hedge again, or 0 for never.
+   uint64_t SendHedge(Exchange* exchange, QueryInfo* query_info, int* hedges);
+
+   void SendQuery(Exchange* exchange, const struct sockaddr_in6& addr,
+         bool hedge);
+   bool RetryOverTcp(Exchange* exchange);
+
+   // Feeds the round trip of |exchange|'s response to the infra cache.
+   void RecordUpstreamRtt(Exchange* exchange);
+
+   // Stops waiting on in_flight_[|i|] of |exchange|, a server that will not
+   // answer it, and counts that against the server. If the task was waiting
+   // on it, it moves on to the next authority; answers from the others
+   // asked are still taken.
+   void DropInFlight(Exchange* exchange, int i);
+
+   RRVec::iterator FindNameserverIp(DnsResourceRecord& auth_rr,
+         RRVec& addl_rrs);
+
+   // Fills in |addr| (the upstream port) from an A or AAAA record.
+   void NameserverAddr(DnsResourceRecord& addr_rr, struct sockaddr_in6* addr);
+
+   // Moves the authority with the best expected round trip (per the infra
+   // cache) to the front of |query_info|'s authority RRs.
+   void SelectAuthority(QueryInfo* query_info);
+
+   // Moves the first authority of |query_info| that has glue to the front,
+   // and returns its address record (or the end of the additional RRs).
+   RRVec::iterator PromoteGluedAuthority(QueryInfo* query_info);
+
+   // Adds cached addresses of |query_info|'s authorities to its additional
+   // RRs. Returns true if any were found.
+   bool FillGlueFromCache(QueryInfo* query_info);
+
+   // Picks an unused upstream id.
+   uint16_t AllocateUpstreamId();
+
+   void ArmTimer(Waiter* waiter, uint64_t when_ms);
+   void Wake(Waiter* waiter);
+
+   // Runs queued tasks until every task is waiting on something.
+   void RunReady();
+
+   const Options options_;
+   DnsCache* cache_;
+   InfraCache* infra_;
+   Transport* transport_;
+   LatencyStats* latency_;   // NULL if round trips go unrecorded
+   Metrics* metrics_;        // NULL if timeouts go uncounted
+
+   // Time of the event being handled
+   uint64_t now_ms_;
+
+   // Hedge budget: each primary upstream query earns hedge_budget_ tokens,
+   // each hedge spends one
+   double hedge_tokens_;
+
+   ExchangeMap exchanges_;
+   NsLookupMap ns_lookups_;
+   TimerMap timers_;
+   ReadyList ready_;
+   bool running_;
+
+   Stats stats_;
+};
+
+#endif   // _RESOLVER_H_
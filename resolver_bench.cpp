@@ -0,0 +1,338 @@
+// Resolves names against a simulated hierarchy of authorities (see
+// sim_network.h), with no sockets involved, and reports how fast the
+// resolution engine runs and how it behaves.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "arena.h"
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "frame_pool.h"
+#include "infra_cache.h"
+#include "resolver.h"
+#include "sim_network.h"
+#include "slab_arena.h"
+#include "slab_pool.h"
+#include "task.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+// Where DnsCache's root hints point
+const char* kRootServers[] = {
+   "198.41.0.4", "192.228.79.201", "192.33.4.12", "128.8.10.90",
+   "192.203.230.10", "192.5.5.241", "192.112.36.4", "128.63.2.53",
+   "192.36.148.17", "129.58.128.30", "193.0.14.129", "199.7.83.42",
+   "202.12.27.33"
+};
+
+const uint32_t kRootRttMs = 20;
+const uint32_t kTldRttMs = 30;
+
+// Zone servers are this far away, give or take kZoneRttSpreadMs
+const uint32_t kZoneRttMs = 40;
+const uint32_t kZoneRttSpreadMs = 30;
+
+// Every kGluelessEvery-th zone is delegated without glue, to the nameserver
+// of the zone before it; every kTruncateEvery-th zone's server (with
+// --truncate) only answers in full over TCP
+const int kGluelessEvery = 4;
+const int kTruncateEvery = 8;
+
+// Share of queries for names that don't exist
+const double kMissingFraction = 0.05;
+
+const double kExploreProbability = 0.05;
+
+struct Workload {
+   int queries_;
+   int zones_;
+   int hosts_;
+
+   int next_;
+   int answered_;
+   int negative_;
+   int failed_;
+};
+
+uint64_t WallUs() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+std::string ZoneName(int zone) {
+   char name[64];
+   snprintf(name, sizeof(name), "zone%d.com", zone);
+   return name;
+}
+
+std::string ZoneIp(int zone) {
+   char ip[32];
+   snprintf(ip, sizeof(ip), "10.1.%d.%d", zone / 256, zone % 256);
+   return ip;
+}
+
+// One client, asking one name after another until the workload is done
+DetachedTask Client(Resolver* resolver, Workload* workload) {
+   Arena arena;
+
+   while (workload->next_ < workload->queries_) {
+      workload->next_++;
+      arena.Reset();
+
+      int zone = random() % workload->zones_;
+      char name[128];
+      if (random() < kMissingFraction * RAND_MAX) {
+         snprintf(name, sizeof(name), "missing%ld.%s", random() % 1000,
+               ZoneName(zone).c_str());
+      } else if (random() % 10 == 0) {
+         snprintf(name, sizeof(name), "www.%s", ZoneName(zone).c_str());
+      } else {
+         snprintf(name, sizeof(name), "h%ld.%s",
+               random() % workload->hosts_, ZoneName(zone).c_str());
+      }
+
+      DnsQuery query(SimZone::DnsName(name), htons(constants::type::A),
+            htons(constants::clz::IN));
+      Resolver::Answer answer = co_await resolver->Resolve(query, &arena);
+
+      if (answer.resolved_)
+         workload->answered_++;
+      else if (answer.response_.size())
+         workload->negative_++;
+      else
+         workload->failed_++;
+   }
+}
+
+void usage(const char* prog) {
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  --queries=N           names to resolve (20000)\n"
+         "  --concurrency=N       clients resolving at once (64)\n"
+         "  --zones=N             zones under com (1000)\n"
+         "  --hosts=N             names per zone (20)\n"
+         "  --loss=F              chance a UDP query is lost (0)\n"
+         "  --truncate            some servers answer in full over TCP only\n"
+         "  --hedge               hedge slow authorities\n"
+         "  --huge-pages=MODE     back the cache with huge pages: none, thp\n"
+         "                        (transparent) or explicit (none)\n"
+         "  --seed=N              random seed (1)\n",
+         prog);
+   exit(EXIT_FAILURE);
+}
+}
+
+int main(int argc, char** argv) {
+   Resolver::Options options;
+   Workload workload;
+   memset(&workload, 0, sizeof(Workload));
+   workload.queries_ = 20000;
+   workload.zones_ = 1000;
+   workload.hosts_ = 20;
+
+   int concurrency = 64;
+   double loss = 0;
+   bool truncate = false;
+   long seed = 1;
+   SlabArena::HugePages huge_pages = SlabArena::kNoHugePages;
+
+   static struct option long_options[] = {
+      { "queries",     required_argument, NULL, 'q' },
+      { "concurrency", required_argument, NULL, 'c' },
+      { "zones",       required_argument, NULL, 'z' },
+      { "hosts",       required_argument, NULL, 'n' },
+      { "loss",        required_argument, NULL, 'l' },
+      { "truncate",    no_argument,       NULL, 't' },
+      { "hedge",       no_argument,       NULL, 'h' },
+      { "seed",        required_argument, NULL, 's' },
+      { "huge-pages",  required_argument, NULL, 'p' },
+      { NULL,          0,                 NULL, 0 }
+   };
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 'q':
+            workload.queries_ = atoi(optarg);
+            break;
+         case 'c':
+            concurrency = atoi(optarg);
+            break;
+         case 'z':
+            workload.zones_ = atoi(optarg);
+            break;
+         case 'n':
+            workload.hosts_ = atoi(optarg);
+            break;
+         case 'l':
+            loss = atof(optarg);
+            break;
+         case 't':
+            truncate = true;
+            break;
+         case 'h':
+            options.hedge_ = true;
+            break;
+         case 's':
+            seed = atol(optarg);
+            break;
+         case 'p':
+            if (!strcmp(optarg, "none"))
+               huge_pages = SlabArena::kNoHugePages;
+            else if (!strcmp(optarg, "thp"))
+               huge_pages = SlabArena::kTransparentHugePages;
+            else if (!strcmp(optarg, "explicit"))
+               huge_pages = SlabArena::kExplicitHugePages;
+            else
+               usage(argv[0]);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+
+   if (workload.zones_ < 1 || workload.zones_ > 65536 ||
+       workload.hosts_ < 1 || concurrency < 1)
+      usage(argv[0]);
+
+   srandom(seed);
+
+   // Build the hierarchy: the root delegates com, com delegates the zones
+   SimNetwork network;
+
+   SimZone root("");
+   root.AddDelegation("com", "a.gtld.com", "10.0.0.1");
+   root.AddDelegation("com", "b.gtld.com", "10.0.0.2");
+   for (size_t i = 0; i < sizeof(kRootServers) / sizeof(kRootServers[0]); ++i)
+      network.AddServer(kRootServers[i], &root, kRootRttMs, loss, false);
+
+   SimZone com("com");
+   network.AddServer("10.0.0.1", &com, kTldRttMs, loss, false);
+   network.AddServer("10.0.0.2", &com, kTldRttMs, loss, false);
+
+   std::vector<SimZone*> zones;
+   for (int z = 0; z < workload.zones_; ++z) {
+      std::string zone_name = ZoneName(z);
+      std::string ns_name = "ns1." + zone_name;
+      std::string ip = ZoneIp(z);
+
+      SimZone* zone = new SimZone(zone_name.c_str());
+      zone->AddA(ns_name.c_str(), ip.c_str());
+      for (int h = 0; h < workload.hosts_; ++h) {
+         std::string host = "h" + std::to_string(h) + "." + zone_name;
+         char host_ip[32];
+         snprintf(host_ip, sizeof(host_ip), "10.2.%d.%d", z % 256, h % 256);
+         zone->AddA(host.c_str(), host_ip);
+      }
+      std::string www = "www." + zone_name;
+      std::string h0 = "h0." + zone_name;
+      zone->AddCname(www.c_str(), h0.c_str());
+      zones.push_back(zone);
+
+      uint32_t rtt_ms = kZoneRttMs - kZoneRttSpreadMs +
+            random() % (2 * kZoneRttSpreadMs + 1);
+      bool truncate_udp = truncate && z % kTruncateEvery == kTruncateEvery - 1;
+
+      // Glueless: served by, and delegated to, the previous zone's server
+      if (z % kGluelessEvery == kGluelessEvery - 1) {
+         std::string host_ns = "ns1." + ZoneName(z - 1);
+         com.AddDelegation(zone_name.c_str(), host_ns.c_str(), NULL);
+         network.AddServer(ZoneIp(z - 1).c_str(), zone, rtt_ms, loss,
+               truncate_udp);
+      } else {
+         com.AddDelegation(zone_name.c_str(), ns_name.c_str(), ip.c_str());
+         network.AddServer(ip.c_str(), zone, rtt_ms, loss, truncate_udp);
+      }
+   }
+
+   DnsCache cache(huge_pages);
+   InfraCache infra(kExploreProbability);
+   Resolver resolver(options, &cache, &infra, &network);
+
+   uint64_t start_us = WallUs();
+
+   for (int i = 0; i < concurrency; ++i)
+      resolver.Start(Client(&resolver, &workload), network.now_ms());
+   network.Run(&resolver);
+
+   uint64_t elapsed_us = WallUs() - start_us;
+   if (!elapsed_us)
+      elapsed_us = 1;
+
+   const Resolver::Stats& stats = resolver.stats();
+   const SimNetwork::Stats& net = network.stats();
+   const FramePool::Stats& frames = FramePool::Instance()->stats();
+   const SlabPool::Stats& slabs = SlabPool::Local()->stats();
+   SlabArena::Stats cache_slabs = cache.arena_stats();
+
+   printf("%d queries (%d answered, %d negative, %d failed), "
+         "%d clients\n",
+         workload.queries_, workload.answered_, workload.negative_,
+         workload.failed_, concurrency);
+   printf("wall: %.3f s, %.0f resolutions/s, %.2f us/resolution\n",
+         elapsed_us / 1e6, workload.queries_ * 1e6 / elapsed_us,
+         (double) elapsed_us / workload.queries_);
+   printf("simulated: %.3f s\n", network.now_ms() / 1e3);
+   printf("upstream: %llu UDP queries (%llu lost), %llu over TCP, "
+         "%llu timeouts, %llu hedges (%llu won)\n",
+         (unsigned long long) net.queries,
+         (unsigned long long) net.lost,
+         (unsigned long long) net.tcp_queries,
+         (unsigned long long) stats.timeouts,
+         (unsigned long long) stats.hedges_sent,
+         (unsigned long long) stats.hedges_won);
+   printf("nameserver lookups: %llu started, %llu joined, %llu resolved, "
+         "%llu failed\n",
+         (unsigned long long) stats.ns_lookups_started,
+         (unsigned long long) stats.ns_lookups_joined,
+         (unsigned long long) stats.ns_lookups_resolved,
+         (unsigned long long) stats.ns_lookups_failed);
+   printf("frames: %llu allocated, %llu reused, peak %llu live, "
+         "%llu bytes pooled\n",
+         (unsigned long long) frames.allocations,
+         (unsigned long long) frames.reused,
+         (unsigned long long) frames.peak_outstanding,
+         (unsigned long long) frames.bytes_reserved);
+   printf("slabs: %llu allocations (%llu large), %llu slabs, "
+         "%llu bytes reserved; %lld in use over all threads\n",
+         (unsigned long long) slabs.allocations,
+         (unsigned long long) slabs.large,
+         (unsigned long long) slabs.slabs,
+         (unsigned long long) slabs.bytes_reserved,
+         (long long) SlabPool::BytesInUse());
+   printf("cache arena: %llu regions (%llu huge, %llu fallbacks), "
+         "%llu slabs, %llu of %llu bytes in use, %.1f%% fragmented\n",
+         (unsigned long long) cache_slabs.regions,
+         (unsigned long long) cache_slabs.huge_page_regions,
+         (unsigned long long) cache_slabs.huge_page_fallbacks,
+         (unsigned long long) cache_slabs.slabs_used,
+         (unsigned long long) cache_slabs.bytes_in_use,
+         (unsigned long long) cache_slabs.bytes_mapped,
+         100 * SlabArena::Fragmentation(cache_slabs));
+
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   printf("peak RSS: %ld KiB\n", usage.ru_maxrss);
+
+   for (size_t i = 0; i < zones.size(); ++i)
+      delete zones[i];
+
+   return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "pipeline.h"
+#include "scheduler.h"
+
+Scheduler::Options::Options()
+      : fast_weight_(8),
+        lane_slots_(1024) {
+   budget_us_[kFast] = 1000;
+   budget_us_[kSlow] = 50000;
+}
+
+Scheduler::Scheduler(const Options& options)
+      : options_(options),
+        fast_credit_(options.fast_weight_) {
+   for (int i = 0; i < kLanes; ++i) {
+      lanes_[i].items_ = new Datagram[options_.lane_slots_];
+      MALLOCCHECK(lanes_[i].items_);
+      lanes_[i].head_ = 0;
+      lanes_[i].count_ = 0;
+      memset(&lanes_[i].stats_, 0, sizeof(LaneStats));
+   }
+}
+
+Scheduler::~Scheduler() {
+   for (int i = 0; i < kLanes; ++i)
+      delete[] lanes_[i].items_;
+}
+
+bool Scheduler::Push(Lane lane, const Datagram& datagram, uint64_t now_us) {
+   Ring* ring = &lanes_[lane];
+   if (ring->count_ == options_.lane_slots_) {
+      ring->stats_.dropped++;
+      return false;
+   }
+
+   Datagram* item = &ring->items_[(ring->head_ + ring->count_++) %
+         options_.lane_slots_];
+   *item = datagram;
+   item->enqueued_ns_ = now_us * 1000;
+   ring->stats_.queued++;
+   return true;
+}
+
+bool Scheduler::Next(Datagram* datagram, Lane* lane, uint64_t now_us) {
+   Ring* fast = &lanes_[kFast];
+   Ring* slow = &lanes_[kSlow];
+   if (!fast->count_ && !slow->count_)
+      return false;
+
+   // Slow work past its budget goes first, whatever the weights say
+   bool slow_overdue = slow->count_ &&
+         now_us - slow->items_[slow->head_].enqueued_ns_ / 1000 >
+         options_.budget_us_[kSlow];
+
+   if (fast->count_ && !slow_overdue && (fast_credit_ > 0 || !slow->count_)) {
+      *lane = kFast;
+      if (slow->count_)
+         fast_credit_--;
+   } else {
+      *lane = kSlow;
+      fast_credit_ = options_.fast_weight_;
+   }
+
+   Take(*lane, datagram, now_us);
+   return true;
+}
+
+void Scheduler::Take(Lane lane, Datagram* datagram, uint64_t now_us) {
+   Ring* ring = &lanes_[lane];
+   *datagram = ring->items_[ring->head_];
+   ring->head_ = (ring->head_ + 1) % options_.lane_slots_;
+   ring->count_--;
+
+   uint64_t enqueued_us = datagram->enqueued_ns_ / 1000;
+   uint64_t wait_us = now_us > enqueued_us ? now_us - enqueued_us : 0;
+   ring->stats_.served++;
+   ring->stats_.total_wait_us += wait_us;
+   if (wait_us > ring->stats_.max_wait_us)
+      ring->stats_.max_wait_us = wait_us;
+   if (wait_us > options_.budget_us_[lane])
+      ring->stats_.over_budget++;
+}
@@ -0,0 +1,85 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "smartalloc.h"
+
+#include "pipeline.h"
+
+// Orders the event loop's work in two lanes, so cheap work is not stuck
+// behind expensive work that happened to arrive first. The fast lane holds
+// client queries, most of which the cache answers; the slow lane holds
+// what needs the resolver: queries the cache missed, and upstream
+// responses.
+//
+// Lanes are served weighted round robin, up to |fast_weight_| fast items
+// for each slow one, so a burst of upstream responses delays a cache hit
+// by at most one slow item. Each lane has a latency budget. A slow item
+// queued for longer than its budget is served next regardless, so
+// recursion is never starved; a fast item served later than its budget is
+// counted, as that is the tail the weights are meant to keep short.
+//
+// Lanes are fixed-size rings of Datagrams, allocated up front. Single
+// threaded.
+class Scheduler {
+  public:
+   enum Lane {
+      kFast = 0,
+      kSlow = 1,
+      kLanes = 2
+   };
+
+   struct Options {
+      Options();
+
+      int fast_weight_;
+      uint64_t budget_us_[kLanes];
+      size_t lane_slots_;
+   };
+
+   struct LaneStats {
+      uint64_t queued;
+      uint64_t dropped;         // lane full
+      uint64_t served;
+      uint64_t total_wait_us;
+      uint64_t max_wait_us;
+      uint64_t over_budget;     // served after waiting past the budget
+   };
+
+   explicit Scheduler(const Options& options);
+   ~Scheduler();
+
+   // Queues a copy of |datagram|. Returns false if |lane| is full.
+   bool Push(Lane lane, const Datagram& datagram, uint64_t now_us);
+
+   // Takes the next item to serve, and says from which lane. Returns false
+   // if both are empty.
+   bool Next(Datagram* datagram, Lane* lane, uint64_t now_us);
+
+   bool empty() const { return !lanes_[kFast].count_ && !lanes_[kSlow].count_; }
+
+   const LaneStats& stats(Lane lane) const { return lanes_[lane].stats_; }
+
+  private:
+   struct Ring {
+      Datagram* items_;
+      size_t head_;
+      size_t count_;
+      LaneStats stats_;
+   };
+
+   void Take(Lane lane, Datagram* datagram, uint64_t now_us);
+
+   const Options options_;
+   Ring lanes_[kLanes];
+
+   // Fast items left before a waiting slow item gets its turn
+   int fast_credit_;
+
+   Scheduler(const Scheduler&);
+   void operator=(const Scheduler&);
+};
+
+#endif   // _SCHEDULER_H_
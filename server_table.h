@@ -0,0 +1,106 @@
+#ifndef _SERVER_TABLE_H_
+#define _SERVER_TABLE_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+// A T for each upstream server, for stats kept per server: a fixed table
+// of |slots| entries, open addressed by the server's address, of which up
+// to |max_servers| are claimed so probes stay short. Servers past that get
+// NULL, and are for the caller to count together.
+//
+// Find() claims entries, and is for one thread only (the resolver's).
+// ForEach() may run on any thread at the same time, and visits an entry
+// once its address is set; T's fields must stand being read while they are
+// written, as PerThread's do.
+template <typename T>
+class ServerTable {
+  public:
+   ServerTable(int slots, int max_servers);
+   ~ServerTable();
+
+   // |addr|'s entry, claiming one if it is new; NULL once |max_servers|
+   // are claimed.
+   T* Find(const struct in6_addr& addr);
+
+   // Calls |visit|(addr, entry) for each claimed entry.
+   template <typename Visit>
+   void ForEach(Visit visit) const;
+
+  private:
+   struct Slot {
+      Slot() : used_(false), value_() { }
+
+      struct in6_addr addr_;
+      std::atomic<bool> used_;   // set once addr_ is
+      T value_;
+   };
+
+   static uint32_t HashAddr(const struct in6_addr& addr);
+
+   Slot* slots_;
+   const int num_slots_;
+   const int max_servers_;
+   int num_servers_;
+
+   ServerTable(const ServerTable&);
+   void operator=(const ServerTable&);
+};
+
+template <typename T>
+ServerTable<T>::ServerTable(int slots, int max_servers)
+      : slots_(new Slot[slots]),
+        num_slots_(slots),
+        max_servers_(max_servers),
+        num_servers_(0) {
+   MALLOCCHECK(slots_);
+}
+
+template <typename T>
+ServerTable<T>::~ServerTable() {
+   delete[] slots_;
+}
+
+template <typename T>
+T* ServerTable<T>::Find(const struct in6_addr& addr) {
+   uint32_t i = HashAddr(addr) % num_slots_;
+   while (slots_[i].used_.load(std::memory_order_relaxed)) {
+      if (!memcmp(&slots_[i].addr_, &addr, sizeof(addr)))
+         return &slots_[i].value_;
+      i = (i + 1) % num_slots_;
+   }
+
+   // New, and the probe ended on a free slot
+   if (num_servers_ == max_servers_)
+      return NULL;
+
+   slots_[i].addr_ = addr;
+   slots_[i].used_.store(true, std::memory_order_release);
+   num_servers_++;
+   return &slots_[i].value_;
+}
+
+template <typename T>
+template <typename Visit>
+void ServerTable<T>::ForEach(Visit visit) const {
+   for (int i = 0; i < num_slots_; ++i) {
+      if (slots_[i].used_.load(std::memory_order_acquire))
+         visit(slots_[i].addr_, slots_[i].value_);
+   }
+}
+
+// static
+template <typename T>
+uint32_t ServerTable<T>::HashAddr(const struct in6_addr& addr) {
+   uint32_t words[4];
+   memcpy(words, &addr, sizeof(words));
+   uint32_t hash = words[0] ^ words[1] ^ words[2] ^ words[3];
+   return hash * 2654435761u;
+}
+
+#endif   // _SERVER_TABLE_H_
@@ -0,0 +1,484 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "shared_cache.h"
+
+namespace {
+// How long an attaching process waits for the creator to set the segment up
+const int kAttachWaitMs = 1000;
+
+// Stats counters, in the order of SharedCache::Stats
+enum Counter {
+   kLookups, kHits, kTornReads, kInserts, kBusy, kTooLarge, kEvictions,
+   kRecovered
+};
+
+// Appends |len| bytes at |*p|, if they fit before |end|.
+bool Put(char** p, char* end, const void* data, size_t len) {
+   if ((size_t) (end - *p) < len)
+      return false;
+   memcpy(*p, data, len);
+   *p += len;
+   return true;
+}
+
+bool Put16(char** p, char* end, uint16_t v) { return Put(p, end, &v, 2); }
+bool Put32(char** p, char* end, uint32_t v) { return Put(p, end, &v, 4); }
+
+// Takes |len| bytes from |*p|, if they are there before |end|.
+bool Take(const char** p, const char* end, void* data, size_t len) {
+   if ((size_t) (end - *p) < len)
+      return false;
+   memcpy(data, *p, len);
+   *p += len;
+   return true;
+}
+
+bool Expired(uint32_t inserted, uint32_t ttl, time_t now) {
+   // TTL == 0 never expires
+   ttl = ntohl(ttl);
+   return ttl && now - (time_t) inserted > (time_t) ttl;
+}
+}
+
+// static
+SharedCache* SharedCache::Attach(const char* name, uint32_t slots) {
+   uint32_t count = 1;
+   while (count < slots)
+      count <<= 1;
+
+   bool created = true;
+   int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   if (fd < 0 && errno == EEXIST) {
+      created = false;
+      fd = shm_open(name, O_RDWR, 0);
+   }
+   if (fd < 0) {
+      perror("shm_open");
+      return NULL;
+   }
+
+   size_t size;
+   if (created) {
+      size = sizeof(Header) + (size_t) count * sizeof(Slot);
+      if (ftruncate(fd, size) < 0) {
+         perror("ftruncate");
+         close(fd);
+         shm_unlink(name);
+         return NULL;
+      }
+   } else {
+      // The creator may not have sized it yet
+      struct stat st;
+      int waited = 0;
+      while (!fstat(fd, &st) && st.st_size == 0 && waited < kAttachWaitMs) {
+         usleep(1000);
+         waited++;
+      }
+      size = st.st_size;
+      if (size < sizeof(Header)) {
+         fprintf(stderr, "Shared cache %s was never set up\n", name);
+         close(fd);
+         return NULL;
+      }
+   }
+
+   void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      perror("mmap");
+      return NULL;
+   }
+
+   // A fresh segment is all zeros, which is every slot free
+   Header* header = (Header*) p;
+   if (created) {
+      header->version_ = kLayoutVersion;
+      header->slots_ = count;
+      header->slot_size_ = sizeof(Slot);
+      header->magic_.store(kMagic, std::memory_order_release);
+   } else {
+      int waited = 0;
+      while (header->magic_.load(std::memory_order_acquire) != kMagic &&
+             waited < kAttachWaitMs) {
+         usleep(1000);
+         waited++;
+      }
+
+      if (header->magic_.load(std::memory_order_acquire) != kMagic ||
+          header->version_ != kLayoutVersion ||
+          header->slot_size_ != sizeof(Slot) ||
+          sizeof(Header) + (size_t) header->slots_ * sizeof(Slot) != size) {
+         fprintf(stderr, "Shared cache %s has a different layout\n", name);
+         munmap(p, size);
+         return NULL;
+      }
+   }
+
+   SharedCache* cache = new SharedCache((char*) p, size);
+   MALLOCCHECK(cache);
+   return cache;
+}
+
+SharedCache::SharedCache(char* base, size_t size)
+      : base_(base),
+        size_(size),
+        header_((Header*) base),
+        slots_((Slot*) (base + sizeof(Header))),
+        mask_(header_->slots_ - 1) {
+   for (int i = 0; i < 8; ++i)
+      counters_[i].store(0, std::memory_order_relaxed);
+}
+
+SharedCache::~SharedCache() {
+   munmap(base_, size_);
+}
+
+bool SharedCache::Get(const DnsQuery& query, int cache, time_t now,
+                      RRVec* rrs) {
+   counters_[kLookups].fetch_add(1, std::memory_order_relaxed);
+
+   uint32_t hash = Hash(query, cache);
+   Image image;
+   for (uint32_t i = 0; i < kProbe; ++i) {
+      Slot* slot = &slots_[(hash + i) & mask_];
+      size_t at;
+      if (!Read(slot, hash, &image) || !image.len_ || image.hash_ != hash ||
+          !MatchKey(image, query, cache, &at))
+         continue;
+
+      // Push all unexpired RRs, their TTLs counted down to now
+      uint32_t inserted[kMaxRecords];
+      size_t first = rrs->size();
+      int found = DecodeRecords(image, at, now, rrs, inserted);
+      for (int j = 0; j < found; ++j) {
+         DnsResourceRecord& rr = (*rrs)[first + j];
+         if (ntohl(rr.ttl()))
+            rr.SubtractFromTtl(now - inserted[j]);
+      }
+
+      if (!found)
+         return false;
+
+      counters_[kHits].fetch_add(1, std::memory_order_relaxed);
+      return true;
+   }
+
+   return false;
+}
+
+bool SharedCache::Insert(const DnsQuery& query, int cache,
+                         const DnsResourceRecord& record, time_t now,
+                         RRVec* spilled) {
+   counters_[kInserts].fetch_add(1, std::memory_order_relaxed);
+
+   // The slot already holding the set; failing that, a free one, an expired
+   // one, or the one that expires soonest
+   uint32_t hash = Hash(query, cache);
+   Image image;
+   Slot* target = NULL;
+   Slot* victim = NULL;
+   uint32_t victim_expires = 0;
+   for (uint32_t i = 0; i < kProbe; ++i) {
+      Slot* slot = &slots_[(hash + i) & mask_];
+      if (!Read(slot, hash, &image)) {
+         // Left claimed by a writer that died: free for the taking
+         if (Abandoned(slot->seq_.load(std::memory_order_acquire))) {
+            victim = slot;
+            victim_expires = 0;
+         }
+         continue;
+      }
+
+      size_t at;
+      if (image.len_ && image.hash_ == hash &&
+          MatchKey(image, query, cache, &at)) {
+         target = slot;
+         break;
+      }
+
+      uint32_t expires = image.len_ ? image.expires_ : 0;
+      if (!victim || expires < victim_expires) {
+         victim = slot;
+         victim_expires = expires;
+      }
+   }
+
+   if (!target)
+      target = victim;
+   uint64_t seq = target ? Lock(target) : 0;
+   if (!seq) {
+      counters_[kBusy].fetch_add(1, std::memory_order_relaxed);
+      return false;
+   }
+
+   // Holding the slot, so it cannot change under us; but it may have since
+   // the probe
+   RRVec rrs;
+   uint32_t inserted[kMaxRecords + 1];
+   int count = 0;
+   size_t at;
+   if (target->len_ && target->len_ <= kDataSize && target->hash_ == hash &&
+       Checksum(target->data_, target->len_) == target->checksum_) {
+      memcpy(&image, &target->hash_, offsetof(Image, data_));
+      memcpy(image.data_, target->data_, target->len_);
+      if (MatchKey(image, query, cache, &at))
+         count = DecodeRecords(image, at, now, &rrs, inserted);
+   }
+
+   if (!count && target->len_ && target->expires_ > now)
+      counters_[kEvictions].fetch_add(1, std::memory_order_relaxed);
+
+   for (int i = 0; i < count; ++i) {
+      if (record == rrs[i]) {
+         Unlock(target, seq);
+         return true;
+      }
+   }
+
+   rrs.push_back(record);
+   inserted[count++] = now;
+
+   if (count > kMaxRecords ||
+       !Encode(query, cache, hash, rrs, inserted, &image)) {
+      counters_[kTooLarge].fetch_add(1, std::memory_order_relaxed);
+      target->len_ = 0;
+      Unlock(target, seq);
+
+      // The caller keeps the set from now on, new record included
+      for (int i = 0; i < count; ++i) {
+         spilled->push_back(rrs[i]);
+         if (ntohl(rrs[i].ttl()))
+            spilled->back().SubtractFromTtl(now - inserted[i]);
+      }
+      return false;
+   }
+
+   memcpy(&target->hash_, &image, offsetof(Image, data_));
+   memcpy(target->data_, image.data_, image.len_);
+   Unlock(target, seq);
+   return true;
+}
+
+SharedCache::Stats SharedCache::stats() const {
+   Stats stats;
+   uint64_t* fields = (uint64_t*) &stats;
+   for (int i = 0; i < 8; ++i)
+      fields[i] = counters_[i].load(std::memory_order_relaxed);
+   return stats;
+}
+
+// static
+uint32_t SharedCache::Hash(const DnsQuery& query, int cache) {
+   // FNV-1a: std::hash may differ between the processes
+   uint32_t hash = 2166136261u;
+   const std::string& name = query.name();
+   for (size_t i = 0; i < name.size(); ++i)
+      hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+
+   uint32_t key = (uint32_t) cache << 16 ^ query.type() ^ query.clz() << 8;
+   for (int i = 0; i < 4; ++i)
+      hash = (hash ^ (uint8_t) (key >> 8 * i)) * 16777619u;
+   return hash;
+}
+
+bool SharedCache::Read(const Slot* slot, uint32_t hash, Image* image) {
+   for (int i = 0; i < kReadAttempts; ++i) {
+      uint64_t seq = slot->seq_.load(std::memory_order_acquire);
+      if (seq & 1)
+         continue;
+
+      memcpy(image, &slot->hash_, offsetof(Image, data_));
+      bool wanted = image->len_ && image->hash_ == hash &&
+            image->len_ <= kDataSize;
+      if (wanted)
+         memcpy(image->data_, slot->data_, image->len_);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->seq_.load(std::memory_order_relaxed) != seq)
+         continue;
+
+      // A torn copy that got past the sequence would not add up
+      if (wanted && Checksum(image->data_, image->len_) != image->checksum_)
+         continue;
+
+      return true;
+   }
+
+   counters_[kTornReads].fetch_add(1, std::memory_order_relaxed);
+   return false;
+}
+
+uint64_t SharedCache::Lock(Slot* slot) {
+   uint64_t mine = (uint64_t) getpid() << 32;
+   uint64_t seq = slot->seq_.load(std::memory_order_acquire);
+   uint64_t claimed;
+
+   if (seq & 1) {
+      // Claimed; give up unless whoever claimed it is gone
+      if (!Abandoned(seq))
+         return 0;
+
+      claimed = mine | (uint32_t) (seq + 2);
+      if (!slot->seq_.compare_exchange_strong(seq, claimed,
+            std::memory_order_acq_rel))
+         return 0;
+
+      // Whatever it left half-written is garbage
+      slot->len_ = 0;
+      counters_[kRecovered].fetch_add(1, std::memory_order_relaxed);
+   } else {
+      claimed = mine | (uint32_t) (seq + 1);
+      if (!slot->seq_.compare_exchange_strong(seq, claimed,
+            std::memory_order_acq_rel))
+         return 0;
+   }
+
+   // Readers must see the odd sequence before any of the writes
+   std::atomic_thread_fence(std::memory_order_release);
+   return claimed;
+}
+
+// static
+bool SharedCache::Abandoned(uint64_t seq) {
+   return (seq & 1) && kill(seq >> 32, 0) < 0 && errno == ESRCH;
+}
+
+void SharedCache::Unlock(Slot* slot, uint64_t seq) {
+   slot->seq_.store((uint32_t) (seq + 1), std::memory_order_release);
+}
+
+// An image's data is the key (cache, type, class, name) followed by the
+// record count and the records (insertion time, TTL, type, class, data
+// length, name, data), all in the byte order they are kept in.
+// static
+bool SharedCache::Encode(const DnsQuery& query, int cache, uint32_t hash,
+                         const RRVec& rrs, const uint32_t* inserted,
+                         Image* image) {
+   if (query.name().size() > 255)
+      return false;
+
+   char* p = image->data_;
+   char* end = image->data_ + kDataSize;
+   uint8_t clz = cache;
+   uint8_t name_len = query.name().size();
+   if (!Put(&p, end, &clz, 1) ||
+       !Put16(&p, end, query.type()) ||
+       !Put16(&p, end, query.clz()) ||
+       !Put(&p, end, &name_len, 1) ||
+       !Put(&p, end, query.name().data(), name_len) ||
+       !Put16(&p, end, rrs.size()))
+      return false;
+
+   uint32_t expires = UINT32_MAX;
+   for (size_t i = 0; i < rrs.size(); ++i) {
+      const DnsResourceRecord& rr = rrs[i];
+      name_len = rr.name().size();
+      if (rr.name().size() > 255 ||
+          !Put32(&p, end, inserted[i]) ||
+          !Put32(&p, end, rr.ttl()) ||
+          !Put16(&p, end, rr.type()) ||
+          !Put16(&p, end, rr.clz()) ||
+          !Put16(&p, end, rr.data_len()) ||
+          !Put(&p, end, &name_len, 1) ||
+          !Put(&p, end, rr.name().data(), name_len) ||
+          !Put(&p, end, rr.data(), ntohs(rr.data_len())))
+         return false;
+
+      if (ntohl(rr.ttl()) && inserted[i] + ntohl(rr.ttl()) < expires)
+         expires = inserted[i] + ntohl(rr.ttl());
+   }
+
+   image->hash_ = hash;
+   image->expires_ = expires;
+   image->len_ = p - image->data_;
+   image->checksum_ = Checksum(image->data_, image->len_);
+   return true;
+}
+
+// static
+bool SharedCache::MatchKey(const Image& image, const DnsQuery& query,
+                           int cache, size_t* records_at) {
+   const char* p = image.data_;
+   const char* end = image.data_ + image.len_;
+   uint8_t clz;
+   uint16_t type;
+   uint16_t query_clz;
+   uint8_t name_len;
+   if (!Take(&p, end, &clz, 1) || clz != cache ||
+       !Take(&p, end, &type, 2) || type != query.type() ||
+       !Take(&p, end, &query_clz, 2) || query_clz != query.clz() ||
+       !Take(&p, end, &name_len, 1) || name_len != query.name().size() ||
+       end - p < name_len || memcmp(p, query.name().data(), name_len))
+      return false;
+
+   *records_at = p + name_len - image.data_;
+   return true;
+}
+
+// static
+int SharedCache::DecodeRecords(const Image& image, size_t at, time_t now,
+                               RRVec* rrs, uint32_t* inserted) {
+   const char* p = image.data_ + at;
+   const char* end = image.data_ + image.len_;
+   uint16_t count;
+   if (!Take(&p, end, &count, 2))
+      return 0;
+
+   int found = 0;
+   for (int i = 0; i < count; ++i) {
+      uint32_t when;
+      uint32_t ttl;
+      uint16_t type;
+      uint16_t clz;
+      uint16_t data_len;
+      uint8_t name_len;
+      if (!Take(&p, end, &when, 4) ||
+          !Take(&p, end, &ttl, 4) ||
+          !Take(&p, end, &type, 2) ||
+          !Take(&p, end, &clz, 2) ||
+          !Take(&p, end, &data_len, 2) ||
+          !Take(&p, end, &name_len, 1) ||
+          end - p < name_len + ntohs(data_len))
+         break;
+
+      std::string name(p, name_len);
+      char* data = (char*) p + name_len;
+      p += name_len + ntohs(data_len);
+
+      if (Expired(when, ttl, now) || found == kMaxRecords)
+         continue;
+
+      rrs->push_back(DnsResourceRecord(name, type, clz, ttl, data_len, data));
+      inserted[found++] = when;
+   }
+
+   return found;
+}
+
+// static
+uint16_t SharedCache::Checksum(const char* data, size_t len) {
+   uint32_t sum = 2166136261u;
+   for (size_t i = 0; i < len; ++i)
+      sum = (sum ^ (uint8_t) data[i]) * 16777619u;
+   return sum ^ sum >> 16;
+}
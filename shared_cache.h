@@ -0,0 +1,160 @@
+#ifndef _SHARED_CACHE_H_
+#define _SHARED_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+
+// A cache tier in a POSIX shared memory segment, which any number of
+// resolver processes on the host attach to by name, so they share hit rates
+// and memory. DnsCache puts what fits here and keeps the rest to itself.
+//
+// The segment holds no pointers: a header, then an open-addressed table of
+// fixed-size slots, each with one RRset serialized into it. A slot is
+// guarded by a sequence word. A writer claims it by swapping in an odd
+// sequence tagged with its pid, and publishes by making it even again;
+// readers copy a slot out and keep the copy only if the sequence did not
+// move and the checksum matches. Nobody ever waits on a slot: a reader that
+// keeps finding it mid-write counts a miss, a writer that finds it claimed
+// gives up. A writer that died mid-write leaves its pid in the sequence, and
+// the next writer to come along takes the slot over and clears it, so a
+// crash costs one entry and never corrupts the segment. (A pid reused
+// before that happens keeps the slot claimed; that too costs one entry.)
+//
+// The segment outlives the processes; remove it with shm_unlink, or by
+// deleting /dev/shm/<name> on Linux.
+class SharedCache {
+  public:
+   struct Stats {
+      uint64_t lookups;
+      uint64_t hits;
+      uint64_t torn_reads;     // slot kept changing while being read
+      uint64_t inserts;
+      uint64_t busy;           // slot claimed by another writer
+      uint64_t too_large;      // RRset did not fit in a slot
+      uint64_t evictions;      // live entries overwritten
+      uint64_t recovered;      // slots taken over from dead writers
+   };
+
+   // Opens segment |name| (e.g. "/dns_cache"), creating it with |slots|
+   // slots (rounded up to a power of two) if it does not exist. Returns NULL
+   // after printing why if it cannot be used.
+   static SharedCache* Attach(const char* name, uint32_t slots);
+
+   // Unmaps the segment; it stays for the other processes.
+   ~SharedCache();
+
+   // Appends the unexpired records cached under |query| to |rrs|, their
+   // TTLs counted down to |now| (in seconds, since boot, as every time here
+   // is). |cache| is dns_cache::kCache or kNegativeCache.
+   bool Get(const DnsQuery& query, int cache, time_t now, RRVec* rrs);
+
+   // Adds |record| to the RRset under |query|, dropping expired records.
+   // Returns false if it could not be stored: the slot was busy, or the set
+   // outgrew a slot, in which case the slot is freed and the records it held
+   // are appended to |spilled| for the caller to keep.
+   bool Insert(const DnsQuery& query, int cache,
+         const DnsResourceRecord& record, time_t now, RRVec* spilled);
+
+   uint32_t slots() const { return mask_ + 1; }
+
+   Stats stats() const;
+
+  private:
+   static const uint32_t kMagic = 0x444e5343;   // "DNSC"
+   // 2: times are seconds of the monotonic Clock (since boot), not since
+   // the epoch
+   static const uint32_t kLayoutVersion = 2;
+   static const size_t kSlotSize = 512;
+   static const size_t kDataSize = kSlotSize - 24;
+
+   // Most records an RRset can have and still fit
+   static const int kMaxRecords = kDataSize / 16;
+
+   // Slots an RRset may sit in, starting at its hash
+   static const uint32_t kProbe = 8;
+
+   // Times a reader copies a slot that changes under it before giving up
+   static const int kReadAttempts = 4;
+
+   struct Header {
+      std::atomic<uint32_t> magic_;   // set last by the creator
+      uint32_t version_;
+      uint32_t slots_;
+      uint32_t slot_size_;
+      char pad_[48];
+   };
+
+   struct Slot {
+      // Odd while a writer has it, with the writer's pid in the top half
+      std::atomic<uint64_t> seq_;
+      uint32_t hash_;
+      uint32_t expires_;    // of its first record to expire
+      uint16_t len_;        // of data_; 0 if the slot is free
+      uint16_t checksum_;   // of data_
+      uint32_t pad_;
+      char data_[kDataSize];
+   };
+
+   // An RRset serialized the way slots hold it
+   struct Image {
+      uint32_t hash_;
+      uint32_t expires_;
+      uint16_t len_;
+      uint16_t checksum_;
+      char data_[kDataSize];
+   };
+
+   SharedCache(char* base, size_t size);
+
+   // Process-independent hash of the key
+   static uint32_t Hash(const DnsQuery& query, int cache);
+
+   // Copies |slot| out consistently; its data only if it is in use and
+   // under |hash|. Returns false if it kept changing or did not check out.
+   bool Read(const Slot* slot, uint32_t hash, Image* image);
+
+   // Claims |slot| for writing, taking it over if its writer died. Returns
+   // the sequence it was claimed at, or 0 if another writer has it.
+   uint64_t Lock(Slot* slot);
+   void Unlock(Slot* slot, uint64_t seq);
+
+   // True if |seq| is a claim by a process that no longer exists
+   static bool Abandoned(uint64_t seq);
+
+   // Serializes |query| and |rrs|, inserted at the times in |inserted|.
+   // Returns false if they do not fit.
+   static bool Encode(const DnsQuery& query, int cache, uint32_t hash,
+         const RRVec& rrs, const uint32_t* inserted, Image* image);
+
+   // True if |image| holds the RRset of |query|. Fills in where its
+   // records start.
+   static bool MatchKey(const Image& image, const DnsQuery& query, int cache,
+         size_t* records_at);
+
+   // Appends the unexpired records of |image|, from |at| on, to |rrs| and
+   // their insertion times to |inserted|. Returns how many.
+   static int DecodeRecords(const Image& image, size_t at, time_t now,
+         RRVec* rrs, uint32_t* inserted);
+
+   static uint16_t Checksum(const char* data, size_t len);
+
+   char* base_;
+   size_t size_;
+   Header* header_;
+   Slot* slots_;
+   uint32_t mask_;
+
+   mutable std::atomic<uint64_t> counters_[8];   // Stats, in order
+
+   SharedCache(const SharedCache&);
+   void operator=(const SharedCache&);
+};
+
+#endif   // _SHARED_CACHE_H_
@@ -0,0 +1,286 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <string>
+
+#include "debug.h"
+#include "checksum.h"
+#include "smartalloc.h"
+
+#include "dns_packet.h"
+#include "resolver.h"
+#include "sim_network.h"
+
+namespace constants = dns_packet_constants;
+
+namespace {
+const uint32_t kTtl = 3600;
+
+// Responses are built in a buffer this big
+const int kMaxResponseLen = 65535;
+}
+
+SimZone::SimZone(const char* origin)
+      : origin_(DnsName(origin)) {
+}
+
+// static
+std::string SimZone::DnsName(const char* name) {
+   std::string ret;
+
+   while (*name) {
+      const char* dot = strchr(name, '.');
+      int len = dot ? dot - name : strlen(name);
+
+      ret.push_back((char) len);
+      ret.append(name, len);
+
+      name += len;
+      if (*name == '.')
+         name++;
+   }
+
+   return ret;
+}
+
+// static
+bool SimZone::InZone(const std::string& name, const std::string& zone) {
+   std::string suffix = name;
+
+   while (1) {
+      if (suffix == zone)
+         return true;
+      if (suffix.empty())
+         return false;
+      suffix = DnsPacket::ShortenName(suffix);
+   }
+}
+
+void SimZone::AddA(const char* name, const char* ip) {
+   struct in_addr addr;
+   inet_pton(AF_INET, ip, &addr);
+
+   records_.push_back(DnsResourceRecord(DnsName(name),
+         htons(constants::type::A), htons(constants::clz::IN), htonl(kTtl),
+         htons(sizeof(struct in_addr)), (char*) &addr));
+}
+
+void SimZone::AddCname(const char* name, const char* target) {
+   std::string data = DnsName(target);
+
+   records_.push_back(DnsResourceRecord(DnsName(name),
+         htons(constants::type::CNAME), htons(constants::clz::IN),
+         htonl(kTtl), htons(data.size() + 1), (char*) data.c_str()));
+}
+
+void SimZone::AddDelegation(const char* child, const char* ns,
+                            const char* glue_ip) {
+   std::string data = DnsName(ns);
+
+   delegations_.push_back(DnsResourceRecord(DnsName(child),
+         htons(constants::type::NS), htons(constants::clz::IN), htonl(kTtl),
+         htons(data.size() + 1), (char*) data.c_str()));
+
+   if (glue_ip) {
+      struct in_addr addr;
+      inet_pton(AF_INET, glue_ip, &addr);
+
+      glue_.push_back(DnsResourceRecord(data, htons(constants::type::A),
+            htons(constants::clz::IN), htonl(kTtl),
+            htons(sizeof(struct in_addr)), (char*) &addr));
+   }
+}
+
+int SimZone::Answer(char* query, char* response) const {
+   DnsPacket packet(query);
+   DnsQuery question = packet.GetQuery();
+
+   RRVec answer_rrs;
+   RRVec authority_rrs;
+   RRVec additional_rrs;
+
+   // Below a delegation: refer to the child zone's nameservers, with glue
+   // only for those inside the child zone
+   RRVec::const_iterator it;
+   for (it = delegations_.begin(); it != delegations_.end(); ++it) {
+      if (InZone(question.name(), it->name()))
+         break;
+   }
+
+   if (it != delegations_.end()) {
+      std::string child = it->name();
+      for (it = delegations_.begin(); it != delegations_.end(); ++it) {
+         if (it->name() == child)
+            authority_rrs.push_back(*it);
+      }
+
+      RRVec::const_iterator auth_it;
+      for (auth_it = authority_rrs.begin(); auth_it != authority_rrs.end();
+           ++auth_it) {
+         for (it = glue_.begin(); it != glue_.end(); ++it) {
+            if (!it->name().compare(auth_it->data()) &&
+                InZone(it->name(), child))
+               additional_rrs.push_back(*it);
+         }
+      }
+
+      return DnsPacket::ConstructPacket(response, packet.id(), true,
+            constants::opcode::Query, false, false, false, false,
+            constants::response_code::NoError, question, answer_rrs,
+            authority_rrs, additional_rrs);
+   }
+
+   // Ours: the records asked for, or a CNAME to them
+   for (it = records_.begin(); it != records_.end(); ++it) {
+      if (it->name() == question.name() &&
+          (it->type() == question.type() ||
+           it->type() == htons(constants::type::CNAME)))
+         answer_rrs.push_back(*it);
+   }
+
+   if (answer_rrs.size()) {
+      return DnsPacket::ConstructPacket(response, packet.id(), true,
+            constants::opcode::Query, true, false, false, false,
+            constants::response_code::NoError, question, answer_rrs,
+            authority_rrs, additional_rrs);
+   }
+
+   // Nothing there: NXDOMAIN, with our SOA for negative caching
+   std::string mname = DnsName("ns") + origin_;
+   std::string rname = DnsName("hostmaster") + origin_;
+   uint32_t serial_etc[5] = { htonl(1), htonl(kTtl), htonl(kTtl),
+         htonl(kTtl), htonl(kTtl) };
+
+   std::string soa_data;
+   soa_data.append(mname.c_str(), mname.size() + 1);
+   soa_data.append(rname.c_str(), rname.size() + 1);
+   soa_data.append((char*) serial_etc, sizeof(serial_etc));
+
+   authority_rrs.push_back(DnsResourceRecord(origin_,
+         htons(constants::type::SOA), htons(constants::clz::IN),
+         htonl(kTtl), htons(soa_data.size()), (char*) soa_data.data()));
+
+   return DnsPacket::ConstructPacket(response, packet.id(), true,
+         constants::opcode::Query, true, false, false, false,
+         constants::response_code::NameError, question, answer_rrs,
+         authority_rrs, additional_rrs);
+}
+
+SimNetwork::SimNetwork()
+      : clock_(0) {
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+void SimNetwork::AddServer(const char* ip, SimZone* zone, uint32_t rtt_ms,
+                           double loss, bool truncate_udp) {
+   struct in6_addr addr;
+   memset(&addr, 0, sizeof(struct in6_addr));
+   memcpy(&addr, "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xFF\xFF", 12);
+   inet_pton(AF_INET, ip, ((char*) &addr) + 12);
+
+   Server& server = servers_[addr];
+   if (zone)
+      server.zones_.push_back(zone);
+   server.rtt_ms_ = rtt_ms;
+   server.loss_ = loss;
+   server.truncate_udp_ = truncate_udp;
+}
+
+void SimNetwork::SendUdp(const struct sockaddr_in6& addr, const char* packet,
+                         int len) {
+   stats_.queries++;
+   if (!Respond(addr, packet, len, false))
+      stats_.lost++;
+}
+
+bool SimNetwork::SendTcp(const struct sockaddr_in6& addr, const char* packet,
+                         int len, uint16_t id, uint64_t now_ms) {
+   stats_.tcp_queries++;
+   return Respond(addr, packet, len, true);
+}
+
+bool SimNetwork::Respond(const struct sockaddr_in6& addr, const char* packet,
+                         int len, bool tcp) {
+   ServerMap::iterator it = servers_.find(addr.sin6_addr);
+   if (it == servers_.end())
+      return false;
+
+   Server& server = it->second;
+   if (!tcp && random() < server.loss_ * RAND_MAX)
+      return false;
+
+   std::string query(packet, len);
+   DnsPacket query_packet(&query[0]);
+   DnsQuery question = query_packet.GetQuery();
+
+   // The most specific zone the server hosts answers
+   SimZone* zone = NULL;
+   ZoneVec::iterator zone_it;
+   for (zone_it = server.zones_.begin(); zone_it != server.zones_.end();
+        ++zone_it) {
+      if ((*zone_it)->Contains(question.name()) &&
+          (!zone || (*zone_it)->origin().size() > zone->origin().size()))
+         zone = *zone_it;
+   }
+
+   // Lame for it: refuse, as a real server does
+   char response[kMaxResponseLen];
+   int response_len;
+   if (zone) {
+      response_len = zone->Answer(&query[0], response);
+   } else {
+      RRVec none;
+      response_len = DnsPacket::ConstructPacket(response, query_packet.id(),
+            true, constants::opcode::Query, false, false, false, false,
+            constants::response_code::Refused, question, none, none, none);
+   }
+
+   // Too big for UDP: just the header and question, with TC set
+   if (zone && !tcp && server.truncate_udp_) {
+      DnsPacket response_packet(response);
+      DnsQuery question = response_packet.GetQuery();
+      RRVec none;
+      response_len = DnsPacket::ConstructPacket(response,
+            response_packet.id(), true, constants::opcode::Query, false,
+            true, false, false, constants::response_code::NoError, question,
+            none, none, none);
+   }
+
+   // A TCP exchange takes a round trip for the handshake first
+   uint64_t delay_ms = tcp ? 2 * server.rtt_ms_ : server.rtt_ms_;
+
+   DeliveryMap::iterator delivery = deliveries_.insert(
+         std::pair<const uint64_t, Delivery>(clock_.NowMs() + delay_ms,
+               Delivery()));
+   delivery->second.packet_.assign(response, response_len);
+   delivery->second.from_ = addr;
+   return true;
+}
+
+void SimNetwork::Run(Resolver* resolver) {
+   while (1) {
+      uint64_t timer_ms;
+      bool has_timer = resolver->NextTimer(&timer_ms);
+
+      if (deliveries_.empty() && !has_timer)
+         break;
+
+      // Whichever comes first; deliveries win ties, as a response that
+      // arrives just in time would in the real server
+      if (!deliveries_.empty() &&
+          (!has_timer || deliveries_.begin()->first <= timer_ms)) {
+         clock_.Set(deliveries_.begin()->first);
+
+         Delivery delivery = deliveries_.begin()->second;
+         deliveries_.erase(deliveries_.begin());
+         resolver->HandleResponse(&delivery.packet_[0],
+               delivery.packet_.size(), delivery.from_, clock_.NowMs());
+      } else {
+         clock_.Set(timer_ms);
+         resolver->HandleTimers(clock_.NowMs());
+      }
+   }
+}
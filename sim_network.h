@@ -0,0 +1,131 @@
+#ifndef _SIM_NETWORK_H_
+#define _SIM_NETWORK_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "smartalloc.h"
+
+#include "clock.h"
+#include "dns_packet.h"
+#include "resolver.h"
+
+// Authoritative data for one zone of the simulated network. A zone answers
+// with the records it holds, refers queries below its delegations to the
+// child zone's nameservers, and answers anything else with NXDOMAIN.
+//
+// Names are given in dotted form ("www.example.com").
+class SimZone {
+  public:
+   SimZone(const char* origin);
+
+   void AddA(const char* name, const char* ip);
+   void AddCname(const char* name, const char* target);
+
+   // Delegates |child| to nameserver |ns|, with glue if |glue_ip| is not
+   // NULL.
+   void AddDelegation(const char* child, const char* ns, const char* glue_ip);
+
+   // Builds the response to |query| (a packet) into |response|. Returns its
+   // length.
+   int Answer(char* query, char* response) const;
+
+   // True if |name| (DNS name format) is in this zone or below it.
+   bool Contains(const std::string& name) const { return InZone(name, origin_); }
+
+   const std::string& origin() const { return origin_; }
+
+   // "www.example.com" -> DNS name format, as the rest of the code keeps
+   // names.
+   static std::string DnsName(const char* name);
+
+  private:
+   // True if |name| is |zone| or below it.
+   static bool InZone(const std::string& name, const std::string& zone);
+
+   std::string origin_;
+   RRVec records_;
+   RRVec delegations_;   // NS records of child zones
+   RRVec glue_;
+};
+
+// A simulated network of authorities, for running the Resolver without
+// sockets. Queries are answered by the SimZone served at their destination,
+// and the responses delivered after that server's round trip time, on a
+// simulated clock. Run() interleaves deliveries with the resolver's timers
+// until every task has finished.
+class SimNetwork : public Transport {
+  public:
+   struct Stats {
+      uint64_t queries;
+      uint64_t tcp_queries;
+      uint64_t lost;   // dropped, or sent to an address nobody serves
+   };
+
+   SimNetwork();
+
+   // Serves |zone| at |ip| (IPv4). |loss| is the chance a UDP query gets no
+   // response. If |truncate_udp| is set, UDP responses come back truncated,
+   // so the resolver has to retry over TCP. A server may host several zones;
+   // the settings of the last one added apply. It answers questions outside
+   // them REFUSED, so a NULL |zone| makes a lame server.
+   void AddServer(const char* ip, SimZone* zone, uint32_t rtt_ms,
+         double loss, bool truncate_udp);
+
+   // Transport
+   virtual void SendUdp(const struct sockaddr_in6& addr, const char* packet,
+         int len);
+   virtual bool SendTcp(const struct sockaddr_in6& addr, const char* packet,
+         int len, uint16_t id, uint64_t now_ms);
+
+   // Delivers responses and fires |resolver|'s timers, in simulated time
+   // order, until there is nothing left to do.
+   void Run(Resolver* resolver);
+
+   uint64_t now_ms() const { return clock_.NowMs(); }
+   const Stats& stats() const { return stats_; }
+
+  private:
+   typedef std::vector<SimZone*, STLsmartalloc<SimZone*> > ZoneVec;
+
+   struct Server {
+      ZoneVec zones_;
+      uint32_t rtt_ms_;
+      double loss_;
+      bool truncate_udp_;
+   };
+
+   struct Delivery {
+      std::string packet_;
+      struct sockaddr_in6 from_;
+   };
+
+   struct AddrLess {
+      bool operator()(const struct in6_addr& a, const struct in6_addr& b) const {
+         return memcmp(&a, &b, sizeof(struct in6_addr)) < 0;
+      }
+   };
+
+   typedef std::map<struct in6_addr, Server, AddrLess,
+         STLsmartalloc<std::pair<const struct in6_addr, Server> > > ServerMap;
+   typedef std::multimap<uint64_t, Delivery, std::less<uint64_t>,
+         STLsmartalloc<std::pair<const uint64_t, Delivery> > > DeliveryMap;
+
+   // Queues the response of the server at |addr| to |packet|, due one round
+   // trip from now. Returns false if nobody serves |addr| or the query was
+   // lost.
+   bool Respond(const struct sockaddr_in6& addr, const char* packet, int len,
+         bool tcp);
+
+   ServerMap servers_;
+   DeliveryMap deliveries_;
+   FakeClock clock_;
+   Stats stats_;
+};
+
+#endif   // _SIM_NETWORK_H_
@@ -0,0 +1,331 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <iostream>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "slab_arena.h"
+
+namespace {
+// Cache map nodes run 100-150 bytes and record vectors grow in multiples of
+// about 90, hence the finer steps in the middle
+const size_t kClassSizes[] = {
+   8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384,
+   512, 768, 1024, 1536, 2048, 4096, 8192
+};
+
+int SizeClass(size_t size) {
+   int clz = 0;
+   while (kClassSizes[clz] < size)
+      clz++;
+   return clz;
+}
+}
+
+SlabArena::SlabArena(HugePages huge_pages, size_t region_size)
+      : huge_pages_(huge_pages),
+        region_size_(region_size),
+        regions_(NULL),
+        empty_(NULL),
+        compacting_(false) {
+   memset(partial_, 0, sizeof(partial_));
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+SlabArena::~SlabArena() {
+   while (regions_) {
+      Region* region = regions_;
+      regions_ = region->next_;
+      munmap(region, region_size_);
+   }
+}
+
+void* SlabArena::Allocate(size_t size) {
+   stats_.allocations++;
+
+   if (size > kMaxSize) {
+      stats_.large++;
+      void* p = malloc(size);
+      MALLOCCHECK(p);
+      return p;
+   }
+
+   int clz = SizeClass(size);
+   Slab* slab = partial_[clz];
+   if (!slab) {
+      slab = TakeEmptySlab();
+      slab->size_class_ = clz;
+      slab->free_ = NULL;
+      slab->unused_ = slab->base_;
+      slab->live_ = 0;
+      slab->capacity_ = kSlabSize / kClassSizes[clz];
+      slab->draining_ = false;
+      Push(&partial_[clz], slab);
+      stats_.slabs_used++;
+   }
+
+   void* p;
+   if (slab->free_) {
+      p = slab->free_;
+      slab->free_ = slab->free_->next_;
+   } else {
+      p = slab->unused_;
+      slab->unused_ += kClassSizes[clz];
+   }
+
+   slab->live_++;
+   stats_.bytes_in_use += kClassSizes[clz];
+
+   if (slab->live_ == slab->capacity_)
+      Unlink(&partial_[clz], slab);
+
+   return p;
+}
+
+void SlabArena::Free(void* p, size_t size) {
+   if (!p)
+      return;
+
+   stats_.frees++;
+
+   if (size > kMaxSize) {
+      free(p);
+      return;
+   }
+
+   Slab* slab = SlabOf(p);
+   int clz = slab->size_class_;
+   bool was_full = slab->live_ == slab->capacity_;
+
+   FreeObject* object = (FreeObject*) p;
+   object->next_ = slab->free_;
+   slab->free_ = object;
+   slab->live_--;
+   stats_.bytes_in_use -= kClassSizes[clz];
+
+   // Compaction got the last object out
+   if (slab->draining_) {
+      if (!slab->live_) {
+         RetireSlab(slab, true);
+         stats_.slabs_drained++;
+      }
+      return;
+   }
+
+   if (was_full)
+      Push(&partial_[clz], slab);
+
+   // Empty, and not the class's only slab with room: let any class have it
+   if (!slab->live_ && (partial_[clz] != slab || slab->next_)) {
+      Unlink(&partial_[clz], slab);
+      RetireSlab(slab, false);
+   }
+}
+
+int SlabArena::StartCompaction() {
+   if (compacting_)
+      return 0;
+
+   int picked = 0;
+
+   for (int clz = 0; clz < kClasses; ++clz) {
+      // Keep the fullest slab with room to take the moved objects
+      Slab* keep = NULL;
+      Slab* slab;
+      for (slab = partial_[clz]; slab; slab = slab->next_) {
+         if (!keep || slab->live_ > keep->live_)
+            keep = slab;
+      }
+
+      // Drain the ones under a quarter full
+      slab = partial_[clz];
+      while (slab) {
+         Slab* next = slab->next_;
+         if (slab != keep && slab->live_ * 4 < slab->capacity_) {
+            Unlink(&partial_[clz], slab);
+            slab->draining_ = true;
+            picked++;
+         }
+         slab = next;
+      }
+   }
+
+   if (picked) {
+      compacting_ = true;
+      stats_.compactions++;
+   }
+
+   return picked;
+}
+
+bool SlabArena::IsDraining(const void* p) const {
+   if (!compacting_)
+      return false;
+
+   Region* region;
+   for (region = regions_; region; region = region->next_) {
+      if ((char*) p >= (char*) region &&
+          (char*) p < (char*) region + region_size_)
+         return SlabOf(p)->draining_;
+   }
+
+   // Large objects live outside the regions
+   return false;
+}
+
+void SlabArena::FinishCompaction() {
+   if (!compacting_)
+      return;
+
+   Region* region;
+   for (region = regions_; region; region = region->next_) {
+      for (size_t i = region->first_slab_; i < region->carved_; ++i) {
+         Slab* slab = &region->slabs_[i];
+         if (!slab->draining_)
+            continue;
+
+         slab->draining_ = false;
+         Push(&partial_[slab->size_class_], slab);
+      }
+   }
+
+   compacting_ = false;
+}
+
+// static
+double SlabArena::Fragmentation(const Stats& stats) {
+   if (!stats.slabs_used)
+      return 0;
+
+   return 1 - (double) stats.bytes_in_use / (stats.slabs_used * kSlabSize);
+}
+
+SlabArena::Slab* SlabArena::SlabOf(const void* p) const {
+   Region* region = (Region*) ((uintptr_t) p & ~(uintptr_t) (region_size_ - 1));
+   return &region->slabs_[((char*) p - (char*) region) / kSlabSize];
+}
+
+SlabArena::Slab* SlabArena::TakeEmptySlab() {
+   if (empty_) {
+      Slab* slab = empty_;
+      Unlink(&empty_, slab);
+      stats_.slabs_free--;
+      return slab;
+   }
+
+   if (!regions_ || regions_->carved_ == region_size_ / kSlabSize)
+      MapRegion();
+
+   size_t i = regions_->carved_++;
+   Slab* slab = &regions_->slabs_[i];
+   slab->base_ = (char*) regions_ + i * kSlabSize;
+   slab->prev_ = NULL;
+   slab->next_ = NULL;
+   return slab;
+}
+
+void SlabArena::MapRegion() {
+   // Reserve twice the size, so an aligned region can be cut out of it
+   size_t map_size = 2 * region_size_;
+   void* p = mmap(NULL, map_size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+   }
+
+   char* start = (char*) p;
+   char* base = (char*) (((uintptr_t) start + region_size_ - 1) &
+         ~(uintptr_t) (region_size_ - 1));
+   if (base > start)
+      munmap(start, base - start);
+   if (start + map_size > base + region_size_)
+      munmap(base + region_size_, start + map_size - (base + region_size_));
+
+   // Explicit huge pages are reserved up front (without MAP_NORESERVE), so
+   // an empty pool fails here rather than with SIGBUS on first touch
+   bool huge = false;
+#ifdef MAP_HUGETLB
+   if (huge_pages_ == kExplicitHugePages &&
+       mmap(base, region_size_, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+            -1, 0) != MAP_FAILED)
+      huge = true;
+#endif
+
+   if (huge_pages_ == kExplicitHugePages && !huge)
+      stats_.huge_page_fallbacks++;
+
+   if (!huge && mmap(base, region_size_, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+         -1, 0) == MAP_FAILED) {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+   }
+
+#ifdef MADV_HUGEPAGE
+   if (!huge && huge_pages_ != kNoHugePages &&
+       !madvise(base, region_size_, MADV_HUGEPAGE))
+      huge = true;
+#endif
+
+   size_t header_len = offsetof(Region, slabs_) +
+         region_size_ / kSlabSize * sizeof(Slab);
+
+   Region* region = (Region*) base;
+   region->next_ = regions_;
+   region->first_slab_ = (header_len + kSlabSize - 1) / kSlabSize;
+   region->carved_ = region->first_slab_;
+   region->huge_ = huge;
+   regions_ = region;
+
+   stats_.regions++;
+   stats_.bytes_mapped += region_size_;
+   if (huge)
+      stats_.huge_page_regions++;
+}
+
+// static
+void SlabArena::Unlink(Slab** list, Slab* slab) {
+   if (slab->prev_)
+      slab->prev_->next_ = slab->next_;
+   else
+      *list = slab->next_;
+
+   if (slab->next_)
+      slab->next_->prev_ = slab->prev_;
+
+   slab->prev_ = NULL;
+   slab->next_ = NULL;
+}
+
+// static
+void SlabArena::Push(Slab** list, Slab* slab) {
+   slab->prev_ = NULL;
+   slab->next_ = *list;
+   if (*list)
+      (*list)->prev_ = slab;
+   *list = slab;
+}
+
+void SlabArena::RetireSlab(Slab* slab, bool release) {
+   slab->size_class_ = -1;
+   slab->draining_ = false;
+   slab->free_ = NULL;
+   Push(&empty_, slab);
+
+   stats_.slabs_used--;
+   stats_.slabs_free++;
+
+   // Splitting a huge page would cost more than the memory is worth
+   Region* region = (Region*) ((uintptr_t) slab->base_ &
+         ~(uintptr_t) (region_size_ - 1));
+   if (release && !region->huge_)
+      madvise(slab->base_, kSlabSize, MADV_DONTNEED);
+}
@@ -0,0 +1,197 @@
+#ifndef _SLAB_ARENA_H_
+#define _SLAB_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <type_traits>
+
+#include "smartalloc.h"
+
+// A dedicated heap for one long-lived data structure (the cache). Memory is
+// mapped in large regions, optionally backed by huge pages to cut TLB
+// misses, and cut into 64 KiB slabs. Each slab holds objects of one size
+// class; freed objects are reused by their class, and emptied slabs by any
+// class. Objects over kMaxSize go to malloc.
+//
+// Objects cannot be moved behind their owner's back, so compaction is a
+// joint effort: StartCompaction() stops allocating from the sparsest slabs,
+// the owner reallocates whatever of its objects IsDraining(), and each slab
+// is released to the system as its last object leaves.
+//
+// Not thread-safe; the owner locks.
+class SlabArena {
+  public:
+   enum HugePages {
+      kNoHugePages,
+      kTransparentHugePages,   // madvise(MADV_HUGEPAGE)
+      kExplicitHugePages       // MAP_HUGETLB, else transparent
+   };
+
+   struct Stats {
+      uint64_t allocations;
+      uint64_t frees;
+      uint64_t large;                 // allocations over kMaxSize
+      uint64_t regions;
+      uint64_t huge_page_regions;
+      uint64_t huge_page_fallbacks;   // explicit huge pages unavailable
+      uint64_t slabs_used;            // holding a size class
+      uint64_t slabs_free;            // empty, mapped
+      uint64_t bytes_mapped;
+      uint64_t bytes_in_use;          // live objects, rounded up to a class
+      uint64_t compactions;
+      uint64_t slabs_drained;         // emptied by compaction and released
+   };
+
+   static const size_t kMaxSize = 8192;
+
+   // |region_size| is a power of two, and a multiple of the huge page size.
+   SlabArena(HugePages huge_pages = kNoHugePages,
+         size_t region_size = kDefaultRegionSize);
+   ~SlabArena();
+
+   void* Allocate(size_t size);
+   void Free(void* p, size_t size);
+
+   // Picks the slabs worth emptying (mostly empty, and not the last with
+   // room in their class) and stops allocating from them. Returns how many.
+   int StartCompaction();
+
+   // True if |p| is in a slab being emptied.
+   bool IsDraining(const void* p) const;
+
+   // Goes back to allocating from the slabs that could not be emptied.
+   void FinishCompaction();
+
+   // Share of the space in used slabs that holds no live object
+   double Fragmentation() const { return Fragmentation(stats_); }
+
+   // The same, for stats added up over several arenas
+   static double Fragmentation(const Stats& stats);
+
+   const Stats& stats() const { return stats_; }
+
+  private:
+   static const size_t kSlabSize = 64 * 1024;
+   static const size_t kDefaultRegionSize = 32 * 1024 * 1024;
+   static const int kClasses = 23;
+
+   struct FreeObject {
+      FreeObject* next_;
+   };
+
+   struct Slab {
+      char* base_;
+      FreeObject* free_;
+      char* unused_;       // start of the never-used tail
+      uint32_t live_;
+      uint32_t capacity_;
+      int size_class_;     // -1 if empty
+      bool draining_;
+
+      // Links in its class's list of slabs with room, or the empty list
+      Slab* prev_;
+      Slab* next_;
+   };
+
+   // Lives at the start of its (size-aligned) region, so the slab of any
+   // object is found by masking its address
+   struct Region {
+      Region* next_;
+      size_t first_slab_;   // slabs before it hold this header
+      size_t carved_;       // slabs handed out so far
+      bool huge_;
+      Slab slabs_[1];       // one per slab of the region
+   };
+
+   Slab* SlabOf(const void* p) const;
+
+   // An empty slab: a released one, a new one from the last region, or one
+   // from a new region.
+   Slab* TakeEmptySlab();
+   void MapRegion();
+
+   static void Unlink(Slab** list, Slab* slab);
+   static void Push(Slab** list, Slab* slab);
+
+   // Returns an emptied slab to the empty list, and its memory to the
+   // system if |release|.
+   void RetireSlab(Slab* slab, bool release);
+
+   const HugePages huge_pages_;
+   const size_t region_size_;
+
+   Region* regions_;
+   Slab* partial_[kClasses];   // slabs with room, per class
+   Slab* empty_;
+   bool compacting_;
+
+   Stats stats_;
+
+   SlabArena(const SlabArena&);
+   void operator=(const SlabArena&);
+};
+
+// STL allocator over a SlabArena. Copies of a container stay in its arena.
+// Without an arena (the default) it allocates through STLsmartalloc.
+template <class T>
+class SlabArenaAllocator {
+  public:
+   typedef T                 value_type;
+   typedef value_type*       pointer;
+   typedef const value_type* const_pointer;
+   typedef value_type&       reference;
+   typedef const value_type& const_reference;
+   typedef std::size_t       size_type;
+   typedef std::ptrdiff_t    difference_type;
+
+   typedef std::true_type  propagate_on_container_copy_assignment;
+   typedef std::true_type  propagate_on_container_move_assignment;
+   typedef std::true_type  propagate_on_container_swap;
+   typedef std::false_type is_always_equal;
+
+   SlabArenaAllocator() : arena_(NULL) { }
+   SlabArenaAllocator(SlabArena* arena) : arena_(arena) { }
+   SlabArenaAllocator(const SlabArenaAllocator& alloc)
+         : arena_(alloc.arena_) { }
+   template <class U> SlabArenaAllocator(const SlabArenaAllocator<U>& alloc)
+         : arena_(alloc.arena()) { }
+
+   pointer allocate(size_type n) {
+      if (!arena_)
+         return STLsmartalloc<T>().allocate(n);
+      return static_cast<pointer>(arena_->Allocate(n * sizeof(T)));
+   }
+
+   void deallocate(pointer p, size_type n) {
+      if (!arena_)
+         STLsmartalloc<T>().deallocate(p, n);
+      else
+         arena_->Free(p, n * sizeof(T));
+   }
+
+   size_type max_size() const {
+      return static_cast<size_type>(-1) / sizeof(value_type);
+   }
+
+   SlabArena* arena() const { return arena_; }
+
+   template <class U> struct rebind { typedef SlabArenaAllocator<U> other; };
+
+  private:
+   SlabArena* arena_;
+};
+
+template <class T, class U>
+inline bool operator==(const SlabArenaAllocator<T>& a,
+                       const SlabArenaAllocator<U>& b) {
+   return a.arena() == b.arena();
+}
+
+template <class T, class U>
+inline bool operator!=(const SlabArenaAllocator<T>& a,
+                       const SlabArenaAllocator<U>& b) {
+   return a.arena() != b.arena();
+}
+
+#endif   // _SLAB_ARENA_H_
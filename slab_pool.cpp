@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <mutex>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "slab_pool.h"
+
+namespace {
+// Tuned for what the server allocates: 4 and 16 byte rdata, names, map and
+// list nodes of 48-128 bytes, and vectors of a handful of 64 byte records.
+const size_t kClassSizes[] = {
+   8, 16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 768, 1024
+};
+
+// Size (rounded up to 8) / 8 -> size class
+struct ClassTable {
+   ClassTable() {
+      int clz = 0;
+      for (size_t i = 0; i <= SlabPool::kMaxSize / 8; ++i) {
+         while (kClassSizes[clz] < i * 8)
+            clz++;
+         class_of_[i] = clz;
+      }
+   }
+
+   uint8_t class_of_[SlabPool::kMaxSize / 8 + 1];
+};
+
+const ClassTable kClassTable;
+
+inline int SizeClass(size_t size) {
+   return kClassTable.class_of_[(size + 7) / 8];
+}
+
+// Every live thread's pool, and the bytes in use left by those that exited
+std::mutex pools_mutex;
+SlabPool* pools = NULL;
+int64_t exited_bytes_in_use = 0;
+
+inline void Add(std::atomic<int64_t>* counter, int64_t n) {
+   // One writer: no need for an atomic add
+   counter->store(counter->load(std::memory_order_relaxed) + n,
+         std::memory_order_relaxed);
+}
+}
+
+// static
+SlabPool* SlabPool::Local() {
+   // Objects from this pool may outlive the thread: its destructor leaves
+   // them be
+   static thread_local SlabPool pool;
+   return &pool;
+}
+
+SlabPool::SlabPool()
+      : bytes_in_use_(0) {
+   memset(free_lists_, 0, sizeof(free_lists_));
+   memset(&stats_, 0, sizeof(Stats));
+
+   std::lock_guard<std::mutex> lock(pools_mutex);
+   next_ = pools;
+   pools = this;
+}
+
+SlabPool::~SlabPool() {
+   // The objects stay, as do the slabs; only the count moves
+   std::lock_guard<std::mutex> lock(pools_mutex);
+   exited_bytes_in_use += bytes_in_use_.load(std::memory_order_relaxed);
+   SlabPool** link = &pools;
+   while (*link != this)
+      link = &(*link)->next_;
+   *link = next_;
+}
+
+// static
+int64_t SlabPool::BytesInUse() {
+   std::lock_guard<std::mutex> lock(pools_mutex);
+   int64_t total = exited_bytes_in_use;
+   for (SlabPool* pool = pools; pool; pool = pool->next_)
+      total += pool->bytes_in_use_.load(std::memory_order_relaxed);
+   return total;
+}
+
+void* SlabPool::Allocate(size_t size) {
+   stats_.allocations++;
+
+#ifdef NO_SMARTALLOC
+   if (size > kMaxSize) {
+      stats_.large++;
+      void* p = malloc(size);
+      MALLOCCHECK(p);
+      return p;
+   }
+
+   int clz = SizeClass(size);
+   if (!free_lists_[clz])
+      Refill(clz);
+
+   FreeObject* object = free_lists_[clz];
+   free_lists_[clz] = object->next_;
+   Add(&bytes_in_use_, kClassSizes[clz]);
+   return object;
+#else
+   if (size > kMaxSize)
+      stats_.large++;
+
+   void* p = malloc(size ? size : 1);
+   MALLOCCHECK(p);
+   return p;
+#endif
+}
+
+void SlabPool::Free(void* p, size_t size) {
+   if (!p)
+      return;
+
+   stats_.frees++;
+
+#ifdef NO_SMARTALLOC
+   if (size > kMaxSize) {
+      free(p);
+      return;
+   }
+
+   int clz = SizeClass(size);
+   FreeObject* object = (FreeObject*) p;
+   object->next_ = free_lists_[clz];
+   free_lists_[clz] = object;
+   Add(&bytes_in_use_, -(int64_t) kClassSizes[clz]);
+#else
+   free(p);
+#endif
+}
+
+void SlabPool::Refill(int size_class) {
+   char* slab = (char*) malloc(kSlabSize);
+   MALLOCCHECK(slab);
+
+   stats_.slabs++;
+   stats_.bytes_reserved += kSlabSize;
+
+   size_t object_size = kClassSizes[size_class];
+   size_t count = kSlabSize / object_size;
+
+   // Thread the slab onto the free list back to front, so objects are handed
+   // out in address order
+   for (size_t i = count; i > 0; --i) {
+      FreeObject* object = (FreeObject*) (slab + (i - 1) * object_size);
+      object->next_ = free_lists_[size_class];
+      free_lists_[size_class] = object;
+   }
+}
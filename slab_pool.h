@@ -0,0 +1,115 @@
+#ifndef _SLAB_POOL_H_
+#define _SLAB_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <new>
+
+// Size-classed slab allocator for the small objects DNS handling churns
+// through: cache map nodes, resource records and their rdata, vector
+// buffers of a few records. Objects are carved out of 64 KiB slabs and
+// recycled through per-class free lists, with no per-object header; callers
+// pass the size back to Free(), as STL allocators do anyway. Anything larger
+// than kMaxSize goes straight to malloc.
+//
+// Each thread has its own pool, so there is no locking. An object may be
+// freed on a thread other than the one that allocated it; it then joins the
+// freeing thread's free list, and counts against the freeing thread's bytes
+// in use, which may go below zero. Only the total over every thread's pool,
+// BytesInUse(), is meaningful. Slabs are never returned to the system.
+//
+// In the debug build (smartalloc on) every allocation is passed through to
+// malloc instead, so smartalloc still checks each object on its own.
+class SlabPool {
+  public:
+   struct Stats {
+      uint64_t allocations;
+      uint64_t frees;
+      uint64_t large;            // allocations over kMaxSize
+      uint64_t slabs;
+      uint64_t bytes_reserved;   // in slabs
+   };
+
+   static const size_t kMaxSize = 1024;
+
+   // The calling thread's pool
+   static SlabPool* Local();
+
+   void* Allocate(size_t size);
+   void Free(void* p, size_t size);
+
+   const Stats& stats() const { return stats_; }
+
+   // Bytes held by live objects, rounded up to a class, over every thread
+   // (including those that have exited). Thread-safe.
+   static int64_t BytesInUse();
+
+  private:
+   static const size_t kSlabSize = 64 * 1024;
+   static const int kClasses = 17;
+
+   struct FreeObject {
+      FreeObject* next_;
+   };
+
+   SlabPool();
+   ~SlabPool();
+
+   // Carves a new slab into objects of |size_class|.
+   void Refill(int size_class);
+
+   FreeObject* free_lists_[kClasses];
+   Stats stats_;
+
+   // Allocated less freed by this thread. Written by it alone; read by
+   // BytesInUse() on any thread.
+   std::atomic<int64_t> bytes_in_use_;
+
+   SlabPool* next_;   // in the list of live threads' pools
+};
+
+// STL allocator over the calling thread's SlabPool. In the release build
+// this is what STLsmartalloc names (see smartalloc.h).
+template <class T>
+class SlabAllocator {
+  public:
+   typedef T                 value_type;
+   typedef value_type*       pointer;
+   typedef const value_type* const_pointer;
+   typedef value_type&       reference;
+   typedef const value_type& const_reference;
+   typedef std::size_t       size_type;
+   typedef std::ptrdiff_t    difference_type;
+
+   SlabAllocator() { }
+   SlabAllocator(const SlabAllocator&) { }
+   template <class U> SlabAllocator(const SlabAllocator<U>&) { }
+
+   pointer allocate(size_type n) {
+      return static_cast<pointer>(SlabPool::Local()->Allocate(n * sizeof(T)));
+   }
+
+   void deallocate(pointer p, size_type n) {
+      SlabPool::Local()->Free(p, n * sizeof(T));
+   }
+
+   size_type max_size() const {
+      return static_cast<size_type>(-1) / sizeof(value_type);
+   }
+
+   template <class U> struct rebind { typedef SlabAllocator<U> other; };
+};
+
+template <class T, class U>
+inline bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) {
+   return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) {
+   return false;
+}
+
+#endif   // _SLAB_POOL_H_
@@ -40,12 +40,20 @@
   * source.
   */
 
+ /*
+  * Release builds define NO_SMARTALLOC. Smartalloc then compiles out
+  * entirely: malloc and new are the system's, and STLsmartalloc names the
+  * slab allocator from slab_pool.h instead.
+  */
+
+#ifndef NO_SMARTALLOC
 #define malloc(x)   smartalloc((x), __FILE__, __LINE__, 0x55)
 #define calloc(x,y) smartalloc((x)*(y), __FILE__, __LINE__, 0)
 #define free(x)     smartfree((x), __FILE__, __LINE__)
 #define valloc(x)	smartvalloc((x), __FILE__, __LINE__, 0x55)
 #define realloc(x,y)	smartrealloc((x),(y),0,__FILE__, __LINE__, 0x66)
 #define reallocf(x,y)	smartrealloc((x),(y),1,__FILE__, __LINE__, 0x77)
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -77,16 +85,25 @@ void smartalloc_track(char *data, unsigned long space, unsigned char needs_free,
 #include <unordered_map>
 #endif
 
+#ifdef NO_SMARTALLOC
+
+#include "slab_pool.h"
+
+template <class T>
+using STLsmartalloc = SlabAllocator<T>;
+
+#else
+
 inline void *operator new(size_t size, char *file, int line, char pat) { return smartalloc(size, file, line, pat); }
 inline void *operator new[](size_t size, char *file, int line, char pat) { return smartalloc(size, file, line, pat); }
-inline void operator delete(void *p) { smartfree(p, __FILE__, __LINE__); }
-inline void operator delete[](void *p) { smartfree(p, __FILE__, __LINE__); }
 inline void *operator new(size_t size, const std::nothrow_t&t, char *file, int line, char pat) { return smartalloc(size, file, line, pat); }
 inline void *operator new[](size_t size, const std::nothrow_t&t, char *file, int line, char pat) { return smartalloc(size, file, line, pat); }
-inline void *operator new(size_t size) { return smartalloc(size, __FILE__, __LINE__, 0x54); }
 
-inline void *operator new(size_t size, const std::nothrow_t&t) { return smartalloc(size, __FILE__, __LINE__, 0x54); }
-inline void *operator new[](size_t size, const std::nothrow_t&t) { return smartalloc(size, __FILE__, __LINE__, 0x54); }
+/* The replaceable global operator new/delete are defined once, out of line,
+ * in smartalloc_cxx.cpp. Inline replacements are not seen by the parts of
+ * libstdc++ compiled into the shared library, so memory allocated on one side
+ * and freed on the other went to the wrong allocator. */
+
 
 inline void *operator new(size_t size, const void *p, const char *file, int line, char pat)
 {
@@ -177,6 +194,8 @@ inline bool operator!=(const STLsmartalloc<T>&, const STLsmartalloc<T>&)
 	return false;
 }
 
+#endif
+
 // #define SMA(x) STLsmartalloc<x,__FILE__,__LINE__> 
 #define SMA(x) STLsmartalloc<x> 
 
@@ -0,0 +1,57 @@
+/*
+ * Out-of-line replacements for the global allocation operators, so that
+ * every new/delete in the program, including those inside libstdc++, goes
+ * through smartalloc. See smartalloc.h.
+ */
+
+#include <stddef.h>
+
+#include <new>
+
+#include "smartalloc.h"
+
+#undef new
+
+void *operator new(size_t size)
+{
+   return smartalloc(size, __FILE__, __LINE__, 0x54);
+}
+
+void *operator new[](size_t size)
+{
+   return smartalloc(size, __FILE__, __LINE__, 0x54);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+   return smartalloc(size, __FILE__, __LINE__, 0x54);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+   return smartalloc(size, __FILE__, __LINE__, 0x54);
+}
+
+void operator delete(void *p) noexcept
+{
+   if (p)
+      smartfree(p, __FILE__, __LINE__);
+}
+
+void operator delete[](void *p) noexcept
+{
+   if (p)
+      smartfree(p, __FILE__, __LINE__);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+   if (p)
+      smartfree(p, __FILE__, __LINE__);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+   if (p)
+      smartfree(p, __FILE__, __LINE__);
+}
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// Uses struct timespec without declaring it
+#include <linux/errqueue.h>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "concurrency.h"
+#include "socket_monitor.h"
+
+namespace {
+// Sets |sock|'s |option| buffer to |bytes|, past |limit| if we are allowed
+// to (|force_option| needs CAP_NET_ADMIN), and warns if the kernel holds it
+// below that. Returns false, having said why, if it cannot be set.
+bool SetBuffer(int sock, int option, int force_option, int bytes,
+               const char* name, const char* limit) {
+   if (setsockopt(sock, SOL_SOCKET, force_option, &bytes, sizeof(bytes)) &&
+       setsockopt(sock, SOL_SOCKET, option, &bytes, sizeof(bytes))) {
+      perror(name);
+      return false;
+   }
+
+   // The kernel doubles what it is given, to leave room for its overhead
+   int got = 0;
+   socklen_t len = sizeof(got);
+   if (getsockopt(sock, SOL_SOCKET, option, &got, &len)) {
+      perror(name);
+      return false;
+   }
+   if (got / 2 < bytes)
+      fprintf(stderr, "Asked for a %d byte %s, the kernel gave %d; raise "
+            "%s\n", bytes, name, got / 2, limit);
+   return true;
+}
+
+// Whether an error says the destination cannot be reached
+bool IsUnreachable(int error) {
+   return error == ECONNREFUSED || error == EHOSTUNREACH ||
+         error == EHOSTDOWN || error == ENETUNREACH || error == ENETDOWN;
+}
+}
+
+SocketMonitor::SocketMonitor()
+      : sock_(-1),
+        rcvbuf_(0),
+        sndbuf_(0),
+        datagrams_(0),
+        kernel_drops_(0),
+        total_wait_ns_(0),
+        max_wait_ns_(0),
+        icmp_errors_(0),
+        pending_(0) {
+   for (int i = 0; i < kErrors; ++i)
+      errors_[i].store(0, std::memory_order_relaxed);
+}
+
+bool SocketMonitor::Attach(int sock, int rcvbuf, int sndbuf) {
+   if (rcvbuf > 0 && !SetBuffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf,
+         "receive buffer", "net.core.rmem_max"))
+      return false;
+   if (sndbuf > 0 && !SetBuffer(sock, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf,
+         "send buffer", "net.core.wmem_max"))
+      return false;
+
+   // ICMP errors are queued for IPv4 (mapped) destinations and IPv6 ones
+   // alike
+   int on = 1;
+   if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) ||
+       setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) ||
+       setsockopt(sock, SOL_IP, IP_RECVERR, &on, sizeof(on)) ||
+       setsockopt(sock, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on))) {
+      perror("setsockopt");
+      return false;
+   }
+
+   socklen_t len = sizeof(int);
+   getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf_, &len);
+   len = sizeof(int);
+   getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf_, &len);
+   sock_ = sock;
+   return true;
+}
+
+uint64_t SocketMonitor::KernelWait(const struct msghdr& msg,
+                                   uint64_t realtime_ns) {
+   uint64_t wait_ns = 0;
+   for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+        cmsg = CMSG_NXTHDR((struct msghdr*) &msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET)
+         continue;
+
+      if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+         struct timespec arrived;
+         memcpy(&arrived, CMSG_DATA(cmsg), sizeof(arrived));
+         uint64_t arrived_ns = (uint64_t) arrived.tv_sec * 1000000000 +
+               arrived.tv_nsec;
+         // The wall clock may have stepped in between
+         if (realtime_ns > arrived_ns)
+            wait_ns = realtime_ns - arrived_ns;
+      } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+         // Only sent once there have been drops
+         uint32_t drops;
+         memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+         RaiseTo(&kernel_drops_, drops);
+      }
+   }
+   return wait_ns;
+}
+
+void SocketMonitor::Count(uint64_t datagrams, uint64_t total_ns,
+                          uint64_t max_ns) {
+   datagrams_.fetch_add(datagrams, std::memory_order_relaxed);
+   total_wait_ns_.fetch_add(total_ns, std::memory_order_relaxed);
+   RaiseTo(&max_wait_ns_, max_ns);
+}
+
+// static
+SocketMonitor::Error SocketMonitor::Classify(int error) {
+   if (error == EINTR)
+      return kRetry;
+   if (error == EAGAIN || error == EWOULDBLOCK)
+      return kWouldBlock;
+   if (IsUnreachable(error))
+      return kUnreachable;
+   if (error == EBADF || error == ENOTSOCK)
+      return kFatal;
+
+   // ENOBUFS, ENOMEM, EMSGSIZE, EPERM (a firewall), EINVAL and the like
+   // are about this datagram
+   return kDrop;
+}
+
+int SocketMonitor::ReadErrors() {
+   int kept = 0;
+   for (;;) {
+      // The start of the datagram is quoted back: its DNS id is enough
+      SentError error;
+      memset(&error, 0, sizeof(error));
+      struct iovec iov;
+      iov.iov_base = &error.id_;
+      iov.iov_len = sizeof(error.id_);
+      char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+            sizeof(struct sockaddr_in6)) + kControlLen];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &error.to_;
+      msg.msg_namelen = sizeof(error.to_);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      ssize_t len = recvmsg(sock_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len < 0)
+         break;
+
+      icmp_errors_.fetch_add(1, std::memory_order_relaxed);
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+         if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+             !(cmsg->cmsg_level == SOL_IPV6 &&
+               cmsg->cmsg_type == IPV6_RECVERR))
+            continue;
+
+         struct sock_extended_err extended;
+         memcpy(&extended, CMSG_DATA(cmsg), sizeof(extended));
+         if ((extended.ee_origin == SO_EE_ORIGIN_ICMP ||
+              extended.ee_origin == SO_EE_ORIGIN_ICMP6) &&
+             IsUnreachable(extended.ee_errno) &&
+             len >= (ssize_t) sizeof(error.id_)) {
+            PushError(error);
+            kept++;
+         }
+         break;
+      }
+   }
+   return kept;
+}
+
+bool SocketMonitor::PopError(SentError* error) {
+   if (!has_errors())
+      return false;
+
+   std::lock_guard<std::mutex> lock(lock_);
+   if (sent_errors_.empty())
+      return false;
+   *error = sent_errors_.back();
+   sent_errors_.pop_back();
+   pending_.store(sent_errors_.size(), std::memory_order_relaxed);
+   return true;
+}
+
+void SocketMonitor::PushError(const SentError& error) {
+   std::lock_guard<std::mutex> lock(lock_);
+   sent_errors_.push_back(error);
+   pending_.store(sent_errors_.size(), std::memory_order_relaxed);
+}
+
+SocketMonitor::Stats SocketMonitor::stats() const {
+   Stats stats;
+   stats.datagrams = datagrams_.load(std::memory_order_relaxed);
+   stats.kernel_drops = kernel_drops_.load(std::memory_order_relaxed);
+   stats.total_wait_ns = total_wait_ns_.load(std::memory_order_relaxed);
+   stats.max_wait_ns = max_wait_ns_.load(std::memory_order_relaxed);
+   stats.rcvbuf = rcvbuf_;
+   stats.sndbuf = sndbuf_;
+   for (int i = 0; i < kErrors; ++i)
+      stats.errors[i] = errors_[i].load(std::memory_order_relaxed);
+   stats.icmp_errors = icmp_errors_.load(std::memory_order_relaxed);
+   return stats;
+}
+
+// static
+uint64_t SocketMonitor::RealtimeNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,129 @@
+#ifndef _SOCKET_MONITOR_H_
+#define _SOCKET_MONITOR_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "smartalloc.h"
+
+// What the kernel can tell about a UDP socket that the datagrams read off
+// it do not: how many it dropped because the receive buffer was full
+// (SO_RXQ_OVFL), and when each one arrived (SO_TIMESTAMPNS). A query can
+// wait in the socket's buffer as long as in any queue of ours, and the
+// drops are lost without a trace; with these, buffer sizes and thread
+// counts can be set from what the socket sees.
+//
+// Readers pass a control buffer of kControlLen with each recvmsg() (or
+// recvmmsg() slot), and hand what comes back to KernelWait(). Thread-safe,
+// so receiver threads can share one. How full the buffers are right now is
+// for Metrics to read (SO_MEMINFO) when scraped.
+//
+// It also sorts out what a failed send or receive calls for (Classify()),
+// and reads the ICMP errors the kernel queues for datagrams sent earlier
+// (IP_RECVERR), so that an upstream server that cannot be reached is given
+// up on at once instead of at its timeout.
+class SocketMonitor {
+  public:
+   // What a failed send or receive calls for
+   enum Error {
+      kRetry,         // interrupted: try again
+      kWouldBlock,    // nothing to read, or no room to send: later
+      kUnreachable,   // an ICMP error, for this datagram or (as the socket
+                      // reports it on whatever comes next) an earlier one:
+                      // ReadErrors(), and retry once
+      kDrop,          // out of buffers, or a bad datagram: skip it
+      kFatal,         // the socket is gone
+      kErrors
+   };
+
+   // An ICMP error for a datagram sent earlier
+   struct SentError {
+      struct sockaddr_in6 to_;   // where it was going
+      uint16_t id_;              // its DNS id, network order
+   };
+
+   struct Stats {
+      uint64_t datagrams;       // read
+      uint64_t kernel_drops;    // as of the last datagram read
+      uint64_t total_wait_ns;   // arrival -> read
+      uint64_t max_wait_ns;
+      int rcvbuf;               // as the kernel has them (twice what was
+      int sndbuf;               // asked for, for its bookkeeping)
+      uint64_t errors[kErrors];   // counted by the callers
+      uint64_t icmp_errors;       // read off the error queue
+   };
+
+   // Room for the control messages of one datagram
+   static const size_t kControlLen = CMSG_SPACE(sizeof(uint32_t)) +
+         CMSG_SPACE(sizeof(struct timespec));
+
+   SocketMonitor();
+
+   // Asks for |rcvbuf| and |sndbuf| bytes of buffer on |sock| (the kernel's
+   // default for either that is 0), saying so on stderr if the kernel gives
+   // less, and turns on drop counts, arrival times and the error queue.
+   // Returns false, having said why, if it cannot.
+   bool Attach(int sock, int rcvbuf, int sndbuf);
+
+   // How long the datagram read with |msg| waited in the kernel before
+   // |realtime_ns| (a RealtimeNs()), or 0 if it has no arrival time. Notes
+   // the drop count, if the kernel sent one.
+   uint64_t KernelWait(const struct msghdr& msg, uint64_t realtime_ns);
+
+   // Counts |datagrams| read, which waited |total_ns| in the kernel, none
+   // of them longer than |max_ns|.
+   void Count(uint64_t datagrams, uint64_t total_ns, uint64_t max_ns);
+
+   static Error Classify(int error);
+   void CountError(Error error) {
+      errors_[error].fetch_add(1, std::memory_order_relaxed);
+   }
+
+   // Reads the socket's error queue, keeping the errors that say where a
+   // datagram could not be delivered for PopError(). Returns how many it
+   // kept.
+   int ReadErrors();
+
+   // Takes an error ReadErrors() kept, or returns false if none is left.
+   // PushError() adds one, for a send that failed outright.
+   bool PopError(SentError* error);
+   void PushError(const SentError& error);
+   bool has_errors() const {
+      return pending_.load(std::memory_order_relaxed) != 0;
+   }
+
+   Stats stats() const;
+
+   // Arrival times are on the wall clock
+   static uint64_t RealtimeNs();
+
+  private:
+   typedef std::vector<SentError, STLsmartalloc<SentError> > SentErrorVec;
+
+   int sock_;
+   int rcvbuf_;
+   int sndbuf_;
+   std::atomic<uint64_t> datagrams_;
+   std::atomic<uint64_t> kernel_drops_;
+   std::atomic<uint64_t> total_wait_ns_;
+   std::atomic<uint64_t> max_wait_ns_;
+   std::atomic<uint64_t> errors_[kErrors];
+   std::atomic<uint64_t> icmp_errors_;
+
+   // Errors read and not yet taken
+   std::mutex lock_;
+   SentErrorVec sent_errors_;
+   std::atomic<int> pending_;
+
+   SocketMonitor(const SocketMonitor&);
+   void operator=(const SocketMonitor&);
+};
+
+#endif   // _SOCKET_MONITOR_H_
@@ -0,0 +1,158 @@
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <coroutine>
+#include <utility>
+
+#include "smartalloc.h"
+
+#include "frame_pool.h"
+
+// Coroutine return types for the resolver. Both allocate their frames from
+// the FramePool.
+//
+// smartalloc.h defines new(...) as a macro, which would mangle the
+// declarations of the promises' allocation functions below.
+#pragma push_macro("new")
+#undef new
+
+// A lazily started coroutine producing a T. It runs when co_awaited, and
+// resumes its awaiter when it finishes.
+//
+// Most tasks finish without ever suspending (a cache hit, say). Those run
+// to completion inside await_suspend(), and the awaiter carries on without
+// suspending; handing control back through symmetric transfer instead would
+// grow the stack with every such task in a loop, as unoptimized builds don't
+// turn the transfer into a tail call.
+template <typename T>
+class Task {
+  public:
+   struct promise_type;
+   typedef std::coroutine_handle<promise_type> Handle;
+
+   struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+         // Finishing inside await_suspend(), which resumes the awaiter itself
+         if (handle.promise().running_inline_)
+            return std::noop_coroutine();
+
+         std::coroutine_handle<> continuation = handle.promise().continuation_;
+         if (continuation)
+            return continuation;
+         return std::noop_coroutine();
+      }
+
+      void await_resume() noexcept { }
+   };
+
+   struct promise_type {
+      promise_type() : value_(), running_inline_(false) { }
+
+      Task get_return_object() { return Task(Handle::from_promise(*this)); }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+      void return_value(T value) { value_ = std::move(value); }
+      void unhandled_exception() { abort(); }
+
+      static void* operator new(size_t size) {
+         return FramePool::Instance()->Allocate(size);
+      }
+
+      static void operator delete(void* p, size_t size) {
+         FramePool::Instance()->Free(p, size);
+      }
+
+      T value_;
+      std::coroutine_handle<> continuation_;
+      bool running_inline_;
+   };
+
+   Task(Task&& task) : handle_(task.handle_) { task.handle_ = nullptr; }
+   ~Task() {
+      if (handle_)
+         handle_.destroy();
+   }
+
+   bool await_ready() const { return false; }
+
+   // Runs the task until it first suspends. Returns false (don't suspend
+   // the awaiter) if it already finished.
+   bool await_suspend(std::coroutine_handle<> awaiter) {
+      promise_type& promise = handle_.promise();
+      promise.continuation_ = awaiter;
+
+      promise.running_inline_ = true;
+      handle_.resume();
+      promise.running_inline_ = false;
+
+      return !handle_.done();
+   }
+
+   T await_resume() { return std::move(handle_.promise().value_); }
+
+  private:
+   explicit Task(Handle handle) : handle_(handle) { }
+   Task(const Task&);
+   void operator=(const Task&);
+
+   Handle handle_;
+};
+
+// A coroutine nobody awaits, such as the one answering a client. It is
+// handed to Resolver::Start() and frees itself when it finishes.
+class DetachedTask {
+  public:
+   struct promise_type;
+   typedef std::coroutine_handle<promise_type> Handle;
+
+   struct promise_type {
+      DetachedTask get_return_object() {
+         return DetachedTask(Handle::from_promise(*this));
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() { }
+      void unhandled_exception() { abort(); }
+
+      static void* operator new(size_t size) {
+         return FramePool::Instance()->Allocate(size);
+      }
+
+      static void operator delete(void* p, size_t size) {
+         FramePool::Instance()->Free(p, size);
+      }
+   };
+
+   DetachedTask(DetachedTask&& task) : handle_(task.handle_) {
+      task.handle_ = nullptr;
+   }
+
+   // A task that was never started is simply dropped
+   ~DetachedTask() {
+      if (handle_)
+         handle_.destroy();
+   }
+
+   // Gives up ownership; the coroutine now owns itself.
+   std::coroutine_handle<> Release() {
+      std::coroutine_handle<> handle = handle_;
+      handle_ = nullptr;
+      return handle;
+   }
+
+  private:
+   explicit DetachedTask(Handle handle) : handle_(handle) { }
+   DetachedTask(const DetachedTask&);
+   void operator=(const DetachedTask&);
+
+   Handle handle_;
+};
+
+#pragma pop_macro("new")
+
+#endif   // _TASK_H_
@@ -0,0 +1,364 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+
+#include "debug.h"
+#include "smartalloc.h"
+
+#include "clock.h"
+#include "tcp_connection_pool.h"
+
+namespace {
+// Queries that have not been answered after this long are forgotten, so that
+// the connection they were sent on can become idle again. The resolver has
+// long since retried elsewhere by then.
+const uint64_t kQueryTimeoutMs = 10000;
+
+const int kReadChunk = 4096;
+
+bool SameServer(const struct sockaddr_in6& a, const struct sockaddr_in6& b) {
+   return a.sin6_port == b.sin6_port &&
+         !memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(struct in6_addr));
+}
+}
+
+TcpConnectionPool::Connection::Connection(const struct sockaddr_in6& addr,
+                                          int fd,
+                                          uint64_t now_ms)
+      : addr_(addr),
+        fd_(fd),
+        connecting_(true),
+        connect_start_us_(Clock::System()->NowUs()),
+        last_used_ms_(now_ms) {
+}
+
+TcpConnectionPool::TcpConnectionPool(int max_idle_per_server,
+                                     int max_total,
+                                     int idle_timeout_ms,
+                                     int max_pipelined)
+      : max_idle_per_server_(max_idle_per_server),
+        max_total_(max_total),
+        idle_timeout_ms_(idle_timeout_ms),
+        max_pipelined_(max_pipelined),
+        handshakes_completed_(0) {
+   memset(&stats_, 0, sizeof(Stats));
+}
+
+TcpConnectionPool::~TcpConnectionPool() {
+   while (!connections_.empty())
+      Close(connections_.begin());
+}
+
+bool TcpConnectionPool::Send(const struct sockaddr_in6& addr,
+                             const char* query,
+                             int len,
+                             uint16_t id,
+                             uint64_t now_ms) {
+   ConnectionList::iterator it = FindUsable(addr, id);
+
+   if (it == connections_.end()) {
+      it = Open(addr, now_ms);
+      if (it == connections_.end())
+         return false;
+   } else {
+      LOG << "Reusing TCP connection (fd " << it->fd_ << ")" << std::endl;
+      stats_.connections_reused++;
+      if (handshakes_completed_)
+         stats_.handshake_us_saved +=
+               stats_.handshake_us_total / handshakes_completed_;
+   }
+
+   // Frame the query with its two byte length
+   uint16_t framed_len = htons((uint16_t) len);
+   it->out_.append((const char*) &framed_len, sizeof(uint16_t));
+   it->out_.append(query, len);
+   it->pending_[id] = now_ms;
+   it->last_used_ms_ = now_ms;
+   stats_.queries_sent++;
+
+   if (!it->connecting_ && !Flush(&(*it))) {
+      stats_.connections_failed++;
+      Close(it);
+      return false;
+   }
+
+   return true;
+}
+
+int TcpConnectionPool::AddToFdSets(fd_set* readfds, fd_set* writefds) const {
+   int max_fd = -1;
+
+   ConnectionList::const_iterator it;
+   for (it = connections_.begin(); it != connections_.end(); ++it) {
+      FD_SET(it->fd_, readfds);
+      if (it->connecting_ || !it->out_.empty())
+         FD_SET(it->fd_, writefds);
+
+      if (it->fd_ > max_fd)
+         max_fd = it->fd_;
+   }
+
+   return max_fd;
+}
+
+void TcpConnectionPool::Process(fd_set* readfds,
+                                fd_set* writefds,
+                                uint64_t now_ms) {
+   ConnectionList::iterator it = connections_.begin();
+   while (it != connections_.end()) {
+      Connection* conn = &(*it);
+      bool ok = true;
+
+      // Finish a pending connect
+      if (conn->connecting_ && FD_ISSET(conn->fd_, writefds)) {
+         int err = 0;
+         socklen_t err_len = sizeof(int);
+         getsockopt(conn->fd_, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+         if (err) {
+            LOG << "TCP connect failed: " << strerror(err) << std::endl;
+            ok = false;
+         } else {
+            conn->connecting_ = false;
+            stats_.handshake_us_total += Clock::System()->NowUs() -
+                  conn->connect_start_us_;
+            handshakes_completed_++;
+         }
+      }
+
+      if (ok && !conn->connecting_ && !conn->out_.empty() &&
+          FD_ISSET(conn->fd_, writefds))
+         ok = Flush(conn);
+
+      if (ok && !conn->connecting_ && FD_ISSET(conn->fd_, readfds))
+         ok = Read(conn, now_ms);
+
+      // Queries still waiting on it will not be answered now
+      if (!ok) {
+         if (!conn->pending_.empty())
+            stats_.connections_failed++;
+         PendingMap::iterator pending_it;
+         for (pending_it = conn->pending_.begin();
+              pending_it != conn->pending_.end(); ++pending_it) {
+            failures_.push_back(Failure());
+            failures_.back().to_ = conn->addr_;
+            failures_.back().id_ = pending_it->first;
+         }
+         Close(it++);
+         continue;
+      }
+
+      // Forget queries that will never be answered
+      size_t before = conn->pending_.size();
+      PendingMap::iterator pending_it = conn->pending_.begin();
+      while (pending_it != conn->pending_.end()) {
+         if (now_ms - pending_it->second > kQueryTimeoutMs)
+            conn->pending_.erase(pending_it++);
+         else
+            ++pending_it;
+      }
+      if (before && conn->pending_.empty())
+         conn->last_used_ms_ = now_ms;
+
+      // Evict idle connections that timed out, or that exceed the per-server
+      // idle cap
+      if (conn->idle() &&
+          (now_ms - conn->last_used_ms_ > (uint64_t) idle_timeout_ms_ ||
+           IdleCount(conn->addr_) > max_idle_per_server_)) {
+         LOG << "Evicting idle TCP connection (fd " << conn->fd_ << ")" <<
+               std::endl;
+         stats_.connections_evicted++;
+         Close(it++);
+         continue;
+      }
+
+      ++it;
+   }
+}
+
+bool TcpConnectionPool::PopResponse(std::string* response,
+                                    struct sockaddr_in6* from) {
+   if (responses_.empty())
+      return false;
+
+   response->swap(responses_.front().data_);
+   *from = responses_.front().from_;
+   responses_.pop_front();
+
+   return true;
+}
+
+bool TcpConnectionPool::PopFailure(struct sockaddr_in6* to, uint16_t* id) {
+   if (failures_.empty())
+      return false;
+
+   *to = failures_.front().to_;
+   *id = failures_.front().id_;
+   failures_.pop_front();
+
+   return true;
+}
+
+TcpConnectionPool::ConnectionList::iterator TcpConnectionPool::FindUsable(
+      const struct sockaddr_in6& addr, uint16_t id) {
+   ConnectionList::iterator it;
+   for (it = connections_.begin(); it != connections_.end(); ++it) {
+      if (SameServer(it->addr_, addr) &&
+          (int) it->pending_.size() < max_pipelined_ &&
+          !it->pending_.count(id)) {
+         break;
+      }
+   }
+
+   return it;
+}
+
+TcpConnectionPool::ConnectionList::iterator TcpConnectionPool::Open(
+      const struct sockaddr_in6& addr, uint64_t now_ms) {
+   if ((int) connections_.size() >= max_total_ && !EvictOldestIdle()) {
+      LOG << "TCP connection pool full" << std::endl;
+      return connections_.end();
+   }
+
+   int fd = socket(AF_INET6, SOCK_STREAM, 0);
+   if (fd < 0) {
+      perror("socket");
+      stats_.connections_failed++;
+      return connections_.end();
+   }
+
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+   connections_.push_back(Connection(addr, fd, now_ms));
+   ConnectionList::iterator it = --connections_.end();
+   stats_.connections_opened++;
+
+   if (!connect(fd, (const struct sockaddr*) &addr,
+         sizeof(struct sockaddr_in6))) {
+      it->connecting_ = false;
+      stats_.handshake_us_total += Clock::System()->NowUs() -
+            it->connect_start_us_;
+      handshakes_completed_++;
+   } else if (errno != EINPROGRESS) {
+      LOG << "TCP connect failed: " << strerror(errno) << std::endl;
+      stats_.connections_failed++;
+      Close(it);
+      return connections_.end();
+   }
+
+   LOG << "Opened TCP connection (fd " << fd << ")" << std::endl;
+   return it;
+}
+
+void TcpConnectionPool::Close(ConnectionList::iterator it) {
+   close(it->fd_);
+   connections_.erase(it);
+}
+
+bool TcpConnectionPool::EvictOldestIdle() {
+   ConnectionList::iterator oldest = connections_.end();
+
+   ConnectionList::iterator it;
+   for (it = connections_.begin(); it != connections_.end(); ++it) {
+      if (it->idle() && (oldest == connections_.end() ||
+            it->last_used_ms_ < oldest->last_used_ms_))
+         oldest = it;
+   }
+
+   if (oldest == connections_.end())
+      return false;
+
+   stats_.connections_evicted++;
+   Close(oldest);
+   return true;
+}
+
+int TcpConnectionPool::IdleCount(const struct sockaddr_in6& addr) const {
+   int count = 0;
+
+   ConnectionList::const_iterator it;
+   for (it = connections_.begin(); it != connections_.end(); ++it) {
+      if (it->idle() && SameServer(it->addr_, addr))
+         count++;
+   }
+
+   return count;
+}
+
+bool TcpConnectionPool::Flush(Connection* conn) {
+   while (!conn->out_.empty()) {
+      ssize_t n = send(conn->fd_, conn->out_.data(), conn->out_.size(),
+            MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return true;
+         return false;
+      }
+
+      conn->out_.erase(0, n);
+   }
+
+   return true;
+}
+
+bool TcpConnectionPool::Read(Connection* conn, uint64_t now_ms) {
+   char chunk[kReadChunk];
+
+   // The peer may close right after its last responses: frame them first
+   bool closed = false;
+   while (1) {
+      ssize_t n = recv(conn->fd_, chunk, kReadChunk, 0);
+      if (n == 0) {
+         closed = true;
+         break;
+      }
+      if (n < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            break;
+         closed = true;
+         break;
+      }
+
+      conn->in_.append(chunk, n);
+   }
+
+   // Split off every complete message
+   while (conn->in_.size() >= sizeof(uint16_t)) {
+      uint16_t msg_len;
+      memcpy(&msg_len, conn->in_.data(), sizeof(uint16_t));
+      msg_len = ntohs(msg_len);
+
+      if (conn->in_.size() < sizeof(uint16_t) + msg_len)
+         break;
+
+      responses_.push_back(Response());
+      Response& response = responses_.back();
+      response.data_ = conn->in_.substr(sizeof(uint16_t), msg_len);
+      response.from_ = conn->addr_;
+      conn->in_.erase(0, sizeof(uint16_t) + msg_len);
+
+      if (msg_len >= sizeof(uint16_t)) {
+         uint16_t id;
+         memcpy(&id, response.data_.data(), sizeof(uint16_t));
+         conn->pending_.erase(id);
+      }
+
+      stats_.responses_received++;
+      conn->last_used_ms_ = now_ms;
+   }
+
+   return !closed;
+}
@@ -0,0 +1,138 @@
+#ifndef _TCP_CONNECTION_POOL_H_
+#define _TCP_CONNECTION_POOL_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "smartalloc.h"
+
+// A bounded pool of TCP connections to upstream authorities, used when a UDP
+// response comes back truncated. Connections are keyed by server address and
+// kept open after their queries are answered, so the next fallback to the same
+// server skips the handshake. Several queries may be in flight on one
+// connection at once; replies are matched back to them by DNS id.
+//
+// All sockets are non-blocking. The owner adds the pool's descriptors to its
+// select() sets with AddToFdSets(), hands the result to Process(), and then
+// drains complete responses with PopResponse().
+class TcpConnectionPool {
+  public:
+   struct Stats {
+      uint64_t queries_sent;
+      uint64_t responses_received;
+      uint64_t connections_opened;
+      uint64_t connections_reused;   // queries sent on an existing connection
+      uint64_t connections_evicted;  // idle timeout or pool cap
+      uint64_t connections_failed;   // connect/read/write errors
+      uint64_t handshake_us_total;   // sum of measured connect latencies
+      uint64_t handshake_us_saved;   // estimated: reuses * mean handshake
+   };
+
+   TcpConnectionPool(int max_idle_per_server, int max_total, int idle_timeout_ms,
+         int max_pipelined);
+   ~TcpConnectionPool();
+
+   // Queues |len| bytes of |query| (without the TCP length prefix) to |addr|,
+   // reusing an idle or pipelining connection if one exists and opening a new
+   // one otherwise. |id| is the DNS id of the query, network order. Returns
+   // false if the pool is full or the connect failed outright.
+   bool Send(const struct sockaddr_in6& addr, const char* query, int len,
+         uint16_t id, uint64_t now_ms);
+
+   // Adds every pool socket to |readfds| and, if it has pending output or is
+   // still connecting, to |writefds|. Returns the highest descriptor added, or
+   // -1 if the pool is empty.
+   int AddToFdSets(fd_set* readfds, fd_set* writefds) const;
+
+   // Completes connects, flushes output and reads input on the sockets
+   // select() flagged. Complete responses are queued for PopResponse(), and
+   // the queries of connections that failed or were closed for
+   // PopFailure(). Also closes connections that have sat idle too long and
+   // forgets queries that were never answered.
+   void Process(fd_set* readfds, fd_set* writefds, uint64_t now_ms);
+
+   // Pops the next complete response (length prefix stripped) and the address
+   // it came from. Returns false if none is queued.
+   bool PopResponse(std::string* response, struct sockaddr_in6* from);
+
+   // Pops the next query whose connection went away before it was answered:
+   // the server it was sent to, and its DNS id (network order). Returns false
+   // if none is queued.
+   bool PopFailure(struct sockaddr_in6* to, uint16_t* id);
+
+   int size() const { return connections_.size(); }
+   const Stats& stats() const { return stats_; }
+
+  private:
+   // DNS id (network order) -> time sent
+   typedef std::map<uint16_t, uint64_t, std::less<uint16_t>,
+         STLsmartalloc<std::pair<const uint16_t, uint64_t> > > PendingMap;
+
+   struct Connection {
+      Connection(const struct sockaddr_in6& addr, int fd, uint64_t now_ms);
+
+      struct sockaddr_in6 addr_;
+      int fd_;
+      bool connecting_;
+      uint64_t connect_start_us_;
+      uint64_t last_used_ms_;
+      std::string out_;   // framed queries not yet written
+      std::string in_;    // bytes read but not yet framed
+      PendingMap pending_;
+
+      bool idle() const { return !connecting_ && pending_.empty(); }
+   };
+
+   typedef std::list<Connection, STLsmartalloc<Connection> > ConnectionList;
+
+   struct Response {
+      std::string data_;
+      struct sockaddr_in6 from_;
+   };
+
+   typedef std::list<Response, STLsmartalloc<Response> > ResponseList;
+
+   struct Failure {
+      struct sockaddr_in6 to_;
+      uint16_t id_;
+   };
+
+   typedef std::list<Failure, STLsmartalloc<Failure> > FailureList;
+
+   // Finds a connection to |addr| that can take another query with id |id|.
+   ConnectionList::iterator FindUsable(const struct sockaddr_in6& addr,
+         uint16_t id);
+   ConnectionList::iterator Open(const struct sockaddr_in6& addr,
+         uint64_t now_ms);
+   void Close(ConnectionList::iterator it);
+
+   // Evicts the least recently used idle connection. Returns false if every
+   // connection is busy.
+   bool EvictOldestIdle();
+
+   // Counts idle connections to |addr|.
+   int IdleCount(const struct sockaddr_in6& addr) const;
+
+   bool Flush(Connection* conn);
+   bool Read(Connection* conn, uint64_t now_ms);
+
+   const int max_idle_per_server_;
+   const int max_total_;
+   const int idle_timeout_ms_;
+   const int max_pipelined_;
+
+   ConnectionList connections_;
+   ResponseList responses_;
+   FailureList failures_;
+   Stats stats_;
+   uint64_t handshakes_completed_;
+};
+
+#endif   // _TCP_CONNECTION_POOL_H_